@@ -14,7 +14,13 @@
 #include "base_misc.h"
 #include "power_management.h"
 
-static volatile bool _delay_active = false;
+// Compare channel interrupts of the delays running. The timer counts freely
+// while any are, each delay waiting for the count on its own channel
+static volatile uint16_t _timer_running = 0;
+
+/* Functions used only in this file */
+static void _misc_timer_start(uint16_t channel, uint32_t ms);
+static void _misc_timer_stop(uint16_t channels);
 
 /**
  * Set up a timer to use for general purpose delays
@@ -29,7 +35,7 @@ void misc_delay_init(void)
     {
         .TIM_ClockDivision = TIM_CKD_DIV1,
         .TIM_Prescaler = 32000, // Corresponds to a 1ms tick period
-        .TIM_Period = 1000,
+        .TIM_Period = 0xFFFFFFFF,
         .TIM_CounterMode = TIM_CounterMode_Up,
     };
 
@@ -37,8 +43,15 @@ void misc_delay_init(void)
 
     TIM_ARRPreloadConfig(TIM5, DISABLE);
 
-    // Enable the overflow interrupt
-    TIM_ITConfig(TIM5, TIM_IT_Update, ENABLE);
+    // One compare channel for misc_delay(), one for misc_timeout()
+    TIM_OCInitTypeDef compareInit;
+    TIM_OCStructInit(&compareInit);
+    compareInit.TIM_OCMode = TIM_OCMode_Timing;
+
+    TIM_OC1Init(TIM5, &compareInit);
+    TIM_OC1PreloadConfig(TIM5, TIM_OCPreload_Disable);
+    TIM_OC2Init(TIM5, &compareInit);
+    TIM_OC2PreloadConfig(TIM5, TIM_OCPreload_Disable);
 
     // Enable the timer's interrupts in the interrupt controller
     NVIC_InitTypeDef nvicInit =
@@ -63,26 +76,12 @@ void misc_delay_init(void)
  */
 void misc_delay(uint32_t ms, bool block)
 {
-    // Calculate ticks
-    uint32_t delay_ticks = get_ticks_from_ms(ms, 32000);
-
-    // Power up the timer
-    RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM5, ENABLE);
-
-    // Keep clocks on
-    power_set_minimum(PWR_DELAY, PWR_SLEEP);
-
-    // Mark delay active
-    _delay_active = true;
-
-    // Set timer and start
-    TIM5->ARR = delay_ticks;
-    TIM_Cmd(TIM5, ENABLE);
+    _misc_timer_start(TIM_IT_CC1, ms);
 
     // Wait for timeout
     if (block)
     {
-        while (_delay_active)
+        while (misc_delay_active())
         {
             power_sleep();
         }
@@ -95,25 +94,137 @@ void misc_delay(uint32_t ms, bool block)
  */
 bool misc_delay_active(void)
 {
-    return _delay_active;
+    return (_timer_running & TIM_IT_CC1) != 0;
+}
+
+/**
+ * Stop a running delay early, releasing the timer if the timeout isn't running
+ */
+void misc_delay_cancel(void)
+{
+    _misc_timer_stop(TIM_IT_CC1);
+}
+
+/**
+ * Start a timeout, which runs alongside misc_delay() on its own channel so
+ * neither cuts the other short. Check misc_timeout_active() after each wake
+ *
+ * @param ms Time in ms until it runs out. Do not exceed 49 days
+ */
+void misc_timeout(uint32_t ms)
+{
+    _misc_timer_start(TIM_IT_CC2, ms);
+}
+
+/**
+ * Check if a timeout is still running
+ * @return True if it hasn't run out or been cancelled
+ */
+bool misc_timeout_active(void)
+{
+    return (_timer_running & TIM_IT_CC2) != 0;
+}
+
+/**
+ * Stop a running timeout early, releasing the timer if no delay is running
+ */
+void misc_timeout_cancel(void)
+{
+    _misc_timer_stop(TIM_IT_CC2);
 }
 
 /**
- * Handle timer ending by stopping the delay
+ * Handle a delay or timeout running out
  */
 void TIM5_IRQHandler(void)
 {
-    if (TIM_GetITStatus(TIM5, TIM_IT_Update))
+    uint16_t ended = 0;
+
+    if (TIM_GetITStatus(TIM5, TIM_IT_CC1))
     {
-        // Timeout reached, clear flag, shut down the timer
-        _delay_active = false;
+        ended |= TIM_IT_CC1;
+    }
 
-        TIM_Cmd(TIM5, DISABLE);
-        TIM_ClearITPendingBit(TIM5, TIM_IT_Update);
-        RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM5, DISABLE);
+    if (TIM_GetITStatus(TIM5, TIM_IT_CC2))
+    {
+        ended |= TIM_IT_CC2;
+    }
 
-        power_set_minimum(PWR_DELAY, PWR_CLOCKSTOP);
+    TIM_ClearITPendingBit(TIM5, ended);
+
+    _misc_timer_stop(ended);
+}
+
+/**
+ * Start the timer if it isn't already counting and set a channel to go off
+ * after a time
+ *
+ * @param channel TIM_IT_CCn of the channel
+ * @param ms      Time in ms until it goes off
+ */
+static void _misc_timer_start(uint16_t channel, uint32_t ms)
+{
+    uint32_t ticks = get_ticks_from_ms(ms, 32000);
+
+    // At least far enough ahead that the count can't pass it while it's set
+    if (ticks < 2)
+    {
+        ticks = 2;
+    }
+
+    // Called from interrupts as well as the main loop
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    // Power up the timer and keep clocks on
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM5, ENABLE);
+    power_set_minimum(PWR_DELAY, PWR_SLEEP);
+    TIM_Cmd(TIM5, ENABLE);
+
+    uint32_t compare = TIM_GetCounter(TIM5) + ticks;
+
+    if (channel == TIM_IT_CC1)
+    {
+        TIM_SetCompare1(TIM5, compare);
+    }
+    else
+    {
+        TIM_SetCompare2(TIM5, compare);
     }
+
+    TIM_ClearITPendingBit(TIM5, channel);
+    TIM_ITConfig(TIM5, channel, ENABLE);
+
+    _timer_running |= channel;
+
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Stop channels going off, then stop the timer and release it if none are left
+ *
+ * @param channels TIM_IT_CCn of the channels
+ */
+static void _misc_timer_stop(uint16_t channels)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    if (_timer_running & channels)
+    {
+        TIM_ITConfig(TIM5, channels, DISABLE);
+        _timer_running &= (uint16_t)~channels;
+
+        if (!_timer_running)
+        {
+            TIM_Cmd(TIM5, DISABLE);
+            RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM5, DISABLE);
+
+            power_set_minimum(PWR_DELAY, PWR_CLOCKSTOP);
+        }
+    }
+
+    __set_PRIMASK(primask);
 }
 
 void misc_ringbuffer_write(misc_ringbuf_t *buffer, uint8_t* pdata, uint16_t bytes)
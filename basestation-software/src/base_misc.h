@@ -27,6 +27,10 @@ typedef struct
 void misc_delay_init(void);
 void misc_delay(uint32_t ms, bool block);
 bool misc_delay_active(void);
+void misc_delay_cancel(void);
+void misc_timeout(uint32_t ms);
+bool misc_timeout_active(void);
+void misc_timeout_cancel(void);
 
 // Ringbuffers are commonly used, so this saves some duplication
 void misc_ringbuffer_write(misc_ringbuf_t *buffer, uint8_t* pdata, uint16_t bytes);
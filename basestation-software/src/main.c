@@ -57,13 +57,16 @@ void main(void)
 
     rtc_init();
     proto_init();
+    proto_load_patch();
 
     printf("Startup done. Sleeping\r\n");
 
     // Go to sleep. Interrupts will do the rest
     while (1)
     {
+        radio_service();
         proto_run();
+        rtc_run();
         power_sleep();
     }
 }
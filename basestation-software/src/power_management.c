@@ -5,6 +5,7 @@
 /* Standard libraries */
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 /* Board support headers */
 #include "stm32f4xx.h"
@@ -22,6 +23,20 @@ volatile uint8_t power_gpiod_use_count = 0;
 // Scheduled function to run next we sleep
 static void (*sched_func)(void);
 
+// The RTC counts ms of the day from its subseconds (see rtc_driver.c)
+#define POWER_TICK_WRAP 86400000u
+#define POWER_RTC_SUBSECONDS 321u
+
+// Residency counters, the states currently being charged and the RTC value
+// they have been charged up to
+static power_stats_t stats;
+static power_min_t stats_mode = PWR_WAKE;
+static power_radio_t stats_radio = PWR_RADIO_SLEEP;
+static uint32_t stats_mark = 0;
+
+/* Functions used only in this file */
+static uint32_t _power_ticks(void);
+static void _power_account(void);
 
 /**
  * Allow a system to indicate the minimum power state it can currently operate
@@ -32,6 +47,9 @@ static void (*sched_func)(void);
  */
 void power_set_minimum(power_system_t system, power_min_t minimum)
 {
+    // Charge the time so far to the minimums held until now
+    _power_account();
+
     // First turn off all the state bits for this system
     systems_sleep &= (power_system_store_t)(~(0x1u << system));
 
@@ -78,14 +96,28 @@ void power_sleep(void)
         else if (systems_sleep)
         {
             // Drop to sleep and wait for interrupt
+            _power_account();
+            stats_mode = PWR_SLEEP;
+
             __WFI();
+
+            _power_account();
+            stats_mode = PWR_WAKE;
+            stats.wakes++;
         }
         else
         {
             // No subsystems have requested a power mode, go to stop mode
+            _power_account();
+            stats_mode = PWR_CLOCKSTOP;
+
             //PWR_EnterSTOPMode(PWR_LowPowerRegulator_ON, PWR_STOPEntry_WFI);
             __WFI();
 
+            _power_account();
+            stats_mode = PWR_WAKE;
+            stats.wakes++;
+
             // Restart the HSE and wait for startup
             RCC_HSEConfig(RCC_HSE_ON);
             RCC_WaitForHSEStartUp();
@@ -115,3 +147,108 @@ void power_schedule(void (*fn)(void))
 {
     sched_func = fn;
 }
+
+/**
+ * Note a change of radio state, so time can be charged to each
+ *
+ * @param state State the radio has just been put in
+ */
+void power_radio_state(power_radio_t state)
+{
+    _power_account();
+    stats_radio = state;
+}
+
+/**
+ * Note a frame being transmitted, timed by the radio driver from its length
+ *
+ * @param airtime_us Time from the start of the preamble to the end of the CRC
+ */
+void power_radio_transmit(uint32_t airtime_us)
+{
+    stats.tx_us += airtime_us;
+    stats.tx_frames++;
+}
+
+/**
+ * Get the time spent in each power state since the counters were cleared
+ *
+ * @return Pointer to the counters, brought up to date
+ */
+const power_stats_t* power_stats(void)
+{
+    _power_account();
+
+    return &stats;
+}
+
+/**
+ * Start counting residency afresh from now
+ */
+void power_stats_clear(void)
+{
+    _power_account();
+    memset(&stats, 0, sizeof(stats));
+}
+
+/**
+ * Carry on counting from the RTC's new value after it has been set, rather
+ * than charging the jump to whatever state we're in
+ */
+void power_clock_changed(void)
+{
+    stats_mark = _power_ticks();
+}
+
+/**
+ * Read the RTC as ms since midnight. The subsecond register counts down from
+ * the synchronous prescaler once a second
+ *
+ * @return Time of day in ms
+ */
+static uint32_t _power_ticks(void)
+{
+    RTC_TimeTypeDef time;
+    RTC_GetTime(RTC_Format_BIN, &time);
+    uint32_t subseconds = RTC_GetSubSecond();
+
+    uint32_t seconds = time.RTC_Seconds + time.RTC_Minutes * 60u + time.RTC_Hours * 3600u;
+
+    return seconds * 1000u + (POWER_RTC_SUBSECONDS - 1 - subseconds) * 1000u / POWER_RTC_SUBSECONDS;
+}
+
+/**
+ * Charge the time since the last call to the current processor mode, radio
+ * state and the minimum each system is holding
+ */
+static void _power_account(void)
+{
+    // Called from interrupts as well as the main loop
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    uint32_t now = _power_ticks();
+    uint32_t ticks = (now + POWER_TICK_WRAP - stats_mark) % POWER_TICK_WRAP;
+    stats_mark = now;
+
+    if (ticks)
+    {
+        stats.elapsed += ticks;
+        stats.mode[stats_mode] += ticks;
+        stats.radio[stats_radio] += ticks;
+
+        for (uint8_t i = 0; i < POWER_SYSTEM_COUNT; i++)
+        {
+            if (systems_wake & (0x1 << i))
+            {
+                stats.system[i][PWR_WAKE] += ticks;
+            }
+            else if (systems_sleep & (0x1 << i))
+            {
+                stats.system[i][PWR_SLEEP] += ticks;
+            }
+        }
+    }
+
+    __set_PRIMASK(primask);
+}
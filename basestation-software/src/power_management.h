@@ -12,6 +12,27 @@ typedef uint8_t power_system_store_t;
 
 typedef enum {PWR_WAKE, PWR_SLEEP, PWR_CLOCKSTOP} power_min_t;
 typedef enum {PWR_RADIO, PWR_DELAY, PWR_MODEM} power_system_t;
+typedef enum {PWR_RADIO_SLEEP, PWR_RADIO_STANDBY, PWR_RADIO_RX, PWR_RADIO_LISTEN,
+    PWR_RADIO_TX} power_radio_t;
+
+#define POWER_MODE_COUNT 3
+#define POWER_SYSTEM_COUNT 3
+#define POWER_RADIO_COUNT 5
+
+/**
+ * Time spent in each power state since the counters were last cleared, in ms
+ * by the RTC subseconds
+ */
+typedef struct
+{
+    uint32_t elapsed;                                          //!< All time accounted for
+    uint32_t mode[POWER_MODE_COUNT];                           //!< Time the processor spent in each mode
+    uint32_t system[POWER_SYSTEM_COUNT][POWER_MODE_COUNT - 1]; //!< Time each system held each mode above the lowest
+    uint32_t radio[POWER_RADIO_COUNT];                         //!< Time the radio spent in each state
+    uint32_t tx_us;                                            //!< Air time of the frames sent, in us
+    uint32_t tx_frames;                                        //!< Frames sent
+    uint32_t wakes;                                            //!< Times the processor woke from sleep
+} power_stats_t;
 
 void power_set_minimum(power_system_t system, power_min_t minimum);
 
@@ -19,6 +40,13 @@ void power_sleep(void);
 
 void power_schedule(void (*fn)(void));
 
+void power_radio_state(power_radio_t state);
+void power_radio_transmit(uint32_t airtime_us);
+
+const power_stats_t* power_stats(void);
+void power_stats_clear(void);
+void power_clock_changed(void);
+
 // Needed so that subsystems can find variable from this header
 extern volatile uint8_t power_gpiod_use_count;
 
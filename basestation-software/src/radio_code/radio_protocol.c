@@ -5,6 +5,7 @@
 /* Standard libraries */
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 /* Board support headers */
 #include "stm32f4xx.h"
@@ -13,7 +14,9 @@
 #include "radio_protocol.h"
 #include "radio_control.h"
 #include "radio_shared_types.h"
+#include "radio_packets.h"
 #include "radio_schedule_settings.h"
+#include "radio_schedule.h"
 #include "printf.h"
 #include "power_management.h"
 #include "base_misc.h"
@@ -24,45 +27,257 @@
 // Set this to zero to keep the radio on all the time
 #define RADIO_SLEEP_IDLE 0
 
-#define PROTO_ARRAY_SIZE 512
+// While the radio is kept on, receive in listen mode between slots and beacon
+// windows so stray packets are still caught at a fraction of the current
+#define RADIO_LISTEN_IDLE 1
 
 // Time to wait for next packet
 #define PROTO_TIMEOUT_MS 750
 
-// TIme to wait for first packet
-#define PROTO_INITIAL_TIMEOUT_MS 10000
+// Time a node may be early or late to its slot by. Slots start this long
+// before the node is told to wake, and the node has this long after to be heard.
+// It shrinks from the most to the least as the node's drift is measured
+#define PROTO_SLOT_SLACK_MS 100
+#define PROTO_SLOT_SLACK_MIN_MS 10
 
-#define MAX_REPEAT 20
+// How far a node's clock is trusted until it has been measured, in ppm. Gives
+// PROTO_SLOT_SLACK_MS over a period
+#define PROTO_DRIFT_UNKNOWN_PPM 3000
 
-// Protocol state store
-proto_radio_state_t proto_state = PROTO_IDLE;
+// Largest change to a drift estimate from one upload in ppm, a node that
+// missed its ACK didn't set its clock and looks a long way out
+#define PROTO_DRIFT_STEP_PPM 500
 
-// Packet handling data storage
-static uint8_t incoming_data_array[PROTO_ARRAY_SIZE];
-static uint16_t incoming_data_pointer = 0;
-static uint8_t last_seq_number = 0;
-static uint8_t seq_size;
-static uint8_t seq_to_repeat[MAX_REPEAT] = {0};
-static uint8_t repeat_index = 0;
-static uint8_t source_node;
+// Time left spare at the end of each slot, on top of the radio traffic
+#define PROTO_SLOT_GUARD_MS 100
+
+// Time to allow for powering up the SD card and writing out the uploads held.
+// They're held until there's this long before the next slot or beacon window
+#define PROTO_SAVE_MS 500
+
+// Uploads held to write out together, and bytes of records between them,
+// enough for the whole stores of several nodes
+#define PROTO_HOLD_UPLOADS 32
+#define PROTO_HOLD_LEN 16384
+
+#define PROTO_MS_PER_DAY 86400000u
+
+// Window ACKs sent in a row without the upload moving on before giving up
+#define PROTO_MAX_NACKS 3
+
+// Signal strength we want node packets to arrive at, leaving fade margin above
+// the receiver sensitivity
+#define PROTO_TARGET_RSSI (-85)
+
+// Largest power reduction per exchange (increases are applied in full)
+#define PROTO_POWER_STEP_DOWN 3
+
+// Power increase when a session needed repeats
+#define PROTO_POWER_STEP_UP 3
+
+// Weakest signal strength at which each faster link profile is still used,
+// leaving a few dB above its sensitivity
+#define PROTO_PROFILE_RSSI_19K2 (-97)
+#define PROTO_PROFILE_RSSI_55K5 (-90)
+
+// Beacons held to be answered, once the radio is free of the ones arriving
+#define PROTO_BEACON_QUEUE_LEN 8
+
+// Commands held until the nodes they're for have taken them
+#define PROTO_COMMAND_QUEUE_LEN 8
+
+// Windows of firmware patch chunks a slot has room for while a node fetches it
+#define PROTO_PATCH_SLOT_WINDOWS 2
+
+/**
+ * A beacon heard and not answered yet
+ */
+typedef struct
+{
+    uint8_t node_id;    //!< Node that sent it
+    int16_t rssi;       //!< Signal strength in dBm
+    uint32_t timestamp; //!< Time of day in RADIO_TIME_HZ ticks it arrived
+} proto_beacon_t;
+
+/**
+ * A command waiting to go out on a node's ACKs
+ */
+typedef struct
+{
+    uint8_t node_id;    //!< Node it's for
+    uint8_t id;         //!< Id the node stores once it has taken it
+    uint8_t command;    //!< One of the CMD_x settings
+    uint16_t value;     //!< What to set it to
+} proto_command_t;
+
+/**
+ * How a node's link held up over a day, written out once the day is over to
+ * see where data went missing and where a relay would help
+ */
+typedef struct
+{
+    uint16_t uploads;    //!< Uploads ACKed
+    uint16_t repeats;    //!< Uploads that needed packets sent again
+    uint16_t retries;    //!< ACKs the node missed and asked for again
+    uint16_t missed;     //!< Slots it wasn't heard in
+    uint8_t missed_run;  //!< Most slots missed in a row
+    uint8_t retry_count; //!< Slots missed in a row when last heard of
+    uint8_t registered;  //!< Times it registered
+    uint8_t dropped;     //!< Times it was unregistered for missing slots
+    int32_t rssi_sum;    //!< Weakest packet of each upload in dBm, summed
+    int16_t rssi_min;    //!< Weakest packet of all
+    int8_t tx_power;     //!< TX power it was last told to use
+    uint8_t profile;     //!< Link profile it last uploaded with
+    uint8_t channel;     //!< Channel it last uploaded on
+} proto_link_t;
+
+/**
+ * Where a pass through the records of an upload has got to in a run of
+ * records a relay stored for another node
+ */
+typedef struct
+{
+    uint8_t node_id;    //!< Node the run is from
+    uint16_t left;      //!< Records of the run still to come
+} proto_relay_run_t;
 
-// Node schedule data storage
+/**
+ * An upload held to be written out to the SD card between slots
+ */
 typedef struct
 {
-    uint8_t node_id;
-    uint8_t retry_count;
-    uint16_t offset;
-} schedule_entry_t;
+    uint8_t node_id;    //!< Node that uploaded it
+    uint16_t start;     //!< Where its records start in held_data
+    uint16_t length;    //!< Bytes of records
+    bool acked;         //!< Whether it was complete, and what the node was told
+    int8_t tx_power;    //!< TX power the node was told to use next
+    uint8_t profile;    //!< Link profile the node was told to use next
+    uint8_t channel;    //!< Channel it was uploaded on
+    int16_t rssi;       //!< Weakest packet of it
+    bool repeats;       //!< Whether any packets had to be sent again
+} proto_upload_t;
+
+// Protocol state store
+proto_radio_state_t proto_state = PROTO_IDLE;
+
+// Upload reassembly, one window of packets at a time. Packet seq goes in
+// slot seq % RADIO_WINDOW, from seq_saved (the first not taken out yet) up
+// to seq_expected (the first not received yet) they're in order, after that
+// they wait for the gaps to be filled
+static uint8_t window_data[RADIO_WINDOW][RADIO_MAX_DATA_LEN];
+static uint8_t window_len[RADIO_WINDOW];
+static uint8_t window_full = 0;
+static uint16_t seq_saved = 0;
+static uint16_t seq_expected = 0;
+static uint16_t seq_final = 0;
+static bool seq_final_known = false;
+static uint8_t nack_count = 0;
+static uint8_t source_node;
 
-static schedule_entry_t schedule_entries[RSCHED_MAX_NODES];
-static uint8_t current_schedule_point = 0;
+// Packets the node said it still had stored, last time it said
+static uint8_t session_backlog = 0;
+
+// Sub-slots a relay asked for at the end of its slot, and where each pass
+// through its records has got to
+static uint8_t session_children = 0;
+static proto_relay_run_t confirm_run;
+
+// Uploads taken out of the window as they come into order, and the one of the
+// session in progress. Mounting and writing the SD card takes longer than a
+// node waits for its SACK, so they're written out once there's a gap
+static proto_upload_t held[PROTO_HOLD_UPLOADS];
+static uint8_t held_count = 0;
+static uint8_t held_data[PROTO_HOLD_LEN];
+static uint16_t held_length = 0;
+static proto_upload_t* session_upload = 0x0;
+
+// Time of day in ms of the next slot or beacon window
+static uint32_t idle_until_ms = 0;
+
+// Link quality for the current upload session
+static int16_t session_rssi = 0;
+static bool session_repeats = false;
+
+// How late the node woke for its slot in ms, by when its first packet started
+static int32_t session_late_ms = 0;
+static bool session_timed = false;
+
+// When the node's latest packet arrived, for it to set its clock from
+static uint32_t session_rx_time = 0;
+
+// Last ACK sent, kept to send again if the node asks, as laid out and its
+// length, and the time of day in ms it tells the node to wake at
+static radio_ack_t ack = {0};
+static uint8_t ack_data[RADIO_ACK_MAX_LEN] = {0x00};
+static uint8_t ack_len = RADIO_ACK_LEN;
+static uint32_t ack_wake_ms = 0;
+
+// Node whose slot is next or in progress, and when it was told to wake
+static sched_entry_t* slot_entry = 0x0;
+static uint32_t slot_wake_ms = 0;
+
+// Beacons waiting for their BEACONACK, oldest first
+static proto_beacon_t beacon_queue[PROTO_BEACON_QUEUE_LEN];
+static uint8_t beacon_count = 0;
+
+// Commands for nodes, oldest first, and the id to give the next one
+static proto_command_t command_queue[PROTO_COMMAND_QUEUE_LEN];
+static uint8_t command_count = 0;
+static uint8_t command_next_id = RADIO_COMMAND_ID_PATCH + 1;
+
+// Firmware patch off the SD card for every node to fetch, its length and id,
+// and a bit per node that has it
+static uint8_t patch_data[RADIO_PATCH_MAX_LEN];
+static uint16_t patch_length = 0;
+static uint16_t patch_id = 0;
+static uint8_t patch_taken[256 / 8];
+
+// Chunk of the patch the node being served wants next and which of the
+// RADIO_WINDOW - 1 after it it has, and when its slot ends
+static uint16_t patch_wanted = 0;
+static uint8_t patch_have = 0;
+static uint32_t slot_end_ms = 0;
+
+// How each node's link has held up since the start of the day in stats_date,
+// written out once the date moves on
+static proto_link_t link_stats[256];
+static char stats_date[20] = "";
 
 // Functions used only in this file
 void TIM2_IRQHandler(void);
 static void _proto_savedata(void);
-static void _proto_register_node(void);
-static uint8_t _proto_add_to_schedule(uint8_t node_id);
+static void _proto_savestats(void);
+static void _proto_link_upload(const proto_upload_t* upload);
+static void _proto_link_missed(const sched_entry_t* entry);
+static void _proto_printdata(const proto_upload_t* upload);
+static void _proto_upload_hold(void);
+static void _proto_upload_write(void);
+static bool _proto_window_add(uint16_t seq, uint8_t flags, const uint8_t* data,
+        uint8_t length);
+static uint8_t _proto_window_sacked(void);
+static bool _proto_upload_complete(void);
+static void _proto_queue_beacon(const radio_packet_t* packet);
+static void _proto_answer_beacon(void);
+static void _proto_register_node(const proto_beacon_t* beacon);
+static uint16_t _proto_slot_length(uint8_t profile, uint8_t backlog, uint16_t slack_ms,
+        bool patch);
+static uint32_t _proto_time_ms(uint32_t time);
+static void _proto_update_drift(sched_entry_t* entry);
+static uint16_t _proto_slot_slack(const sched_entry_t* entry);
+static int32_t _proto_ms_between(uint32_t from_ms, uint32_t to_ms);
+static int8_t _proto_adjust_power(int8_t current, int16_t rssi, bool repeats);
+static uint8_t _proto_choose_profile(uint8_t current, int16_t rssi, bool repeats);
+static uint8_t _proto_choose_channel(const sched_entry_t* entry);
 static void _proto_endcleanup(void);
+static void _proto_session_reset(void);
+static void _proto_send_ack(void);
+static void _proto_send_schedule(void);
+static void _proto_add_command(radio_ack_t* reply);
+static void _proto_take_confirms(void);
+static bool _proto_patch_pending(uint8_t node_id);
+static void _proto_send_patch(void);
+static uint8_t _proto_record_node(const data_struct_t* data, uint8_t source,
+        proto_relay_run_t* run);
 
 /**
  * Configure the timer used elsewhere in the protocol
@@ -98,11 +313,8 @@ void proto_init(void)
     // Power down the timer until needed
     RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2, DISABLE);
 
-    // Mark all schedule slots as empty
-    for (uint8_t i = 0; i < RSCHED_MAX_NODES; i++)
-    {
-        schedule_entries[i].node_id = 0xFF;
-    }
+    // Nobody is registered yet
+    sched_init();
 
     // Set up to listen for beacon frames
     proto_togglebeacon();
@@ -128,16 +340,69 @@ void proto_init(void)
  */
 void proto_incoming_packet(uint16_t bytes)
 {
-    // If we're waiting for beacon frames, go handle scheduling separately
+    // Parse the frame in place, it's released once handled
+    const radio_packet_t* packet = radio_rx_peek();
+    radio_patch_request_t request;
+    radio_upload_t upload;
+
+    if (!packet)
+    {
+        return;
+    }
+
+    // If we're waiting for beacon frames, note it to answer once we're not
+    // receiving another
     if (proto_state == PROTO_BEACON)
     {
-        _proto_register_node();
+        _proto_queue_beacon(packet);
     }
-    else
+    // After its ACK the node may ask for chunks of the firmware patch
+    else if ((proto_state == PROTO_ACKED || proto_state == PROTO_PATCHWAIT) &&
+            packet->data[0] == source_node &&
+            radio_patch_request_unpack(&packet->data[1], (uint8_t)(packet->length - 1),
+            &request))
+    {
+        patch_wanted = request.next;
+        patch_have = request.have;
+
+        proto_state = PROTO_PATCH;
+
+        TIM_Cmd(TIM2, DISABLE);
+    }
+    // The node sends its last packet again if it missed the ACK
+    else if (proto_state == PROTO_ACKED)
+    {
+        if (packet->length >= 3 && packet->data[0] == source_node)
+        {
+            printf("Node %d missed its ACK, sending again\r\n", source_node);
+
+            link_stats[source_node].retries++;
+
+            session_rx_time = packet->timestamp;
+            TIM_SetCounter(TIM2, 0);
+            _proto_send_ack();
+        }
+    }
+    // Once an upload has started, packets from other nodes aren't part of it
+    else if (radio_upload_unpack(&packet->data[1], (uint8_t)(packet->length - 1), &upload) &&
+            (proto_state == PROTO_AWAKE || proto_state == PROTO_IDLE ||
+            packet->data[0] == source_node))
     {
         // Reset the timeout since we got a new packet
         TIM_SetCounter(TIM2, 0);
 
+        // The first packet goes as soon as the node wakes, so says how far
+        // its clock has drifted
+        if (proto_state == PROTO_AWAKE && packet->data[0] == slot_entry->node_id &&
+                upload.seq == 0)
+        {
+            uint32_t sent_ms = (_proto_time_ms(packet->timestamp) + PROTO_MS_PER_DAY -
+                    radio_airtime_us(packet->length) / 1000) % PROTO_MS_PER_DAY;
+
+            session_late_ms = _proto_ms_between(slot_wake_ms, sent_ms);
+            session_timed = true;
+        }
+
         // Set flag that receive started
         if (proto_state == PROTO_AWAKE || proto_state == PROTO_IDLE ||
                 proto_state == PROTO_RECV)
@@ -147,46 +412,37 @@ void proto_incoming_packet(uint16_t bytes)
             proto_state = PROTO_RECV;
         }
 
-        // Read in enough data to get sequence numbers
-        uint8_t seq_data[3];
-        uint16_t bytes_read = radio_retrieve_data(seq_data, 3);
+        // Frame is [source(8)] then the upload, see radio_packets.h
+        source_node = packet->data[0];
+        uint16_t seq = upload.seq;
+        uint8_t flags = upload.flags;
+        session_backlog = upload.backlog;
+        session_rx_time = packet->timestamp;
 
-        source_node = seq_data[0];
-        seq_size = seq_data[1];
-        uint8_t seq_number = seq_data[2];
-
-        printf("\r\nGot some radio data. Count: %d of %d - %d bytes\r\n",
-                seq_number, seq_size, bytes);
-
-        // Read rest of data in at correct location
-        bytes_read = radio_retrieve_data(
-                (incoming_data_array + (seq_number - 1) * RADIO_MAX_DATA_LEN),
-                RADIO_MAX_DATA_LEN);
+        // Track the weakest packet, that's the one power has to be set for
+        if (packet->rssi < session_rssi)
+        {
+            session_rssi = packet->rssi;
+        }
 
-        incoming_data_pointer += bytes_read;
+        printf("\r\nGot some radio data. Packet %u, flags %d - %d bytes\r\n",
+                seq, flags, bytes);
 
-        if (proto_state == PROTO_REPEATING)
+        if (!_proto_window_add(seq, flags, upload.data, upload.length))
         {
-            proto_state = PROTO_ARQ;
-            printf("Was a repeat\r\n");
+            printf("Already had it\r\n");
         }
-        else
-        {
-            while (seq_number > ++last_seq_number && repeat_index < MAX_REPEAT)
-            {
-                seq_to_repeat[repeat_index++] = last_seq_number;
-            }
 
-            if (seq_number == seq_size)
-            {
-                // Handle a complete packet by setting state
-                proto_state = PROTO_ARQ;
+        // Reply when the node asks, or as soon as the last gap is filled
+        if ((flags & RADIO_FLAG_POLL) || _proto_upload_complete())
+        {
+            proto_state = PROTO_ARQ;
 
-                TIM_Cmd(TIM2, DISABLE);
-            }
+            TIM_Cmd(TIM2, DISABLE);
         }
-   }
+    }
 
+    radio_rx_commit();
 }
 
 /**
@@ -196,21 +452,31 @@ void proto_start_rec(void)
 {
     // Set protocol state to awake but nothing yet
     proto_state = PROTO_AWAKE;
-    incoming_data_pointer = 0;
-    last_seq_number = 0;
-    repeat_index = 0;
+    _proto_session_reset();
 
     // Enable, set and start the timer
     RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2, ENABLE);
     TIM_ClearFlag(TIM2, TIM_FLAG_Update);
     NVIC_ClearPendingIRQ(TIM2_IRQn);
     TIM_ClearITPendingBit(TIM2, TIM_IT_Update);
+
+    // The node's first packet should be in soon after it was told to wake,
+    // giving up then leaves the rest of the slot free for the next one
+    slot_wake_ms = sched_slot_start_ms(slot_entry) + slot_entry->slack_ms;
+    slot_end_ms = (sched_slot_start_ms(slot_entry) + slot_entry->length * RSCHED_SLOT_MS -
+            slot_entry->children * RADIO_RELAY_SLOT_MS) % PROTO_MS_PER_DAY;
+
     TIM_SetCounter(TIM2, 0);
-    TIM_SetAutoreload(TIM2, PROTO_INITIAL_TIMEOUT_MS);
+    TIM_SetAutoreload(TIM2, 2 * slot_entry->slack_ms + RADIO_REPLY_MARGIN_MS +
+            radio_profile_airtime_us(slot_entry->profile, RADIO_MAX_PACKET_LEN) / 1000);
     TIM_Cmd(TIM2, ENABLE);
 
-    // Radio on and listening
+    // Radio on and listening, using the profile agreed with this node on the
+    // channel it was given
+    radio_set_profile(slot_entry->profile);
+    radio_set_channel(slot_entry->channel);
     radio_powerstate(true);
+    radio_listen_lowpower(false);
     radio_receive_activate(true);
 
     power_set_minimum(PWR_RADIO, PWR_SLEEP);
@@ -225,133 +491,189 @@ void proto_run(void)
     {
         case PROTO_ARQ:
         {
-            // We've received most of a packet, now go get the missing bits
-            uint8_t packet_data[] = {PKT_REPEAT, seq_size, 0x00};
-
-            if (repeat_index > 0)
+            if (!_proto_upload_complete())
             {
-                // Delay for far end to enter receive
-                misc_delay(1000, true);
+                _proto_take_confirms();
+
+                // Asking again for the same packet counts towards giving up
+                if (seq_saved == seq_expected)
+                {
+                    nack_count++;
+                }
+                else
+                {
+                    nack_count = 0;
+                }
+
+                // Take out what's in order to make room for the next window,
+                // the node is waiting for us so it's only copied for now
+                _proto_upload_hold();
+
+                // Tell the node what we have, see radio_packets.h
+                uint8_t sack_data[RADIO_SACK_LEN];
+                radio_sack_t sack;
 
-                repeat_index--;
+                sack.next = seq_expected;
+                sack.have = _proto_window_sacked();
 
-                // Set seq number to repeat
-                packet_data[2] = seq_to_repeat[repeat_index];
+                // Some packets after a gap means the gap was lost
+                if (sack.have)
+                {
+                    session_repeats = true;
+                }
 
-                printf("Requesting repeat of packet %d\r\n",
-                        seq_to_repeat[repeat_index]);
+                printf("Window ACK up to %u, have %02x after\r\n", seq_expected,
+                        sack.have);
 
-                // Send repeat request
-                radio_send_data(packet_data, 3, source_node);
+                radio_turnaround_wait();
+                radio_send_data(sack_data, radio_sack_pack(&sack, sack_data), source_node);
 
-                // Reset state
-                proto_state = PROTO_REPEATING;
+                // Carry on receiving, the node sends the next window straight away
+                proto_state = PROTO_RECV;
 
-                // Reset timer
+                TIM_SetCounter(TIM2, 0);
                 TIM_SetAutoreload(TIM2, PROTO_TIMEOUT_MS);
                 TIM_Cmd(TIM2, ENABLE);
-
-                // Repeat will be received by incoming_packet() and then this
-                // will rerun
             }
             else
             {
-                // We now have the full packet, so ACK it
-                packet_data[0] = PKT_ACK;
+                // We now have the full upload, so ACK it
+                // Tell the node what power and profile to use next time, and
+                // when its next slot is
+                _proto_take_confirms();
 
-                uint32_t time = rtc_get_time_of_day();
-                packet_data[1] = (time & 0x10000) >> 16;
-                packet_data[2] = time & 0xFF;
-                packet_data[3] = (time & 0xFF00) >> 8;
+                sched_entry_t* entry = sched_find(source_node);
+                int8_t tx_power = RADIO_TXPOWER_MAX;
+                uint8_t profile = RADIO_PROFILE_DEFAULT;
 
-                // Delay for far end to enter receive
-                misc_delay(1000, true);
+                memset(&ack, 0, sizeof(ack));
 
-                radio_send_data(packet_data, 2, source_node);
+                if (entry)
+                {
+                    entry->tx_power = _proto_adjust_power(entry->tx_power,
+                            session_rssi, session_repeats);
+                    entry->profile = _proto_choose_profile(entry->profile,
+                            session_rssi, session_repeats);
+                    tx_power = entry->tx_power;
+                    profile = entry->profile;
 
-                // Reset
-                _proto_endcleanup();
+                    entry->retry_count = 0;
 
-                // Save the packet
-                char bughit[] = "Call";
-                char temp[] = "Temperature";
-                char humid[] = "Humidity";
-                char light[] = "Light Level";
-                char other[] = "Other";
+                    if (session_timed)
+                    {
+                        _proto_update_drift(entry);
+                    }
 
-                printf("Data from node %d\r\n", source_node);
+                    // Nodes with more than a packet waiting, a patch to fetch
+                    // or nodes to relay for want a slot every period, the rest
+                    // can take turns if it's crowded. A relay's sub-slots go
+                    // on the end
+                    bool patch = _proto_patch_pending(source_node);
 
-                for (uint16_t i = 0; i < incoming_data_pointer; i += 4)
-                {
-                    data_struct_t* data = (data_struct_t*)(incoming_data_array + i);
-                    char* type;
+                    entry->slack_ms = _proto_slot_slack(entry);
 
-                    switch(data->type & 0x7F)
-                    {
-                        case 0:
-                            type = bughit;
-                            break;
-                        case 1:
-                            type = temp;
-                            break;
-                        case 2:
-                            type = humid;
-                            break;
-                        case 3:
-                            type = light;
-                            break;
-                        default:
-                            type = other;
-                    }
+                    uint16_t length = _proto_slot_length(profile, session_backlog,
+                            entry->slack_ms, patch);
+                    uint16_t relay_length = session_children *
+                            (RADIO_RELAY_SLOT_MS / RSCHED_SLOT_MS);
 
-                    uint32_t timestamp = data->time;
-                    timestamp |= (data->type & 0x80) << 9;
+                    sched_plan(entry, length + relay_length, session_backlog > 1 ||
+                            patch || session_children, rtc_get_ms_of_day());
 
-                    uint8_t hours = timestamp / 3600;
-                    timestamp -= hours * 3600;
-                    uint8_t minutes = timestamp / 60;
-                    timestamp -= minutes * 60;
-                    uint8_t seconds = timestamp;
+                    entry->children = (entry->length >= length + relay_length) ?
+                            session_children : 0;
 
-                    if ((data->type & 0x7F) == 0)
-                    {
-                        // Display a different message for calls
-                        printf("%02d:%02d:%02d : %s - %d clicks", hours, minutes,
-                                seconds, type, data->otherdata & 0x7F);
-
-                        if (data->otherdata & 0x80)
-                        {
-                            // Got a female
-                            printf(" and female");
-                        }
-                        printf("\r\n");
-                    }
-                    else
+                    ack_wake_ms = sched_slot_start_ms(entry) + entry->slack_ms;
+                    ack.slot = true;
+                    ack.period = (uint16_t)sched_slot_period(entry);
+                    ack.drift_ppm = entry->drift_ppm;
+
+                    printf("Node %d has %d packets stored, next slot %d ms into the period for %d ms, every %d periods\r\n",
+                            source_node, session_backlog,
+                            (int)(RSCHED_SLOT_START * 1000u + entry->offset * RSCHED_SLOT_MS),
+                            (int)(entry->length * RSCHED_SLOT_MS), entry->every);
+
+                    // Tell a relay how many sub-slots it has and how long
+                    // after waking they start
+                    if (entry->children)
                     {
-                        printf("%02d:%02d:%02d : %s - %d\r\n", hours, minutes,
-                                seconds, type, data->otherdata);
+                        uint16_t start_ms = (uint16_t)(entry->length * RSCHED_SLOT_MS -
+                                entry->children * RADIO_RELAY_SLOT_MS - entry->slack_ms);
+
+                        ack.children = entry->children;
+                        ack.children_ms = start_ms;
+
+                        printf("Node %d relays in %d sub-slots\r\n", source_node,
+                                entry->children);
                     }
                 }
-                printf("Data done. \r\n");
 
-                _proto_savedata();
+                ack.tx_power = tx_power;
+                ack.profile = profile;
 
-                // Reset some stuff
-                incoming_data_pointer = 0;
-                last_seq_number = 0;
-                repeat_index = 0;
+                // Send the node's oldest command until it says it has taken it
+                _proto_add_command(&ack);
+
+                _proto_send_ack();
+
+                printf("Node %d RSSI %d dBm, TX power now %d dBm, profile %d\r\n",
+                        source_node, session_rssi, tx_power, profile);
+
+                // Stay on long enough for the node to send its last packet
+                // again if the ACK got lost, the session ends when the timer
+                // runs out
+                proto_state = PROTO_ACKED;
 
+                TIM_SetCounter(TIM2, 0);
+                TIM_SetAutoreload(TIM2, RADIO_REPLY_MARGIN_MS + RADIO_RETRY_JITTER_MS +
+                        (radio_airtime_us(ack_len) +
+                        radio_airtime_us(RADIO_MAX_PACKET_LEN)) / 1000);
+                TIM_Cmd(TIM2, ENABLE);
+
+                // Hold the rest of the upload with what the node was told, it's
+                // counted once saved so the first upload of a day is counted on
+                // the new day's statistics
+                _proto_upload_hold();
 
+                session_upload->acked = true;
+                session_upload->tx_power = tx_power;
+                session_upload->profile = profile;
+                session_upload->channel = radio_get_channel();
+                session_upload->rssi = session_rssi;
+                session_upload->repeats = session_repeats;
+
+                // Reset some stuff
+                _proto_session_reset();
             }
 
             break;
         }
+        case PROTO_BEACON:
+        {
+            // Answer a beacon, the rest wait for the next time round so any
+            // arriving in the meantime are read first
+            _proto_answer_beacon();
+
+            break;
+        }
+        case PROTO_PATCH:
+        {
+            _proto_send_patch();
+
+            break;
+        }
         case PROTO_IDLE:
         default:
             // Nothing to do here! An interrupt will jump us forward
             break;
     }
 
+    // Write out the uploads held if there's time before the next slot
+    if (proto_state == PROTO_IDLE &&
+            _proto_ms_between(rtc_get_ms_of_day(), idle_until_ms) >= PROTO_SAVE_MS)
+    {
+        _proto_upload_write();
+    }
 }
 
 /**
@@ -362,6 +684,16 @@ void proto_togglebeacon()
     if (proto_state != PROTO_BEACON)
     {
         proto_state = PROTO_BEACON;
+
+        // Registration always happens on the default profile and the
+        // control channel
+        radio_set_profile(RADIO_PROFILE_DEFAULT);
+        radio_set_channel(RADIO_CHANNEL_CONTROL);
+        radio_listen_lowpower(false);
+
+        // Nodes that lost track of their slot are listening for it now
+        _proto_send_schedule();
+
         radio_receive_activate(true);
         printf("Waiting for beacon frame\r\n");
 
@@ -370,6 +702,12 @@ void proto_togglebeacon()
     }
     else
     {
+        // Nodes whose beacons came in at the end are still listening
+        while (beacon_count)
+        {
+            _proto_answer_beacon();
+        }
+
         radio_receive_activate(false);
 
 #if RADIO_SLEEP_IDLE
@@ -383,84 +721,78 @@ void proto_togglebeacon()
 }
 
 /**
- * Save received data to the SD card
+ * Queue a setting for a node to change, sent with each of its ACKs until it
+ * stores a DATA_CONFIG record of the command's id. Commands for a node go out
+ * one at a time, oldest first
+ *
+ * @param node_id Node to send it to
+ * @param command One of the CMD_x settings
+ * @param value   What to set it to
+ * @return        False if the queue is full
  */
-static void _proto_savedata(void)
+bool proto_queue_command(uint8_t node_id, uint8_t command, uint16_t value)
 {
-    FATFS filesystem;
-    FIL data_file;
+    if (command_count >= PROTO_COMMAND_QUEUE_LEN)
+    {
+        return false;
+    }
 
-    // Power up the card
-    GPIO_ResetBits(GPIOB, 4);
+    proto_command_t* queued = &command_queue[command_count++];
 
-    // Mark that we're using GPIOD so the GSM module doesn't shut it down
-    power_gpiod_use_count++;
+    queued->node_id = node_id;
+    queued->id = command_next_id++;
+    queued->command = command;
+    queued->value = value;
 
-    // Mount the disk
-    if (f_mount(&filesystem, "0:", 1) != FR_OK)
+    // The patch has an id of its own
+    if (command_next_id == RADIO_COMMAND_ID_PATCH)
     {
-        printf("File system mounting failed!\r\n");
-
-        // Kill power to some subsystems
-        RCC_AHB1PeriphClockCmd (RCC_AHB1Periph_GPIOC, DISABLE);
-        RCC_APB2PeriphClockCmd (RCC_APB2Periph_SDIO, DISABLE);
-        RCC_AHB1PeriphClockCmd (RCC_AHB1Periph_DMA2, DISABLE);
+        command_next_id++;
+    }
 
-        // GPIOD is used by the GSM modem, so we need to make sure its not in use
-        power_gpiod_use_count--;
-        if (power_gpiod_use_count == 0)
-        {
-            RCC_AHB1PeriphClockCmd (RCC_AHB1Periph_GPIOC, DISABLE);
-        }
+    printf("Command %d for node %d queued\r\n", queued->id, node_id);
 
-        return;
-    }
+    return true;
+}
 
-    // Try to open/create today's file for append
-    char date[20];
-    char filename[60];
-    rtc_get_date_string(date);
-    sprintf(filename, "0:SBC-WSN-DATA-%s.csv", date);
+/**
+ * Read the firmware patch for the nodes off the SD card, if there is one, made
+ * with host-software's ota_diff. Every node is sent it until it has fetched it
+ *
+ * @return True if there's a patch to send
+ */
+bool proto_load_patch(void)
+{
+    FATFS filesystem;
+    FIL patch_file;
+    UINT bytes = 0;
+    radio_patch_header_t header;
 
-    if (f_open(&data_file, filename,
-            FA_OPEN_ALWAYS | FA_READ | FA_WRITE) == FR_OK)
-    {
-        // Opening the file succeeded, now seek to the end
-        f_lseek(&data_file, f_size(&data_file));
+    patch_length = 0;
 
-        // Ok, now we loop through the data we got and write it
-        for (uint16_t i = 0; i < incoming_data_pointer; i += 4)
-        {
-            // Cast the block back to a data struct
-            data_struct_t* data = (data_struct_t*)(incoming_data_array + i);
+    // Power up the card
+    GPIO_ResetBits(GPIOB, 4);
 
-            // Assemble time with the top bit
-            uint32_t timestamp = data->time;
-            timestamp |= (data->type & 0x80) << 9;
-            data->type &= 0x7F;
+    // Mark that we're using GPIOD so the GSM module doesn't shut it down
+    power_gpiod_use_count++;
 
-            // Split time up
-            uint8_t hours = timestamp / 3600;
-            timestamp -= hours * 3600;
-            uint8_t minutes = timestamp / 60;
-            timestamp -= minutes * 60;
-            uint8_t seconds = timestamp;
+    if (f_mount(&filesystem, "0:", 1) == FR_OK)
+    {
+        if (f_open(&patch_file, "0:SBC-WSN-PATCH.BIN", FA_OPEN_EXISTING | FA_READ) == FR_OK)
+        {
+            if (f_size(&patch_file) > sizeof(patch_data) ||
+                    f_read(&patch_file, patch_data, sizeof(patch_data), &bytes) != FR_OK)
+            {
+                bytes = 0;
+            }
 
-            // Write out a CSV style line
-            // Columns: NodeID, Time, Type, Other
-            f_printf(&data_file, "%d, %02d:%02d:%02d, %d, %d\n", source_node, hours,
-                    minutes, seconds, data->type, data->otherdata);
+            f_close(&patch_file);
         }
 
-        // Close file
-        f_close(&data_file);
-
-        printf("Data written to SD card - %d lines\r\n", incoming_data_pointer/4);
+        // Unmount the card (mounting 0x0 triggers unmount)
+        f_mount(0, "0:", 1);
     }
 
-    // Finally unmount the card (mounting 0x0 triggers unmount)
-    f_mount(0, "0:", 1);
-
     // Kill power to some subsystems
     RCC_AHB1PeriphClockCmd (RCC_AHB1Periph_GPIOC, DISABLE);
     RCC_APB2PeriphClockCmd (RCC_APB2Periph_SDIO, DISABLE);
@@ -475,217 +807,1347 @@ static void _proto_savedata(void)
 
     // Power down the card
     GPIO_SetBits(GPIOB, 4);
+
+    memcpy(&header, patch_data, sizeof(header));
+
+    if (bytes < sizeof(header) || header.magic != RADIO_PATCH_MAGIC)
+    {
+        printf("No firmware patch\r\n");
+        return false;
+    }
+
+    patch_length = (uint16_t)bytes;
+    patch_id = header.new_crc & 0xFFFF;
+
+    printf("Firmware patch %u read, %u bytes\r\n", patch_id, patch_length);
+
+    return true;
 }
 
 /**
- * Handle a timeout by adjusting the state machine
+ * Write out how each node's link held up, once the day they were counted over
+ * has ended, to SBC-WSN-STATS-<date>.csv next to that day's data. Lines are
+ * "node, uploads, repeats, retries, missed, most missed in a row, missed in a
+ * row at the end, registered, unregistered, mean RSSI, weakest RSSI, TX power,
+ * profile, channel" for each node heard from or expected that day. The card
+ * must be mounted
  */
-void TIM2_IRQHandler(void)
+static void _proto_savestats(void)
 {
-    if (TIM_GetITStatus(TIM2, TIM_IT_Update) == SET && TIM2->CNT == TIM2->ARR)
-    {
-        switch (proto_state)
-        {
-            case PROTO_AWAKE:
-            {
-                // We didn't get anything from this node. Assume its dead, de-register
-                schedule_entries[current_schedule_point].retry_count++;
+    FIL stats_file;
+    char date[20];
+    char filename[60];
 
-                if (schedule_entries[current_schedule_point].retry_count > RSCHED_MAX_RETRIES)
-                {
-                    // De-register the node
-                    printf("Unregistering node %d\r\n", schedule_entries[current_schedule_point].node_id);
+    rtc_get_date_string(date);
 
-                    schedule_entries[current_schedule_point].node_id = 0xFF;
-                }
+    // Start counting from the first save after we start up
+    if (!stats_date[0])
+    {
+        strcpy(stats_date, date);
+    }
 
-                _proto_endcleanup();
+    if (strcmp(date, stats_date) == 0)
+    {
+        return;
+    }
 
-                break;
-            }
-            case PROTO_RECV:
-            {
-                // Looks like the last packets were dropped! Mark for repeat
-                while (++last_seq_number <= seq_size)
-                {
-                    seq_to_repeat[repeat_index++] = last_seq_number;
-                }
+    sprintf(filename, "0:SBC-WSN-STATS-%s.csv", stats_date);
 
-                proto_state = PROTO_ARQ;
+    if (f_open(&stats_file, filename, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK)
+    {
+        uint16_t lines = 0;
 
-                TIM_Cmd(TIM2, DISABLE);
-                printf("Timer ran out, last packets lost\r\n");
+        for (uint16_t node_id = 0; node_id < 256; node_id++)
+        {
+            const proto_link_t* link = &link_stats[node_id];
 
-                break;
-            }
-            case PROTO_ARQ:
-            case PROTO_REPEATING:
+            if (!link->uploads && !link->missed && !link->registered)
             {
-                // Well that's gone well. Call the whole thing off?
-                printf("Abandoning waiting for packet\r\n");
+                continue;
+            }
 
-                _proto_endcleanup();
+            int16_t rssi_mean = link->uploads ?
+                    (int16_t)(link->rssi_sum / link->uploads) : 0;
 
-                break;
-            }
-            default:
-                // Do nothing
-                printf("How did we get in state %d\r\n", proto_state);
-                break;
+            f_printf(&stats_file, "%d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d\n",
+                    node_id, link->uploads, link->repeats, link->retries,
+                    link->missed, link->missed_run, link->retry_count,
+                    link->registered, link->dropped, rssi_mean, link->rssi_min,
+                    link->tx_power, link->profile, link->channel);
+            lines++;
         }
 
-        TIM_ClearITPendingBit(TIM2, TIM_IT_Update);
+        f_close(&stats_file);
+
+        printf("Link stats for %s written - %d nodes\r\n", stats_date, lines);
     }
+
+    // Carry over where each node was left for the new day
+    for (uint16_t node_id = 0; node_id < 256; node_id++)
+    {
+        proto_link_t* link = &link_stats[node_id];
+        proto_link_t last = *link;
+
+        memset(link, 0, sizeof(*link));
+        link->retry_count = last.retry_count;
+        link->tx_power = last.tx_power;
+        link->profile = last.profile;
+        link->channel = last.channel;
+    }
+
+    strcpy(stats_date, date);
 }
 
 /**
- * Shut down after timeout/receive complete
+ * Count a completed upload towards its node's link statistics
+ *
+ * @param upload Upload, ACKed
  */
-static void _proto_endcleanup(void)
+static void _proto_link_upload(const proto_upload_t* upload)
 {
-    // Go back to sleep
-    proto_state = PROTO_IDLE;
+    proto_link_t* link = &link_stats[upload->node_id];
 
-    TIM_Cmd(TIM2, DISABLE);
+    if (!link->uploads || upload->rssi < link->rssi_min)
+    {
+        link->rssi_min = upload->rssi;
+    }
 
-#if RADIO_SLEEP_IDLE
-    // Radio off
-    radio_powerstate(false);
-    RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2, DISABLE);
-    power_set_minimum(PWR_RADIO, PWR_CLOCKSTOP);
-#endif
+    link->uploads++;
+    link->rssi_sum += upload->rssi;
+    link->retry_count = 0;
+    link->tx_power = upload->tx_power;
+    link->profile = upload->profile;
+    link->channel = upload->channel;
 
-    // Work out when to wake next
-    uint8_t i = current_schedule_point;
-    for (; i < RSCHED_MAX_NODES; i++)
+    if (upload->repeats)
     {
-        if (schedule_entries[i].node_id != 0xFF)
-        {
-            break;
+        link->repeats++;
+    }
+}
+
+/**
+ * Count a slot a node wasn't heard in towards its link statistics
+ *
+ * @param entry Node whose slot it was, its retry_count already counting it
+ */
+static void _proto_link_missed(const sched_entry_t* entry)
+{
+    proto_link_t* link = &link_stats[entry->node_id];
+
+    link->missed++;
+    link->retry_count = entry->retry_count;
+
+    if (entry->retry_count > link->missed_run)
+    {
+        link->missed_run = entry->retry_count;
+    }
+}
+
+/**
+ * Print an upload held
+ *
+ * @param upload Upload to print
+ */
+static void _proto_printdata(const proto_upload_t* upload)
+{
+    char bughit[] = "Call";
+    char temp[] = "Temperature";
+    char humid[] = "Humidity";
+    char light[] = "Light Level";
+    char config[] = "Command taken";
+    char battery[] = "Battery months";
+    char txpower[] = "TX power";
+    char other[] = "Other";
+    proto_relay_run_t run = {0};
+
+    if (!upload->length)
+    {
+        return;
+    }
+
+    printf("Data from node %d\r\n", upload->node_id);
+
+    for (uint16_t i = 0; i + 4 <= upload->length; i += 4)
+    {
+        const data_struct_t* data = (const data_struct_t*)&held_data[upload->start + i];
+        uint8_t node_id = _proto_record_node(data, upload->node_id, &run);
+        char* type;
+
+        if ((data->type & 0x7F) == DATA_RELAY)
+        {
+            if (node_id == 0)
+            {
+                printf("Relayed from node %d - %d records\r\n", data->otherdata,
+                        data->time);
+            }
+            else
+            {
+                printf("Relay sub-slots wanted - %d\r\n", data->time);
+            }
+            continue;
+        }
+
+        switch(data->type & 0x7F)
+        {
+            case 0:
+                type = bughit;
+                break;
+            case 1:
+                type = temp;
+                break;
+            case 2:
+                type = humid;
+                break;
+            case 3:
+                type = light;
+                break;
+            case 5:
+                type = config;
+                break;
+            case 6:
+                type = battery;
+                break;
+            case 7:
+                type = txpower;
+                break;
+            default:
+                type = other;
+        }
+
+        uint32_t timestamp = data->time;
+        timestamp |= (data->type & 0x80) << 9;
+
+        uint8_t hours = timestamp / 3600;
+        timestamp -= hours * 3600;
+        uint8_t minutes = timestamp / 60;
+        timestamp -= minutes * 60;
+        uint8_t seconds = timestamp;
+
+        if ((data->type & 0x7F) == 0)
+        {
+            // Display a different message for calls
+            printf("%02d:%02d:%02d : %s - %d clicks", hours, minutes,
+                    seconds, type, data->otherdata & 0x7F);
+
+            if (data->otherdata & 0x80)
+            {
+                // Got a female
+                printf(" and female");
+            }
+            printf("\r\n");
+        }
+        else
+        {
+            printf("%02d:%02d:%02d : %s - %d\r\n", hours, minutes,
+                    seconds, type, data->otherdata);
+        }
+    }
+    printf("Data done. \r\n");
+}
+
+/**
+ * Save the uploads held to the SD card
+ */
+static void _proto_savedata(void)
+{
+    FATFS filesystem;
+    FIL data_file;
+
+    if (!held_length)
+    {
+        return;
+    }
+
+    // Power up the card
+    GPIO_ResetBits(GPIOB, 4);
+
+    // Mark that we're using GPIOD so the GSM module doesn't shut it down
+    power_gpiod_use_count++;
+
+    // Mount the disk
+    if (f_mount(&filesystem, "0:", 1) != FR_OK)
+    {
+        printf("File system mounting failed!\r\n");
+
+        // Kill power to some subsystems
+        RCC_AHB1PeriphClockCmd (RCC_AHB1Periph_GPIOC, DISABLE);
+        RCC_APB2PeriphClockCmd (RCC_APB2Periph_SDIO, DISABLE);
+        RCC_AHB1PeriphClockCmd (RCC_AHB1Periph_DMA2, DISABLE);
+
+        // GPIOD is used by the GSM modem, so we need to make sure its not in use
+        power_gpiod_use_count--;
+        if (power_gpiod_use_count == 0)
+        {
+            RCC_AHB1PeriphClockCmd (RCC_AHB1Periph_GPIOC, DISABLE);
+        }
+
+        return;
+    }
+
+    // Yesterday's link statistics go out with the first upload of the day
+    _proto_savestats();
+
+    // Try to open/create today's file for append
+    char date[20];
+    char filename[60];
+    rtc_get_date_string(date);
+    sprintf(filename, "0:SBC-WSN-DATA-%s.csv", date);
+
+    if (f_open(&data_file, filename,
+            FA_OPEN_ALWAYS | FA_READ | FA_WRITE) == FR_OK)
+    {
+        // Opening the file succeeded, now seek to the end
+        f_lseek(&data_file, f_size(&data_file));
+
+        // Ok, now we loop through the data we got and write it
+        uint16_t lines = 0;
+
+        for (uint8_t n = 0; n < held_count; n++)
+        {
+            const proto_upload_t* upload = &held[n];
+            proto_relay_run_t run = {0};
+
+            for (uint16_t i = 0; i + 4 <= upload->length; i += 4)
+            {
+                // Cast the block back to a data struct, relayed records are
+                // written out as the node they came from
+                data_struct_t* data = (data_struct_t*)&held_data[upload->start + i];
+                uint8_t node_id = _proto_record_node(data, upload->node_id, &run);
+
+                if ((data->type & 0x7F) == DATA_RELAY)
+                {
+                    continue;
+                }
+
+                // Assemble time with the top bit
+                uint32_t timestamp = data->time;
+                timestamp |= (data->type & 0x80) << 9;
+                data->type &= 0x7F;
+
+                // Split time up
+                uint8_t hours = timestamp / 3600;
+                timestamp -= hours * 3600;
+                uint8_t minutes = timestamp / 60;
+                timestamp -= minutes * 60;
+                uint8_t seconds = timestamp;
+
+                // Write out a CSV style line
+                // Columns: NodeID, Time, Type, Other
+                f_printf(&data_file, "%d, %02d:%02d:%02d, %d, %d\n", node_id, hours,
+                        minutes, seconds, data->type, data->otherdata);
+                lines++;
+            }
+        }
+
+        // Close file
+        f_close(&data_file);
+
+        printf("Data written to SD card - %d lines\r\n", lines);
+    }
+
+    // Finally unmount the card (mounting 0x0 triggers unmount)
+    f_mount(0, "0:", 1);
+
+    // Kill power to some subsystems
+    RCC_AHB1PeriphClockCmd (RCC_AHB1Periph_GPIOC, DISABLE);
+    RCC_APB2PeriphClockCmd (RCC_APB2Periph_SDIO, DISABLE);
+    RCC_AHB1PeriphClockCmd (RCC_AHB1Periph_DMA2, DISABLE);
+
+    // GPIOD is used by the GSM modem, so we need to make sure its not in use
+    power_gpiod_use_count--;
+    if (power_gpiod_use_count == 0)
+    {
+        RCC_AHB1PeriphClockCmd (RCC_AHB1Periph_GPIOC, DISABLE);
+    }
+
+    // Power down the card
+    GPIO_SetBits(GPIOB, 4);
+}
+
+/**
+ * Take the packets received in order out of the window into the session's
+ * upload, freeing their slots for the next window. If there isn't room to hold
+ * them the uploads held are written out first, keeping the node waiting
+ */
+static void _proto_upload_hold(void)
+{
+    uint16_t length = 0;
+
+    for (uint16_t seq = seq_saved; seq != seq_expected; seq++)
+    {
+        length += window_len[seq % RADIO_WINDOW];
+    }
+
+    if (held_length + length > PROTO_HOLD_LEN ||
+            (!session_upload && held_count == PROTO_HOLD_UPLOADS))
+    {
+        printf("No room to hold uploads, writing them out now\r\n");
+        _proto_upload_write();
+    }
+
+    if (!session_upload)
+    {
+        session_upload = &held[held_count++];
+        memset(session_upload, 0, sizeof(*session_upload));
+        session_upload->node_id = source_node;
+        session_upload->start = held_length;
+    }
+
+    for (; seq_saved != seq_expected; seq_saved++)
+    {
+        uint8_t slot = seq_saved % RADIO_WINDOW;
+
+        memcpy(&held_data[held_length], window_data[slot], window_len[slot]);
+        held_length += window_len[slot];
+        session_upload->length += window_len[slot];
+
+        window_full &= (uint8_t)~(0x1 << slot);
+    }
+}
+
+/**
+ * Print and save the uploads held, then count the complete ones towards their
+ * nodes' link statistics. One in progress carries on from empty
+ */
+static void _proto_upload_write(void)
+{
+    if (!held_count)
+    {
+        return;
+    }
+
+    for (uint8_t n = 0; n < held_count; n++)
+    {
+        _proto_printdata(&held[n]);
+    }
+
+    _proto_savedata();
+
+    for (uint8_t n = 0; n < held_count; n++)
+    {
+        if (held[n].acked)
+        {
+            _proto_link_upload(&held[n]);
+        }
+    }
+
+    held_count = 0;
+    held_length = 0;
+
+    if (session_upload)
+    {
+        held[0] = *session_upload;
+        held[0].start = 0;
+        held[0].length = 0;
+        held_count = 1;
+        session_upload = &held[0];
+    }
+}
+
+/**
+ * Handle a timeout by adjusting the state machine
+ */
+void TIM2_IRQHandler(void)
+{
+    if (TIM_GetITStatus(TIM2, TIM_IT_Update) == SET && TIM2->CNT == TIM2->ARR)
+    {
+        switch (proto_state)
+        {
+            case PROTO_AWAKE:
+            {
+                // We didn't get anything from this node. Assume its dead, de-register
+                slot_entry->retry_count++;
+                _proto_link_missed(slot_entry);
+
+                // The node may have missed its last ACK and still be using the
+                // old profile, both ends drop back to the default after a miss
+                slot_entry->profile = RADIO_PROFILE_DEFAULT;
+
+                if (slot_entry->retry_count > RSCHED_MAX_RETRIES)
+                {
+                    // De-register the node
+                    printf("Unregistering node %d\r\n", slot_entry->node_id);
+
+                    link_stats[slot_entry->node_id].dropped++;
+
+                    sched_remove(slot_entry);
+                }
+
+                _proto_endcleanup();
+
+                break;
+            }
+            case PROTO_RECV:
+            {
+                if (nack_count < PROTO_MAX_NACKS)
+                {
+                    // Looks like the last packets were dropped! Ask for them
+                    proto_state = PROTO_ARQ;
+                    session_repeats = true;
+
+                    TIM_Cmd(TIM2, DISABLE);
+                    printf("Timer ran out, last packets lost\r\n");
+
+                    break;
+                }
+
+                // Well that's gone well. Call the whole thing off? The node
+                // won't get an ACK so will go back to the default profile
+                printf("Abandoning waiting for packet\r\n");
+
+                sched_entry_t* entry = sched_find(source_node);
+                if (entry)
+                {
+                    entry->profile = RADIO_PROFILE_DEFAULT;
+                }
+
+                _proto_endcleanup();
+
+                break;
+            }
+            case PROTO_ACKED:
+            {
+                // Node didn't ask for the ACK again, it must have got it
+                _proto_endcleanup();
+
+                break;
+            }
+            case PROTO_PATCHWAIT:
+            {
+                // Node has stopped asking for the patch, it carries on next time
+                _proto_endcleanup();
+
+                break;
+            }
+            default:
+                // Do nothing
+                printf("How did we get in state %d\r\n", proto_state);
+                break;
+        }
+
+        TIM_ClearITPendingBit(TIM2, TIM_IT_Update);
+    }
+}
+
+/**
+ * Put an upload packet in its window slot, then move seq_expected past any
+ * packets now in order. Packets already received or beyond the window are
+ * dropped, a full window waits for _proto_upload_hold() to empty it.
+ *
+ * @param seq    Sequence number of the packet
+ * @param flags  RADIO_FLAG_x sent with the packet
+ * @param data   Packet data
+ * @param length Bytes of data
+ * @return       True if the packet was new
+ */
+static bool _proto_window_add(uint16_t seq, uint8_t flags, const uint8_t* data,
+        uint8_t length)
+{
+    uint8_t slot = seq % RADIO_WINDOW;
+
+    if ((uint16_t)(seq - seq_saved) >= RADIO_WINDOW ||
+            (uint16_t)(seq - seq_saved) < (uint16_t)(seq_expected - seq_saved) ||
+            (window_full & (0x1 << slot)) || length > RADIO_MAX_DATA_LEN)
+    {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < length; i++)
+    {
+        window_data[slot][i] = data[i];
+    }
+
+    window_len[slot] = length;
+    window_full |= (uint8_t)(0x1 << slot);
+
+    if (flags & RADIO_FLAG_LAST)
+    {
+        seq_final = seq;
+        seq_final_known = true;
+    }
+
+    // Packets up to the first gap are now in order
+    while ((uint16_t)(seq_expected - seq_saved) < RADIO_WINDOW &&
+            (window_full & (0x1 << (seq_expected % RADIO_WINDOW))))
+    {
+        seq_expected++;
+    }
+
+    return true;
+}
+
+/**
+ * Work out which of the packets after the first missing one have arrived
+ *
+ * @return Bit per packet after seq_expected, bit 0 is seq_expected + 1
+ */
+static uint8_t _proto_window_sacked(void)
+{
+    uint8_t sacked = 0;
+
+    for (uint8_t i = 0; i < RADIO_WINDOW - 1; i++)
+    {
+        uint16_t seq = seq_expected + 1 + i;
+
+        if ((uint16_t)(seq - seq_saved) < RADIO_WINDOW &&
+                (window_full & (0x1 << (seq % RADIO_WINDOW))))
+        {
+            sacked |= (uint8_t)(0x1 << i);
         }
     }
 
-    // Calculate the time at the start of this period (for example, top of the hour)
-    uint32_t timebase = (rtc_get_time_of_day() / RSCHED_NODE_PERIOD) * RSCHED_NODE_PERIOD;
+    return sacked;
+}
+
+/**
+ * Check whether every packet up to the last one of the upload is in
+ *
+ * @return True if the upload is complete
+ */
+static bool _proto_upload_complete(void)
+{
+    return seq_final_known && (uint16_t)(seq_expected - seq_final) == 1;
+}
+
+/**
+ * Forget everything about the last upload session
+ */
+static void _proto_session_reset(void)
+{
+    window_full = 0;
+    seq_saved = 0;
+    seq_expected = 0;
+    seq_final_known = false;
+    nack_count = 0;
+    session_backlog = 0;
+    session_children = 0;
+    confirm_run.left = 0;
+    session_upload = 0x0;
+    session_rssi = 0;
+    session_repeats = false;
+    session_timed = false;
+}
+
+/**
+ * Send the ACK for the upload just received, with the time brought up to date
+ * (see radio_packets.h). The node sets its clock to ours from when its last
+ * packet arrived and when the ACK finishes going out, then wakes nextwake ms
+ * after it reaches nextwake, running its clock at our rate by the drift
+ */
+static void _proto_send_ack(void)
+{
+    // Make sure the node is receiving again
+    radio_turnaround_wait();
+
+    // A node that can't use the timestamps sets its clock as the ACK arrives
+    ack_len = radio_ack_length(&ack);
+
+    uint32_t now_ms = (rtc_get_ms_of_day() +
+            radio_airtime_us(ack_len) / 1000) % PROTO_MS_PER_DAY;
+    uint32_t wake = ack_wake_ms % PROTO_MS_PER_DAY;
+
+    ack.time = now_ms / 1000;
+    ack.next_wake = wake / 1000;
+    ack.next_wake_ms = (uint16_t)(wake % 1000);
+    ack.rx_time = session_rx_time;
+
+    radio_ack_pack(&ack, ack_data);
+    radio_send_timed(ack_data, ack_len, source_node);
+
+    // The node's clock runs from when the ACK ended
+    sched_entry_t* entry = sched_find(source_node);
+
+    if (entry && ack.slot)
+    {
+        entry->synced_ms = _proto_time_ms(radio_last_txtime());
+    }
+}
+
+/**
+ * Broadcast the slots of nodes that missed their last one (see PKT_SCHEDULE),
+ * timed so they can set their clocks from it too. Nodes that missed an ACK
+ * find out where their slot went from this instead of registering again
+ */
+static void _proto_send_schedule(void)
+{
+    uint8_t pkt_data[RADIO_SCHEDULE_HEADER_LEN +
+            RADIO_SCHEDULE_MAX_ENTRIES * RADIO_SCHEDULE_ENTRY_LEN + RADIO_TIMESTAMP_LEN];
+    sched_entry_t* listed[RADIO_SCHEDULE_MAX_ENTRIES];
+    radio_schedule_t schedule;
+
+    schedule.version = sched_version();
+    schedule.count = 0;
+
+    for (uint16_t i = 0; i < RSCHED_MAX_NODES && schedule.count < RADIO_SCHEDULE_MAX_ENTRIES;
+            i++)
+    {
+        sched_entry_t* entry = sched_entry_at((uint8_t)i);
+
+        if (entry && entry->retry_count)
+        {
+            listed[schedule.count++] = entry;
+        }
+    }
+
+    // Wake times count from when the frame is expected to end
+    uint32_t end_ms = (rtc_get_ms_of_day() +
+            radio_airtime_us(radio_schedule_length(schedule.count)) / 1000) % PROTO_MS_PER_DAY;
+
+    for (uint8_t i = 0; i < schedule.count; i++)
+    {
+        schedule.entry[i].node = listed[i]->node_id;
+        schedule.entry[i].wake_in_ms = (uint32_t)(_proto_ms_between(end_ms,
+                (sched_slot_start_ms(listed[i]) + listed[i]->slack_ms) % PROTO_MS_PER_DAY) +
+                PROTO_MS_PER_DAY) % PROTO_MS_PER_DAY;
+        schedule.entry[i].period = (uint16_t)sched_slot_period(listed[i]);
+    }
+
+    radio_send_timed(pkt_data, radio_schedule_pack(&schedule, pkt_data), RADIO_BCAST_ADDR);
+
+    if (schedule.count)
+    {
+        printf("Sent schedule version %d for %d nodes\r\n", schedule.version,
+                schedule.count);
+    }
+}
+
+/**
+ * Shut down after timeout/receive complete
+ */
+static void _proto_endcleanup(void)
+{
+    // Go back to sleep
+    proto_state = PROTO_IDLE;
+
+    TIM_Cmd(TIM2, DISABLE);
+
+    uint32_t now_ms = rtc_get_ms_of_day();
+
+#if RADIO_SLEEP_IDLE
+    // Radio off
+    radio_powerstate(false);
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2, DISABLE);
+    power_set_minimum(PWR_RADIO, PWR_CLOCKSTOP);
+#elif RADIO_LISTEN_IDLE
+    // Let the radio duty cycle itself until the next slot. A node that was
+    // missed may still be sending again, so listen on the channel of the slot
+    // we're in, or stay on the one of the slot just ended
+    sched_entry_t* current = sched_at(now_ms);
 
-    if (i == RSCHED_MAX_NODES)
+    if (current)
     {
-        // We've reached the beacon frame point, schedule that (waking ahead of the hour)
-        rtc_schedule_callback(proto_togglebeacon, timebase +
-                (RSCHED_NODE_PERIOD - RSCHED_WAKELENGTH));
-        current_schedule_point = 0;
+        radio_set_channel(current->channel);
+    }
+
+    radio_set_profile(RADIO_PROFILE_DEFAULT);
+    radio_listen_lowpower(true);
+    radio_receive_activate(true);
+#endif
 
+    // Work out when to wake next. The alarm only goes off when the time of day
+    // matches, so the schedule skips any slot an overrunning session has
+    // already eaten into
+    slot_entry = sched_next(now_ms);
+
+    if (slot_entry)
+    {
+        idle_until_ms = sched_slot_start_ms(slot_entry);
+        rtc_schedule_callback_ms(proto_start_rec, idle_until_ms);
     }
     else
     {
-        rtc_schedule_callback(proto_start_rec, timebase + (i * RSCHED_TIME_STEP));
-        current_schedule_point = i + 1;
+        // We've reached the beacon frame point, schedule that (waking ahead
+        // of the hour), or open the window now if that's gone by too
+        uint32_t beacon_ms = (now_ms / SCHED_PERIOD_MS) * SCHED_PERIOD_MS +
+                RSCHED_SLOT_END * 1000u;
+
+        idle_until_ms = beacon_ms;
+
+        if (beacon_ms > now_ms)
+        {
+            rtc_schedule_callback_ms(proto_togglebeacon, beacon_ms);
+        }
+        else
+        {
+            proto_togglebeacon();
+        }
     }
 
 }
 
 /**
- * Find a free slot for a node and register it
+ * Hold on to a beacon to answer from proto_run. Answering straight away from
+ * the receive callback would keep the radio transmitting while other nodes'
+ * beacons arrive
+ *
+ * @param packet Beacon frame, [source(8)],[1],[1],[PKT_BEACON]
  */
-static void _proto_register_node(void)
+static void _proto_queue_beacon(const radio_packet_t* packet)
 {
     printf("Got beacon frame \r\n");
 
-    // Read in full packet including source address
-    uint8_t pkt_data[16];
-    uint16_t bytes_read = radio_retrieve_data(pkt_data, 4);
-
     // Sanity check
-    if (pkt_data[3] != PKT_BEACON)
+    if (packet->length < 4 || packet->data[3] != PKT_BEACON)
     {
         printf("Expected a beacon frame but didn't get one, ignoring!\r\n");
         return;
     }
 
+    // A node beaconing again before we got to it only needs the one answer
+    for (uint8_t i = 0; i < beacon_count; i++)
+    {
+        if (beacon_queue[i].node_id == packet->data[0])
+        {
+            return;
+        }
+    }
+
+    if (beacon_count == PROTO_BEACON_QUEUE_LEN)
+    {
+        printf("Too many beacons at once, ignoring node %d\r\n", packet->data[0]);
+        return;
+    }
+
+    proto_beacon_t* beacon = &beacon_queue[beacon_count++];
+    beacon->node_id = packet->data[0];
+    beacon->rssi = packet->rssi;
+    beacon->timestamp = packet->timestamp;
+}
+
+/**
+ * Register the node of the oldest beacon waiting, if there is one
+ */
+static void _proto_answer_beacon(void)
+{
+    if (!beacon_count)
+    {
+        return;
+    }
+
+    proto_beacon_t beacon = beacon_queue[0];
+
+    beacon_count--;
+
+    for (uint8_t i = 0; i < beacon_count; i++)
+    {
+        beacon_queue[i] = beacon_queue[i + 1];
+    }
+
+    _proto_register_node(&beacon);
+}
+
+/**
+ * Find a free slot for a node and register it
+ *
+ * @param beacon Beacon the node sent
+ */
+static void _proto_register_node(const proto_beacon_t* beacon)
+{
     // Get node address
-    uint8_t node_id = pkt_data[0];
+    uint8_t node_id = beacon->node_id;
+
+    // Find a space in the schedule for this new node, starting with the
+    // shortest slot, the first upload says how much the node really needs.
+    // Its drift isn't known yet, so the slot allows for the most
+    sched_entry_t* entry = sched_add(node_id, _proto_slot_length(
+            RADIO_PROFILE_DEFAULT, 0, PROTO_SLOT_SLACK_MS, false), rtc_get_ms_of_day());
+
+    if (!entry)
+    {
+        printf("Schedule full, ignoring node %d\r\n", node_id);
+        return;
+    }
+
+    // Nodes register at full power on the default profile, work out what
+    // they actually need
+    int16_t rssi = beacon->rssi;
+    entry->tx_power = _proto_adjust_power(RADIO_TXPOWER_MAX, rssi, false);
+    entry->profile = _proto_choose_profile(RADIO_PROFILE_DEFAULT, rssi, false);
+    entry->drift_ppm = 0;
+    entry->drift_error_ppm = PROTO_DRIFT_UNKNOWN_PPM;
+    entry->slack_ms = PROTO_SLOT_SLACK_MS;
+    entry->children = 0;
+    entry->channel = _proto_choose_channel(entry);
+
+    link_stats[node_id].registered++;
+    link_stats[node_id].retry_count = 0;
+
+    // ACK back to the node, see radio_packets.h
+    radio_beaconack_t reply;
+    uint8_t pkt_data[RADIO_BEACONACK_LEN];
+
+    // Make sure the node is receiving again
+    radio_turnaround_wait();
+
+    // The node sets its clock from when its beacon arrived and when the ACK
+    // finishes going out, or as the ACK arrives if it can't use them
+    uint32_t now_ms = (rtc_get_ms_of_day() +
+            radio_airtime_us(sizeof(pkt_data)) / 1000) % PROTO_MS_PER_DAY;
+    uint32_t wake = (sched_slot_start_ms(entry) + entry->slack_ms) % PROTO_MS_PER_DAY;
+
+    reply.time = now_ms / 1000;
+    reply.period = sched_slot_period(entry);
+    reply.next_wake = wake / 1000;
+    reply.next_wake_ms = (uint16_t)(wake % 1000);
+    reply.tx_power = entry->tx_power;
+    reply.profile = entry->profile;
+    reply.channel = entry->channel;
+    reply.rx_time = beacon->timestamp;
+
+    radio_beaconack_pack(&reply, pkt_data);
+    radio_send_timed(pkt_data, sizeof(pkt_data), node_id);
+
+    entry->synced_ms = _proto_time_ms(radio_last_txtime());
+}
+
+/**
+ * Work out how long a node needs to upload its backlog: every packet, a window
+ * ACK for every window of them, the final ACK and time for the node to ask for
+ * it again, time to save the data, and the slack either side of when the node
+ * wakes, all on the node's link profile. A node fetching the patch gets time
+ * for PROTO_PATCH_SLOT_WINDOWS windows of it too
+ *
+ * @param profile  Link profile the node uploads with, one of RADIO_PROFILE_x
+ * @param backlog  Packets to upload
+ * @param slack_ms Time the node may be early or late by
+ * @param patch    True if the node is fetching the patch
+ * @return         Slot length in steps of RSCHED_SLOT_MS
+ */
+static uint16_t _proto_slot_length(uint8_t profile, uint8_t backlog, uint16_t slack_ms,
+        bool patch)
+{
+    uint32_t packets = (backlog > 0) ? backlog : 1;
+    uint32_t windows = (packets + RADIO_WINDOW - 1) / RADIO_WINDOW;
+    uint32_t packet_us = radio_profile_airtime_us(profile, RADIO_MAX_PACKET_LEN);
+    uint32_t ack_us = radio_profile_airtime_us(profile, sizeof(ack_data));
+
+    uint32_t time_us = packets * packet_us +
+            windows * (radio_profile_airtime_us(profile, RADIO_SACK_LEN) +
+            RADIO_REPLY_MARGIN_MS * 1000u) +
+            2 * ack_us + packet_us +
+            (RADIO_REPLY_MARGIN_MS + RADIO_RETRY_JITTER_MS + PROTO_SLOT_GUARD_MS +
+            2u * slack_ms) * 1000u;
+
+    if (patch)
+    {
+        time_us += PROTO_PATCH_SLOT_WINDOWS * (RADIO_WINDOW *
+                radio_profile_airtime_us(profile, RADIO_PATCH_FRAME_LEN) +
+                radio_profile_airtime_us(profile, RADIO_PATCH_REQUEST_LEN) +
+                RADIO_REPLY_MARGIN_MS * 1000u);
+    }
+
+    return (uint16_t)((time_us + RSCHED_SLOT_MS * 1000u - 1) / (RSCHED_SLOT_MS * 1000u));
+}
+
+/**
+ * Convert a frame timestamp to ms
+ *
+ * @param time Time of day in RADIO_TIME_HZ ticks
+ * @return     Time of day in ms
+ */
+static uint32_t _proto_time_ms(uint32_t time)
+{
+    return (uint32_t)(((uint64_t)time * 1000u) / RADIO_TIME_HZ);
+}
+
+/**
+ * Refine a node's drift estimate from how late it woke this time, against how
+ * long its clock had been running since we set it. Half of what's left is
+ * taken each time, and how far out it was goes into how far it's trusted
+ *
+ * @param entry Entry of the node
+ */
+static void _proto_update_drift(sched_entry_t* entry)
+{
+    int32_t running_ms = _proto_ms_between(entry->synced_ms, slot_wake_ms);
+
+    if (running_ms <= 0)
+    {
+        return;
+    }
+
+    // Waking late means the clock is slow
+    int32_t error_ppm = (int32_t)(-(int64_t)session_late_ms * 1000000 / running_ms);
+
+    if (error_ppm > PROTO_DRIFT_STEP_PPM)
+    {
+        error_ppm = PROTO_DRIFT_STEP_PPM;
+    }
+    else if (error_ppm < -PROTO_DRIFT_STEP_PPM)
+    {
+        error_ppm = -PROTO_DRIFT_STEP_PPM;
+    }
+
+    entry->drift_ppm = (int16_t)(entry->drift_ppm + error_ppm / 2);
+    entry->drift_error_ppm = (uint16_t)((3u * entry->drift_error_ppm +
+            (uint32_t)(error_ppm < 0 ? -error_ppm : error_ppm)) / 4u);
+
+    printf("Node %d woke %d ms late, drift now %d ppm +/- %d\r\n", entry->node_id,
+            (int)session_late_ms, entry->drift_ppm, entry->drift_error_ppm);
+}
+
+/**
+ * Work out how early or late a node could be to its next slot, from how well
+ * its drift is known. Allows for twice the error over the longest the node
+ * could wait, a whole superframe
+ *
+ * @param entry Entry of the node
+ * @return      Slack in ms, from PROTO_SLOT_SLACK_MIN_MS to PROTO_SLOT_SLACK_MS
+ */
+static uint16_t _proto_slot_slack(const sched_entry_t* entry)
+{
+    uint32_t slack_ms = PROTO_SLOT_SLACK_MIN_MS + 2u * entry->drift_error_ppm *
+            RSCHED_SUPERFRAME * RSCHED_NODE_PERIOD / 1000u;
+
+    return (slack_ms > PROTO_SLOT_SLACK_MS) ? PROTO_SLOT_SLACK_MS : (uint16_t)slack_ms;
+}
+
+/**
+ * Work out the time from one time of day to another, either way round midnight
+ *
+ * @param from_ms Time of day in ms
+ * @param to_ms   Time of day in ms
+ * @return        Time from from_ms to to_ms in ms, negative if to_ms is before
+ */
+static int32_t _proto_ms_between(uint32_t from_ms, uint32_t to_ms)
+{
+    int32_t ms = (int32_t)((to_ms + PROTO_MS_PER_DAY - from_ms) % PROTO_MS_PER_DAY);
+
+    return (ms > (int32_t)(PROTO_MS_PER_DAY / 2)) ? ms - (int32_t)PROTO_MS_PER_DAY : ms;
+}
+
+/**
+ * Work out the transmit power a node should use next so its packets arrive
+ * close to PROTO_TARGET_RSSI. Power is stepped down gradually but put back up
+ * straight away, and bumped if the last session needed repeats
+ *
+ * @param current Power the node transmitted at in dBm
+ * @param rssi    Weakest signal strength seen from the node in dBm
+ * @param repeats True if any packets had to be repeated
+ * @return        New power for the node in dBm
+ */
+static int8_t _proto_adjust_power(int8_t current, int16_t rssi, bool repeats)
+{
+    int16_t power = (int16_t)(current + (PROTO_TARGET_RSSI - rssi));
 
-    // Find a space in the schedule for this new node
-    uint8_t node_index = _proto_add_to_schedule(node_id);
+    if (power < current - PROTO_POWER_STEP_DOWN)
+    {
+        power = (int16_t)(current - PROTO_POWER_STEP_DOWN);
+    }
 
-    // Calculate next wakeup time
-    uint32_t nextwake = (rtc_get_time_of_day() / RSCHED_NODE_PERIOD) *
-            RSCHED_NODE_PERIOD +
-            node_index * RSCHED_TIME_STEP +
-            RSCHED_NODE_PERIOD;
+    if (repeats && power < current + PROTO_POWER_STEP_UP)
+    {
+        power = (int16_t)(current + PROTO_POWER_STEP_UP);
+    }
 
-    // ACK back to the node [time(16)], [period(16)], [nextwake(16)],[options(8)]
-    uint32_t timenow = rtc_get_time_of_day();
-    uint32_t period = RSCHED_NODE_PERIOD;
+    if (power < RADIO_TXPOWER_MIN)
+    {
+        power = RADIO_TXPOWER_MIN;
+    }
+    else if (power > RADIO_TXPOWER_MAX)
+    {
+        power = RADIO_TXPOWER_MAX;
+    }
 
-    pkt_data[0] = PKT_BEACONACK;
+    return (int8_t)power;
+}
 
-    pkt_data[1] = (timenow & 0xFF00) >> 8;
-    pkt_data[2] = (timenow & 0xFF);
-    pkt_data[7] = (timenow & 0x10000) >> 16;
+/**
+ * Pick the link profile a node should upload with next. The fastest profile
+ * the signal strength supports is used, dropping one step slower after a
+ * session that needed repeats and only speeding up one step at a time
+ *
+ * @param current Profile the node last used, one of RADIO_PROFILE_x
+ * @param rssi    Weakest signal strength seen from the node in dBm
+ * @param repeats True if any packets had to be repeated
+ * @return        Profile for the next session
+ */
+static uint8_t _proto_choose_profile(uint8_t current, int16_t rssi, bool repeats)
+{
+    uint8_t profile = RADIO_PROFILE_4K8;
 
-    pkt_data[3] = (period & 0xFF00) >> 8;
-    pkt_data[4] = (period & 0xFF);
-    pkt_data[7] |= (period & 0x10000) >> 15;
+    if (rssi >= PROTO_PROFILE_RSSI_55K5)
+    {
+        profile = RADIO_PROFILE_55K5;
+    }
+    else if (rssi >= PROTO_PROFILE_RSSI_19K2)
+    {
+        profile = RADIO_PROFILE_19K2;
+    }
 
-    pkt_data[5] = (nextwake & 0xFF00) >> 8;
-    pkt_data[6] = (nextwake & 0xFF);
-    pkt_data[7] |= (nextwake & 0x10000) >> 14;
+    if (repeats && current > RADIO_PROFILE_4K8 && profile >= current)
+    {
+        profile = (uint8_t)(current - 1);
+    }
 
-    // Delay for far end to enter receive
-    misc_delay(1000, true);
+    if (profile > current + 1)
+    {
+        profile = (uint8_t)(current + 1);
+    }
 
-    radio_send_data(pkt_data, 8, node_id);
+    return profile;
 }
 
 /**
- * Find a slot in the schedule and add a node
- * @param node_id ID of node to add
- * @return        Location of new slot
+ * Pick the channel a registering node uploads on, whichever of the upload
+ * channels has fewest nodes on it so far
+ *
+ * @param entry Schedule entry of the node
+ * @return      Channel for its uploads, never RADIO_CHANNEL_CONTROL
  */
-static uint8_t _proto_add_to_schedule(const uint8_t node_id)
+static uint8_t _proto_choose_channel(const sched_entry_t* entry)
 {
-    uint8_t left_value = 0;
-    uint8_t right_value = 0;
-    uint8_t last_item_seen = 0;
-    uint32_t max_diff = 0;
+    uint8_t nodes[RADIO_CHANNEL_COUNT] = {0};
+    uint8_t channel = RADIO_CHANNEL_CONTROL + 1;
 
     for (uint8_t i = 0; i < RSCHED_MAX_NODES; i++)
     {
-        // Reject unoccupied slots (0xFF is not a valid node ID)
-        if (schedule_entries[i].node_id != 0xFF)
+        sched_entry_t* other = sched_entry_at(i);
+
+        if (other && other != entry && other->channel < RADIO_CHANNEL_COUNT)
+        {
+            nodes[other->channel]++;
+        }
+    }
+
+    for (uint8_t i = RADIO_CHANNEL_CONTROL + 1; i < RADIO_CHANNEL_COUNT; i++)
+    {
+        if (nodes[i] < nodes[channel])
+        {
+            channel = i;
+        }
+    }
+
+    return channel;
+}
+
+/**
+ * Put the oldest command waiting for the node being ACKed into its ACK
+ *
+ * @param reply ACK to put it in, left without one if nothing is waiting
+ */
+static void _proto_add_command(radio_ack_t* reply)
+{
+    for (uint8_t i = 0; i < command_count; i++)
+    {
+        const proto_command_t* queued = &command_queue[i];
+
+        if (queued->node_id == source_node)
+        {
+            reply->command_id = queued->id;
+            reply->command = queued->command;
+            reply->value = queued->value;
+
+            return;
+        }
+    }
+
+    // Then the firmware patch, until the node has fetched it
+    if (_proto_patch_pending(source_node))
+    {
+        reply->command_id = RADIO_COMMAND_ID_PATCH;
+        reply->command = CMD_PATCH;
+        reply->value = patch_id;
+    }
+}
+
+/**
+ * Drop the commands the node says it has taken, by the DATA_CONFIG records
+ * among the packets received in order but not taken out yet, and note how
+ * many sub-slots a relay wants. Records relayed for other nodes are passed over
+ */
+static void _proto_take_confirms(void)
+{
+    for (uint16_t seq = seq_saved; seq != seq_expected; seq++)
+    {
+        uint8_t slot = seq % RADIO_WINDOW;
+
+        for (uint8_t i = 0; i + 4 <= window_len[slot]; i += 4)
         {
-            if ((i - last_item_seen) > max_diff)
+            const data_struct_t* data = (const data_struct_t*)(window_data[slot] + i);
+
+            if (_proto_record_node(data, source_node, &confirm_run) != source_node)
             {
-                // This is the new largest gap!
-                left_value = last_item_seen;
-                right_value = i;
-                max_diff = i - last_item_seen;
+                continue;
             }
 
-            last_item_seen = i;
+            if ((data->type & 0x7F) == DATA_RELAY)
+            {
+                session_children = (data->time > RADIO_RELAY_MAX_CHILDREN) ?
+                        RADIO_RELAY_MAX_CHILDREN : (uint8_t)data->time;
+                continue;
+            }
+
+            if ((data->type & 0x7F) != DATA_CONFIG)
+            {
+                continue;
+            }
+
+            if (data->otherdata == RADIO_COMMAND_ID_PATCH)
+            {
+                if (_proto_patch_pending(source_node))
+                {
+                    printf("Node %d has fetched patch %u\r\n", source_node, patch_id);
+
+                    patch_taken[source_node / 8] |= (uint8_t)(0x1 << (source_node % 8));
+                }
+
+                continue;
+            }
+
+            for (uint8_t j = 0; j < command_count; j++)
+            {
+                if (command_queue[j].node_id == source_node &&
+                        command_queue[j].id == data->otherdata)
+                {
+                    printf("Node %d took command %d\r\n", source_node,
+                            data->otherdata);
+
+                    command_count--;
+
+                    for (; j < command_count; j++)
+                    {
+                        command_queue[j] = command_queue[j + 1];
+                    }
+
+                    break;
+                }
+            }
         }
     }
+}
 
-    uint8_t new_index = 0;
+/**
+ * Work out which node a record is from, following the runs of records a relay
+ * stores for the nodes it relays for
+ *
+ * @param data   Record from the upload
+ * @param source Node that uploaded it
+ * @param run    Where this pass through the records has got to
+ * @return       Node the record is from, 0 for the DATA_RELAY record starting a run
+ */
+static uint8_t _proto_record_node(const data_struct_t* data, uint8_t source,
+        proto_relay_run_t* run)
+{
+    if (run->left)
+    {
+        run->left--;
+        return run->node_id;
+    }
 
-    // Handle the special case where nothing is in the schedule
-    if (left_value == 0 && right_value == 0)
+    if ((data->type & 0x7F) == DATA_RELAY && data->otherdata)
     {
-        // Put it directly in the middle
-        new_index = RSCHED_MAX_NODES / 2;
+        run->node_id = data->otherdata;
+        run->left = data->time;
+        return 0;
     }
-    else
+
+    return source;
+}
+
+/**
+ * Check whether a node still has to fetch the firmware patch
+ *
+ * @param node_id Node to check
+ * @return        True if there's a patch it hasn't said it has
+ */
+static bool _proto_patch_pending(uint8_t node_id)
+{
+    return patch_length && !(patch_taken[node_id / 8] & (0x1 << (node_id % 8)));
+}
+
+/**
+ * Send the node the chunks of the patch it asked for, as many as there's time
+ * for before its slot ends. The last asks the node to say what it has, or
+ * tells it to stop if there isn't time for another window
+ */
+static void _proto_send_patch(void)
+{
+    uint8_t pkt_data[RADIO_PATCH_FRAME_LEN];
+    uint16_t send[RADIO_WINDOW];
+    uint8_t count = 0;
+    uint16_t chunks = (uint16_t)((patch_length + RADIO_PATCH_CHUNK_LEN - 1) / RADIO_PATCH_CHUNK_LEN);
+    uint32_t frame_us = radio_airtime_us(RADIO_PATCH_FRAME_LEN);
+    uint32_t window_ms = (RADIO_WINDOW * frame_us +
+            radio_airtime_us(RADIO_PATCH_REQUEST_LEN)) / 1000 + RADIO_REPLY_MARGIN_MS;
+    int32_t left_ms = _proto_ms_between(rtc_get_ms_of_day(), slot_end_ms) -
+            PROTO_SLOT_GUARD_MS;
+
+    if (!_proto_patch_pending(source_node) || patch_wanted >= chunks)
+    {
+        printf("Node %d has all of patch %u\r\n", source_node, patch_id);
+        _proto_endcleanup();
+        return;
+    }
+
+    // Chunks the node doesn't have, up to the end of the window or the slot
+    for (uint8_t i = 0; i < RADIO_WINDOW && patch_wanted + i < chunks; i++)
+    {
+        if (i && (patch_have & (0x1 << (i - 1))))
+        {
+            continue;
+        }
+
+        if ((int32_t)((count + 1) * frame_us / 1000) > left_ms)
+        {
+            break;
+        }
+
+        send[count++] = (uint16_t)(patch_wanted + i);
+    }
+
+    if (!count)
     {
-        // Equidistant between the two neighbour nodes
-        new_index = left_value + (left_value - right_value) / 2;
+        printf("No time left for node %d's patch\r\n", source_node);
+        _proto_endcleanup();
+        return;
     }
 
-    // Insert new entry into the table
-    schedule_entries[new_index].node_id = node_id;
-    schedule_entries[new_index].retry_count = 0;
+    bool last = left_ms < (int32_t)(count * frame_us / 1000 + window_ms);
 
-    return new_index;
+    // Make sure the node is receiving again
+    radio_turnaround_wait();
 
-}
+    // See radio_packets.h for the layout
+    for (uint8_t i = 0; i < count; i++)
+    {
+        radio_patch_t chunk;
+        uint16_t offset = (uint16_t)(send[i] * RADIO_PATCH_CHUNK_LEN);
+        uint16_t length = patch_length - offset;
+
+        if (length > RADIO_PATCH_CHUNK_LEN)
+        {
+            length = RADIO_PATCH_CHUNK_LEN;
+        }
 
+        chunk.chunk = send[i];
+        chunk.chunks = chunks;
+        chunk.flags = 0x00;
+        chunk.length = (uint8_t)length;
+
+        if (i == count - 1)
+        {
+            chunk.flags = last ? (RADIO_FLAG_POLL | RADIO_FLAG_LAST) : RADIO_FLAG_POLL;
+        }
+
+        memcpy(&pkt_data[RADIO_PATCH_HEADER_LEN], &patch_data[offset], length);
+        radio_send_data(pkt_data, radio_patch_pack(&chunk, pkt_data), source_node);
+    }
+
+    printf("Sent node %d patch chunks %u to %u of %u\r\n", source_node, send[0],
+            send[count - 1], chunks);
+
+    if (last)
+    {
+        _proto_endcleanup();
+        return;
+    }
+
+    // Wait for the node to ask for more, allowing for it asking again
+    proto_state = PROTO_PATCHWAIT;
+
+    TIM_SetCounter(TIM2, 0);
+    TIM_SetAutoreload(TIM2, 2 * RADIO_REPLY_MARGIN_MS + RADIO_RETRY_JITTER_MS +
+            (frame_us + radio_airtime_us(RADIO_PATCH_REQUEST_LEN)) / 1000);
+    TIM_Cmd(TIM2, ENABLE);
+}
@@ -5,7 +5,7 @@
 #ifndef RADIO_CODE_RADIO_PROTOCOL_H_
 #define RADIO_CODE_RADIO_PROTOCOL_H_
 
-typedef enum {PROTO_IDLE, PROTO_AWAKE, PROTO_RECV, PROTO_ARQ, PROTO_REPEATING, PROTO_BEACON} proto_radio_state_t;
+typedef enum {PROTO_IDLE, PROTO_AWAKE, PROTO_RECV, PROTO_ARQ, PROTO_ACKED, PROTO_BEACON, PROTO_PATCH, PROTO_PATCHWAIT} proto_radio_state_t;
 
 void proto_init(void);
 void proto_incoming_packet(uint16_t bytes);
@@ -14,4 +14,7 @@ void proto_start_rec(void);
 void proto_run(void);
 void proto_togglebeacon(void);
 
+bool proto_queue_command(uint8_t node_id, uint8_t command, uint16_t value);
+bool proto_load_patch(void);
+
 #endif /* RADIO_CODE_RADIO_PROTOCOL_H_ */
@@ -0,0 +1,678 @@
+/**
+ * Keeps track of registered nodes and the upload slots they wake for
+ *
+ * Each of the RSCHED_SUPERFRAME periods of a superframe has a map of which
+ * RSCHED_SLOT_MS steps are taken, for finding room for a slot, and a list of
+ * the entries with a slot in it in time order, so getting from one slot to the
+ * next doesn't need a search. Nodes that wake every period are in all of the
+ * maps and lists, nodes taking turns only in the ones for their phase.
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Application-specific headers */
+#include "radio_schedule.h"
+#include "radio_control.h"
+#include "radio_shared_types.h"
+
+// Periods in a day. RSCHED_SUPERFRAME has to divide this so phases carry on
+// across midnight
+#define SCHED_PERIODS_PER_DAY (86400u / RSCHED_NODE_PERIOD)
+
+// Marks an address without an entry, and a slot that couldn't be placed
+#define SCHED_NO_ENTRY 0xFF
+#define SCHED_NO_ROOM 0xFFFF
+
+// Steps free in every period that idle nodes leave for busy ones, idle nodes
+// take turns rather than use them
+#define SCHED_RESERVE_STEPS (SCHED_STEPS / 4)
+
+// Registered nodes, and the entry for each address
+static sched_entry_t entries[RSCHED_MAX_NODES];
+static bool entry_used[RSCHED_MAX_NODES];
+static uint8_t entry_of_node[256];
+
+// Steps taken in each period of the superframe, a bit per step
+static uint8_t steps_used[RSCHED_SUPERFRAME][(SCHED_STEPS + 7) / 8];
+
+// Entries with a slot in each period of the superframe, in time order
+static uint8_t slot_order[RSCHED_SUPERFRAME][RSCHED_MAX_NODES];
+static uint8_t slot_count[RSCHED_SUPERFRAME];
+
+// Period of the day being worked through, and the next of its slots
+static uint16_t cursor_period = SCHED_PERIODS_PER_DAY;
+static uint8_t cursor = 0;
+
+// Phase the next node to take turns tries first, so they spread out
+static uint8_t next_phase = 0;
+
+// Changes whenever a slot is added, moved or freed
+static uint8_t version = 0;
+
+/* Functions used only in this file */
+static bool _sched_place(sched_entry_t* entry, uint16_t length, uint8_t every);
+static bool _sched_free(uint8_t every, uint8_t phase, uint16_t offset, uint16_t length);
+static uint16_t _sched_find_room(uint8_t every, uint8_t phase, uint16_t length);
+static void _sched_mark(const sched_entry_t* entry, bool used);
+static void _sched_link(const sched_entry_t* entry);
+static void _sched_unlink(const sched_entry_t* entry);
+static void _sched_set_due(sched_entry_t* entry, uint32_t now_ms);
+static bool _sched_in_phase(const sched_entry_t* entry, uint8_t phase);
+static uint16_t _sched_free_every(void);
+
+/**
+ * Start with nobody registered
+ */
+void sched_init(void)
+{
+    for (uint16_t i = 0; i < 256; i++)
+    {
+        entry_of_node[i] = SCHED_NO_ENTRY;
+    }
+
+    for (uint8_t i = 0; i < RSCHED_MAX_NODES; i++)
+    {
+        entry_used[i] = false;
+    }
+
+    for (uint8_t phase = 0; phase < RSCHED_SUPERFRAME; phase++)
+    {
+        for (uint16_t i = 0; i < sizeof(steps_used[phase]); i++)
+        {
+            steps_used[phase][i] = 0;
+        }
+
+        slot_count[phase] = 0;
+    }
+
+    cursor_period = SCHED_PERIODS_PER_DAY;
+    cursor = 0;
+    next_phase = 0;
+    version++;
+}
+
+/**
+ * Get a registered node by where its entry is kept, for going through them all
+ *
+ * @param index Entry from 0 to RSCHED_MAX_NODES - 1
+ * @return      Pointer to the entry, or 0x0 if it's free
+ */
+sched_entry_t* sched_entry_at(uint8_t index)
+{
+    return (index < RSCHED_MAX_NODES && entry_used[index]) ? &entries[index] : 0x0;
+}
+
+/**
+ * Get the version of the schedule, which changes whenever a slot does
+ *
+ * @return Version number, wraps round
+ */
+uint8_t sched_version(void)
+{
+    return version;
+}
+
+/**
+ * Look up the schedule entry for a registered node
+ * @param node_id ID of node to find
+ * @return        Pointer to the entry, or 0x0 if the node is not registered
+ */
+sched_entry_t* sched_find(uint8_t node_id)
+{
+    uint8_t index = entry_of_node[node_id];
+
+    return (index == SCHED_NO_ENTRY) ? 0x0 : &entries[index];
+}
+
+/**
+ * Register a node and find it a slot, every period if there's room or taking
+ * turns if not. A node registering again has lost track of its slot, so keeps
+ * its entry and is planned again
+ *
+ * @param node_id ID of node to add
+ * @param length  Steps of RSCHED_SLOT_MS the node needs
+ * @param now_ms  Time of day in ms
+ * @return        The node's entry, 0x0 if it can't be registered
+ */
+sched_entry_t* sched_add(uint8_t node_id, uint16_t length, uint32_t now_ms)
+{
+    // Neither broadcast nor our own address can be a node
+    if (node_id == RADIO_BCAST_ADDR || node_id == BASE_ADDR)
+    {
+        return 0x0;
+    }
+
+    sched_entry_t* entry = sched_find(node_id);
+
+    if (entry)
+    {
+        entry->retry_count = 0;
+        sched_plan(entry, length, false, now_ms);
+
+        return entry;
+    }
+
+    uint8_t index = 0;
+
+    for (; index < RSCHED_MAX_NODES; index++)
+    {
+        if (!entry_used[index])
+        {
+            break;
+        }
+    }
+
+    if (index == RSCHED_MAX_NODES)
+    {
+        return 0x0;
+    }
+
+    entry = &entries[index];
+    entry->node_id = node_id;
+    entry->retry_count = 0;
+    entry->tx_power = RADIO_TXPOWER_MAX;
+    entry->profile = RADIO_PROFILE_DEFAULT;
+    entry->channel = RADIO_CHANNEL_CONTROL;
+    entry->every = 0;
+    entry->children = 0;
+
+    if (!(_sched_free_every() >= length + SCHED_RESERVE_STEPS &&
+            _sched_place(entry, length, 1)) &&
+            !_sched_place(entry, length, RSCHED_SUPERFRAME))
+    {
+        return 0x0;
+    }
+
+    entry_used[index] = true;
+    entry_of_node[node_id] = index;
+    version++;
+
+    _sched_set_due(entry, now_ms);
+
+    return entry;
+}
+
+/**
+ * De-register a node, freeing its slot
+ *
+ * @param entry Entry of the node
+ */
+void sched_remove(sched_entry_t* entry)
+{
+    _sched_mark(entry, false);
+    _sched_unlink(entry);
+
+    entry_of_node[entry->node_id] = SCHED_NO_ENTRY;
+    entry_used[entry - entries] = false;
+    version++;
+}
+
+/**
+ * Give a node its slot for next time after an upload. Busy nodes get a slot
+ * every period if there's room anywhere, idle ones only while that leaves
+ * SCHED_RESERVE_STEPS free for busy ones, otherwise they take turns. The slot
+ * only moves if it has to grow or change how often it comes round, and stays
+ * as it was if there's no room anywhere
+ *
+ * @param entry  Entry of the node
+ * @param length Steps of RSCHED_SLOT_MS the node needs
+ * @param busy   True if the node has more than one packet to send
+ * @param now_ms Time of day in ms
+ */
+void sched_plan(sched_entry_t* entry, uint16_t length, bool busy, uint32_t now_ms)
+{
+    sched_entry_t old = *entry;
+
+    _sched_mark(entry, false);
+    _sched_unlink(entry);
+
+    bool placed = false;
+
+    if (busy || _sched_free_every() >= length + SCHED_RESERVE_STEPS)
+    {
+        placed = _sched_place(entry, length, 1);
+    }
+
+    if (!placed)
+    {
+        placed = _sched_place(entry, length, RSCHED_SUPERFRAME);
+    }
+
+    if (!placed)
+    {
+        *entry = old;
+        _sched_mark(entry, true);
+        _sched_link(entry);
+    }
+    else if (entry->offset != old.offset || entry->length != old.length ||
+            entry->every != old.every || entry->phase != old.phase)
+    {
+        version++;
+    }
+
+    _sched_set_due(entry, now_ms);
+}
+
+/**
+ * Note that a node wasn't heard in its slot. It wakes again one of its wake
+ * periods later
+ *
+ * @param entry Entry of the node
+ */
+void sched_missed(sched_entry_t* entry)
+{
+    entry->due = (entry->due + entry->every) % SCHED_PERIODS_PER_DAY;
+}
+
+/**
+ * Work out when a node's next slot starts
+ *
+ * @param entry Entry of the node
+ * @return      Time of day in ms
+ */
+uint32_t sched_slot_start_ms(const sched_entry_t* entry)
+{
+    return entry->due * SCHED_PERIOD_MS + RSCHED_SLOT_START * 1000u +
+            entry->offset * RSCHED_SLOT_MS;
+}
+
+/**
+ * Work out how often a node wakes
+ *
+ * @param entry Entry of the node
+ * @return      Time between its slots in seconds
+ */
+uint32_t sched_slot_period(const sched_entry_t* entry)
+{
+    return entry->every * RSCHED_NODE_PERIOD;
+}
+
+/**
+ * Find the next slot to listen for this period. Slots already started are
+ * passed over and their nodes counted as missed, as are any left over from
+ * the last period when a new one starts
+ *
+ * @param now_ms Time of day in ms
+ * @return       Entry of the next node to wake, 0x0 if there are none left
+ *               this period
+ */
+sched_entry_t* sched_next(uint32_t now_ms)
+{
+    uint16_t period = (uint16_t)(now_ms / SCHED_PERIOD_MS);
+
+    if (period != cursor_period)
+    {
+        if (cursor_period < SCHED_PERIODS_PER_DAY)
+        {
+            uint8_t last_phase = cursor_period % RSCHED_SUPERFRAME;
+
+            for (; cursor < slot_count[last_phase]; cursor++)
+            {
+                sched_entry_t* entry = &entries[slot_order[last_phase][cursor]];
+
+                if (entry->due == cursor_period)
+                {
+                    sched_missed(entry);
+                }
+            }
+        }
+
+        cursor_period = period;
+        cursor = 0;
+    }
+
+    uint8_t phase = period % RSCHED_SUPERFRAME;
+
+    for (; cursor < slot_count[phase]; cursor++)
+    {
+        sched_entry_t* entry = &entries[slot_order[phase][cursor]];
+
+        if (entry->due != period)
+        {
+            continue;
+        }
+
+        if (sched_slot_start_ms(entry) > now_ms)
+        {
+            return entry;
+        }
+
+        sched_missed(entry);
+    }
+
+    return 0x0;
+}
+
+/**
+ * Find the slot a time of day falls in, whether or not it was listened for
+ *
+ * @param now_ms Time of day in ms
+ * @return       Entry of the node whose slot it is, 0x0 if it's between slots
+ */
+sched_entry_t* sched_at(uint32_t now_ms)
+{
+    uint32_t into_ms = now_ms % SCHED_PERIOD_MS;
+    uint8_t phase = (uint8_t)((now_ms / SCHED_PERIOD_MS) % RSCHED_SUPERFRAME);
+
+    for (uint8_t i = 0; i < slot_count[phase]; i++)
+    {
+        sched_entry_t* entry = &entries[slot_order[phase][i]];
+        uint32_t start_ms = RSCHED_SLOT_START * 1000u + entry->offset * RSCHED_SLOT_MS;
+
+        if (into_ms >= start_ms && into_ms < start_ms + entry->length * RSCHED_SLOT_MS)
+        {
+            return entry;
+        }
+    }
+
+    return 0x0;
+}
+
+/**
+ * Put a node's slot somewhere it fits, where it was if possible. Nodes taking
+ * turns try each phase, starting with next_phase for a new one
+ *
+ * @param entry  Entry of the node, taken out of the maps and lists
+ * @param length Steps of RSCHED_SLOT_MS the node needs
+ * @param every  1 to wake every period, RSCHED_SUPERFRAME to take turns
+ * @return       True if the slot was placed
+ */
+static bool _sched_place(sched_entry_t* entry, uint16_t length, uint8_t every)
+{
+    if (length == 0)
+    {
+        length = 1;
+    }
+
+    if (length > SCHED_STEPS)
+    {
+        length = SCHED_STEPS;
+    }
+
+    uint8_t phase = (entry->every == every) ? entry->phase : next_phase;
+    uint16_t offset = SCHED_NO_ROOM;
+
+    if (entry->every == every &&
+            _sched_free(every, phase, entry->offset, length))
+    {
+        offset = entry->offset;
+    }
+
+    for (uint8_t i = 0; offset == SCHED_NO_ROOM && i < RSCHED_SUPERFRAME; i++)
+    {
+        if (i > 0)
+        {
+            if (every == 1)
+            {
+                break;
+            }
+
+            phase = (phase + 1) % RSCHED_SUPERFRAME;
+        }
+
+        offset = _sched_find_room(every, phase, length);
+    }
+
+    if (offset == SCHED_NO_ROOM)
+    {
+        return false;
+    }
+
+    entry->every = every;
+    entry->phase = (every == 1) ? 0 : phase;
+    entry->offset = offset;
+    entry->length = length;
+
+    if (every != 1 && phase == next_phase)
+    {
+        next_phase = (next_phase + 1) % RSCHED_SUPERFRAME;
+    }
+
+    _sched_mark(entry, true);
+    _sched_link(entry);
+
+    return true;
+}
+
+/**
+ * Check whether a slot is free in all the periods it would be in
+ *
+ * @param every  1 to wake every period, RSCHED_SUPERFRAME to take turns
+ * @param phase  Period of the superframe, for taking turns
+ * @param offset First step of the slot
+ * @param length Steps in the slot
+ * @return       True if none of the steps are taken
+ */
+static bool _sched_free(uint8_t every, uint8_t phase, uint16_t offset, uint16_t length)
+{
+    if (offset + length > SCHED_STEPS)
+    {
+        return false;
+    }
+
+    for (uint8_t p = 0; p < RSCHED_SUPERFRAME; p++)
+    {
+        if (every != 1 && p != phase)
+        {
+            continue;
+        }
+
+        for (uint16_t step = offset; step < offset + length; step++)
+        {
+            if (steps_used[p][step / 8] & (0x1 << (step % 8)))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Find the first run of free steps long enough for a slot
+ *
+ * @param every  1 to wake every period, RSCHED_SUPERFRAME to take turns
+ * @param phase  Period of the superframe, for taking turns
+ * @param length Steps in the slot
+ * @return       First step of the slot, SCHED_NO_ROOM if there isn't room
+ */
+static uint16_t _sched_find_room(uint8_t every, uint8_t phase, uint16_t length)
+{
+    uint16_t run = 0;
+
+    for (uint16_t step = 0; step < SCHED_STEPS; step++)
+    {
+        bool taken = false;
+
+        for (uint8_t p = 0; p < RSCHED_SUPERFRAME && !taken; p++)
+        {
+            if (every == 1 || p == phase)
+            {
+                taken = steps_used[p][step / 8] & (0x1 << (step % 8));
+            }
+        }
+
+        run = taken ? 0 : run + 1;
+
+        if (run == length)
+        {
+            return step + 1 - length;
+        }
+    }
+
+    return SCHED_NO_ROOM;
+}
+
+/**
+ * Mark the steps of a slot as taken or free
+ *
+ * @param entry Entry of the node
+ * @param used  True to take the steps, false to free them
+ */
+static void _sched_mark(const sched_entry_t* entry, bool used)
+{
+    for (uint8_t p = 0; p < RSCHED_SUPERFRAME; p++)
+    {
+        if (!_sched_in_phase(entry, p))
+        {
+            continue;
+        }
+
+        for (uint16_t step = entry->offset; step < entry->offset + entry->length; step++)
+        {
+            if (used)
+            {
+                steps_used[p][step / 8] |= (uint8_t)(0x1 << (step % 8));
+            }
+            else
+            {
+                steps_used[p][step / 8] &= (uint8_t)~(0x1 << (step % 8));
+            }
+        }
+    }
+}
+
+/**
+ * Add a node to the time ordered slot lists it belongs in, keeping the cursor
+ * on the same slot
+ *
+ * @param entry Entry of the node
+ */
+static void _sched_link(const sched_entry_t* entry)
+{
+    uint8_t index = (uint8_t)(entry - entries);
+
+    for (uint8_t p = 0; p < RSCHED_SUPERFRAME; p++)
+    {
+        if (!_sched_in_phase(entry, p))
+        {
+            continue;
+        }
+
+        uint8_t position = slot_count[p];
+
+        while (position > 0 && entries[slot_order[p][position - 1]].offset > entry->offset)
+        {
+            slot_order[p][position] = slot_order[p][position - 1];
+            position--;
+        }
+
+        slot_order[p][position] = index;
+        slot_count[p]++;
+
+        if (cursor_period < SCHED_PERIODS_PER_DAY &&
+                p == cursor_period % RSCHED_SUPERFRAME && position < cursor)
+        {
+            cursor++;
+        }
+    }
+}
+
+/**
+ * Take a node out of the time ordered slot lists, keeping the cursor on the
+ * same slot
+ *
+ * @param entry Entry of the node
+ */
+static void _sched_unlink(const sched_entry_t* entry)
+{
+    uint8_t index = (uint8_t)(entry - entries);
+
+    for (uint8_t p = 0; p < RSCHED_SUPERFRAME; p++)
+    {
+        if (!_sched_in_phase(entry, p))
+        {
+            continue;
+        }
+
+        uint8_t position = 0;
+
+        while (position < slot_count[p] && slot_order[p][position] != index)
+        {
+            position++;
+        }
+
+        if (position == slot_count[p])
+        {
+            continue;
+        }
+
+        slot_count[p]--;
+
+        for (uint8_t i = position; i < slot_count[p]; i++)
+        {
+            slot_order[p][i] = slot_order[p][i + 1];
+        }
+
+        if (cursor_period < SCHED_PERIODS_PER_DAY &&
+                p == cursor_period % RSCHED_SUPERFRAME && position < cursor)
+        {
+            cursor--;
+        }
+    }
+}
+
+/**
+ * Work out which period a node's slot next comes round in, after this one
+ *
+ * @param entry  Entry of the node
+ * @param now_ms Time of day in ms
+ */
+static void _sched_set_due(sched_entry_t* entry, uint32_t now_ms)
+{
+    uint16_t period = (uint16_t)(now_ms / SCHED_PERIOD_MS) + 1;
+
+    if (entry->every != 1)
+    {
+        period += (entry->phase + RSCHED_SUPERFRAME - period % RSCHED_SUPERFRAME) %
+                RSCHED_SUPERFRAME;
+    }
+
+    entry->due = period % SCHED_PERIODS_PER_DAY;
+}
+
+/**
+ * Check whether a node has a slot in a period of the superframe
+ *
+ * @param entry Entry of the node
+ * @param phase Period of the superframe
+ * @return      True if the node wakes in that period
+ */
+static bool _sched_in_phase(const sched_entry_t* entry, uint8_t phase)
+{
+    return entry->every == 1 || (entry->every != 0 && entry->phase == phase);
+}
+
+/**
+ * Count the steps free in every period of the superframe, which is the room
+ * left for slots every period
+ *
+ * @return Number of steps
+ */
+static uint16_t _sched_free_every(void)
+{
+    uint16_t count = 0;
+
+    for (uint16_t i = 0; i < sizeof(steps_used[0]); i++)
+    {
+        uint8_t used = 0;
+
+        for (uint8_t p = 0; p < RSCHED_SUPERFRAME; p++)
+        {
+            used |= steps_used[p][i];
+        }
+
+        for (uint8_t bit = 0; bit < 8 && (uint16_t)(i * 8u + bit) < SCHED_STEPS; bit++)
+        {
+            if (!(used & (0x1 << bit)))
+            {
+                count++;
+            }
+        }
+    }
+
+    return count;
+}
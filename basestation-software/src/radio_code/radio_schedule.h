@@ -0,0 +1,62 @@
+/**
+ * Keeps track of registered nodes and the upload slots they wake for - header
+ * file
+ */
+
+#ifndef RADIO_CODE_RADIO_SCHEDULE_H_
+#define RADIO_CODE_RADIO_SCHEDULE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "radio_schedule_settings.h"
+
+// Length of a period in ms
+#define SCHED_PERIOD_MS (RSCHED_NODE_PERIOD * 1000u)
+
+// Number of RSCHED_SLOT_MS steps between RSCHED_SLOT_START and RSCHED_SLOT_END
+#define SCHED_STEPS (((RSCHED_SLOT_END - RSCHED_SLOT_START) * 1000u) / RSCHED_SLOT_MS)
+
+/**
+ * A registered node and its slot. The slot starts offset steps of
+ * RSCHED_SLOT_MS after RSCHED_SLOT_START and lasts length steps, either in
+ * every period or, for a node taking turns, in every RSCHED_SUPERFRAME periods
+ * starting with period phase of the superframe. The node's clock runs
+ * drift_ppm fast, known to within drift_error_ppm, since we set it at
+ * synced_ms, so it is told to wake slack_ms into its slot. The last children
+ * RADIO_RELAY_SLOT_MS of the slot are the sub-slots it relays in. It uploads
+ * on channel, given when it registered
+ */
+typedef struct
+{
+    uint8_t node_id;
+    uint8_t retry_count;
+    int8_t tx_power;
+    uint8_t profile;
+    uint8_t channel;
+    uint16_t offset;
+    uint16_t length;
+    uint8_t every;
+    uint8_t phase;
+    uint16_t due;
+    int16_t drift_ppm;
+    uint16_t drift_error_ppm;
+    uint16_t slack_ms;
+    uint8_t children;
+    uint32_t synced_ms;
+} sched_entry_t;
+
+void sched_init(void);
+sched_entry_t* sched_entry_at(uint8_t index);
+uint8_t sched_version(void);
+sched_entry_t* sched_find(uint8_t node_id);
+sched_entry_t* sched_add(uint8_t node_id, uint16_t length, uint32_t now_ms);
+void sched_remove(sched_entry_t* entry);
+void sched_plan(sched_entry_t* entry, uint16_t length, bool busy, uint32_t now_ms);
+void sched_missed(sched_entry_t* entry);
+uint32_t sched_slot_start_ms(const sched_entry_t* entry);
+uint32_t sched_slot_period(const sched_entry_t* entry);
+sched_entry_t* sched_next(uint32_t now_ms);
+sched_entry_t* sched_at(uint32_t now_ms);
+
+#endif /* RADIO_CODE_RADIO_SCHEDULE_H_ */
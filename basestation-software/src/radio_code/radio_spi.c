@@ -13,15 +13,22 @@
 /* Application-specific headers */
 #include "radio_spi.h"
 #include "misc.h"
+#include "base_misc.h"
 #include "radio_control.h"
 #include "power_management.h"
 #include "printf.h"
+#include "rtc_driver.h"
 
 void EXTI3_IRQHandler(void);
 
 // Type of interrupt currently being waited on
 static volatile uint8_t interrupt_state = RADIO_INT_NONE;
 
+// Time of day the last receive and transmit done interrupts fired, in
+// RADIO_TIME_HZ ticks
+static volatile uint32_t rx_time = 0;
+static volatile uint32_t tx_time = 0;
+
 /**
  * Configure the SPI peripheral and pins to talk to the radio
  */
@@ -165,14 +172,63 @@ void radio_spi_select(bool select)
 
 /**
  * Wait until the interrupt pin asserts that transmit is complete.
+ *
+ * @return True if transmit completed, false if the wait timed out
  */
-void radio_spi_transmitwait(void)
+bool radio_spi_transmitwait(void)
 {
+    // Set a timeout so a missing interrupt can't lock us up
+    misc_timeout(RADIO_TX_TIMEOUT_MS);
+
     // Sleep until the flag is cleared by the interrupt routine
-    while (interrupt_state != RADIO_INT_NONE)
+    while (interrupt_state != RADIO_INT_NONE && misc_timeout_active())
     {
         power_sleep();
     }
+
+    misc_timeout_cancel();
+
+    return (interrupt_state == RADIO_INT_NONE);
+}
+
+/**
+ * Check without blocking whether a transmission has completed
+ *
+ * @return True if the transmit done interrupt has fired
+ */
+bool radio_spi_transmitdone(void)
+{
+    return (interrupt_state == RADIO_INT_NONE);
+}
+
+/**
+ * Get the time of day by the RTC
+ *
+ * @return Time of day in RADIO_TIME_HZ ticks
+ */
+uint32_t radio_spi_time(void)
+{
+    return rtc_get_ticks() * (RADIO_TIME_HZ / RTC_TICKS_PER_SECOND);
+}
+
+/**
+ * Get the time the last receive interrupt fired
+ *
+ * @return Time of day in RADIO_TIME_HZ ticks
+ */
+uint32_t radio_spi_rxtime(void)
+{
+    return rx_time;
+}
+
+/**
+ * Get the time the last transmit done interrupt fired
+ *
+ * @return Time of day in RADIO_TIME_HZ ticks
+ */
+uint32_t radio_spi_txtime(void)
+{
+    return tx_time;
 }
 
 /**
@@ -197,10 +253,12 @@ void EXTI3_IRQHandler(void)
         {
             case RADIO_INT_TXDONE:
                 // A transmission finished, clear the flag
+                tx_time = radio_spi_time();
                 interrupt_state = RADIO_INT_NONE;
                 break;
             case RADIO_INT_RXREADY:
                 // Payload data is waiting to be read
+                rx_time = radio_spi_time();
                 power_schedule(_radio_payload_ready);
                 break;
             default:
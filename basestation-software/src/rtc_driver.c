@@ -16,12 +16,22 @@
 #include "power_management.h"
 #include "base_misc.h"
 #include "gsm_modem.h"
+#include "radio_control.h"
 
 #define MODEM_WAKEUP_HOUR 3
 
+// LSI prescalers, the synchronous one also sets the sub-second resolution.
+// Dividing mostly in the synchronous one gives ~120us steps for timestamping
+// radio frames, at a little more current than dividing in the asynchronous one
+#define RTC_ASYNCH_PREDIV 3
+#define RTC_SYNCH_PREDIV 8104
+
 // Function callback storage
 static void (*cb_func)(void);
 
+// Set at midnight for rtc_run() to report the day
+static volatile bool rtc_day_ended = false;
+
 void RTC_Alarm_IRQHandler(void);
 
 
@@ -53,8 +63,8 @@ void rtc_init(void)
 
     RTC_InitTypeDef rtcInit =
     {
-            .RTC_AsynchPrediv = 100,
-            .RTC_SynchPrediv = 320,
+            .RTC_AsynchPrediv = RTC_ASYNCH_PREDIV,
+            .RTC_SynchPrediv = RTC_SYNCH_PREDIV,
             .RTC_HourFormat = RTC_HourFormat_24
     };
     RTC_Init(&rtcInit);
@@ -154,6 +164,9 @@ void rtc_set(uint8_t hour, uint8_t minute, uint8_t second, uint8_t year,
             time_sync_complete = true;
         }
     }
+
+    // Don't count the jump as time spent in any power state
+    power_clock_changed();
 }
 
 /**
@@ -172,6 +185,48 @@ uint32_t rtc_get_time_of_day(void)
     return total_seconds;
 }
 
+/**
+ * Return current RTC time to the nearest sub-second tick
+ * @return Milliseconds since midnight
+ */
+uint32_t rtc_get_ms_of_day(void)
+{
+    uint32_t subsecond;
+    uint32_t seconds;
+
+    // If the sub-seconds moved while reading the time, the second may have
+    // ticked over in between, so read again
+    do
+    {
+        subsecond = RTC_GetSubSecond();
+        seconds = rtc_get_time_of_day();
+    } while (subsecond != RTC_GetSubSecond());
+
+    // Sub-seconds count down from the synchronous prescaler value
+    return seconds * 1000u + ((RTC_SYNCH_PREDIV - subsecond) * 1000u) /
+            (RTC_SYNCH_PREDIV + 1u);
+}
+
+/**
+ * Return current RTC time to the nearest sub-second tick, in the units radio
+ * frames are timestamped with
+ * @return RTC_TICKS_PER_SECOND ticks since midnight
+ */
+uint32_t rtc_get_ticks(void)
+{
+    uint32_t subsecond;
+    uint32_t seconds;
+
+    do
+    {
+        subsecond = RTC_GetSubSecond();
+        seconds = rtc_get_time_of_day();
+    } while (subsecond != RTC_GetSubSecond());
+
+    return seconds * RTC_TICKS_PER_SECOND + ((RTC_SYNCH_PREDIV - subsecond) *
+            RTC_TICKS_PER_SECOND) / (RTC_SYNCH_PREDIV + 1u);
+}
+
 /**
  * Return a string containing the date
  * @param date Pointer to a string for date in YY-MM-DD form
@@ -191,18 +246,36 @@ void rtc_get_date_string(char* date)
  * @param time Timestamp at which to run function
  */
 void rtc_schedule_callback(void (*fn)(void), uint32_t time)
+{
+    rtc_schedule_callback_ms(fn, time * 1000u);
+}
+
+/**
+ * Schedule a function to run at a specified time to the nearest sub-second
+ * tick (overwrites past schedules)
+ * @param fn      Function to call
+ * @param time_ms Milliseconds since midnight at which to run function
+ */
+void rtc_schedule_callback_ms(void (*fn)(void), uint32_t time_ms)
 {
     // Set up function storage
     cb_func = fn;
 
     // Compute wake time
+    uint32_t time = time_ms / 1000u;
     uint8_t hours = (uint8_t)(time / 3600u);
     time -= hours * 3600u;
     uint8_t minutes = (uint8_t)(time / 60u);
     time -= minutes * 60u;
     uint8_t seconds = (uint8_t)time;
 
-    // Configure alarm A
+    // Sub-seconds count down from the synchronous prescaler value
+    uint32_t subsecond = RTC_SYNCH_PREDIV -
+            ((time_ms % 1000u) * (RTC_SYNCH_PREDIV + 1u)) / 1000u;
+
+    // Configure alarm A, it has to be off to change
+    RTC_AlarmCmd(RTC_Alarm_A, DISABLE);
+
     RTC_AlarmTypeDef rtcAlarmInit =
     {
             .RTC_AlarmDateWeekDay = 1,
@@ -217,11 +290,44 @@ void rtc_schedule_callback(void (*fn)(void), uint32_t time)
     };
 
     RTC_SetAlarm(RTC_Format_BIN, RTC_Alarm_A, &rtcAlarmInit);
+    RTC_AlarmSubSecondConfig(RTC_Alarm_A, subsecond, RTC_AlarmSubSecondMask_None);
     RTC_ClearITPendingBit(RTC_IT_ALRA);
     RTC_AlarmCmd(RTC_Alarm_A, ENABLE);
     RTC_ITConfig(RTC_IT_ALRA, ENABLE);
 }
 
+/**
+ * Report the day's radio and power counters once midnight has passed, from
+ * the main loop rather than the interrupt
+ */
+void rtc_run(void)
+{
+    if (!rtc_day_ended)
+    {
+        return;
+    }
+
+    rtc_day_ended = false;
+
+    // Report radio polling avoided today
+    const radio_ready_stats_t* stats = radio_ready_stats();
+    printf("Radio: %u mode waits skipped, %u polls in %u waits, %u polls saved (est.)\r\n",
+            (unsigned)stats->waits_skipped, (unsigned)stats->polls, (unsigned)stats->waits,
+            (unsigned)radio_ready_polls_saved());
+    radio_ready_stats_clear();
+
+    // Report time spent in each power state today
+    const power_stats_t* power = power_stats();
+    printf("Power: %u ms awake, %u ms sleep, %u ms stop, %u wakes. Radio %u ms RX,"
+            " %u ms listen, %u ms standby, %u frames in %u ms TX\r\n",
+            (unsigned)power->mode[PWR_WAKE], (unsigned)power->mode[PWR_SLEEP],
+            (unsigned)power->mode[PWR_CLOCKSTOP], (unsigned)power->wakes,
+            (unsigned)power->radio[PWR_RADIO_RX], (unsigned)power->radio[PWR_RADIO_LISTEN],
+            (unsigned)power->radio[PWR_RADIO_STANDBY], (unsigned)power->tx_frames,
+            (unsigned)(power->tx_us / 1000u));
+    power_stats_clear();
+}
+
 /**
  * Handle alarm interrupts by dispatching functions, resetting
  */
@@ -241,6 +347,9 @@ void RTC_Alarm_IRQHandler(void)
         // Upload data
         //TODO!
 
+        // Report the day from the main loop, printing takes too long here
+        rtc_day_ended = true;
+
         // Clear flag
         RTC_ClearITPendingBit(RTC_IT_ALRB);
     }
@@ -6,14 +6,23 @@
 #ifndef RTC_DRIVER_H_
 #define RTC_DRIVER_H_
 
+// Rate rtc_get_ticks() counts at, finer than the sub-second register so it
+// converts to radio timestamps without rounding
+#define RTC_TICKS_PER_SECOND 32768u
+
 void rtc_init(void);
 
 void rtc_set(uint8_t hour, uint8_t minute, uint8_t second, uint8_t year,
         uint8_t month, uint8_t day);
 
 uint32_t rtc_get_time_of_day(void);
+uint32_t rtc_get_ms_of_day(void);
+uint32_t rtc_get_ticks(void);
 void rtc_get_date_string(char* date);
 
 void rtc_schedule_callback(void (*fn)(void), uint32_t time);
+void rtc_schedule_callback_ms(void (*fn)(void), uint32_t time_ms);
+
+void rtc_run(void);
 
 #endif /* RTC_DRIVER_H_ */
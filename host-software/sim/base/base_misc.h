@@ -0,0 +1,11 @@
+/**
+ * Basestation helpers for simulator builds - header file
+ * The delay timer comes from the host build, running on virtual time
+ */
+
+#ifndef BASE_MISC_H_
+#define BASE_MISC_H_
+
+#include "host_misc.h"
+
+#endif /* BASE_MISC_H_ */
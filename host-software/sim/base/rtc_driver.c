@@ -0,0 +1,247 @@
+/**
+ * Real time clock for the simulated basestation
+ * Keeps time of day on the instance's drifting local clock, with alarm A
+ * dispatching scheduled functions as on the STM32
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Application-specific headers */
+#include "rtc_driver.h"
+#include "printf.h"
+#include "power_management.h"
+#include "radio_control.h"
+#include "sim_instance.h"
+#include "host_env.h"
+
+#define RTC_SECONDS_PER_DAY 86400u
+#define RTC_MS_PER_DAY (RTC_SECONDS_PER_DAY * 1000u)
+
+// Function to call when the alarm goes off, 0x0 if the alarm is off
+static void (*cb_func)(void) = 0x0;
+
+// Time of day the alarm is set for in ms
+static uint32_t alarm_time = 0;
+
+// Local ms the alarms have been handled up to
+static uint64_t rtc_seen = 0;
+
+// Set at midnight for rtc_run() to report the day
+static bool rtc_day_ended = false;
+
+/* Functions used only in this file */
+static uint64_t _rtc_ms(void);
+static uint64_t _rtc_next(void);
+static void _rtc_service(uint64_t now);
+static bool _rtc_passed(uint64_t from, uint64_t to, uint32_t time);
+
+/**
+ * Start the clock at midnight on day one
+ */
+void rtc_init(void)
+{
+    sim_clock_set_local_us(0);
+    rtc_seen = 0;
+
+    power_add_wakeup(_rtc_next, _rtc_service);
+}
+
+/**
+ * Set the time and date
+ */
+void rtc_set(uint8_t hour, uint8_t minute, uint8_t second, uint8_t year,
+        uint8_t month, uint8_t day)
+{
+    (void)year;
+    (void)month;
+
+    uint64_t seconds = (uint64_t)(day > 0 ? day - 1 : 0) * RTC_SECONDS_PER_DAY +
+            hour * 3600u + minute * 60u + second;
+
+    sim_clock_set_local_us(seconds * 1000000);
+    rtc_seen = seconds * 1000;
+}
+
+/**
+ * Return current RTC time (seconds since midnight)
+ * @return Seconds since midnight
+ */
+uint32_t rtc_get_time_of_day(void)
+{
+    return (uint32_t)((_rtc_ms() / 1000) % RTC_SECONDS_PER_DAY);
+}
+
+/**
+ * Return current RTC time to the nearest ms
+ * @return Milliseconds since midnight
+ */
+uint32_t rtc_get_ms_of_day(void)
+{
+    return (uint32_t)(_rtc_ms() % RTC_MS_PER_DAY);
+}
+
+/**
+ * Return current RTC time to the nearest tick
+ * @return RTC_TICKS_PER_SECOND ticks since midnight
+ */
+uint32_t rtc_get_ticks(void)
+{
+    return (uint32_t)((sim_clock_local_us() * RTC_TICKS_PER_SECOND / 1000000) %
+            (RTC_SECONDS_PER_DAY * RTC_TICKS_PER_SECOND));
+}
+
+/**
+ * Return a string containing the date
+ * @param date Pointer to a string for date in YY-MM-DD form
+ */
+void rtc_get_date_string(char* date)
+{
+    uint32_t day = (uint32_t)(_rtc_ms() / RTC_MS_PER_DAY);
+
+    sprintf(date, "16-%02d-%02d", 1 + day / 28, 1 + day % 28);
+}
+
+/**
+ * Schedule a function to run at a specified time (overwrites past schedules)
+ * @param fn   Function to call
+ * @param time Timestamp at which to run function
+ */
+void rtc_schedule_callback(void (*fn)(void), uint32_t time)
+{
+    rtc_schedule_callback_ms(fn, time * 1000u);
+}
+
+/**
+ * Schedule a function to run at a specified time to the nearest ms
+ * (overwrites past schedules)
+ * @param fn      Function to call
+ * @param time_ms Milliseconds since midnight at which to run function
+ */
+void rtc_schedule_callback_ms(void (*fn)(void), uint32_t time_ms)
+{
+    cb_func = fn;
+    alarm_time = time_ms % RTC_MS_PER_DAY;
+}
+
+/**
+ * Report the day's radio and power counters once midnight has passed, from
+ * the main loop rather than the interrupt
+ */
+void rtc_run(void)
+{
+    if (!rtc_day_ended)
+    {
+        return;
+    }
+
+    rtc_day_ended = false;
+
+    // Report radio polling avoided today
+    const radio_ready_stats_t* stats = radio_ready_stats();
+    printf("Radio: %u mode waits skipped, %u polls in %u waits, %u polls saved (est.)\r\n",
+            (unsigned)stats->waits_skipped, (unsigned)stats->polls, (unsigned)stats->waits,
+            (unsigned)radio_ready_polls_saved());
+    radio_ready_stats_clear();
+
+    // Report time spent in each power state today
+    const power_stats_t* power = power_stats();
+    printf("Power: %u ms awake, %u ms sleep, %u ms stop, %u wakes. Radio %u ms RX,"
+            " %u ms listen, %u ms standby, %u frames in %u ms TX\r\n",
+            (unsigned)power->mode[PWR_WAKE], (unsigned)power->mode[PWR_SLEEP],
+            (unsigned)power->mode[PWR_CLOCKSTOP], (unsigned)power->wakes,
+            (unsigned)power->radio[PWR_RADIO_RX], (unsigned)power->radio[PWR_RADIO_LISTEN],
+            (unsigned)power->radio[PWR_RADIO_STANDBY], (unsigned)power->tx_frames,
+            (unsigned)(power->tx_us / 1000u));
+    power_stats_clear();
+}
+
+/**
+ * Get the number of whole ms the local clock has counted
+ *
+ * @return Milliseconds since the simulation started, by the local clock
+ */
+static uint64_t _rtc_ms(void)
+{
+    return sim_clock_local_us() / 1000;
+}
+
+/**
+ * Find when the alarm goes off next, or the day ends
+ *
+ * @return Virtual time in us
+ */
+static uint64_t _rtc_next(void)
+{
+    uint64_t day_start = (rtc_seen / RTC_MS_PER_DAY) * RTC_MS_PER_DAY;
+    uint64_t next = day_start + RTC_MS_PER_DAY;
+    uint64_t alarm = day_start + alarm_time;
+
+    if (cb_func && alarm > rtc_seen && alarm < next)
+    {
+        next = alarm;
+    }
+
+    return sim_clock_virtual_us(next * 1000);
+}
+
+/**
+ * Handle alarms for every second passed since last time
+ *
+ * @param now Virtual time in us
+ */
+static void _rtc_service(uint64_t now)
+{
+    (void)now;
+
+    uint64_t ms = _rtc_ms();
+
+    if (ms <= rtc_seen)
+    {
+        return;
+    }
+
+    if (cb_func && _rtc_passed(rtc_seen, ms, alarm_time))
+    {
+        // Cancel the alarm and schedule the callback
+        void (*fn)(void) = cb_func;
+        cb_func = 0x0;
+
+        power_schedule(fn);
+    }
+
+    if (_rtc_passed(rtc_seen, ms, 0))
+    {
+        // Reported from the main loop
+        rtc_day_ended = true;
+    }
+
+    rtc_seen = ms;
+}
+
+/**
+ * Check whether the time of day went through a value between two times
+ *
+ * @param from Local ms already handled
+ * @param to   Local ms now
+ * @param time Time of day to look for in ms
+ * @return     True if time of day reached time after from, up to and including to
+ */
+static bool _rtc_passed(uint64_t from, uint64_t to, uint32_t time)
+{
+    uint64_t since = (time + RTC_MS_PER_DAY -
+            (from + 1) % RTC_MS_PER_DAY) % RTC_MS_PER_DAY;
+
+    return since < to - from;
+}
+
+/**
+ * Read the clock the firmware keeps, the RTC's
+ *
+ * @return Local time in us
+ */
+uint64_t host_clock_us(void)
+{
+    return sim_clock_local_us();
+}
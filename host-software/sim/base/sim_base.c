@@ -0,0 +1,296 @@
+/**
+ * Simulated basestation
+ * Runs the basestation's main loop with the real protocol and schedule. The
+ * SD card is replaced with counters that take as long as a card would, the
+ * serial port and modem are left out.
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Application-specific headers */
+#include "sim_instance.h"
+#include "stm32f4xx.h"
+#include "tm_stm32f4_fatfs.h"
+#include "radio_control.h"
+#include "power_management.h"
+#include "radio_protocol.h"
+#include "radio_shared_types.h"
+#include "base_misc.h"
+#include "rtc_driver.h"
+#include "host_env.h"
+#include "printf.h"
+
+#define NODE_ADDR 0xFF
+
+// Longest line written to the SD card
+#define SIM_LINE_LEN 80
+
+// How long the SD card keeps the base busy: powering up and mounting it,
+// finding a file, writing each sector and updating the directory on close
+#define SIM_SD_MOUNT_US 250000u
+#define SIM_SD_OPEN_US 15000u
+#define SIM_SD_SECTOR_US 8000u
+#define SIM_SD_CLOSE_US 20000u
+#define SIM_SD_SECTOR_LEN 512u
+
+// Calls seen, to spot the same call uploaded again. Must be a power of two
+#define SIM_CALLS_SEEN 1048576u
+
+// Calls written so far, keyed by node, time and clicks. 0x0 until needed
+static uint64_t* calls_seen = 0x0;
+static uint32_t calls_seen_count = 0;
+
+/* Functions used only in this file */
+static bool _sim_base_call_new(uint64_t key);
+
+/**
+ * Basestation main loop, as main() on the base without the hardware set up
+ */
+void sim_instance_main(void)
+{
+    printf("Starting up..\r\n");
+
+    misc_delay_init();
+    sim_stm32_init();
+
+    // Configure the radio
+    if (!radio_init(NODE_ADDR, proto_incoming_packet))
+    {
+        printf("Radio setup failed\r\nLooping.");
+
+        while (true)
+        {
+            host_sleep_until(HOST_NEVER);
+        }
+    }
+
+    rtc_init();
+    proto_init();
+    proto_load_patch();
+
+    // Commands from the command line go out as the nodes upload
+    for (uint8_t i = 0; i < sim_config.command_count; i++)
+    {
+        const sim_command_t* command = &sim_config.commands[i];
+
+        proto_queue_command(command->node, command->command, command->value);
+    }
+
+    printf("Startup done. Sleeping\r\n");
+
+    // Go to sleep. Interrupts will do the rest
+    while (true)
+    {
+        radio_service();
+        proto_run();
+        rtc_run();
+        power_sleep();
+    }
+}
+
+/**
+ * The basestation isn't on a battery, its power state residency is only
+ * printed daily
+ */
+void sim_instance_collect(void)
+{
+}
+
+/**
+ * Mount the card, which takes as long as powering it up and reading its file
+ * system would. Unmounting takes no time
+ *
+ * @param fs   File system to mount, 0x0 to unmount
+ * @param path Drive
+ * @param opt  Mount now if 1
+ * @return     FR_OK
+ */
+FRESULT f_mount(FATFS* fs, const char* path, uint8_t opt)
+{
+    (void)path;
+    (void)opt;
+
+    if (fs)
+    {
+        fs->mounted = 1;
+        host_spend_us(SIM_SD_MOUNT_US);
+    }
+
+    return FR_OK;
+}
+
+/**
+ * Open a file. The firmware patch is there if the simulator was given one,
+ * every other file starts empty
+ *
+ * @param fp   File to open
+ * @param path Its name
+ * @param mode FA_x
+ * @return     FR_OK, or FR_NO_FILE for a patch that isn't there
+ */
+FRESULT f_open(FIL* fp, const char* path, uint8_t mode)
+{
+    (void)mode;
+
+    fp->fsize = 0;
+    fp->fptr = 0;
+    fp->data = 0x0;
+
+    host_spend_us(SIM_SD_OPEN_US);
+
+    if (strstr(path, "PATCH"))
+    {
+        if (!sim_config.patch)
+        {
+            return FR_NO_FILE;
+        }
+
+        fp->fsize = sim_config.patch_length;
+        fp->data = sim_config.patch;
+    }
+
+    return FR_OK;
+}
+
+FRESULT f_read(FIL* fp, void* buff, UINT btr, UINT* br)
+{
+    UINT left = fp->data ? fp->fsize - fp->fptr : 0;
+
+    *br = (btr < left) ? btr : left;
+
+    if (*br)
+    {
+        memcpy(buff, &fp->data[fp->fptr], *br);
+        fp->fptr += *br;
+    }
+
+    return FR_OK;
+}
+
+FRESULT f_lseek(FIL* fp, uint32_t ofs)
+{
+    (void)fp;
+    (void)ofs;
+
+    return FR_OK;
+}
+
+/**
+ * Close a file, writing out the last part sector of one written to and its
+ * directory entry
+ *
+ * @param fp File to close
+ * @return   FR_OK
+ */
+FRESULT f_close(FIL* fp)
+{
+    if (!fp->data)
+    {
+        host_spend_us(((fp->fsize % SIM_SD_SECTOR_LEN) ? SIM_SD_SECTOR_US : 0) +
+                SIM_SD_CLOSE_US);
+    }
+
+    return FR_OK;
+}
+
+/**
+ * Count a record written to the data file, and how long after the call it got
+ * to the base. Lines are "node, hh:mm:ss, type, other". Filling a sector
+ * writes it to the card
+ *
+ * @param fp  File being written
+ * @param str Format string
+ * @return    Number of characters written
+ */
+int f_printf(FIL* fp, const char* str, ...)
+{
+    char line[SIM_LINE_LEN];
+    va_list args;
+
+    va_start(args, str);
+    int length = vsnprintf(line, sizeof(line), str, args);
+    va_end(args);
+
+    unsigned int node, hours, minutes, seconds, type;
+
+    if (sscanf(line, "%u, %u:%u:%u, %u", &node, &hours, &minutes, &seconds,
+            &type) == 5 && node < SIM_ADDR_COUNT)
+    {
+        sim_stats.records_saved++;
+
+        unsigned int other = 0;
+        sscanf(line, "%*u, %*u:%*u:%*u, %*u, %u", &other);
+
+        if (type == DATA_CALL)
+        {
+            sim_stats.calls_copies[node]++;
+
+            // Key is never zero, so zero marks an empty entry
+            uint64_t key = (uint64_t)(node + 1) << 32 |
+                    (hours * 3600u + minutes * 60u + seconds) << 8 | (other & 0xFF);
+
+            if (_sim_base_call_new(key))
+            {
+                uint32_t call_s = hours * 3600u + minutes * 60u + seconds;
+
+                sim_stats.calls_saved[node]++;
+                sim_stats.latency_s[node] += (rtc_get_ms_of_day() / 1000u + 86400u -
+                        call_s) % 86400u;
+            }
+        }
+    }
+
+    if ((fp->fsize + (uint32_t)length) / SIM_SD_SECTOR_LEN != fp->fsize / SIM_SD_SECTOR_LEN)
+    {
+        host_spend_us(SIM_SD_SECTOR_US);
+    }
+
+    fp->fsize += (uint32_t)length;
+
+    return length;
+}
+
+/**
+ * Remember a call, the same call arrives again whenever a node misses its ACK.
+ * Calls on different days at the same second with the same clicks count as
+ * one, which is rare enough not to matter.
+ *
+ * @param key Node, time of day and clicks of the call
+ * @return    True if the call hadn't been seen before
+ */
+static bool _sim_base_call_new(uint64_t key)
+{
+    if (!calls_seen)
+    {
+        calls_seen = calloc(SIM_CALLS_SEEN, sizeof(uint64_t));
+    }
+
+    // Count everything once the table is too full to search
+    if (!calls_seen || calls_seen_count >= SIM_CALLS_SEEN / 2)
+    {
+        return true;
+    }
+
+    uint32_t i = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 44) & (SIM_CALLS_SEEN - 1);
+
+    while (calls_seen[i])
+    {
+        if (calls_seen[i] == key)
+        {
+            return false;
+        }
+
+        i = (i + 1) & (SIM_CALLS_SEEN - 1);
+    }
+
+    calls_seen[i] = key;
+    calls_seen_count++;
+
+    return true;
+}
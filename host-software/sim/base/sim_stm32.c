@@ -0,0 +1,241 @@
+/**
+ * Stand in for the STM32F4 peripherals the basestation protocol uses
+ * TIM2 counts on virtual time and raises its update interrupt when the
+ * counter reaches the auto-reload value, which is what the protocol's handler
+ * checks for. ARR writes take effect straight away rather than being
+ * preloaded. Clock and GPIO control do nothing.
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Application-specific headers */
+#include "stm32f4xx.h"
+#include "power_management.h"
+#include "host_env.h"
+
+TIM_TypeDef sim_tim2;
+
+// Timer enables: peripheral clock, counter and update interrupt
+static bool tim2_clock = false;
+static bool tim2_running = false;
+static bool tim2_irq = false;
+static bool tim2_pending = false;
+
+// Virtual time at which the counter held the value in CNT
+static uint64_t tim2_ref = 0;
+
+// Set when the counter is written, so the update handler can tell
+static bool tim2_written = false;
+
+// Implemented by the basestation protocol
+void TIM2_IRQHandler(void);
+
+/* Functions used only in this file */
+static uint32_t _sim_tim2_tick_ns(void);
+static void _sim_tim2_latch(void);
+static uint64_t _sim_tim2_next(void);
+static void _sim_tim2_service(uint64_t now);
+
+/**
+ * Register TIM2 as a wake up source
+ */
+void sim_stm32_init(void)
+{
+    power_add_wakeup(_sim_tim2_next, _sim_tim2_service);
+}
+
+void RCC_APB1PeriphClockCmd(uint32_t periph, FunctionalState state)
+{
+    if (periph & RCC_APB1Periph_TIM2)
+    {
+        _sim_tim2_latch();
+        tim2_clock = (state == ENABLE);
+    }
+}
+
+void RCC_APB2PeriphClockCmd(uint32_t periph, FunctionalState state)
+{
+    (void)periph;
+    (void)state;
+}
+
+void RCC_AHB1PeriphClockCmd(uint32_t periph, FunctionalState state)
+{
+    (void)periph;
+    (void)state;
+}
+
+void TIM_TimeBaseInit(TIM_TypeDef* timer, TIM_TimeBaseInitTypeDef* init)
+{
+    timer->PSC = init->TIM_Prescaler;
+    timer->ARR = init->TIM_Period;
+    timer->CNT = 0;
+    tim2_ref = host_now_us();
+}
+
+void TIM_ARRPreloadConfig(TIM_TypeDef* timer, FunctionalState state)
+{
+    (void)timer;
+    (void)state;
+}
+
+void TIM_ITConfig(TIM_TypeDef* timer, uint16_t interrupt, FunctionalState state)
+{
+    (void)timer;
+
+    if (interrupt & TIM_IT_Update)
+    {
+        tim2_irq = (state == ENABLE);
+    }
+}
+
+void TIM_ClearFlag(TIM_TypeDef* timer, uint16_t flag)
+{
+    (void)timer;
+
+    if (flag & TIM_FLAG_Update)
+    {
+        tim2_pending = false;
+    }
+}
+
+void TIM_SetCounter(TIM_TypeDef* timer, uint32_t counter)
+{
+    timer->CNT = counter;
+    tim2_ref = host_now_us();
+    tim2_written = true;
+}
+
+void TIM_SetAutoreload(TIM_TypeDef* timer, uint32_t autoreload)
+{
+    _sim_tim2_latch();
+    timer->ARR = autoreload;
+}
+
+void TIM_Cmd(TIM_TypeDef* timer, FunctionalState state)
+{
+    (void)timer;
+
+    _sim_tim2_latch();
+    tim2_running = (state == ENABLE);
+    tim2_written = true;
+}
+
+ITStatus TIM_GetITStatus(TIM_TypeDef* timer, uint16_t interrupt)
+{
+    (void)timer;
+
+    return ((interrupt & TIM_IT_Update) && tim2_pending && tim2_irq) ? SET : RESET;
+}
+
+void TIM_ClearITPendingBit(TIM_TypeDef* timer, uint16_t interrupt)
+{
+    (void)timer;
+
+    if (interrupt & TIM_IT_Update)
+    {
+        tim2_pending = false;
+    }
+}
+
+void NVIC_Init(NVIC_InitTypeDef* init)
+{
+    (void)init;
+}
+
+void NVIC_ClearPendingIRQ(int irq)
+{
+    (void)irq;
+}
+
+void GPIO_Init(void* port, GPIO_InitTypeDef* init)
+{
+    (void)port;
+    (void)init;
+}
+
+void GPIO_SetBits(void* port, uint16_t pins)
+{
+    (void)port;
+    (void)pins;
+}
+
+void GPIO_ResetBits(void* port, uint16_t pins)
+{
+    (void)port;
+    (void)pins;
+}
+
+/**
+ * Length of one timer tick
+ *
+ * @return Tick length in ns
+ */
+static uint32_t _sim_tim2_tick_ns(void)
+{
+    return (uint32_t)(((uint64_t)TIM2->PSC + 1) * 1000000000 / SIM_TIM_CLOCK_HZ);
+}
+
+/**
+ * Bring CNT up to date with the time that has passed
+ */
+static void _sim_tim2_latch(void)
+{
+    uint64_t now = host_now_us();
+
+    if (tim2_clock && tim2_running && now > tim2_ref)
+    {
+        TIM2->CNT += (uint32_t)((now - tim2_ref) * 1000 / _sim_tim2_tick_ns());
+    }
+
+    tim2_ref = now;
+}
+
+/**
+ * Find when the counter reaches the auto-reload value
+ *
+ * @return Virtual time in us, HOST_NEVER if the timer won't interrupt
+ */
+static uint64_t _sim_tim2_next(void)
+{
+    if (!tim2_clock || !tim2_running || !tim2_irq || TIM2->CNT > TIM2->ARR)
+    {
+        return HOST_NEVER;
+    }
+
+    uint64_t ticks = TIM2->ARR - TIM2->CNT;
+
+    return tim2_ref + (ticks * _sim_tim2_tick_ns() + 999) / 1000;
+}
+
+/**
+ * Raise the update interrupt once the counter gets to the auto-reload value,
+ * then carry on from zero
+ *
+ * @param now Virtual time in us
+ */
+static void _sim_tim2_service(uint64_t now)
+{
+    uint64_t update = _sim_tim2_next();
+
+    if (update > now)
+    {
+        return;
+    }
+
+    TIM2->CNT = TIM2->ARR;
+    tim2_ref = update;
+    tim2_pending = true;
+    tim2_written = false;
+
+    TIM2_IRQHandler();
+
+    // Counter reads ARR for one tick then wraps, unless the handler moved it
+    if (!tim2_written)
+    {
+        TIM2->CNT = 0;
+        tim2_ref = update + _sim_tim2_tick_ns() / 1000;
+    }
+}
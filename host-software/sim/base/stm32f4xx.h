@@ -0,0 +1,95 @@
+/**
+ * Stand in for the parts of the STM32F4 standard peripheral library the
+ * basestation protocol uses - header file
+ * TIM2 is emulated on virtual time, clock and GPIO control do nothing.
+ */
+
+#ifndef STM32F4XX_H_
+#define STM32F4XX_H_
+
+#include <stdint.h>
+
+typedef enum {DISABLE = 0, ENABLE = !DISABLE} FunctionalState;
+typedef enum {RESET = 0, SET = !RESET} FlagStatus, ITStatus;
+
+// Clock the simulated timers count from before the prescaler
+#define SIM_TIM_CLOCK_HZ 8000000
+
+typedef struct
+{
+    uint32_t CNT;
+    uint32_t ARR;
+    uint32_t PSC;
+} TIM_TypeDef;
+
+extern TIM_TypeDef sim_tim2;
+#define TIM2 (&sim_tim2)
+
+typedef struct
+{
+    uint16_t TIM_Prescaler;
+    uint16_t TIM_CounterMode;
+    uint32_t TIM_Period;
+    uint16_t TIM_ClockDivision;
+} TIM_TimeBaseInitTypeDef;
+
+#define TIM_CKD_DIV1        0x0000
+#define TIM_CounterMode_Up  0x0000
+#define TIM_IT_Update       0x0001
+#define TIM_FLAG_Update     0x0001
+
+typedef struct
+{
+    uint8_t NVIC_IRQChannel;
+    uint8_t NVIC_IRQChannelPreemptionPriority;
+    uint8_t NVIC_IRQChannelSubPriority;
+    FunctionalState NVIC_IRQChannelCmd;
+} NVIC_InitTypeDef;
+
+#define TIM2_IRQn 28
+
+#define RCC_APB1Periph_TIM2  0x00000001
+#define RCC_APB2Periph_SDIO  0x00000800
+#define RCC_AHB1Periph_GPIOC 0x00000004
+#define RCC_AHB1Periph_DMA2  0x00400000
+
+typedef struct
+{
+    uint32_t GPIO_Pin;
+    uint8_t GPIO_Mode;
+    uint8_t GPIO_Speed;
+    uint8_t GPIO_OType;
+    uint8_t GPIO_PuPd;
+} GPIO_InitTypeDef;
+
+#define GPIOB             ((void*)0x0)
+#define GPIO_Pin_4        0x0010
+#define GPIO_Mode_OUT     0x01
+#define GPIO_OType_OD     0x01
+#define GPIO_PuPd_NOPULL  0x00
+#define GPIO_Speed_50MHz  0x02
+
+void RCC_APB1PeriphClockCmd(uint32_t periph, FunctionalState state);
+void RCC_APB2PeriphClockCmd(uint32_t periph, FunctionalState state);
+void RCC_AHB1PeriphClockCmd(uint32_t periph, FunctionalState state);
+
+void TIM_TimeBaseInit(TIM_TypeDef* timer, TIM_TimeBaseInitTypeDef* init);
+void TIM_ARRPreloadConfig(TIM_TypeDef* timer, FunctionalState state);
+void TIM_ITConfig(TIM_TypeDef* timer, uint16_t interrupt, FunctionalState state);
+void TIM_ClearFlag(TIM_TypeDef* timer, uint16_t flag);
+void TIM_SetCounter(TIM_TypeDef* timer, uint32_t counter);
+void TIM_SetAutoreload(TIM_TypeDef* timer, uint32_t autoreload);
+void TIM_Cmd(TIM_TypeDef* timer, FunctionalState state);
+ITStatus TIM_GetITStatus(TIM_TypeDef* timer, uint16_t interrupt);
+void TIM_ClearITPendingBit(TIM_TypeDef* timer, uint16_t interrupt);
+
+void NVIC_Init(NVIC_InitTypeDef* init);
+void NVIC_ClearPendingIRQ(int irq);
+
+void GPIO_Init(void* port, GPIO_InitTypeDef* init);
+void GPIO_SetBits(void* port, uint16_t pins);
+void GPIO_ResetBits(void* port, uint16_t pins);
+
+void sim_stm32_init(void);
+
+#endif /* STM32F4XX_H_ */
@@ -0,0 +1,43 @@
+/**
+ * Stand in for the FatFS calls the basestation uses to save data - header file
+ * Nothing is written to disk, each saved record is counted instead. The only
+ * file read is the firmware patch given to the simulator
+ */
+
+#ifndef TM_FATFS_H
+#define TM_FATFS_H
+
+#include <stdint.h>
+
+typedef enum {FR_OK = 0, FR_DISK_ERR, FR_NO_FILE = 4} FRESULT;
+
+typedef unsigned int UINT;
+
+typedef struct
+{
+    uint8_t mounted;
+} FATFS;
+
+typedef struct
+{
+    uint32_t fsize;
+    uint32_t fptr;
+    const uint8_t* data;
+} FIL;
+
+#define FA_OPEN_EXISTING 0x00
+#define FA_READ         0x01
+#define FA_WRITE        0x02
+#define FA_CREATE_ALWAYS 0x08
+#define FA_OPEN_ALWAYS  0x10
+
+#define f_size(fp) ((fp)->fsize)
+
+FRESULT f_mount(FATFS* fs, const char* path, uint8_t opt);
+FRESULT f_open(FIL* fp, const char* path, uint8_t mode);
+FRESULT f_read(FIL* fp, void* buff, UINT btr, UINT* br);
+FRESULT f_lseek(FIL* fp, uint32_t ofs);
+FRESULT f_close(FIL* fp);
+int f_printf(FIL* fp, const char* str, ...);
+
+#endif /* TM_FATFS_H */
@@ -0,0 +1,23 @@
+/**
+ * Stand in for the device header, giving the flash layout the node keeps its
+ * settings and firmware updates in - header file
+ * Main flash and the user data page are arrays in the simulated node, so what's
+ * written lasts as long as the instance
+ */
+
+#ifndef EM_DEVICE_H_
+#define EM_DEVICE_H_
+
+#include <stdint.h>
+
+// Page size and main flash size of the EFM32ZG222F32
+#define FLASH_PAGE_SIZE 1024
+#define FLASH_SIZE      0x8000u
+
+extern uint32_t sim_flash[FLASH_SIZE / 4];
+extern uint32_t sim_userdata_page[FLASH_PAGE_SIZE / 4];
+
+#define FLASH_BASE    ((uintptr_t)sim_flash)
+#define USERDATA_BASE ((uintptr_t)sim_userdata_page)
+
+#endif /* EM_DEVICE_H_ */
@@ -0,0 +1,19 @@
+/**
+ * Stand in for the emlib flash controller functions the node settings and
+ * firmware updates use - header file
+ * Erasing and writing act on the simulated flash straight away
+ */
+
+#ifndef EM_MSC_H_
+#define EM_MSC_H_
+
+#include <stdint.h>
+
+typedef enum {mscReturnOk = 0, mscReturnInvalidAddr = -1} MSC_Status_TypeDef;
+
+void MSC_Init(void);
+void MSC_Deinit(void);
+MSC_Status_TypeDef MSC_ErasePage(uint32_t* startAddress);
+MSC_Status_TypeDef MSC_WriteWord(uint32_t* address, void const* data, uint32_t numBytes);
+
+#endif /* EM_MSC_H_ */
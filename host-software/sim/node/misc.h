@@ -0,0 +1,15 @@
+/**
+ * Node helpers for simulator builds - header file
+ * The delay timer comes from the host build, running on virtual time. A reset
+ * runs the bootloader's part of a firmware update and starts the node's main
+ * loop again, see sim_node.c
+ */
+
+#ifndef MISC_H_
+#define MISC_H_
+
+#include "host_misc.h"
+
+void misc_reset(void);
+
+#endif /* MISC_H_ */
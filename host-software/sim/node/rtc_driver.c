@@ -0,0 +1,306 @@
+/**
+ * Real time clock for simulated nodes
+ * Counts ticks on the instance's drifting local clock, which is never set. The
+ * time of day is set and disciplined for drift on top of it in software, as
+ * the node's RTC driver does with its free running counter. COMP1 matches
+ * trigger uploads and midnight reports the day's stats.
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Application-specific headers */
+#include "rtc_driver.h"
+#include "power_management.h"
+#include "power_model.h"
+#include "radio_protocol.h"
+#include "radio_control.h"
+#include "sim_instance.h"
+#include "printf.h"
+
+#define RTC_SECONDS_PER_DAY      (86400)
+#define RTC_TICKS_PER_DAY        (RTC_SECONDS_PER_DAY * RTC_TICKS_PER_SECOND)
+
+// Time between wakes in seconds, and the time of day of the next one in ticks
+static uint32_t rtc_wake_period = RTC_SECONDS_PER_DAY;
+static uint32_t rtc_wake_ticks = RTC_TICKS_PER_DAY;
+
+// How fast the local clock runs in ppm, and the local tick and time of day
+// the correction runs from
+static int16_t rtc_drift_ppm = 0;
+static uint64_t rtc_sync_count = 0;
+static uint32_t rtc_sync_ticks = 0;
+
+// Local ticks the next wake and midnight come at, and have been handled up to
+static uint64_t rtc_wake_count = UINT64_MAX;
+static uint64_t rtc_midnight_count = UINT64_MAX;
+static uint64_t rtc_seen = 0;
+
+// Set at midnight for rtc_run() to report the day
+static bool rtc_day_ended = false;
+
+/* Functions used only in this file */
+static uint64_t _rtc_count(void);
+static void _rtc_anchor(uint32_t ticks);
+static void _rtc_arm(bool due_now);
+static uint64_t _rtc_count_at(uint32_t ticks, bool due_now);
+static uint64_t _rtc_next(void);
+static void _rtc_service(uint64_t now);
+
+/**
+ * Configure and start the real time counter
+ */
+void rtc_init(void)
+{
+    rtc_seen = _rtc_count();
+    _rtc_anchor(0);
+    _rtc_arm(false);
+
+    power_add_wakeup(_rtc_next, _rtc_service);
+
+    // We can't drop to EM3 when using the ULFRCO or it will stop
+    power_set_minimum(PWR_RTC, PWR_EM2);
+}
+
+bool rtc_get_time_16(uint16_t* time_p)
+{
+    uint32_t count = rtc_get_ticks() / RTC_TICKS_PER_SECOND;
+    *time_p = count & 0xFFFF;
+    return (0x10000 & count);
+}
+
+/**
+ * Get the time of day to the nearest tick
+ *
+ * @return Ticks since midnight, at RTC_TICKS_PER_SECOND
+ */
+uint32_t rtc_get_ticks(void)
+{
+    int64_t elapsed = (int64_t)(_rtc_count() - rtc_sync_count);
+
+    elapsed -= elapsed * rtc_drift_ppm / 1000000;
+
+    return (uint32_t)((rtc_sync_ticks + elapsed) % RTC_TICKS_PER_DAY);
+}
+
+/**
+ * Set the current real time clock value in seconds
+ * @param timestamp Current time from upstream
+ * @param msb	    Most significant bit (stored elsewhere)
+ */
+void rtc_set_time(uint16_t timestamp, uint8_t msb)
+{
+    uint32_t ticks = ((uint32_t) timestamp | ((uint32_t) msb << 16)) * RTC_TICKS_PER_SECOND;
+
+    _rtc_anchor(ticks);
+
+    // Calculate the next interrupt (and adjust for crossing midnight)
+    rtc_wake_ticks = (ticks + rtc_wake_period * RTC_TICKS_PER_SECOND) % RTC_TICKS_PER_DAY;
+    _rtc_arm(false);
+}
+
+/**
+ * Move the time of day on or back, keeping the wake times as they are
+ *
+ * @param ticks Ticks to add, negative to go back
+ */
+void rtc_adjust(int32_t ticks)
+{
+    _rtc_anchor((uint32_t)(((int64_t)rtc_get_ticks() + RTC_TICKS_PER_DAY + ticks) %
+            RTC_TICKS_PER_DAY));
+    _rtc_arm(true);
+}
+
+/**
+ * Discipline the time of day against the local clock from now on
+ *
+ * @param drift_ppm How fast the local clock runs in ppm, the time of day makes
+ *                  up for it
+ */
+void rtc_set_drift(int16_t drift_ppm)
+{
+    _rtc_anchor(rtc_get_ticks());
+    rtc_drift_ppm = drift_ppm;
+    _rtc_arm(true);
+}
+
+/**
+ * Adjust the schedule for next wakeup. This should be called after
+ * time has been set!
+ *
+ * @param period    Period between wakeups
+ * @param next_wake Absolute time value at which to next wake
+ * @param wake_ms   Milliseconds into that second to wake at
+ */
+void rtc_set_schedule(uint32_t period, uint32_t next_wake, uint16_t wake_ms)
+{
+    rtc_wake_period = period;
+    rtc_wake_ticks = (next_wake * RTC_TICKS_PER_SECOND +
+            (wake_ms * RTC_TICKS_PER_SECOND) / 1000u) % RTC_TICKS_PER_DAY;
+    _rtc_arm(true);
+}
+
+/**
+ * Get when the next wake is due
+ *
+ * @return Time of day in ms
+ */
+uint32_t rtc_get_wake_ms(void)
+{
+    return (uint32_t)(((uint64_t)rtc_wake_ticks * 1000u) / RTC_TICKS_PER_SECOND);
+}
+
+/**
+ * Get the number of whole ticks the local clock has counted
+ *
+ * @return Ticks since the simulation started, by the local clock
+ */
+static uint64_t _rtc_count(void)
+{
+    return sim_clock_local_us() * RTC_TICKS_PER_SECOND / 1000000;
+}
+
+/**
+ * Make the time of day be a value now, and run the drift correction from here
+ *
+ * @param ticks Ticks since midnight it is now
+ */
+static void _rtc_anchor(uint32_t ticks)
+{
+    rtc_sync_count = _rtc_count();
+    rtc_sync_ticks = ticks;
+}
+
+/**
+ * Work out the local ticks the next wake and midnight come at
+ *
+ * @param due_now Whether a wake on this very tick is still to come, false if
+ *                it has just been handled or a period of a whole day has
+ *                brought it round again. Midnight on this tick never is, the
+ *                clock is set to it when a node registers
+ */
+static void _rtc_arm(bool due_now)
+{
+    rtc_wake_count = (rtc_wake_ticks < RTC_TICKS_PER_DAY) ?
+            _rtc_count_at(rtc_wake_ticks, due_now) : UINT64_MAX;
+    rtc_midnight_count = _rtc_count_at(0, false);
+}
+
+/**
+ * Turn the next time a time of day comes round into local ticks
+ *
+ * @param ticks   Time of day in ticks since midnight
+ * @param due_now Whether a time of day on this tick is due now rather than a
+ *                day on
+ * @return        Local tick it comes at
+ */
+static uint64_t _rtc_count_at(uint32_t ticks, bool due_now)
+{
+    int64_t ahead = (ticks + RTC_TICKS_PER_DAY - rtc_get_ticks()) % RTC_TICKS_PER_DAY;
+
+    if (ahead == 0 && due_now)
+    {
+        // Compares are handled once a tick, one for a tick already handled
+        // goes off on the next
+        return (_rtc_count() > rtc_seen) ? _rtc_count() : rtc_seen + 1;
+    }
+
+    if (ahead == 0)
+    {
+        ahead = RTC_TICKS_PER_DAY;
+    }
+
+    ahead += ahead * rtc_drift_ppm / 1000000;
+
+    return _rtc_count() + (uint64_t)ahead;
+}
+
+/**
+ * Find when the next wake or midnight comes
+ *
+ * @return Virtual time in us
+ */
+static uint64_t _rtc_next(void)
+{
+    uint64_t next = (rtc_wake_count < rtc_midnight_count) ? rtc_wake_count :
+            rtc_midnight_count;
+
+    return sim_clock_virtual_us((next * 1000000 + RTC_TICKS_PER_SECOND - 1) /
+            RTC_TICKS_PER_SECOND);
+}
+
+/**
+ * RTC interrupts, run for every compare passed since last time
+ *
+ * @param now Virtual time in us
+ */
+static void _rtc_service(uint64_t now)
+{
+    (void)now;
+
+    uint64_t count = _rtc_count();
+
+    if (count <= rtc_seen)
+    {
+        return;
+    }
+
+    rtc_seen = count;
+
+    if (count >= rtc_wake_count)
+    {
+        // Upload interrupt fired, calculate the next one (and adjust for
+        // crossing midnight with a mod)
+        rtc_wake_ticks = (rtc_wake_ticks + rtc_wake_period * RTC_TICKS_PER_SECOND) %
+                RTC_TICKS_PER_DAY;
+        _rtc_arm(false);
+
+        // Send a burst of data back on the radio
+        proto_triggerupload();
+    }
+
+    if (count >= rtc_midnight_count)
+    {
+        _rtc_arm(false);
+
+        // Daily interrupt fired, reported from the main loop
+        rtc_day_ended = true;
+    }
+}
+
+/**
+ * Report the day's radio and power counters once midnight has passed, from
+ * the main loop rather than the interrupt
+ */
+void rtc_run(void)
+{
+    if (!rtc_day_ended)
+    {
+        return;
+    }
+
+    rtc_day_ended = false;
+
+    // Report radio polling avoided today
+    const radio_ready_stats_t* stats = radio_ready_stats();
+    printf("Radio: %u mode waits skipped, %u polls in %u waits, %u polls saved (est.)\r\n",
+            (unsigned)stats->waits_skipped, (unsigned)stats->polls, (unsigned)stats->waits,
+            (unsigned)radio_ready_polls_saved());
+    radio_ready_stats_clear();
+
+    // Report time spent in each power state today and the battery life
+    // it works out at
+    power_model_report(power_stats());
+    sim_instance_collect();
+}
+
+/**
+ * Read the clock the firmware keeps, the RTC's time of day
+ *
+ * @return Time of day in us
+ */
+uint64_t host_clock_us(void)
+{
+    return (uint64_t)rtc_get_ticks() * 1000000 / RTC_TICKS_PER_SECOND;
+}
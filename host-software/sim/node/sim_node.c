@@ -0,0 +1,356 @@
+/**
+ * Simulated sensor node
+ * Runs the node's main loop with the real protocol, data store and settings.
+ * The call detector, sensors, status LEDs and flash are replaced with
+ * stand-ins.
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <string.h>
+#include <setjmp.h>
+
+/* Application-specific headers */
+#include "sim_instance.h"
+#include "misc.h"
+#include "radio_control.h"
+#include "power_management.h"
+#include "power_model.h"
+#include "i2c_sensors.h"
+#include "rtc_driver.h"
+#include "detect_data_store.h"
+#include "radio_protocol.h"
+#include "status_leds.h"
+#include "detect_algorithm.h"
+#include "node_config.h"
+#include "em_device.h"
+#include "em_msc.h"
+#include "radio_shared_types.h"
+#include "ota_patch.h"
+#include "host_env.h"
+#include "printf.h"
+
+// Most clicks in a detected call
+#define SIM_CALL_MAX_CLICKS 40
+
+// Virtual time of the next detected call
+static uint64_t next_call = HOST_NEVER;
+
+// Main flash and the user data page, erased when the node starts
+uint32_t sim_flash[FLASH_SIZE / 4];
+uint32_t sim_userdata_page[FLASH_PAGE_SIZE / 4];
+
+// Where misc_reset() starts the node again
+static jmp_buf restart;
+
+/* Functions used only in this file */
+static void _sim_node_call_schedule(void);
+static uint64_t _sim_node_call_next(void);
+static void _sim_node_call_service(uint64_t now);
+static bool _sim_node_flash_valid(const uint32_t* address, uint32_t numBytes);
+static uint32_t _sim_node_firmware_crc(void);
+
+/**
+ * Node main loop, as main() on the node without the hardware set up
+ */
+void sim_instance_main(void)
+{
+    // Erased flash reads as all ones, the image given goes where the
+    // bootloader starts the application
+    memset(sim_flash, 0xFF, sizeof(sim_flash));
+    memset(sim_userdata_page, 0xFF, sizeof(sim_userdata_page));
+
+    if (sim_config.image && sim_config.image_length <= OTA_APP_SIZE)
+    {
+        memcpy((uint8_t*)OTA_APP_BASE, sim_config.image, sim_config.image_length);
+        sim_stats.firmware_crc = _sim_node_firmware_crc();
+    }
+
+    // A reset keeps the flash and starts again from here. The protocol's RAM
+    // would have been cleared
+    if (setjmp(restart))
+    {
+        proto_init();
+    }
+
+    // Announce startup on debug interface
+    printf("Starting up...\r\n");
+
+    // Configure the delay function
+    misc_delay_init();
+
+    // Initialise the radio chip, with the address the simulator gave us
+    if (!radio_init(sim_config.address, proto_incoming_packet))
+    {
+        printf("Radio setup fails...\r\n");
+
+        while (true)
+        {
+            host_sleep_until(HOST_NEVER);
+        }
+    }
+
+    // Calls turn up at random, standing in for the detection algorithm
+    _sim_node_call_schedule();
+    power_add_wakeup(_sim_node_call_next, _sim_node_call_service);
+
+    config_init();
+
+    sensors_init();
+
+    // Start the RTC (it will be set when the radio protocol kicks in)
+    rtc_init();
+    proto_run();
+
+    radio_powerstate(true);
+
+    // Remain in sleep mode unless woken by interrupt
+    while (true)
+    {
+        radio_service();
+        proto_run();
+        rtc_run();
+        power_sleep();
+    }
+}
+
+/**
+ * Reset the node. The bootloader's part of a firmware update runs, then the
+ * main loop starts again
+ */
+void misc_reset(void)
+{
+    ota_boot();
+    sim_stats.firmware_crc = _sim_node_firmware_crc();
+
+    longjmp(restart, 1);
+}
+
+/**
+ * Add the charge drawn since last time to the counters, by the node's own
+ * current model, and start the residency counters again
+ */
+void sim_instance_collect(void)
+{
+    const power_stats_t* power = power_stats();
+
+    sim_stats.relay = config_get()->relay;
+
+    sim_stats.charge_nams += power_model_charge(power);
+    sim_stats.charge_ms += power->elapsed;
+    power_stats_clear();
+
+    if (sim_stats.charge_ms)
+    {
+        sim_stats.battery_days = power_model_battery_days(
+                (uint32_t)(sim_stats.charge_nams / sim_stats.charge_ms));
+    }
+}
+
+/**
+ * Sensors always start
+ *
+ * @return True
+ */
+bool sensors_init(void)
+{
+    return true;
+}
+
+/**
+ * Give a plausible reading for a sensor
+ *
+ * @param sensor Sensor to read
+ * @return       Reading
+ */
+uint16_t sensors_read(sensor_type_t sensor)
+{
+    switch (sensor)
+    {
+        case SENS_TEMP:
+            return (uint16_t)(15 + sim_random() % 10);
+        case SENS_HUMID:
+            return (uint16_t)(50 + sim_random() % 40);
+        case SENS_LIGHT:
+        default:
+            return (uint16_t)(sim_random() % 100);
+    }
+}
+
+void status_init(void)
+{
+}
+
+void status_led_set(uint8_t led, bool state)
+{
+    (void)led;
+    (void)state;
+}
+
+void status_illuminate(bool active)
+{
+    (void)active;
+}
+
+/**
+ * Any policy the node knows is fine, there are no LEDs to light
+ *
+ * @param policy One of STATUS_POLICY_x
+ * @return       False if there is no such policy
+ */
+bool status_set_policy(uint8_t policy)
+{
+    return policy < STATUS_POLICY_COUNT;
+}
+
+/**
+ * Any profile the node knows is fine, calls turn up at the same rate whatever
+ * the bounds
+ *
+ * @param profile One of DETECT_PROFILE_x
+ * @return        False if there is no such profile
+ */
+bool detect_set_profile(uint8_t profile)
+{
+    return profile < DETECT_PROFILE_COUNT;
+}
+
+void MSC_Init(void)
+{
+}
+
+void MSC_Deinit(void)
+{
+}
+
+/**
+ * Erase a page of main flash or the user data page
+ *
+ * @param startAddress Start of the page
+ * @return             mscReturnInvalidAddr if it isn't the start of a page
+ */
+MSC_Status_TypeDef MSC_ErasePage(uint32_t* startAddress)
+{
+    if (startAddress != sim_userdata_page && (startAddress < sim_flash ||
+            startAddress >= sim_flash + FLASH_SIZE / 4 ||
+            (startAddress - sim_flash) % (FLASH_PAGE_SIZE / 4)))
+    {
+        return mscReturnInvalidAddr;
+    }
+
+    memset(startAddress, 0xFF, FLASH_PAGE_SIZE);
+
+    return mscReturnOk;
+}
+
+/**
+ * Write words to main flash or the user data page. Flash bits only go from one
+ * to zero
+ *
+ * @param address  Where to write
+ * @param data     Words to write
+ * @param numBytes Bytes to write, a multiple of four
+ * @return         mscReturnInvalidAddr if they don't fit in the flash
+ */
+MSC_Status_TypeDef MSC_WriteWord(uint32_t* address, void const* data, uint32_t numBytes)
+{
+    const uint32_t* words = (const uint32_t*)data;
+
+    if (!_sim_node_flash_valid(address, numBytes))
+    {
+        return mscReturnInvalidAddr;
+    }
+
+    for (uint32_t i = 0; i < numBytes / 4; i++)
+    {
+        address[i] &= words[i];
+    }
+
+    return mscReturnOk;
+}
+
+/**
+ * Pick the time of the next call, calls arriving as a Poisson process
+ */
+static void _sim_node_call_schedule(void)
+{
+    if (sim_config.call_period_s == 0)
+    {
+        next_call = HOST_NEVER;
+        return;
+    }
+
+    // Exponential gap by inversion, uniform value in (0, 1]
+    double uniform = ((sim_random() >> 8) + 1) / 16777216.0;
+    double gap = -log(uniform);
+
+    next_call = host_now_us() + (uint64_t)(gap * sim_config.call_period_s * 1000000);
+}
+
+/**
+ * Get the virtual time of the next call
+ *
+ * @return Virtual time in us
+ */
+static uint64_t _sim_node_call_next(void)
+{
+    return next_call;
+}
+
+/**
+ * Store a call once it is due, as the detection interrupt would
+ *
+ * @param now Virtual time in us
+ */
+static void _sim_node_call_service(uint64_t now)
+{
+    if (now < next_call)
+    {
+        return;
+    }
+
+    store_call((sim_random() & 0x07) == 0, (uint8_t)(1 + sim_random() % SIM_CALL_MAX_CLICKS));
+    sim_stats.calls_detected++;
+
+    _sim_node_call_schedule();
+}
+
+/**
+ * Check some words are all in main flash or all in the user data page
+ *
+ * @param address  First word
+ * @param numBytes Bytes from there
+ * @return         True if they are
+ */
+static bool _sim_node_flash_valid(const uint32_t* address, uint32_t numBytes)
+{
+    return (address >= sim_flash && address + numBytes / 4 <= sim_flash + FLASH_SIZE / 4) ||
+            (address >= sim_userdata_page &&
+            address + numBytes / 4 <= sim_userdata_page + FLASH_PAGE_SIZE / 4);
+}
+
+/**
+ * Work out the CRC-32 of the image the node runs, the new one if the patch has
+ * been applied or else the one it started with
+ *
+ * @return CRC-32, as a patch header gives them
+ */
+static uint32_t _sim_node_firmware_crc(void)
+{
+    radio_patch_header_t header;
+
+    if (sim_config.patch)
+    {
+        memcpy(&header, sim_config.patch, sizeof(header));
+
+        if (header.new_length <= OTA_APP_SIZE &&
+                ota_crc32(0, (const uint8_t*)OTA_APP_BASE, header.new_length) == header.new_crc)
+        {
+            return header.new_crc;
+        }
+    }
+
+    return ota_crc32(0, (const uint8_t*)OTA_APP_BASE, sim_config.image_length);
+}
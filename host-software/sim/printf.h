@@ -0,0 +1,19 @@
+/**
+ * Stand in for the small embedded printf used by the firmware, output goes to
+ * the simulator's log - header file
+ */
+
+#ifndef __TFP_PRINTF__
+#define __TFP_PRINTF__
+
+#include <stdarg.h>
+
+void init_printf(void* putp, void (*putf) (void*, char));
+
+void tfp_printf(char *fmt, ...);
+void tfp_sprintf(char* s, char *fmt, ...);
+
+#define printf tfp_printf
+#define sprintf tfp_sprintf
+
+#endif
@@ -0,0 +1,95 @@
+/**
+ * Radio channel model for the network simulator
+ * Log-distance path loss with per-frame shadow fading, a random frame loss
+ * rate on top, and capture when frames overlap
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+/* Application-specific headers */
+#include "sim_channel.h"
+
+static channel_config_t channel;
+
+// State of the random number generator
+static uint64_t random_state = 1;
+
+/**
+ * Set up the channel
+ *
+ * @param config Channel settings
+ * @param seed   Seed for fading and loss
+ */
+void channel_init(const channel_config_t* config, uint64_t seed)
+{
+    channel = *config;
+    random_state = seed ? seed : 1;
+}
+
+/**
+ * Get a uniformly distributed random number (xorshift64*)
+ *
+ * @return Value in [0, 1)
+ */
+double channel_uniform(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+
+    return (double)((random_state * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+/**
+ * Work out the signal strength a frame arrives at
+ *
+ * @param distance_m Distance between the radios in m
+ * @param tx_power   Transmit power in dBm
+ * @param fade       True to add shadow fading for this frame
+ * @return           Signal strength at the receiver in dBm
+ */
+int16_t channel_rssi(double distance_m, int8_t tx_power, bool fade)
+{
+    if (distance_m < 1.0)
+    {
+        distance_m = 1.0;
+    }
+
+    double rssi = tx_power - CHANNEL_LOSS_1M_DB -
+            10.0 * channel.exponent * log10(distance_m);
+
+    if (fade && channel.fade_db > 0.0)
+    {
+        // Box-Muller, one normal sample per frame is plenty
+        double u1 = 1.0 - channel_uniform();
+        double u2 = channel_uniform();
+        rssi += channel.fade_db * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+    }
+
+    return (int16_t)lround(rssi);
+}
+
+/**
+ * Decide whether a frame is lost to something other than signal strength
+ *
+ * @return True if the frame is lost
+ */
+bool channel_lost(void)
+{
+    return channel.loss > 0.0 && channel_uniform() < channel.loss;
+}
+
+/**
+ * Decide whether a frame survives another one overlapping it
+ *
+ * @param rssi            Signal strength of the wanted frame in dBm
+ * @param interferer_rssi Signal strength of the overlapping frame in dBm
+ * @return                True if the wanted frame is still received
+ */
+bool channel_captured(int16_t rssi, int16_t interferer_rssi)
+{
+    return rssi - interferer_rssi >= CHANNEL_CAPTURE_DB;
+}
@@ -0,0 +1,37 @@
+/**
+ * Radio channel model for the network simulator - header file
+ * Log-distance path loss with per-frame shadow fading, a random frame loss
+ * rate on top, and capture when frames overlap
+ */
+
+#ifndef SIM_CHANNEL_H_
+#define SIM_CHANNEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Path loss at 1m for 868MHz (free space)
+#define CHANNEL_LOSS_1M_DB 31.2
+
+// A frame survives an overlapping one this much weaker (co-channel rejection)
+#define CHANNEL_CAPTURE_DB 6
+
+/**
+ * Channel settings
+ */
+typedef struct
+{
+    double exponent; //!< Path loss exponent, 2 in free space
+    double fade_db;  //!< Standard deviation of per-frame shadow fading
+    double loss;     //!< Probability of losing a frame regardless of signal
+} channel_config_t;
+
+void channel_init(const channel_config_t* config, uint64_t seed);
+
+double channel_uniform(void);
+
+int16_t channel_rssi(double distance_m, int8_t tx_power, bool fade);
+bool channel_lost(void);
+bool channel_captured(int16_t rssi, int16_t interferer_rssi);
+
+#endif /* SIM_CHANNEL_H_ */
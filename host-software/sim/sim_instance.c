@@ -0,0 +1,172 @@
+/**
+ * Parts of a simulated firmware instance shared by the node and basestation
+ * builds: settings, counters, random numbers, a drifting local clock and the
+ * printf the firmware logs through
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Application-specific headers */
+#include "sim_instance.h"
+#include "host_env.h"
+#include "printf.h"
+
+// Longest line passed on to the log
+#define SIM_LOG_LINE 256
+
+sim_config_t sim_config;
+sim_stats_t sim_stats;
+
+// State of the random number generator
+static uint32_t random_state = 1;
+
+// Local clock is virtual time scaled by the drift plus this offset
+static int64_t clock_offset_us = 0;
+
+/* Functions used only in this file */
+static int64_t _sim_clock_scaled(uint64_t virtual_us);
+
+/**
+ * Take the settings for this instance, called before sim_instance_main()
+ *
+ * @param config Settings from the simulator
+ */
+void sim_instance_setup(const sim_config_t* config)
+{
+    sim_config = *config;
+    memset(&sim_stats, 0, sizeof(sim_stats));
+
+    random_state = config->seed ? config->seed : 1;
+    clock_offset_us = 0;
+}
+
+/**
+ * Get the counters this instance has kept, bringing them up to date first
+ *
+ * @return Pointer to the counters
+ */
+const sim_stats_t* sim_instance_stats(void)
+{
+    sim_instance_collect();
+
+    return &sim_stats;
+}
+
+/**
+ * Get a pseudo random number (xorshift32)
+ *
+ * @return Random value
+ */
+uint32_t sim_random(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+
+    return random_state;
+}
+
+/**
+ * Read the instance's own clock, which runs fast or slow by the drift set up
+ * for it
+ *
+ * @return Local time in us
+ */
+uint64_t sim_clock_local_us(void)
+{
+    return (uint64_t)(_sim_clock_scaled(host_now_us()) + clock_offset_us);
+}
+
+/**
+ * Set the instance's own clock
+ *
+ * @param local_us Local time it is now in us
+ */
+void sim_clock_set_local_us(uint64_t local_us)
+{
+    clock_offset_us = (int64_t)local_us - _sim_clock_scaled(host_now_us());
+}
+
+/**
+ * Work out the virtual time at which the local clock reaches a value
+ *
+ * @param local_us Local time in us
+ * @return         First virtual time at or after which it has been reached
+ */
+uint64_t sim_clock_virtual_us(uint64_t local_us)
+{
+    int64_t scaled = (int64_t)local_us - clock_offset_us;
+
+    if (scaled <= 0)
+    {
+        return 0;
+    }
+
+    uint64_t virtual_us = (uint64_t)(scaled * 1000000 /
+            (1000000 + sim_config.drift_ppm));
+
+    // Division rounds down, step forward until the clock has got there
+    while (_sim_clock_scaled(virtual_us) < scaled)
+    {
+        virtual_us++;
+    }
+
+    return virtual_us;
+}
+
+/**
+ * Nothing to configure, output always goes to the simulator
+ */
+void init_printf(void* putp, void (*putf) (void*, char))
+{
+    (void)putp;
+    (void)putf;
+}
+
+/**
+ * Format a message and pass it on to the simulator's log, if this instance's
+ * output is wanted
+ */
+void tfp_printf(char *fmt, ...)
+{
+    if (!sim_config.log)
+    {
+        return;
+    }
+
+    char line[SIM_LOG_LINE];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    sim_log(line);
+}
+
+/**
+ * Format a string into a buffer
+ */
+void tfp_sprintf(char* s, char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vsprintf(s, fmt, args);
+    va_end(args);
+}
+
+/**
+ * Scale virtual time by the clock drift
+ *
+ * @param virtual_us Virtual time in us
+ * @return           Time as counted by this instance's clock, before offset
+ */
+static int64_t _sim_clock_scaled(uint64_t virtual_us)
+{
+    return (int64_t)virtual_us + (int64_t)virtual_us * sim_config.drift_ppm / 1000000;
+}
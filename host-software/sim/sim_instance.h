@@ -0,0 +1,87 @@
+/**
+ * Interface between the network simulator and the firmware instances it
+ * loads - header file
+ * Every node and the basestation is built as a shared object with the
+ * unmodified protocol code, the radio driver and the radio model. The
+ * simulator loads a private copy per instance, so each has its own globals.
+ */
+
+#ifndef SIM_INSTANCE_H_
+#define SIM_INSTANCE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "host_env.h"
+
+// Number of radio addresses, stats are kept per source address
+#define SIM_ADDR_COUNT 256
+
+// Most commands the base can be given to send on
+#define SIM_MAX_COMMANDS 8
+
+/**
+ * A setting for the base to send to a node, see proto_queue_command()
+ */
+typedef struct
+{
+    uint8_t node;    //!< Node to send it to
+    uint8_t command; //!< One of the CMD_x settings
+    uint16_t value;  //!< What to set it to
+} sim_command_t;
+
+/**
+ * Settings handed to an instance before it starts
+ */
+typedef struct
+{
+    uint8_t address;        //!< Radio address of a node, the base uses its own
+    int32_t drift_ppm;      //!< Error of the real time clock in parts per million
+    uint32_t call_period_s; //!< Mean time between detected calls on a node
+    uint32_t seed;          //!< Seed for this instance's random events
+    bool log;               //!< Pass printf output on to the simulator
+    sim_command_t commands[SIM_MAX_COMMANDS]; //!< Settings the base sends on from the start
+    uint8_t command_count;  //!< Commands given
+    const uint8_t* image;   //!< Firmware image a node starts with, 0x0 for none
+    uint32_t image_length;  //!< Its length
+    const uint8_t* patch;   //!< Firmware patch on the base's SD card, 0x0 for none
+    uint32_t patch_length;  //!< Its length
+} sim_config_t;
+
+/**
+ * Counters an instance keeps for the simulator to report
+ */
+typedef struct
+{
+    uint32_t calls_detected;              //!< Calls a node put in its store
+    uint32_t calls_saved[SIM_ADDR_COUNT]; //!< Different calls the base wrote to SD, by node
+    uint32_t calls_copies[SIM_ADDR_COUNT];//!< Call records written, repeats included
+    uint64_t latency_s[SIM_ADDR_COUNT];   //!< Seconds from each call to its first save, summed
+    uint32_t records_saved;               //!< All records the base wrote to SD
+    uint64_t charge_nams;                 //!< Charge a node drew by its current model, in nA ms
+    uint64_t charge_ms;                   //!< Time the charge was drawn over
+    uint32_t battery_days;                //!< Battery life a node's average current gives
+    uint32_t firmware_crc;                //!< CRC-32 of the image a node runs
+    bool relay;                           //!< Node was told to relay for others
+} sim_stats_t;
+
+// Provided by each instance
+void sim_instance_setup(const sim_config_t* config);
+void sim_instance_main(void);
+const sim_stats_t* sim_instance_stats(void);
+void sim_instance_collect(void);
+
+// Provided by the simulator, along with the functions in host_env.h
+void sim_log(const char* text);
+
+// Shared by the instance builds
+extern sim_config_t sim_config;
+extern sim_stats_t sim_stats;
+
+uint32_t sim_random(void);
+
+uint64_t sim_clock_local_us(void);
+void sim_clock_set_local_us(uint64_t local_us);
+uint64_t sim_clock_virtual_us(uint64_t local_us);
+
+#endif /* SIM_INSTANCE_H_ */
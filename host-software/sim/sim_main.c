@@ -0,0 +1,1186 @@
+/**
+ * Discrete event simulator for a network of sensor nodes and a basestation
+ * Loads a private copy of the node firmware for every node and one of the
+ * basestation firmware, runs each as a coroutine on a shared virtual clock and
+ * passes frames between their radio models over a lossy channel. Instances
+ * only run when something is due, so days of network time take seconds.
+ */
+
+#define _GNU_SOURCE
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <ucontext.h>
+
+/* Application-specific headers */
+#include "sim_instance.h"
+#include "sim_channel.h"
+#include "host_env.h"
+#include "radio_shared_types.h"
+
+// Most instances, the basestation included
+#define SIM_MAX_INSTANCES 128
+
+// Stack for each instance's coroutine
+#define SIM_STACK_SIZE (256 * 1024)
+
+// Most frames on air or recent enough to overlap one that is
+#define SIM_AIR_MAX 64
+
+// Longest log line kept per instance
+#define SIM_LOG_LINE 256
+
+#define SIM_BASE_ADDR 0xFF
+#define SIM_BCAST_ADDR 0x00
+
+// Frequency step of RegFrf, 32MHz / 2^19
+#define SIM_FSTEP_HZ 61.03515625
+
+// Nodes are switched on at random over this long unless told otherwise
+#define SIM_START_SPREAD_S 60.0
+
+// Nodes are placed no closer to the base than this
+#define SIM_MIN_DISTANCE_M 10.0
+
+// How far an instance can run ahead of the others. Instances only affect each
+// other through frames, and no frame is shorter than this (ten bytes at the
+// fastest link profile take 1.4ms), so one sent by an instance that is behind
+// can't finish arriving before a receiver that is ahead has got to it
+#define SIM_LOOKAHEAD_US 1000
+
+/**
+ * What was seen on air for one node, the basestation's entry is unused. A
+ * relay's replies to the nodes registered through it count as the base's
+ */
+typedef struct
+{
+    uint32_t beacons;       //!< Beacon frames sent
+    uint32_t registrations; //!< BEACONACKs the node took
+    uint64_t registered_us; //!< When the node first took a BEACONACK, 0 if never
+    uint8_t parent;         //!< Base or relay it last registered with, 0 if none
+    uint32_t data_sent;     //!< Data frames sent, repeats included
+    uint32_t data_received; //!< Data frames the base took
+    uint32_t collided;      //!< Data or beacon frames lost to overlap at the base
+    uint32_t missed;        //!< Frames to the base lost otherwise
+    uint32_t sacks;         //!< Window ACKs the base sent
+    uint32_t acks_sent;     //!< ACKs the base sent
+    uint32_t acks_received; //!< ACKs the node took
+    int64_t rssi_sum;       //!< Sum of signal strengths of frames the base took
+    uint32_t frf_reg;       //!< RegFrf of the last data frame the base took
+} sim_link_stats_t;
+
+/**
+ * A loaded firmware instance
+ */
+typedef struct
+{
+    char name[8];
+    uint8_t address;
+    double x;
+    double y;
+    sim_config_t config;
+
+    void* handle;
+    void (*setup)(const sim_config_t*);
+    void (*main)(void);
+    const sim_stats_t* (*stats)(void);
+    bool (*air_receive)(const host_frame_t*);
+
+    ucontext_t context;
+    uint8_t* stack;
+    uint64_t now;
+    uint64_t wake;
+    bool started;
+    bool sleeping;
+
+    char log_line[SIM_LOG_LINE];
+    uint16_t log_length;
+
+    sim_link_stats_t link;
+} sim_instance_t;
+
+/**
+ * A frame on air
+ */
+typedef struct
+{
+    host_frame_t frame;
+    sim_instance_t* sender;
+    bool delivered;
+} sim_air_t;
+
+/**
+ * Command line settings
+ */
+typedef struct
+{
+    uint16_t nodes;
+    double days;
+    double radius_m;
+    int32_t drift_ppm;
+    uint32_t call_period_s;
+    double start_spread_s;
+    uint64_t seed;
+    const char* libdir;
+    channel_config_t channel;
+    bool log[SIM_ADDR_COUNT];
+    sim_command_t commands[SIM_MAX_COMMANDS];
+    uint8_t command_count;
+    uint8_t* image;
+    uint32_t image_length;
+    uint8_t* patch;
+    uint32_t patch_length;
+    uint8_t relays;
+} sim_options_t;
+
+static sim_instance_t instances[SIM_MAX_INSTANCES];
+static uint16_t instance_count = 0;
+
+static sim_air_t air[SIM_AIR_MAX];
+static uint16_t air_count = 0;
+
+// Virtual time of the event being handled. A running instance keeps its own
+// time, which may be ahead of this by up to the lookahead
+static uint64_t now_us = 0;
+
+// Instance running now, 0x0 while the scheduler is
+static sim_instance_t* current = 0x0;
+
+// Running instance can carry on without yielding until this time
+static uint64_t horizon = HOST_NEVER;
+
+static ucontext_t scheduler_context;
+
+/* Functions used only in this file */
+static bool _sim_options(int argc, char** argv, sim_options_t* options);
+static uint8_t* _sim_read_file(const char* path, uint32_t* length);
+static bool _sim_load(sim_instance_t* inst, const char* library);
+static void _sim_run(sim_instance_t* inst);
+static void _sim_entry(void);
+static void _sim_yield(void);
+static uint64_t _sim_air_next(void);
+static void _sim_air_deliver(void);
+static void _sim_air_purge(void);
+static bool _sim_air_collided(const sim_air_t* wanted, sim_instance_t* receiver,
+        int16_t rssi);
+static double _sim_distance(const sim_instance_t* a, const sim_instance_t* b);
+static sim_instance_t* _sim_find(uint8_t address);
+static void _sim_pick_relays(sim_options_t* options);
+static bool _sim_is_beacon(const host_frame_t* frame);
+static void _sim_report(const sim_options_t* options, double wall_s);
+
+/**
+ * Set up the network, run it for the time asked for and report
+ */
+int main(int argc, char** argv)
+{
+    sim_options_t options;
+
+    if (!_sim_options(argc, argv, &options))
+    {
+        return 1;
+    }
+
+    channel_init(&options.channel, options.seed);
+
+    char node_lib[256];
+    char base_lib[256];
+    snprintf(node_lib, sizeof(node_lib), "%s/sim_node.so", options.libdir);
+    snprintf(base_lib, sizeof(base_lib), "%s/sim_base.so", options.libdir);
+
+    // Basestation first, at the centre, switched on at the start
+    for (uint16_t i = 0; i <= options.nodes; i++)
+    {
+        sim_instance_t* inst = &instances[instance_count++];
+        bool base = (i == 0);
+
+        inst->address = base ? SIM_BASE_ADDR : (uint8_t)i;
+        snprintf(inst->name, sizeof(inst->name), base ? "base" : "n%d", i);
+
+        if (!_sim_load(inst, base ? base_lib : node_lib))
+        {
+            return 1;
+        }
+
+        if (!base)
+        {
+            // Spread evenly over the area of a ring around the base
+            double r_min2 = SIM_MIN_DISTANCE_M * SIM_MIN_DISTANCE_M;
+            double r = sqrt(r_min2 + channel_uniform() *
+                    (options.radius_m * options.radius_m - r_min2));
+            double angle = 2.0 * M_PI * channel_uniform();
+
+            inst->x = r * cos(angle);
+            inst->y = r * sin(angle);
+        }
+
+        inst->config.address = inst->address;
+        inst->config.drift_ppm = (int32_t)lround((2.0 * channel_uniform() - 1.0) *
+                options.drift_ppm);
+        inst->config.call_period_s = options.call_period_s;
+        inst->config.seed = (uint32_t)(options.seed * 7919 + i * 104729 + 1);
+        inst->config.log = options.log[inst->address];
+
+        if (base)
+        {
+            memcpy(inst->config.commands, options.commands, sizeof(options.commands));
+            inst->config.command_count = options.command_count;
+        }
+
+        // Nodes run the old image, the base has the patch from it
+        inst->config.image = options.image;
+        inst->config.image_length = options.image_length;
+        inst->config.patch = options.patch;
+        inst->config.patch_length = options.patch_length;
+
+        inst->wake = base ? 0 : (uint64_t)(channel_uniform() *
+                options.start_spread_s * 1000000.0);
+    }
+
+    // Relays are picked once every node is placed, the base tells them
+    _sim_pick_relays(&options);
+
+    for (uint16_t i = 0; i < instance_count; i++)
+    {
+        instances[i].setup(&instances[i].config);
+    }
+
+    uint64_t end_us = (uint64_t)(options.days * 86400.0 * 1000000.0);
+
+    struct timespec wall_start;
+    struct timespec wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    // Run whatever is due first, instance or frame arrival, until time is up
+    while (true)
+    {
+        sim_instance_t* next = 0x0;
+        uint64_t next_time = HOST_NEVER;
+
+        for (uint16_t i = 0; i < instance_count; i++)
+        {
+            if (instances[i].wake < next_time)
+            {
+                next_time = instances[i].wake;
+                next = &instances[i];
+            }
+        }
+
+        uint64_t air_time = _sim_air_next();
+
+        if (air_time <= next_time)
+        {
+            if (air_time > end_us)
+            {
+                break;
+            }
+
+            now_us = air_time > now_us ? air_time : now_us;
+            _sim_air_deliver();
+            continue;
+        }
+
+        if (next_time > end_us)
+        {
+            break;
+        }
+
+        now_us = next_time > now_us ? next_time : now_us;
+        _sim_run(next);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+
+    double wall_s = (double)(wall_end.tv_sec - wall_start.tv_sec) +
+            (double)(wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+
+    now_us = end_us;
+    _sim_report(&options, wall_s);
+
+    return 0;
+}
+
+/**
+ * Get the virtual time, as the running instance sees it
+ *
+ * @return Time in us
+ */
+uint64_t host_now_us(void)
+{
+    return current ? current->now : now_us;
+}
+
+/**
+ * Move virtual time on while the running instance is busy, letting anything
+ * due in the meantime happen first
+ *
+ * @param us Time spent in us
+ */
+void host_spend_us(uint32_t us)
+{
+    uint64_t target = current->now + us;
+
+    if (target < horizon)
+    {
+        current->now = target;
+        return;
+    }
+
+    current->wake = target;
+    _sim_yield();
+}
+
+/**
+ * Sleep the running instance until the given time, a frame arriving for it
+ * may wake it sooner
+ *
+ * @param time_us Virtual time to wake at, HOST_NEVER to wait for a frame
+ */
+void host_sleep_until(uint64_t time_us)
+{
+    current->wake = time_us > current->now ? time_us : current->now;
+    current->sleeping = true;
+
+    _sim_yield();
+
+    current->sleeping = false;
+}
+
+/**
+ * Put a frame from the running instance on air, it reaches the others when
+ * its last bit has been sent
+ *
+ * @param frame Frame as it was sent
+ */
+void host_air_transmit(const host_frame_t* frame)
+{
+    _sim_air_purge();
+
+    if (air_count == SIM_AIR_MAX || frame->size < 4)
+    {
+        return;
+    }
+
+    sim_air_t* entry = &air[air_count++];
+    entry->frame = *frame;
+    entry->sender = current;
+    entry->delivered = false;
+
+    if (frame->end_us < horizon)
+    {
+        horizon = frame->end_us;
+    }
+
+    // Note what kind of frame went out, frames are [length],[dest],[source],[payload]
+    const uint8_t* data = frame->data;
+    sim_instance_t* dest = _sim_find(data[1]);
+
+    // A node only sends to another node, other than in a beacon, to reply as
+    // a relay. Relays' broadcasts aren't counted
+    bool reply = current->address == SIM_BASE_ADDR || (!_sim_is_beacon(frame) &&
+            dest && dest->address != SIM_BASE_ADDR &&
+            current->link.parent != dest->address);
+
+    if (data[1] == SIM_BCAST_ADDR)
+    {
+        return;
+    }
+
+    if (!reply)
+    {
+        if (_sim_is_beacon(frame))
+        {
+            current->link.beacons++;
+        }
+        else
+        {
+            current->link.data_sent++;
+        }
+    }
+    else if (dest)
+    {
+        if (data[3] == PKT_SACK)
+        {
+            dest->link.sacks++;
+        }
+        else if (data[3] == PKT_ACK)
+        {
+            dest->link.acks_sent++;
+        }
+    }
+}
+
+/**
+ * Pass a line of firmware output on, prefixed with the time and instance
+ *
+ * @param text Text printed, possibly part of a line
+ */
+void sim_log(const char* text)
+{
+    sim_instance_t* inst = current;
+
+    if (!inst)
+    {
+        return;
+    }
+
+    for (; *text; text++)
+    {
+        if (*text == '\r')
+        {
+            continue;
+        }
+
+        if (*text != '\n' && inst->log_length < SIM_LOG_LINE - 1)
+        {
+            inst->log_line[inst->log_length++] = *text;
+            continue;
+        }
+
+        if (*text == '\n')
+        {
+            inst->log_line[inst->log_length] = 0;
+            printf("%12.6f %-5s %s\n", inst->now / 1e6, inst->name, inst->log_line);
+            inst->log_length = 0;
+        }
+    }
+}
+
+/**
+ * Read the command line
+ *
+ * @param argc    Argument count
+ * @param argv    Arguments
+ * @param options Settings to fill in
+ * @return        False if the command line was wrong
+ */
+static bool _sim_options(int argc, char** argv, sim_options_t* options)
+{
+    memset(options, 0, sizeof(*options));
+
+    options->nodes = 20;
+    options->days = 1.0;
+    options->radius_m = 300.0;
+    options->drift_ppm = 50;
+    options->call_period_s = 600;
+    options->start_spread_s = SIM_START_SPREAD_S;
+    options->seed = 1;
+    options->libdir = "build";
+    options->channel.exponent = 3.0;
+    options->channel.fade_db = 4.0;
+    options->channel.loss = 0.0;
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:r:D:c:p:s:l:e:f:v:C:L:U:R:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                options->nodes = (uint16_t)atoi(optarg);
+                break;
+            case 'd':
+                options->days = atof(optarg);
+                break;
+            case 'r':
+                options->radius_m = atof(optarg);
+                break;
+            case 'D':
+                options->drift_ppm = atoi(optarg);
+                break;
+            case 'c':
+                options->call_period_s = (uint32_t)atoi(optarg);
+                break;
+            case 'p':
+                options->start_spread_s = atof(optarg);
+                break;
+            case 's':
+                options->seed = (uint64_t)atoll(optarg);
+                break;
+            case 'l':
+                options->channel.loss = atof(optarg);
+                break;
+            case 'e':
+                options->channel.exponent = atof(optarg);
+                break;
+            case 'f':
+                options->channel.fade_db = atof(optarg);
+                break;
+            case 'v':
+                options->log[atoi(optarg) & 0xFF] = true;
+                break;
+            case 'C':
+            {
+                unsigned int node;
+                unsigned int command;
+                int value;
+
+                if (options->command_count >= SIM_MAX_COMMANDS ||
+                        sscanf(optarg, "%u:%u:%d", &node, &command, &value) != 3)
+                {
+                    printf("Up to %d commands as node:command:value please\n",
+                            SIM_MAX_COMMANDS);
+                    return false;
+                }
+
+                sim_command_t* queued = &options->commands[options->command_count++];
+                queued->node = (uint8_t)node;
+                queued->command = (uint8_t)command;
+                queued->value = (uint16_t)value;
+                break;
+            }
+            case 'L':
+                options->libdir = optarg;
+                break;
+            case 'R':
+                options->relays = (uint8_t)atoi(optarg);
+                break;
+            case 'U':
+            {
+                char* split = strchr(optarg, ':');
+
+                if (!split)
+                {
+                    printf("Firmware update as old.bin:patch.bin please\n");
+                    return false;
+                }
+
+                *split = '\0';
+                options->image = _sim_read_file(optarg, &options->image_length);
+                options->patch = _sim_read_file(split + 1, &options->patch_length);
+
+                if (!options->image || !options->patch ||
+                        options->patch_length < sizeof(radio_patch_header_t))
+                {
+                    return false;
+                }
+
+                break;
+            }
+            default:
+                printf("Usage: %s [-n nodes] [-d days] [-r radius m] [-D drift ppm]\n"
+                        "       [-c mean s between calls] [-p s to switch nodes on over]\n"
+                        "       [-s seed] [-l frame loss 0-1]\n"
+                        "       [-e path loss exponent] [-f fading dB]\n"
+                        "       [-v address to log, 255 for base] [-L library dir]\n"
+                        "       [-C node:command:value for the base to send]\n"
+                        "       [-U old.bin:patch.bin, nodes run old.bin and the base"
+                        " sends them the patch]\n"
+                        "       [-R relays, the base tells that many nodes half way out"
+                        " to relay]\n",
+                        argv[0]);
+                return false;
+        }
+    }
+
+    if (options->nodes < 1 || options->nodes >= SIM_MAX_INSTANCES ||
+            options->nodes >= SIM_BASE_ADDR)
+    {
+        printf("Between 1 and %d nodes please\n", SIM_MAX_INSTANCES - 1);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Read a whole file
+ *
+ * @param path   File to read
+ * @param length Set to its length
+ * @return       Its contents, or 0x0 if it couldn't be read
+ */
+static uint8_t* _sim_read_file(const char* path, uint32_t* length)
+{
+    FILE* file = fopen(path, "rb");
+    uint8_t* data = 0x0;
+    long size = -1;
+
+    if (file && fseek(file, 0, SEEK_END) == 0)
+    {
+        size = ftell(file);
+        rewind(file);
+    }
+
+    if (size > 0)
+    {
+        data = malloc((size_t)size);
+
+        if (data && fread(data, 1, (size_t)size, file) != (size_t)size)
+        {
+            free(data);
+            data = 0x0;
+        }
+    }
+
+    if (file)
+    {
+        fclose(file);
+    }
+
+    if (!data)
+    {
+        printf("Couldn't read %s\n", path);
+        return 0x0;
+    }
+
+    *length = (uint32_t)size;
+
+    return data;
+}
+
+/**
+ * Load a private copy of an instance library. The file is copied first, as
+ * loading the same path twice would share one set of globals.
+ *
+ * @param inst    Instance to load into
+ * @param library Path of the shared object
+ * @return        True if it loaded and has everything needed
+ */
+static bool _sim_load(sim_instance_t* inst, const char* library)
+{
+    char path[] = "/tmp/sim-instance-XXXXXX";
+    int fd = mkstemp(path);
+    FILE* in = fopen(library, "rb");
+
+    if (fd < 0 || !in)
+    {
+        printf("Can't load %s\n", library);
+        return false;
+    }
+
+    char buffer[65536];
+    size_t count;
+
+    while ((count = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    {
+        if (write(fd, buffer, count) != (ssize_t)count)
+        {
+            break;
+        }
+    }
+
+    fclose(in);
+    close(fd);
+
+    inst->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    unlink(path);
+
+    if (!inst->handle)
+    {
+        printf("Can't load %s: %s\n", library, dlerror());
+        return false;
+    }
+
+    inst->setup = (void (*)(const sim_config_t*))dlsym(inst->handle, "sim_instance_setup");
+    inst->main = (void (*)(void))dlsym(inst->handle, "sim_instance_main");
+    inst->stats = (const sim_stats_t* (*)(void))dlsym(inst->handle, "sim_instance_stats");
+    inst->air_receive = (bool (*)(const host_frame_t*))dlsym(inst->handle, "rfm69_air_receive");
+
+    if (!inst->setup || !inst->main || !inst->stats || !inst->air_receive)
+    {
+        printf("%s is missing simulator functions\n", library);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Switch to an instance and let it run until it sleeps or needs time to pass
+ * beyond the next thing due elsewhere
+ *
+ * @param inst Instance to run
+ */
+static void _sim_run(sim_instance_t* inst)
+{
+    current = inst;
+
+    // Nothing can reach this instance before the next frame arrival, or a
+    // frame from another instance sent once it wakes
+    horizon = _sim_air_next();
+
+    for (uint16_t i = 0; i < instance_count; i++)
+    {
+        if (&instances[i] != inst && instances[i].wake < HOST_NEVER &&
+                instances[i].wake + SIM_LOOKAHEAD_US < horizon)
+        {
+            horizon = instances[i].wake + SIM_LOOKAHEAD_US;
+        }
+    }
+
+    if (inst->wake > inst->now)
+    {
+        inst->now = inst->wake;
+    }
+
+    inst->wake = HOST_NEVER;
+
+    if (!inst->started)
+    {
+        inst->started = true;
+        inst->stack = malloc(SIM_STACK_SIZE);
+
+        getcontext(&inst->context);
+        inst->context.uc_stack.ss_sp = inst->stack;
+        inst->context.uc_stack.ss_size = SIM_STACK_SIZE;
+        inst->context.uc_link = &scheduler_context;
+        makecontext(&inst->context, _sim_entry, 0);
+    }
+
+    swapcontext(&scheduler_context, &inst->context);
+
+    current = 0x0;
+}
+
+/**
+ * Coroutine entry point, runs the instance's main loop
+ */
+static void _sim_entry(void)
+{
+    current->main();
+
+    // Main loops never return, but if one does the instance is finished
+    current->wake = HOST_NEVER;
+}
+
+/**
+ * Hand control back to the scheduler from the running instance
+ */
+static void _sim_yield(void)
+{
+    swapcontext(&current->context, &scheduler_context);
+}
+
+/**
+ * Find when the next frame finishes arriving
+ *
+ * @return Virtual time in us, HOST_NEVER if nothing is on air
+ */
+static uint64_t _sim_air_next(void)
+{
+    uint64_t next = HOST_NEVER;
+
+    for (uint16_t i = 0; i < air_count; i++)
+    {
+        if (!air[i].delivered && air[i].frame.end_us < next)
+        {
+            next = air[i].frame.end_us;
+        }
+    }
+
+    return next;
+}
+
+/**
+ * Hand the frame finishing now to every other instance that is switched on,
+ * each sees it at its own signal strength
+ */
+static void _sim_air_deliver(void)
+{
+    sim_air_t* entry = 0x0;
+
+    for (uint16_t i = 0; i < air_count; i++)
+    {
+        if (!air[i].delivered && (!entry || air[i].frame.end_us < entry->frame.end_us))
+        {
+            entry = &air[i];
+        }
+    }
+
+    if (!entry)
+    {
+        return;
+    }
+
+    entry->delivered = true;
+
+    sim_instance_t* sender = entry->sender;
+    uint8_t dest = entry->frame.data[1];
+
+    for (uint16_t i = 0; i < instance_count; i++)
+    {
+        sim_instance_t* receiver = &instances[i];
+
+        if (receiver == sender || !receiver->started)
+        {
+            continue;
+        }
+
+        int16_t rssi = channel_rssi(_sim_distance(sender, receiver),
+                entry->frame.tx_power, true);
+        bool collided = _sim_air_collided(entry, receiver, rssi);
+        bool accepted = false;
+
+        if (!collided && !channel_lost())
+        {
+            host_frame_t frame = entry->frame;
+            frame.rssi = rssi;
+
+            // Lookahead guarantees the receiver hasn't gone past the frame
+            if (receiver->now < now_us)
+            {
+                receiver->now = now_us;
+            }
+
+            current = receiver;
+            accepted = receiver->air_receive(&frame);
+            current = 0x0;
+
+            // Frame interrupts wake a sleeping instance
+            if (accepted && receiver->sleeping)
+            {
+                receiver->wake = now_us;
+            }
+        }
+
+        // Keep count of what happened to frames between nodes and the base,
+        // or the relay a node registered through
+        if (receiver->address == SIM_BASE_ADDR && dest == SIM_BASE_ADDR)
+        {
+            if (accepted)
+            {
+                if (!_sim_is_beacon(&entry->frame))
+                {
+                    sender->link.data_received++;
+                    sender->link.rssi_sum += rssi;
+                    sender->link.frf_reg = entry->frame.frf_reg;
+                }
+            }
+            else if (collided)
+            {
+                sender->link.collided++;
+            }
+            else
+            {
+                sender->link.missed++;
+            }
+        }
+        else if (receiver->address != SIM_BASE_ADDR && dest == receiver->address &&
+                accepted && !_sim_is_beacon(&entry->frame) &&
+                sender->link.parent != receiver->address)
+        {
+            if (entry->frame.data[3] == PKT_BEACONACK)
+            {
+                receiver->link.registrations++;
+                receiver->link.parent = sender->address;
+
+                if (!receiver->link.registered_us)
+                {
+                    receiver->link.registered_us = entry->frame.end_us;
+                }
+            }
+            else if (entry->frame.data[3] == PKT_ACK)
+            {
+                receiver->link.acks_received++;
+            }
+        }
+    }
+
+    _sim_air_purge();
+}
+
+/**
+ * Drop delivered frames that can no longer overlap anything still to arrive
+ */
+static void _sim_air_purge(void)
+{
+    uint64_t oldest = now_us;
+
+    for (uint16_t i = 0; i < air_count; i++)
+    {
+        if (!air[i].delivered && air[i].frame.start_us < oldest)
+        {
+            oldest = air[i].frame.start_us;
+        }
+    }
+
+    uint16_t kept = 0;
+
+    for (uint16_t i = 0; i < air_count; i++)
+    {
+        if (!air[i].delivered || air[i].frame.end_us > oldest)
+        {
+            air[kept++] = air[i];
+        }
+    }
+
+    air_count = kept;
+}
+
+/**
+ * Check whether another frame overlapping the wanted one was too strong at a
+ * receiver for the wanted one to be captured
+ *
+ * @param wanted   Frame being received
+ * @param receiver Instance receiving it
+ * @param rssi     Signal strength of the wanted frame in dBm
+ * @return         True if the frame was lost to the overlap
+ */
+static bool _sim_air_collided(const sim_air_t* wanted, sim_instance_t* receiver,
+        int16_t rssi)
+{
+    for (uint16_t i = 0; i < air_count; i++)
+    {
+        const sim_air_t* other = &air[i];
+
+        if (other == wanted || other->sender == receiver ||
+                other->frame.frf_reg != wanted->frame.frf_reg ||
+                other->frame.start_us >= wanted->frame.end_us ||
+                other->frame.end_us <= wanted->frame.start_us)
+        {
+            continue;
+        }
+
+        int16_t other_rssi = channel_rssi(_sim_distance(other->sender, receiver),
+                other->frame.tx_power, false);
+
+        if (!channel_captured(rssi, other_rssi))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Distance between two instances
+ *
+ * @return Distance in m
+ */
+static double _sim_distance(const sim_instance_t* a, const sim_instance_t* b)
+{
+    return hypot(a->x - b->x, a->y - b->y);
+}
+
+/**
+ * Look up an instance by radio address
+ *
+ * @param address Radio address
+ * @return        Instance, 0x0 if there is none
+ */
+static sim_instance_t* _sim_find(uint8_t address)
+{
+    for (uint16_t i = 0; i < instance_count; i++)
+    {
+        if (instances[i].address == address)
+        {
+            return &instances[i];
+        }
+    }
+
+    return 0x0;
+}
+
+/**
+ * Pick nodes to relay for those out of the base's range, one in each of the
+ * given number of equal sectors around the base, the one nearest half the
+ * radius out. The base sends each of them CMD_RELAY as it first uploads
+ *
+ * @param options Settings the run uses, relays to pick
+ */
+static void _sim_pick_relays(sim_options_t* options)
+{
+    sim_instance_t* base = &instances[0];
+
+    for (uint8_t sector = 0; sector < options->relays; sector++)
+    {
+        sim_instance_t* relay = 0x0;
+        double best = 0.0;
+
+        for (uint16_t i = 1; i < instance_count; i++)
+        {
+            sim_instance_t* inst = &instances[i];
+            double angle = atan2(inst->y, inst->x) + M_PI;
+            double off = fabs(_sim_distance(inst, base) - options->radius_m / 2.0);
+
+            if ((uint8_t)(angle * options->relays / (2.0 * M_PI)) % options->relays == sector &&
+                    (!relay || off < best))
+            {
+                relay = inst;
+                best = off;
+            }
+        }
+
+        if (!relay)
+        {
+            continue;
+        }
+
+        if (base->config.command_count >= SIM_MAX_COMMANDS)
+        {
+            printf("No room to tell more than %d nodes to relay\n", sector);
+            return;
+        }
+
+        sim_command_t* command = &base->config.commands[base->config.command_count++];
+        command->node = relay->address;
+        command->command = CMD_RELAY;
+        command->value = 1;
+    }
+}
+
+/**
+ * Check whether a node's frame is a beacon
+ *
+ * @param frame Frame sent by a node
+ * @return      True for a beacon, [1],[1],[PKT_BEACON] after the header
+ */
+static bool _sim_is_beacon(const host_frame_t* frame)
+{
+    return frame->data[0] == 5 && frame->data[5] == PKT_BEACON;
+}
+
+/**
+ * Print what happened to every node over the run
+ *
+ * @param options Settings the run used
+ * @param wall_s  Real time the run took in s
+ */
+static void _sim_report(const sim_options_t* options, double wall_s)
+{
+    const sim_stats_t* base = instances[0].stats();
+    double sim_s = now_us / 1e6;
+
+    printf("\nSimulated %.2f days, %d nodes, in %.2f s (%.0fx real time)\n",
+            options->days, options->nodes, wall_s, wall_s > 0 ? sim_s / wall_s : 0.0);
+    printf("Frame loss %.3f, path loss exponent %.1f, fading %.1f dB, drift +/-%d ppm\n\n",
+            options->channel.loss, options->channel.exponent,
+            options->channel.fade_db, options->drift_ppm);
+
+    printf("node  dist  drift  rssi beacons regs   frames  rx_ok collided missed"
+            "   sacks   acks acks_rx  calls  saved saved%%  copies   avg_uA  days"
+            "  lat_s    MHz  via\n");
+
+    uint64_t total_calls = 0;
+    uint64_t total_saved = 0;
+    uint64_t total_copies = 0;
+    double total_ua = 0;
+    uint32_t shortest_days = UINT32_MAX;
+    uint16_t registered = 0;
+    uint64_t last_registered_us = 0;
+    uint16_t updated = 0;
+    radio_patch_header_t patch;
+
+    // Relays, the nodes registered through them and the rest, compared
+    uint16_t relay_count = 0;
+    double relay_ua = 0;
+    double other_ua = 0;
+    uint64_t calls[2] = {0};
+    uint64_t saved[2] = {0};
+    uint64_t latency_s[2] = {0};
+
+    memset(&patch, 0, sizeof(patch));
+
+    if (options->patch)
+    {
+        memcpy(&patch, options->patch, sizeof(patch));
+    }
+
+    for (uint16_t i = 1; i < instance_count; i++)
+    {
+        sim_instance_t* inst = &instances[i];
+        sim_link_stats_t* link = &inst->link;
+        const sim_stats_t* stats = inst->stats();
+        uint32_t node_calls = stats->calls_detected;
+        uint32_t node_saved = base->calls_saved[inst->address];
+        uint32_t copies = base->calls_copies[inst->address];
+        uint64_t node_latency_s = base->latency_s[inst->address];
+        sim_instance_t* parent = _sim_find(link->parent);
+        bool relayed = parent && parent->address != SIM_BASE_ADDR;
+
+        total_calls += node_calls;
+        total_saved += node_saved;
+        total_copies += copies;
+
+        calls[relayed] += node_calls;
+        saved[relayed] += node_saved;
+        latency_s[relayed] += node_latency_s;
+
+        double average_ua = stats->charge_ms ? stats->charge_nams / 1000.0 / stats->charge_ms : 0.0;
+        total_ua += average_ua;
+
+        if (stats->relay)
+        {
+            relay_count++;
+            relay_ua += average_ua;
+        }
+        else
+        {
+            other_ua += average_ua;
+        }
+
+        if (stats->battery_days < shortest_days)
+        {
+            shortest_days = stats->battery_days;
+        }
+
+        if (options->patch && stats->firmware_crc == patch.new_crc)
+        {
+            updated++;
+        }
+
+        if (link->registered_us)
+        {
+            registered++;
+
+            if (link->registered_us > last_registered_us)
+            {
+                last_registered_us = link->registered_us;
+            }
+        }
+
+        printf("%-4s %5.0f %6d %5.0f %7u %4u %8u %6u %8u %6u %7u %6u %7u %6u %6u %5.1f %7u %8.2f %5u %6.0f %6.1f  %s%s\n",
+                inst->name, _sim_distance(inst, &instances[0]),
+                inst->config.drift_ppm,
+                link->data_received ? (double)link->rssi_sum / link->data_received : 0.0,
+                link->beacons, link->registrations, link->data_sent,
+                link->data_received, link->collided, link->missed, link->sacks,
+                link->acks_sent, link->acks_received, node_calls, node_saved,
+                node_calls ? 100.0 * node_saved / node_calls : 0.0, copies, average_ua,
+                stats->battery_days,
+                node_saved ? (double)node_latency_s / node_saved : 0.0,
+                link->frf_reg * SIM_FSTEP_HZ / 1e6,
+                parent ? parent->name : "-", stats->relay ? " relay" : "");
+    }
+
+    printf("\nCalls detected %llu, saved at base %llu (%.1f%%) in %llu copies,"
+            " records saved %u\n",
+            (unsigned long long)total_calls, (unsigned long long)total_saved,
+            total_calls ? 100.0 * total_saved / total_calls : 0.0,
+            (unsigned long long)total_copies, base->records_saved);
+    printf("Nodes draw %.2f uA on average, shortest battery life %u days\n",
+            instance_count > 1 ? total_ua / (instance_count - 1) : 0.0,
+            instance_count > 1 ? shortest_days : 0);
+    printf("%u of %u nodes registered, the last %.1f s after the start\n",
+            registered, instance_count - 1, last_registered_us / 1e6);
+
+    if (relay_count)
+    {
+        printf("Relays draw %.2f uA on average, other nodes %.2f uA\n",
+                relay_ua / relay_count, instance_count - 1 > relay_count ?
+                other_ua / (instance_count - 1 - relay_count) : 0.0);
+
+        for (uint8_t relayed = 0; relayed < 2; relayed++)
+        {
+            printf("Nodes registered %s saved %.1f%% of calls, %.0f s after the call"
+                    " on average\n", relayed ? "through a relay" : "with the base",
+                    calls[relayed] ? 100.0 * saved[relayed] / calls[relayed] : 0.0,
+                    saved[relayed] ? (double)latency_s[relayed] / saved[relayed] : 0.0);
+        }
+    }
+
+    if (options->patch)
+    {
+        printf("Firmware updated on %u of %u nodes\n", updated, instance_count - 1);
+    }
+}
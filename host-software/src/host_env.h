@@ -0,0 +1,45 @@
+/**
+ * Environment the host build of the firmware runs in - header file
+ * The firmware side (radio model, delays, sleep) only talks to the outside
+ * world through these functions. A standalone program provides them for a
+ * single instance, the network simulator provides them for many.
+ */
+
+#ifndef HOST_ENV_H_
+#define HOST_ENV_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Time value meaning "no event pending"
+#define HOST_NEVER UINT64_MAX
+
+// Largest frame on air: length byte, 255 bytes and a two byte CRC
+#define HOST_FRAME_MAX 258
+
+/**
+ * A frame as it goes over the air, timestamps are in virtual microseconds
+ */
+typedef struct
+{
+    uint8_t data[HOST_FRAME_MAX]; //!< Length byte, payload then CRC (MSB first)
+    uint16_t size;                //!< Bytes used in data
+    uint64_t start_us;            //!< Preamble starts
+    uint64_t sync_us;             //!< Sync word has been sent
+    uint64_t end_us;              //!< Last CRC bit has been sent
+    uint16_t bitrate_reg;         //!< RegBitrate of the sender
+    uint16_t fdev_reg;            //!< RegFdev of the sender
+    uint32_t frf_reg;             //!< RegFrf of the sender
+    uint8_t sync[8];              //!< Sync word of the sender
+    uint8_t sync_len;             //!< Sync word length, 0 if off
+    int8_t tx_power;              //!< Output power in dBm
+    int16_t rssi;                 //!< Signal strength at the receiver in dBm
+} host_frame_t;
+
+uint64_t host_now_us(void);
+uint64_t host_clock_us(void);
+void host_spend_us(uint32_t us);
+void host_sleep_until(uint64_t time_us);
+void host_air_transmit(const host_frame_t* frame);
+
+#endif /* HOST_ENV_H_ */
@@ -0,0 +1,124 @@
+/**
+ * Delay timer for host builds
+ * Same interface as the firmware delay timers, running on virtual time
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Application-specific headers */
+#include "host_misc.h"
+#include "host_env.h"
+#include "power_management.h"
+
+// Virtual time the running delay and timeout expire, HOST_NEVER when not
+// running
+static uint64_t delay_end = HOST_NEVER;
+static uint64_t timeout_end = HOST_NEVER;
+
+/* Functions used only in this file */
+static uint64_t _misc_delay_next(void);
+static void _misc_delay_service(uint64_t now);
+
+/**
+ * Register the delay timer as a wake up source
+ */
+void misc_delay_init(void)
+{
+    power_add_wakeup(_misc_delay_next, _misc_delay_service);
+}
+
+/**
+ * Start a delay, optionally blocking until it expires
+ *
+ * @param ms       Time in ms to delay for
+ * @param block    Block execution in sleep mode if set to true
+ */
+void misc_delay(uint32_t ms, bool block)
+{
+    delay_end = host_now_us() + (uint64_t)ms * 1000;
+
+    // Wait for timeout
+    if (block)
+    {
+        while (misc_delay_active())
+        {
+            power_sleep();
+        }
+    }
+}
+
+/**
+ * Check if a delay is currently active (useful in non-blocking mode)
+ * @return True if a delay is active
+ */
+bool misc_delay_active(void)
+{
+    return (delay_end != HOST_NEVER);
+}
+
+/**
+ * Stop a running delay early
+ */
+void misc_delay_cancel(void)
+{
+    delay_end = HOST_NEVER;
+}
+
+/**
+ * Start a timeout, which runs alongside misc_delay() so neither cuts the
+ * other short
+ *
+ * @param ms Time in ms until it runs out
+ */
+void misc_timeout(uint32_t ms)
+{
+    timeout_end = host_now_us() + (uint64_t)ms * 1000;
+}
+
+/**
+ * Check if a timeout is still running
+ * @return True if it hasn't run out or been cancelled
+ */
+bool misc_timeout_active(void)
+{
+    return (timeout_end != HOST_NEVER);
+}
+
+/**
+ * Stop a running timeout early
+ */
+void misc_timeout_cancel(void)
+{
+    timeout_end = HOST_NEVER;
+}
+
+/**
+ * Report when the running delay or timeout expires, whichever is first
+ *
+ * @return Virtual time in us, or HOST_NEVER
+ */
+static uint64_t _misc_delay_next(void)
+{
+    return (delay_end < timeout_end) ? delay_end : timeout_end;
+}
+
+/**
+ * Expire the delay and timeout once their time has come, standing in for the
+ * timer interrupt
+ *
+ * @param now Virtual time in us
+ */
+static void _misc_delay_service(uint64_t now)
+{
+    if (delay_end != HOST_NEVER && now >= delay_end)
+    {
+        delay_end = HOST_NEVER;
+    }
+
+    if (timeout_end != HOST_NEVER && now >= timeout_end)
+    {
+        timeout_end = HOST_NEVER;
+    }
+}
@@ -0,0 +1,20 @@
+/**
+ * Delay timer for host builds - header file
+ * Same interface as the firmware delay timers, running on virtual time
+ */
+
+#ifndef HOST_MISC_H_
+#define HOST_MISC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+void misc_delay(uint32_t ms, bool block);
+bool misc_delay_active(void);
+void misc_delay_init(void);
+void misc_delay_cancel(void);
+void misc_timeout(uint32_t ms);
+bool misc_timeout_active(void);
+void misc_timeout_cancel(void);
+
+#endif /* HOST_MISC_H_ */
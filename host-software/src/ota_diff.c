@@ -0,0 +1,366 @@
+/**
+ * Makes the firmware patch the basestation sends out to update the nodes,
+ * from the image they run now and the new one. The patch is a forward patch
+ * then a reverse one for rolling back, in the format radio_shared_types.h
+ * gives. Each is made both ways round, pages first to last and last to first,
+ * and the shorter kept.
+ *
+ *     ota_diff old.bin new.bin SBC-WSN-PATCH.BIN
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Application-specific headers */
+#include "radio_shared_types.h"
+
+// Largest image a node has room for
+#define DIFF_IMAGE_MAX (64 * 1024)
+
+// Shortest copy worth making, an add of the same bytes costs no more
+#define DIFF_MATCH_MIN 4
+
+// Earlier places with the same bytes looked at for each copy
+#define DIFF_CHAIN_MAX 512
+
+#define DIFF_HASH_LEN 65536
+
+/**
+ * A patch being made
+ */
+typedef struct
+{
+    radio_patch_header_t header;
+    uint8_t ops[DIFF_IMAGE_MAX + DIFF_IMAGE_MAX / RADIO_PATCH_OP_MAX + 1];
+} diff_patch_t;
+
+/* Functions used only in this file */
+static uint32_t _diff_crc32(const uint8_t* data, uint32_t length);
+static uint32_t _diff_read(const char* path, uint8_t* data);
+static void _diff_make(const uint8_t* old, uint32_t old_length, const uint8_t* new,
+        uint32_t new_length, uint32_t flags, diff_patch_t* patch);
+static uint32_t _diff_match(const uint8_t* old, uint32_t old_length, const uint8_t* new,
+        uint32_t at, uint32_t end, uint32_t flags, const int32_t* head,
+        const int32_t* chain, uint32_t* source);
+static void _diff_add(diff_patch_t* patch, const uint8_t* data, uint32_t length);
+static void _diff_best(const uint8_t* old, uint32_t old_length, const uint8_t* new,
+        uint32_t new_length, diff_patch_t* patch);
+
+/**
+ * Make the patch
+ *
+ * @param argc Number of arguments
+ * @param argv Old image, new image and the patch file to write
+ * @return     0 on success
+ */
+int main(int argc, char** argv)
+{
+    static uint8_t old[DIFF_IMAGE_MAX];
+    static uint8_t new[DIFF_IMAGE_MAX];
+    static diff_patch_t forward;
+    static diff_patch_t reverse;
+
+    if (argc != 4)
+    {
+        fprintf(stderr, "Usage: %s old.bin new.bin patch.bin\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t old_length = _diff_read(argv[1], old);
+    uint32_t new_length = _diff_read(argv[2], new);
+
+    if (!old_length || !new_length)
+    {
+        return 1;
+    }
+
+    _diff_best(old, old_length, new, new_length, &forward);
+    _diff_best(new, new_length, old, old_length, &reverse);
+
+    // The reverse patch starts on a whole word
+    uint32_t padding = (4 - forward.header.length % 4) % 4;
+    uint32_t total = 2 * sizeof(radio_patch_header_t) + forward.header.length +
+            padding + reverse.header.length;
+
+    printf("Forward patch %u bytes%s, reverse %u bytes%s, %u chunks in all\n",
+            forward.header.length,
+            (forward.header.flags & RADIO_PATCH_DESCENDING) ? " last page first" : "",
+            reverse.header.length,
+            (reverse.header.flags & RADIO_PATCH_DESCENDING) ? " last page first" : "",
+            (total + RADIO_PATCH_CHUNK_LEN - 1) / RADIO_PATCH_CHUNK_LEN);
+    printf("Patch id %u\n", forward.header.new_crc & 0xFFFF);
+
+    if (total > RADIO_PATCH_MAX_LEN)
+    {
+        fprintf(stderr, "Patch is %u bytes, nodes only have room for %u\n", total,
+                RADIO_PATCH_MAX_LEN);
+        return 1;
+    }
+
+    FILE* file = fopen(argv[3], "wb");
+    uint8_t zeros[3] = {0};
+
+    if (!file ||
+            fwrite(&forward.header, sizeof(forward.header), 1, file) != 1 ||
+            fwrite(forward.ops, 1, forward.header.length, file) != forward.header.length ||
+            fwrite(zeros, 1, padding, file) != padding ||
+            fwrite(&reverse.header, sizeof(reverse.header), 1, file) != 1 ||
+            fwrite(reverse.ops, 1, reverse.header.length, file) != reverse.header.length ||
+            fclose(file) != 0)
+    {
+        fprintf(stderr, "Couldn't write %s\n", argv[3]);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Work out the CRC-32 of some bytes, the same one the node checks with
+ *
+ * @param data   Bytes to check
+ * @param length Number of bytes
+ * @return       CRC-32 as used by zip
+ */
+static uint32_t _diff_crc32(const uint8_t* data, uint32_t length)
+{
+    uint32_t crc = 0xFFFFFFFFu;
+
+    while (length--)
+    {
+        crc ^= *data++;
+
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 0x1)));
+        }
+    }
+
+    return ~crc;
+}
+
+/**
+ * Read an image
+ *
+ * @param path File to read
+ * @param data Filled in with its contents
+ * @return     Bytes read, 0 if it couldn't be read or is too big
+ */
+static uint32_t _diff_read(const char* path, uint8_t* data)
+{
+    FILE* file = fopen(path, "rb");
+
+    if (!file)
+    {
+        fprintf(stderr, "Couldn't open %s\n", path);
+        return 0;
+    }
+
+    size_t length = fread(data, 1, DIFF_IMAGE_MAX, file);
+    bool more = fgetc(file) != EOF;
+
+    fclose(file);
+
+    if (more || length > 0xFFFF)
+    {
+        fprintf(stderr, "%s is too big\n", path);
+        return 0;
+    }
+
+    return (uint32_t)length;
+}
+
+/**
+ * Make a patch each way round and keep the shorter
+ *
+ * @param old        Image the node has
+ * @param old_length Its length
+ * @param new        Image it is to have
+ * @param new_length Its length
+ * @param patch      Filled in with the patch
+ */
+static void _diff_best(const uint8_t* old, uint32_t old_length, const uint8_t* new,
+        uint32_t new_length, diff_patch_t* patch)
+{
+    static diff_patch_t descending;
+
+    _diff_make(old, old_length, new, new_length, 0, patch);
+    _diff_make(old, old_length, new, new_length, RADIO_PATCH_DESCENDING, &descending);
+
+    if (descending.header.length < patch->header.length)
+    {
+        *patch = descending;
+    }
+}
+
+/**
+ * Make a patch, copying the longest run of old bytes that can still be read
+ * at each point and adding the rest
+ *
+ * @param old        Image the node has
+ * @param old_length Its length
+ * @param new        Image it is to have
+ * @param new_length Its length
+ * @param flags      RADIO_PATCH_x, the order pages are rewritten in
+ * @param patch      Filled in with the patch
+ */
+static void _diff_make(const uint8_t* old, uint32_t old_length, const uint8_t* new,
+        uint32_t new_length, uint32_t flags, diff_patch_t* patch)
+{
+    static int32_t head[DIFF_HASH_LEN];
+    static int32_t chain[DIFF_IMAGE_MAX];
+
+    // Index every place in the old image by its first bytes
+    memset(head, 0xFF, sizeof(head));
+
+    for (uint32_t i = 0; i + DIFF_MATCH_MIN <= old_length; i++)
+    {
+        uint32_t hash = (uint32_t)(old[i] | old[i + 1] << 8 | old[i + 2] << 16 |
+                (uint32_t)old[i + 3] << 24) * 2654435761u >> 16;
+
+        chain[i] = head[hash];
+        head[hash] = (int32_t)i;
+    }
+
+    patch->header.magic = RADIO_PATCH_MAGIC;
+    patch->header.flags = flags;
+    patch->header.length = 0;
+    patch->header.old_length = old_length;
+    patch->header.old_crc = _diff_crc32(old, old_length);
+    patch->header.new_length = new_length;
+    patch->header.new_crc = _diff_crc32(new, new_length);
+
+    // Ops never make bytes for more than one page
+    for (uint32_t page = 0; page < new_length; page += RADIO_PATCH_PAGE_LEN)
+    {
+        uint32_t end = (page + RADIO_PATCH_PAGE_LEN < new_length) ?
+                page + RADIO_PATCH_PAGE_LEN : new_length;
+        uint32_t added = page;
+
+        for (uint32_t at = page; at < end;)
+        {
+            uint32_t source = 0;
+            uint32_t length = _diff_match(old, old_length, new, at, end, flags, head,
+                    chain, &source);
+
+            if (length < DIFF_MATCH_MIN)
+            {
+                at++;
+                continue;
+            }
+
+            _diff_add(patch, &new[added], at - added);
+
+            patch->ops[patch->header.length++] = (uint8_t)(RADIO_PATCH_COPY | (length - 1));
+            patch->ops[patch->header.length++] = (uint8_t)(source & 0xFF);
+            patch->ops[patch->header.length++] = (uint8_t)(source >> 8);
+
+            at += length;
+            added = at;
+        }
+
+        _diff_add(patch, &new[added], end - added);
+    }
+
+    patch->header.ops_crc = _diff_crc32(patch->ops, patch->header.length);
+}
+
+/**
+ * Find the longest run of old bytes matching the new ones at a point, from the
+ * parts of the old image the node still has when it makes that page
+ *
+ * @param old        Image the node has
+ * @param old_length Its length
+ * @param new        Image it is to have
+ * @param at         Point in the new image
+ * @param end        End of its page
+ * @param flags      RADIO_PATCH_x, the order pages are rewritten in
+ * @param head       Last place in the old image starting with each hash
+ * @param chain      Place before each one with the same hash
+ * @param source     Set to where the run starts
+ * @return           Length of the run, at most RADIO_PATCH_OP_MAX
+ */
+static uint32_t _diff_match(const uint8_t* old, uint32_t old_length, const uint8_t* new,
+        uint32_t at, uint32_t end, uint32_t flags, const int32_t* head,
+        const int32_t* chain, uint32_t* source)
+{
+    uint32_t page = at - at % RADIO_PATCH_PAGE_LEN;
+    uint32_t low = (flags & RADIO_PATCH_DESCENDING) ? 0 : page;
+    uint32_t high = (flags & RADIO_PATCH_DESCENDING) ? page + RADIO_PATCH_PAGE_LEN : old_length;
+    uint32_t most = end - at;
+    uint32_t best = 0;
+
+    if (high > old_length)
+    {
+        high = old_length;
+    }
+
+    if (most > RADIO_PATCH_OP_MAX)
+    {
+        most = RADIO_PATCH_OP_MAX;
+    }
+
+    if (most < DIFF_MATCH_MIN)
+    {
+        return 0;
+    }
+
+    uint32_t hash = (uint32_t)(new[at] | new[at + 1] << 8 | new[at + 2] << 16 |
+            (uint32_t)new[at + 3] << 24) * 2654435761u >> 16;
+    uint32_t looked = 0;
+
+    for (int32_t i = head[hash]; i >= 0 && looked < DIFF_CHAIN_MAX; i = chain[i], looked++)
+    {
+        uint32_t from = (uint32_t)i;
+        uint32_t length = 0;
+
+        if (from < low || from >= high)
+        {
+            continue;
+        }
+
+        while (length < most && from + length < high && old[from + length] == new[at + length])
+        {
+            length++;
+        }
+
+        if (length > best)
+        {
+            best = length;
+            *source = from;
+
+            if (best == most)
+            {
+                break;
+            }
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Add bytes to a patch as they are
+ *
+ * @param patch  Patch being made
+ * @param data   Bytes to add
+ * @param length Number of bytes
+ */
+static void _diff_add(diff_patch_t* patch, const uint8_t* data, uint32_t length)
+{
+    while (length)
+    {
+        uint32_t run = (length > RADIO_PATCH_OP_MAX) ? RADIO_PATCH_OP_MAX : length;
+
+        patch->ops[patch->header.length++] = (uint8_t)(run - 1);
+        memcpy(&patch->ops[patch->header.length], data, run);
+        patch->header.length += run;
+
+        data += run;
+        length -= run;
+    }
+}
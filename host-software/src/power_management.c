@@ -0,0 +1,281 @@
+/**
+ * Sleep and scheduled function handling for host builds
+ * Sleeping hands control to the environment until the earliest event any
+ * wake up source is waiting for, then lets each source run its "interrupt".
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Application-specific headers */
+#include "power_management.h"
+#include "host_env.h"
+
+// Function to run next time we're in the main loop
+static void (*sched_func)(void);
+
+// Marker to indicate scheduled function is running, don't recurse
+static volatile bool sched_active = false;
+
+// Things that can wake us up, standing in for interrupt sources
+typedef struct
+{
+    uint64_t (*next)(void);
+    void (*service)(uint64_t);
+} power_wakeup_t;
+
+static power_wakeup_t wakeups[POWER_MAX_WAKEUPS];
+static uint8_t wakeup_count = 0;
+
+// Bit per system for each minimum power mode except the lowest, as on the
+// targets. Sleeping costs nothing on the host, but residency is counted
+static power_system_store_t systems_min[POWER_MODE_COUNT - 1] = {0};
+
+// Residency counters, the states currently being charged and the virtual time
+// they have been charged up to
+static power_stats_t stats;
+static uint8_t stats_mode = 0;
+static power_radio_t stats_radio = PWR_RADIO_SLEEP;
+static uint64_t stats_mark = 0;
+static bool stats_started = false;
+
+#ifdef HOST_BASESTATION
+volatile uint8_t power_gpiod_use_count = 0;
+#endif
+
+/* Functions used only in this file */
+static uint8_t _power_mode(void);
+static void _power_account(void);
+
+/**
+ * Set the minimum power mode a system can tolerate
+ *
+ * @param system  System that is setting a minimum
+ * @param minimum Lowest power mode the system can work in
+ */
+void power_set_minimum(power_system_t system, power_min_t minimum)
+{
+    // Charge the time so far to the minimums held until now
+    _power_account();
+
+    // First turn off all the state bits for this system
+    for (uint8_t i = 0; i < POWER_MODE_COUNT - 1; i++)
+    {
+        systems_min[i] &= (power_system_store_t)~(0x1 << system);
+    }
+
+    // Nothing to set for the lowest mode as bits already cleared
+    if ((uint8_t)minimum < POWER_MODE_COUNT - 1)
+    {
+        systems_min[minimum] |= (power_system_store_t)(0x1 << system);
+    }
+}
+
+/**
+ * Run any scheduled function, then sleep until something needs attention.
+ * The basestation returns straight after running one, as it does on the STM32
+ */
+void power_sleep(void)
+{
+#ifdef HOST_BASESTATION
+    if (sched_func)
+    {
+        // This enables the scheduled function to set another one if it has to
+        void (*fn)(void) = sched_func;
+        sched_func = 0x0;
+        fn();
+
+        return;
+    }
+#else
+    // First off, run the scheduled function all the time there is one and doing
+    // so won't cause a recursion
+    while (sched_func && !sched_active)
+    {
+        // This enables the scheduled function to set another one if it has to
+        void (*fn)(void) = sched_func;
+        sched_func = 0x0;
+
+        sched_active = true;
+        fn();
+        sched_active = false;
+    }
+#endif
+
+    uint64_t until = HOST_NEVER;
+
+    for (uint8_t i = 0; i < wakeup_count; i++)
+    {
+        uint64_t next = wakeups[i].next();
+
+        if (next < until)
+        {
+            until = next;
+        }
+    }
+
+    // Time up to here was spent awake, nothing is saved if a system needs
+    // full power
+    uint8_t mode = _power_mode();
+
+    _power_account();
+    stats_mode = mode;
+
+    host_sleep_until(until);
+
+    _power_account();
+    stats_mode = 0;
+
+    if (mode != 0)
+    {
+        stats.wakes++;
+    }
+
+    // Let each source handle whatever became due
+    uint64_t now = host_now_us();
+
+    for (uint8_t i = 0; i < wakeup_count; i++)
+    {
+        wakeups[i].service(now);
+    }
+}
+
+/**
+ * Schedule a function to run from the main loop, next time it wakes
+ *
+ * @param fn Function to run
+ */
+void power_schedule(void (*fn)(void))
+{
+    sched_func = fn;
+}
+
+/**
+ * Register something that can wake the processor
+ *
+ * @param next    Returns the virtual time of its next event, or HOST_NEVER
+ * @param service Called with the current time after every wake up
+ */
+void power_add_wakeup(uint64_t (*next)(void), void (*service)(uint64_t))
+{
+    // A node that resets adds its wakeups again
+    for (uint8_t i = 0; i < wakeup_count; i++)
+    {
+        if (wakeups[i].next == next && wakeups[i].service == service)
+        {
+            return;
+        }
+    }
+
+    if (wakeup_count < POWER_MAX_WAKEUPS)
+    {
+        wakeups[wakeup_count].next = next;
+        wakeups[wakeup_count].service = service;
+        wakeup_count++;
+    }
+}
+
+/**
+ * Note a change of radio state, so time can be charged to each
+ *
+ * @param state State the radio has just been put in
+ */
+void power_radio_state(power_radio_t state)
+{
+    _power_account();
+    stats_radio = state;
+}
+
+/**
+ * Note a frame being transmitted, timed by the radio driver from its length
+ *
+ * @param airtime_us Time from the start of the preamble to the end of the CRC
+ */
+void power_radio_transmit(uint32_t airtime_us)
+{
+    stats.tx_us += airtime_us;
+    stats.tx_frames++;
+}
+
+/**
+ * Get the time spent in each power state since the counters were cleared
+ *
+ * @return Pointer to the counters, brought up to date
+ */
+const power_stats_t* power_stats(void)
+{
+    _power_account();
+
+    return &stats;
+}
+
+/**
+ * Start counting residency afresh from now
+ */
+void power_stats_clear(void)
+{
+    _power_account();
+    memset(&stats, 0, sizeof(stats));
+}
+
+/**
+ * Find the mode the target would sleep in, the highest any system needs
+ *
+ * @return Power mode, as a power_min_t
+ */
+static uint8_t _power_mode(void)
+{
+    for (uint8_t i = 0; i < POWER_MODE_COUNT - 1; i++)
+    {
+        if (systems_min[i])
+        {
+            return i;
+        }
+    }
+
+    return POWER_MODE_COUNT - 1;
+}
+
+/**
+ * Charge the virtual time since the last call to the current processor mode,
+ * radio state and the minimum each system is holding
+ */
+static void _power_account(void)
+{
+    uint64_t now = host_now_us();
+
+    // Start counting when the firmware starts, which may be well into a run
+    if (!stats_started)
+    {
+        stats_mark = now;
+        stats_started = true;
+    }
+
+    uint32_t ticks = (uint32_t)((now - stats_mark) / 1000);
+
+    if (ticks == 0)
+    {
+        return;
+    }
+
+    // Carry the part of a ms left over into next time
+    stats_mark += (uint64_t)ticks * 1000;
+
+    stats.elapsed += ticks;
+    stats.mode[stats_mode] += ticks;
+    stats.radio[stats_radio] += ticks;
+
+    for (uint8_t i = 0; i < POWER_SYSTEM_COUNT; i++)
+    {
+        for (uint8_t j = 0; j < POWER_MODE_COUNT - 1; j++)
+        {
+            if (systems_min[j] & (0x1 << i))
+            {
+                stats.system[i][j] += ticks;
+                break;
+            }
+        }
+    }
+}
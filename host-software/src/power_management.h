@@ -0,0 +1,68 @@
+/**
+ * Sleep and scheduled function handling for host builds - header file
+ */
+
+#ifndef POWER_MANAGEMENT_H_
+#define POWER_MANAGEMENT_H_
+
+#include <stdint.h>
+
+// Most wake up sources a host build can register
+#define POWER_MAX_WAKEUPS 8
+
+// Build with -DHOST_BASESTATION for the basestation's power systems and modes,
+// otherwise the node's are used
+#ifdef HOST_BASESTATION
+typedef enum {PWR_WAKE, PWR_SLEEP, PWR_CLOCKSTOP} power_min_t;
+typedef enum {PWR_RADIO, PWR_DELAY, PWR_MODEM} power_system_t;
+#define POWER_MODE_COUNT 3
+#define POWER_SYSTEM_COUNT 3
+
+// Needed so that subsystems can find variable from this header
+extern volatile uint8_t power_gpiod_use_count;
+#else
+typedef enum {PWR_EM0, PWR_EM1, PWR_EM2, PWR_EM3} power_min_t;
+typedef enum {PWR_DETECT, PWR_RADIO, PWR_SENSOR, PWR_DELAY, PWR_RTC} power_system_t;
+#define POWER_MODE_COUNT 4
+#define POWER_SYSTEM_COUNT 5
+#endif
+
+typedef enum {PWR_RADIO_SLEEP, PWR_RADIO_STANDBY, PWR_RADIO_RX, PWR_RADIO_LISTEN,
+    PWR_RADIO_TX} power_radio_t;
+#define POWER_RADIO_COUNT 5
+
+/**
+ * Time spent in each power state since the counters were last cleared, in ms
+ * of virtual time. Laid out as on the targets, the node's power_model.c is
+ * built against the node's own header.
+ */
+typedef struct
+{
+    uint32_t elapsed;                                          //!< All time accounted for
+    uint32_t mode[POWER_MODE_COUNT];                           //!< Time the processor spent in each mode
+    uint32_t system[POWER_SYSTEM_COUNT][POWER_MODE_COUNT - 1]; //!< Time each system held each mode above the lowest
+    uint32_t radio[POWER_RADIO_COUNT];                         //!< Time the radio spent in each state
+    uint32_t tx_us;                                            //!< Air time of the frames sent, in us
+    uint32_t tx_frames;                                        //!< Frames sent
+    uint32_t wakes;                                            //!< Times the processor woke from sleep
+} power_stats_t;
+
+// Make sure this type has at least as many bits as there are items in
+// power_system_t
+typedef uint8_t power_system_store_t;
+
+void power_set_minimum(power_system_t system, power_min_t minimum);
+
+void power_sleep(void);
+
+void power_schedule(void (*fn)(void));
+
+void power_radio_state(power_radio_t state);
+void power_radio_transmit(uint32_t airtime_us);
+
+const power_stats_t* power_stats(void);
+void power_stats_clear(void);
+
+void power_add_wakeup(uint64_t (*next)(void), void (*service)(uint64_t));
+
+#endif /* POWER_MANAGEMENT_H_ */
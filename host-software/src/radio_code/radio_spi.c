@@ -0,0 +1,164 @@
+/**
+ * SPI interface driver for RFM69W radio module
+ * This code exposes functions for radio_control.c to use with the software
+ * radio model on a host PC. Each SPI byte costs virtual time, so polling loops
+ * in the driver see the radio move on.
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Application-specific headers */
+#include "radio_spi.h"
+#include "radio_control.h"
+#include "power_management.h"
+#include "rfm69_model.h"
+#include "host_env.h"
+
+// Type of interrupt currently being waited on
+static volatile uint8_t interrupt_state = RADIO_INT_NONE;
+
+// Time of day by the firmware's clock the last receive and transmit done
+// interrupts fired, in RADIO_TIME_HZ ticks
+static volatile uint32_t rx_time = 0;
+static volatile uint32_t tx_time = 0;
+
+/* Functions used only in this file */
+static void _radio_spi_dio0_handler(void);
+
+/**
+ * Reset the radio model and hook up its interrupt line
+ */
+void radio_spi_init(void)
+{
+    rfm69_reset();
+    rfm69_set_dio0_handler(_radio_spi_dio0_handler);
+
+    power_add_wakeup(rfm69_next_event, rfm69_service);
+}
+
+/**
+ * Enable or disable clock to the SPI module, nothing to do on the host
+ * @param state True to power up, false to power down
+ */
+void radio_spi_powerstate(bool state)
+{
+    (void)state;
+}
+
+/**
+ * Send and receive single bytes of data
+ *
+ * @param send_data A byte of data to send, set to zero for a read
+ * @return          Received byte
+ */
+uint8_t radio_spi_transfer(uint8_t send_data)
+{
+    host_spend_us(RADIO_SPI_BYTE_US);
+
+    return rfm69_transfer(send_data);
+}
+
+/**
+ * Assert or release the NSS line
+ *
+ * @param select Set to true to assert NSS low, false to release
+ */
+void radio_spi_select(bool select)
+{
+    rfm69_select(select);
+}
+
+/**
+ * Wait until the interrupt pin asserts that transmit is complete.
+ *
+ * @return True if transmit completed, false if the wait timed out
+ */
+bool radio_spi_transmitwait(void)
+{
+    // Set a short timeout to avoid radio-related lockups
+    misc_timeout(RADIO_TX_TIMEOUT_MS);
+
+    // Sleep until the flag is cleared by the interrupt routine or timer runs out
+    while (interrupt_state != RADIO_INT_NONE && misc_timeout_active())
+    {
+        power_sleep();
+    }
+
+    misc_timeout_cancel();
+
+    return (interrupt_state == RADIO_INT_NONE);
+}
+
+/**
+ * Check without blocking whether a transmission has completed
+ *
+ * @return True if the transmit done interrupt has fired
+ */
+bool radio_spi_transmitdone(void)
+{
+    return (interrupt_state == RADIO_INT_NONE);
+}
+
+/**
+ * Get the time of day by the firmware's clock
+ *
+ * @return Time of day in RADIO_TIME_HZ ticks
+ */
+uint32_t radio_spi_time(void)
+{
+    return (uint32_t)((host_clock_us() * RADIO_TIME_HZ / 1000000u) % RADIO_TIME_PER_DAY);
+}
+
+/**
+ * Get the time the last receive interrupt fired
+ *
+ * @return Time of day in RADIO_TIME_HZ ticks
+ */
+uint32_t radio_spi_rxtime(void)
+{
+    return rx_time;
+}
+
+/**
+ * Get the time the last transmit done interrupt fired
+ *
+ * @return Time of day in RADIO_TIME_HZ ticks
+ */
+uint32_t radio_spi_txtime(void)
+{
+    return tx_time;
+}
+
+/**
+ * Prepare to wait for a radio interrupt type by setting the type expected
+ * @param interrupt Interrupt to wait for, one of RADIO_INT_n
+ */
+void radio_spi_prepinterrupt(uint8_t interrupt)
+{
+    interrupt_state = interrupt;
+}
+
+/**
+ * Handle a rising edge on DIO0, as the pin change interrupt does on hardware
+ */
+static void _radio_spi_dio0_handler(void)
+{
+    switch(interrupt_state)
+    {
+        case RADIO_INT_TXDONE:
+            // A transmission finished, clear the flag
+            tx_time = radio_spi_time();
+            interrupt_state = RADIO_INT_NONE;
+            break;
+        case RADIO_INT_RXREADY:
+            // Payload data is waiting to be read
+            rx_time = radio_spi_time();
+            power_schedule(_radio_payload_ready);
+            break;
+        default:
+            // We're not listening for an interrupt, ignore
+            break;
+    }
+}
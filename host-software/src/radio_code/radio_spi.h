@@ -0,0 +1,50 @@
+/**
+ * SPI interface driver for RFM69W radio module - header file
+ * This code exposes functions for radio_control.c to use with the software
+ * radio model on a host PC
+ */
+#ifndef RADIO_SPI_H_
+#define RADIO_SPI_H_
+
+// Delay timer functions are used by radio_control.c for timeouts
+#include "host_misc.h"
+
+// Values of interrupt state
+#define RADIO_INT_NONE    0
+#define RADIO_INT_RXREADY 1
+#define RADIO_INT_TXDONE  2
+
+// Longest a transmission may take before the radio is assumed stuck
+#define RADIO_TX_TIMEOUT_MS 1000
+
+// Build with -DRADIO_RX_STREAMING=0 to behave like the node
+#ifndef RADIO_RX_STREAMING
+#define RADIO_RX_STREAMING 1
+#endif
+
+// FIFO status polls with no new byte before a streamed frame is given up on
+#define RADIO_RX_STALL_POLLS 2000
+
+// Time a streamed frame may take beyond its airtime before it is given up on,
+// a few byte times at 4.8kbps
+#define RADIO_RX_STREAM_SLACK_US 5000
+
+// Virtual time one byte over SPI takes, matching the node's 1MHz clock
+#define RADIO_SPI_BYTE_US 8
+
+void radio_spi_init(void);
+
+void radio_spi_powerstate(bool state);
+
+uint8_t radio_spi_transfer(uint8_t send_data);
+void radio_spi_select(bool select);
+
+uint32_t radio_spi_time(void);
+uint32_t radio_spi_rxtime(void);
+uint32_t radio_spi_txtime(void);
+
+bool radio_spi_transmitwait(void);
+bool radio_spi_transmitdone(void);
+void radio_spi_prepinterrupt(uint8_t interrupt);
+
+#endif /* RADIO_SPI_H_ */
@@ -0,0 +1,309 @@
+/**
+ * Prints the fields of the packets nodes and the base station send each other,
+ * read with the same radio_packets.h both firmwares use. Each packet is given
+ * in hex from its type byte on, as an argument or a line on stdin. Uploads and
+ * patch requests have no type, so are read as such after -u:
+ *
+ *     radio_decode 051170025811eb05070200fa0140e2010000000000
+ *     radio_decode -u 0300030200112233
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+/* Application-specific headers */
+#include "radio_control.h"
+#include "radio_shared_types.h"
+#include "radio_packets.h"
+
+// Longest line of hex read from stdin
+#define DECODE_LINE_LEN 1024
+
+/* Functions used only in this file */
+static bool _decode_hex(const char* text, uint8_t* data, uint8_t* length);
+static bool _decode_packet(const char* text, bool from_node);
+static bool _decode_from_node(const uint8_t* data, uint8_t length);
+static void _decode_time(const char* name, uint32_t seconds, uint16_t ms);
+
+/**
+ * Decode the packets on the command line, or each line of stdin if there are
+ * none
+ *
+ * @param argc Number of arguments
+ * @param argv Packets in hex, after -u if they're from a node
+ * @return     0 if every packet could be read
+ */
+int main(int argc, char** argv)
+{
+    bool all_ok = true;
+    bool from_node = false;
+    int first = 1;
+
+    if (argc > 1 && !strcmp(argv[1], "-u"))
+    {
+        from_node = true;
+        first++;
+    }
+
+    if (argc > first)
+    {
+        for (int i = first; i < argc; i++)
+        {
+            all_ok &= _decode_packet(argv[i], from_node);
+        }
+    }
+    else
+    {
+        char line[DECODE_LINE_LEN];
+
+        while (fgets(line, sizeof(line), stdin))
+        {
+            all_ok &= _decode_packet(line, from_node);
+        }
+    }
+
+    return all_ok ? 0 : 1;
+}
+
+/**
+ * Read a packet written in hex, ignoring spaces and colons between bytes
+ *
+ * @param text   Hex
+ * @param data   Filled in with the bytes
+ * @param length Set to the number of bytes
+ * @return       False if it isn't hex or is too long for a frame
+ */
+static bool _decode_hex(const char* text, uint8_t* data, uint8_t* length)
+{
+    int nibble = -1;
+
+    *length = 0;
+
+    for (; *text; text++)
+    {
+        if (isspace((unsigned char)*text) || *text == ':')
+        {
+            continue;
+        }
+
+        if (!isxdigit((unsigned char)*text) || *length >= RADIO_MAX_FRAME_LEN)
+        {
+            return false;
+        }
+
+        int value = isdigit((unsigned char)*text) ? *text - '0' :
+                tolower((unsigned char)*text) - 'a' + 10;
+
+        if (nibble < 0)
+        {
+            nibble = value;
+        }
+        else
+        {
+            data[(*length)++] = (uint8_t)(nibble << 4 | value);
+            nibble = -1;
+        }
+    }
+
+    return nibble < 0;
+}
+
+/**
+ * Print a time of day
+ *
+ * @param name    Field it's in
+ * @param seconds Second of the day
+ * @param ms      ms after it
+ */
+static void _decode_time(const char* name, uint32_t seconds, uint16_t ms)
+{
+    printf("  %-12s %02u:%02u:%02u.%03u\n", name, seconds / 3600, seconds / 60 % 60,
+            seconds % 60, ms);
+}
+
+/**
+ * Print the fields of an upload packet or patch request, which have no type
+ *
+ * @param data   Packet, from its seq on
+ * @param length Its length
+ * @return       False if it's neither
+ */
+static bool _decode_from_node(const uint8_t* data, uint8_t length)
+{
+    radio_upload_t upload;
+    radio_patch_request_t request;
+
+    if (radio_upload_unpack(data, length, &upload))
+    {
+        printf("Upload, %u bytes\n", length);
+        printf("  %-12s %u\n", "seq", upload.seq);
+        printf("  %-12s%s%s\n", "flags", (upload.flags & RADIO_FLAG_LAST) ? " last" : "",
+                (upload.flags & RADIO_FLAG_POLL) ? " poll" : "");
+        printf("  %-12s %u\n", "backlog", upload.backlog);
+        printf("  %-12s %u bytes, %u records\n", "data", upload.length,
+                (unsigned)(upload.length / sizeof(data_struct_t)));
+    }
+    else if (radio_patch_request_unpack(data, length, &request))
+    {
+        printf("Patch request, %u bytes\n", length);
+        printf("  %-12s %u\n", "next chunk", request.next);
+        printf("  %-12s %02x after\n", "have", request.have);
+    }
+    else
+    {
+        printf("Not an upload or patch request, %u bytes\n", length);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Print the fields of one packet
+ *
+ * @param text      Packet in hex, from its type byte on
+ * @param from_node True if it's an upload or patch request, with no type
+ * @return          False if it couldn't be read
+ */
+static bool _decode_packet(const char* text, bool from_node)
+{
+    uint8_t data[RADIO_MAX_FRAME_LEN];
+    uint8_t length;
+
+    if (!_decode_hex(text, data, &length))
+    {
+        printf("Not a packet in hex\n");
+        return false;
+    }
+
+    if (!length)
+    {
+        return true;
+    }
+
+    if (from_node)
+    {
+        return _decode_from_node(data, length);
+    }
+
+    if (data[0] == PKT_BEACONACK)
+    {
+        radio_beaconack_t ack;
+
+        if (!radio_beaconack_unpack(data, length, &ack))
+        {
+            printf("BEACONACK too short, %u bytes\n", length);
+            return false;
+        }
+
+        printf("BEACONACK, %u bytes\n", length);
+        _decode_time("time", ack.time, 0);
+        printf("  %-12s %u s\n", "period", ack.period);
+        _decode_time("next wake", ack.next_wake, ack.next_wake_ms);
+        printf("  %-12s %d dBm\n", "tx power", ack.tx_power);
+        printf("  %-12s %u\n", "profile", ack.profile);
+        printf("  %-12s %u\n", "channel", ack.channel);
+        printf("  %-12s %u ticks\n", "rx time", ack.rx_time);
+    }
+    else if (data[0] == PKT_ACK)
+    {
+        radio_ack_t ack;
+
+        if (!radio_ack_unpack(data, length, &ack))
+        {
+            printf("ACK too short, %u bytes\n", length);
+            return false;
+        }
+
+        printf("ACK, %u bytes\n", length);
+        _decode_time("time", ack.time, 0);
+        printf("  %-12s %d dBm\n", "tx power", ack.tx_power);
+        printf("  %-12s %u\n", "profile", ack.profile);
+
+        if (ack.slot)
+        {
+            _decode_time("next wake", ack.next_wake, ack.next_wake_ms);
+            printf("  %-12s %u s\n", "period", ack.period);
+            printf("  %-12s %d ppm\n", "drift", ack.drift_ppm);
+        }
+        else
+        {
+            printf("  %-12s none, register again\n", "slot");
+        }
+
+        if (ack.children)
+        {
+            printf("  %-12s %u, %u ms after waking\n", "sub-slots", ack.children,
+                    ack.children_ms);
+        }
+
+        if (ack.command)
+        {
+            printf("  %-12s id %u, command %u, value %u\n", "command", ack.command_id,
+                    ack.command, ack.value);
+        }
+
+        printf("  %-12s %u ticks\n", "rx time", ack.rx_time);
+    }
+    else if (data[0] == PKT_SACK)
+    {
+        radio_sack_t sack;
+
+        if (!radio_sack_unpack(data, length, &sack))
+        {
+            printf("SACK too short, %u bytes\n", length);
+            return false;
+        }
+
+        printf("SACK, %u bytes\n", length);
+        printf("  %-12s %u\n", "next seq", sack.next);
+        printf("  %-12s %02x after\n", "have", sack.have);
+    }
+    else if (data[0] == PKT_PATCH)
+    {
+        radio_patch_t chunk;
+
+        if (!radio_patch_unpack(data, length, &chunk))
+        {
+            printf("PATCH too short, %u bytes\n", length);
+            return false;
+        }
+
+        printf("PATCH, %u bytes\n", length);
+        printf("  %-12s %u of %u\n", "chunk", chunk.chunk, chunk.chunks);
+        printf("  %-12s%s%s\n", "flags", (chunk.flags & RADIO_FLAG_POLL) ? " poll" : "",
+                (chunk.flags & RADIO_FLAG_LAST) ? " last" : "");
+        printf("  %-12s %u bytes\n", "data", chunk.length);
+    }
+    else if (data[0] == PKT_SCHEDULE)
+    {
+        radio_schedule_t schedule;
+
+        if (!radio_schedule_unpack(data, length, &schedule))
+        {
+            printf("SCHEDULE too short for its entries, %u bytes\n", length);
+            return false;
+        }
+
+        printf("SCHEDULE, %u bytes\n", length);
+        printf("  %-12s %u\n", "version", schedule.version);
+
+        for (uint8_t i = 0; i < schedule.count; i++)
+        {
+            printf("  node %-7u wake in %u ms, period %u s\n", schedule.entry[i].node,
+                    schedule.entry[i].wake_in_ms, schedule.entry[i].period);
+        }
+
+        printf("  %-12s %u ticks\n", "tx time", schedule.tx_time);
+    }
+    else
+    {
+        printf("Packet type %u, %u bytes, not decoded\n", data[0], length);
+    }
+
+    return true;
+}
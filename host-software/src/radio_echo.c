@@ -0,0 +1,250 @@
+/**
+ * Runs the radio driver against the software radio model, with a peer that
+ * echoes every frame back, and reports what made the round trip. Everything
+ * runs in virtual time, so slow profiles take no longer than fast ones.
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Application-specific headers */
+#include "radio_control.h"
+#include "power_management.h"
+#include "host_misc.h"
+#include "host_env.h"
+#include "rfm69_model.h"
+
+#define ECHO_NODE_ADDR     0x01
+#define ECHO_PEER_ADDR     0x02
+
+// Peer turns frames around this long after they finish
+#define ECHO_TURNAROUND_US 2000
+
+// Signal strength the echo arrives at
+#define ECHO_RSSI          (-70)
+
+// Longest to wait for an echo
+#define ECHO_WAIT_MS       3000
+
+#define ECHO_QUEUE_LEN     4
+
+// Virtual time
+static uint64_t now_us = 0;
+
+// Echoes on their way back
+static host_frame_t echo_queue[ECHO_QUEUE_LEN];
+static uint8_t echo_count = 0;
+
+// What was sent and what came back
+static uint8_t sent_data[RADIO_MAX_FRAME_LEN];
+static uint16_t sent_length = 0;
+static bool echo_received = false;
+static bool echo_matched = false;
+static int16_t echo_rssi = 0;
+
+/* Functions used only in this file */
+static void _echo_received(uint16_t bytes);
+static bool _echo_deliver_due(uint64_t time_us);
+
+/**
+ * Send frames of a few sizes on each link profile and check they come back
+ */
+int main(void)
+{
+    static const uint16_t lengths[] = {10, 60, 200};
+    static const char* profile_names[RADIO_PROFILE_COUNT] = {"4.8k", "19.2k", "55.5k"};
+
+    misc_delay_init();
+
+    if (!radio_init(ECHO_NODE_ADDR, _echo_received))
+    {
+        printf("Radio init failed\r\n");
+        return 1;
+    }
+
+    radio_powerstate(true);
+    radio_receive_activate(true);
+
+    printf("profile length sent echo match rtt_ms rssi\r\n");
+
+    bool all_ok = true;
+
+    for (int8_t profile = RADIO_PROFILE_COUNT - 1; profile >= 0; profile--)
+    {
+        radio_set_profile((uint8_t)profile);
+
+        for (uint8_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+        {
+            sent_length = lengths[i];
+
+            for (uint16_t j = 0; j < sent_length; j++)
+            {
+                sent_data[j] = (uint8_t)(j * 7 + profile);
+            }
+
+            echo_received = false;
+            echo_matched = false;
+
+            uint64_t start = host_now_us();
+            bool sent = radio_send_data(sent_data, sent_length, ECHO_PEER_ADDR);
+
+            misc_delay(ECHO_WAIT_MS, false);
+
+            while (!echo_received && misc_delay_active())
+            {
+                power_sleep();
+            }
+
+            misc_delay_cancel();
+
+            printf("%s %d %d %d %d %d %d\r\n", profile_names[profile],
+                    sent_length, sent, echo_received, echo_matched,
+                    (int)((host_now_us() - start) / 1000), echo_rssi);
+
+            all_ok = all_ok && sent && echo_matched;
+        }
+    }
+
+    return all_ok ? 0 : 1;
+}
+
+/**
+ * Get the virtual time
+ *
+ * @return Time in us
+ */
+uint64_t host_now_us(void)
+{
+    return now_us;
+}
+
+/**
+ * Read the clock the firmware keeps, which is virtual time here
+ *
+ * @return Time in us
+ */
+uint64_t host_clock_us(void)
+{
+    return now_us;
+}
+
+/**
+ * Move virtual time on while the firmware is busy
+ *
+ * @param us Time spent in us
+ */
+void host_spend_us(uint32_t us)
+{
+    now_us += us;
+
+    while (_echo_deliver_due(now_us))
+    {
+    }
+}
+
+/**
+ * Sleep until the given time, or until an echo arrives if that is sooner
+ *
+ * @param time_us Virtual time to wake at, HOST_NEVER to wait for an echo
+ */
+void host_sleep_until(uint64_t time_us)
+{
+    if (_echo_deliver_due(time_us))
+    {
+        return;
+    }
+
+    // Nothing could ever wake us, hand control back to the caller instead
+    if (time_us != HOST_NEVER && time_us > now_us)
+    {
+        now_us = time_us;
+    }
+}
+
+/**
+ * Take a frame off the air and queue it to come back from the peer
+ *
+ * @param frame Frame as it was sent
+ */
+void host_air_transmit(const host_frame_t* frame)
+{
+    if (echo_count == ECHO_QUEUE_LEN || frame->size < 5)
+    {
+        return;
+    }
+
+    host_frame_t* echo = &echo_queue[echo_count++];
+    *echo = *frame;
+
+    // Swap destination and source, the peer answers from its own address
+    echo->data[1] = frame->data[2];
+    echo->data[2] = ECHO_PEER_ADDR;
+
+    uint16_t length = (uint16_t)(echo->size - 2);
+    uint16_t crc = rfm69_crc(echo->data, length);
+    echo->data[length] = (uint8_t)(crc >> 8);
+    echo->data[length + 1] = (uint8_t)(crc & 0xFF);
+
+    uint64_t shift = frame->end_us + ECHO_TURNAROUND_US - frame->start_us;
+    echo->start_us += shift;
+    echo->sync_us += shift;
+    echo->end_us += shift;
+    echo->rssi = ECHO_RSSI;
+}
+
+/**
+ * Check a received frame against what was sent
+ *
+ * @param bytes Number of bytes received
+ */
+static void _echo_received(uint16_t bytes)
+{
+    const radio_packet_t* packet = radio_rx_peek();
+
+    if (!packet)
+    {
+        return;
+    }
+
+    // Stop waiting, so the main loop sees this without sleeping out the delay
+    misc_delay_cancel();
+
+    echo_received = true;
+    echo_rssi = packet->rssi;
+    echo_matched = (bytes == sent_length + 1) &&
+            packet->data[0] == ECHO_PEER_ADDR &&
+            memcmp(packet->data + 1, sent_data, sent_length) == 0;
+
+    radio_rx_commit();
+}
+
+/**
+ * Hand the radio the first queued echo if it has finished arriving
+ *
+ * @param time_us Time to deliver up to
+ * @return        True if an echo was delivered
+ */
+static bool _echo_deliver_due(uint64_t time_us)
+{
+    if (echo_count == 0 || echo_queue[0].end_us > time_us)
+    {
+        return false;
+    }
+
+    host_frame_t frame = echo_queue[0];
+
+    echo_count--;
+    memmove(&echo_queue[0], &echo_queue[1], echo_count * sizeof(host_frame_t));
+
+    if (frame.end_us > now_us)
+    {
+        now_us = frame.end_us;
+    }
+
+    rfm69_air_receive(&frame);
+
+    return true;
+}
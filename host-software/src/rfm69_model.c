@@ -0,0 +1,938 @@
+/**
+ * Software model of the RFM69W radio module for host builds
+ * Emulates the SPI register and FIFO interface closely enough for the
+ * unmodified radio_control.c to run against it: OPMODE transitions including
+ * listen mode, the 66 byte FIFO and its flags, DIO0 mappings, packet timing
+ * from the bitrate and preamble, sync word, address filtering and CRC.
+ *
+ * Mode changes are instant (ModeReady always reads set). Frames are handed to
+ * the environment when the last bit has been sent, so receivers see payload
+ * ready at the right time but the sync word interrupt one frame late.
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Application-specific headers */
+#include "rfm69_model.h"
+#include "host_env.h"
+
+#define RFM69_REG_COUNT 0x80
+#define RFM69_FIFO_SIZE 66
+
+// Registers the model gives meaning to
+#define REG_FIFO          0x00
+#define REG_OPMODE        0x01
+#define REG_BITRATEMSB    0x03
+#define REG_BITRATELSB    0x04
+#define REG_FDEVMSB       0x05
+#define REG_FDEVLSB       0x06
+#define REG_FRFMSB        0x07
+#define REG_FRFMID        0x08
+#define REG_FRFLSB        0x09
+#define REG_PALEVEL       0x0A
+#define REG_LISTEN1       0x0D
+#define REG_LISTEN2       0x0E
+#define REG_LISTEN3       0x0F
+#define REG_VERSION       0x10
+#define REG_RSSIVALUE     0x24
+#define REG_DIOMAPPING1   0x25
+#define REG_IRQFLAGS1     0x27
+#define REG_IRQFLAGS2     0x28
+#define REG_RSSITHRESH    0x29
+#define REG_PREAMBLEMSB   0x2C
+#define REG_PREAMBLELSB   0x2D
+#define REG_SYNCCONFIG    0x2E
+#define REG_SYNCVALUE1    0x2F
+#define REG_PACKETCONFIG1 0x37
+#define REG_PAYLOADLENGTH 0x38
+#define REG_NODEADRS      0x39
+#define REG_BROADCASTADRS 0x3A
+#define REG_FIFOTHRESH    0x3C
+#define REG_PACKETCONFIG2 0x3D
+
+// Operating modes (RegOpMode bits 4-2)
+#define MODE_SLEEP 0
+#define MODE_STDBY 1
+#define MODE_FS    2
+#define MODE_TX    3
+#define MODE_RX    4
+
+// Preamble bytes a receiver needs to lock on before the sync word
+#define RFM69_RX_SETTLE_BYTES 3
+
+// Register state
+static uint8_t regs[RFM69_REG_COUNT];
+
+// FIFO ring
+static uint8_t fifo[RFM69_FIFO_SIZE];
+static uint8_t fifo_head = 0;
+static uint8_t fifo_count = 0;
+static bool fifo_overrun = false;
+
+// SPI transaction state
+static bool spi_selected = false;
+static bool spi_first = false;
+static bool spi_write = false;
+static uint8_t spi_addr = 0;
+
+// Operating mode and when receive (or listen) was switched on
+static uint8_t mode = MODE_STDBY;
+static bool listen_on = false;
+static uint64_t rx_since = 0;
+
+// Frame being transmitted
+static bool tx_active = false;
+static uint64_t tx_start = 0;
+static uint16_t tx_sent = 0;
+static uint16_t tx_total = 0;
+static bool packet_sent = false;
+static host_frame_t tx_frame;
+
+// Frame being received, fed into the FIFO as it drains
+static bool rx_active = false;
+static host_frame_t rx_frame;
+static uint16_t rx_pushed = 0;
+static uint16_t rx_length = 0;
+static bool rx_crc_ok = false;
+static bool sync_match = false;
+static bool payload_ready = false;
+
+// DIO0 line and who to tell about rising edges
+static bool dio0_level = false;
+static void (*dio0_handler)(void) = 0x0;
+
+/* Functions used only in this file */
+static void _rfm69_write(uint8_t address, uint8_t data);
+static uint8_t _rfm69_read(uint8_t address);
+static void _rfm69_set_mode(uint8_t value);
+static void _rfm69_update(uint64_t now);
+static bool _rfm69_dio0_level(void);
+static void _rfm69_update_dio0(void);
+
+static bool _rfm69_fifo_push(uint8_t data);
+static uint8_t _rfm69_fifo_pop(void);
+static void _rfm69_fifo_clear(void);
+
+static void _rfm69_tx_try_start(void);
+static void _rfm69_tx_finish(void);
+static void _rfm69_rx_feed(void);
+static void _rfm69_rx_drop(void);
+
+static uint16_t _rfm69_bitrate_reg(void);
+static uint64_t _rfm69_bytes_us(uint32_t bytes);
+static uint16_t _rfm69_preamble(void);
+static uint8_t _rfm69_sync_len(void);
+static bool _rfm69_can_hear(const host_frame_t* frame);
+static int16_t _rfm69_sensitivity(void);
+static uint32_t _rfm69_listen_us(uint8_t resolution, uint8_t coef);
+
+/**
+ * Put the radio back to its power on register values
+ */
+void rfm69_reset(void)
+{
+    memset(regs, 0, sizeof(regs));
+
+    regs[REG_OPMODE] = 0x04;
+    regs[REG_BITRATEMSB] = 0x1A;
+    regs[REG_BITRATELSB] = 0x0B;
+    regs[REG_FDEVLSB] = 0x52;
+    regs[REG_FRFMSB] = 0xE4;
+    regs[REG_FRFMID] = 0xC0;
+    regs[REG_PALEVEL] = 0x9F;
+    regs[REG_LISTEN1] = 0x92;
+    regs[REG_LISTEN2] = 0xF5;
+    regs[REG_LISTEN3] = 0x20;
+    regs[REG_VERSION] = 0x24;
+    regs[REG_RSSIVALUE] = 0xFF;
+    regs[REG_RSSITHRESH] = 0xE4;
+    regs[REG_PREAMBLELSB] = 0x03;
+    regs[REG_SYNCCONFIG] = 0x98;
+    regs[REG_PACKETCONFIG1] = 0x10;
+    regs[REG_PAYLOADLENGTH] = 0x40;
+    regs[REG_FIFOTHRESH] = 0x8F;
+    regs[REG_PACKETCONFIG2] = 0x02;
+
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        regs[REG_SYNCVALUE1 + i] = 0x01;
+    }
+
+    _rfm69_fifo_clear();
+
+    spi_selected = false;
+    mode = MODE_STDBY;
+    listen_on = false;
+    tx_active = false;
+    packet_sent = false;
+    rx_active = false;
+    sync_match = false;
+    payload_ready = false;
+    dio0_level = false;
+}
+
+/**
+ * Assert or release NSS, which frames each register access
+ *
+ * @param select Set to true to assert NSS
+ */
+void rfm69_select(bool select)
+{
+    spi_selected = select;
+    spi_first = select;
+}
+
+/**
+ * Clock one byte through the SPI interface. The first byte after NSS goes low
+ * is the address (MSB set to write), later bytes are data and the address
+ * increments, except for the FIFO.
+ *
+ * @param send_data Byte sent by the MCU
+ * @return          Byte returned by the radio
+ */
+uint8_t rfm69_transfer(uint8_t send_data)
+{
+    if (!spi_selected)
+    {
+        return 0xFF;
+    }
+
+    _rfm69_update(host_now_us());
+
+    uint8_t ret = 0x00;
+
+    if (spi_first)
+    {
+        spi_first = false;
+        spi_write = (send_data & 0x80);
+        spi_addr = send_data & 0x7F;
+    }
+    else
+    {
+        if (spi_write)
+        {
+            _rfm69_write(spi_addr, send_data);
+        }
+        else
+        {
+            ret = _rfm69_read(spi_addr);
+        }
+
+        if (spi_addr != REG_FIFO)
+        {
+            spi_addr = (spi_addr + 1) & 0x7F;
+        }
+    }
+
+    _rfm69_update_dio0();
+
+    return ret;
+}
+
+/**
+ * Set the function to call on a rising edge of DIO0, standing in for the
+ * pin change interrupt
+ *
+ * @param handler Function to call, 0x0 for none
+ */
+void rfm69_set_dio0_handler(void (*handler)(void))
+{
+    dio0_handler = handler;
+}
+
+/**
+ * Get the level of the DIO0 pin
+ *
+ * @return True if high
+ */
+bool rfm69_dio0(void)
+{
+    return dio0_level;
+}
+
+/**
+ * Find when the radio next needs servicing to move a transmission along or
+ * raise DIO0 for a frame that has arrived
+ *
+ * @return Virtual time in us, or HOST_NEVER
+ */
+uint64_t rfm69_next_event(void)
+{
+    if (_rfm69_dio0_level() && !dio0_level)
+    {
+        return host_now_us();
+    }
+
+    if (!tx_active || packet_sent)
+    {
+        return HOST_NEVER;
+    }
+
+    uint32_t header = _rfm69_preamble() + _rfm69_sync_len();
+
+    // Register accesses bring the transmission up to date, so the firmware only
+    // needs waking when it finishes or the FIFO would run dry first
+    uint16_t total = tx_total;
+
+    if (tx_sent == 0 && fifo_count > 0)
+    {
+        total = (regs[REG_PACKETCONFIG1] & 0x80) ?
+                (uint16_t)(fifo[fifo_head] + 1) : regs[REG_PAYLOADLENGTH];
+    }
+
+    if (tx_sent + fifo_count < total)
+    {
+        return tx_start + _rfm69_bytes_us(header + tx_sent + fifo_count);
+    }
+
+    return tx_start + _rfm69_bytes_us(header + total + 2);
+}
+
+/**
+ * Bring the radio up to date with the current time, raising DIO0 if needed
+ *
+ * @param now Virtual time in us
+ */
+void rfm69_service(uint64_t now)
+{
+    _rfm69_update(now);
+    _rfm69_update_dio0();
+}
+
+/**
+ * A frame has finished arriving over the air. Decide whether this radio
+ * would have picked it up, and if so present it through the FIFO. DIO0 is
+ * raised by the next rfm69_service(), so this can be called from outside the
+ * firmware's own context.
+ *
+ * @param frame Frame, with rssi set for this receiver
+ * @return      True if the frame was presented to the firmware
+ */
+bool rfm69_air_receive(const host_frame_t* frame)
+{
+    _rfm69_update(host_now_us());
+
+    if (!_rfm69_can_hear(frame))
+    {
+        return false;
+    }
+
+    // Packet engine drops frames longer than it was told to accept
+    uint8_t length = frame->data[0];
+
+    if (frame->size < 3 || length > regs[REG_PAYLOADLENGTH] ||
+            (uint16_t)(length + 3) > frame->size)
+    {
+        return false;
+    }
+
+    // Address filtering on the first byte after the length
+    uint8_t filter = (regs[REG_PACKETCONFIG1] >> 1) & 0x03;
+    uint8_t addr = frame->data[1];
+
+    if ((filter == 1 && addr != regs[REG_NODEADRS]) ||
+            (filter == 2 && addr != regs[REG_NODEADRS] &&
+                    addr != regs[REG_BROADCASTADRS]))
+    {
+        return false;
+    }
+
+    rx_frame = *frame;
+    rx_length = (uint16_t)(length + 1);
+    rx_pushed = 0;
+    rx_active = true;
+
+    // Check the CRC that came over the air
+    uint16_t crc = rfm69_crc(frame->data, rx_length);
+    rx_crc_ok = !(regs[REG_PACKETCONFIG1] & 0x10) ||
+            (frame->data[rx_length] == (crc >> 8) &&
+                    frame->data[rx_length + 1] == (crc & 0xFF));
+
+    int16_t rssi = frame->rssi > 0 ? 0 : frame->rssi;
+    regs[REG_RSSIVALUE] = (uint8_t)(-2 * rssi);
+
+    sync_match = true;
+    _rfm69_rx_feed();
+
+    // A bad CRC clears the FIFO unless CrcAutoClearOff is set
+    if (!rx_crc_ok && !(regs[REG_PACKETCONFIG1] & 0x08))
+    {
+        _rfm69_rx_drop();
+
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Work out the CRC the packet engine appends (CCITT, initial value 0x1D0F,
+ * inverted result)
+ *
+ * @param data_p Bytes to protect, starting with the length byte
+ * @param length Number of bytes
+ * @return       CRC value
+ */
+uint16_t rfm69_crc(const uint8_t* data_p, uint16_t length)
+{
+    uint16_t crc = 0x1D0F;
+
+    for (uint16_t i = 0; i < length; i++)
+    {
+        crc ^= (uint16_t)(data_p[i] << 8);
+
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) :
+                    (uint16_t)(crc << 1);
+        }
+    }
+
+    return (uint16_t)~crc;
+}
+
+/**
+ * Handle a register write
+ *
+ * @param address Register address
+ * @param data    Value written
+ */
+static void _rfm69_write(uint8_t address, uint8_t data)
+{
+    switch (address)
+    {
+        case REG_FIFO:
+            _rfm69_fifo_push(data);
+            _rfm69_tx_try_start();
+            break;
+        case REG_OPMODE:
+            _rfm69_set_mode(data);
+            break;
+        case REG_VERSION:
+        case REG_RSSIVALUE:
+        case REG_IRQFLAGS1:
+            // Read only
+            break;
+        case REG_IRQFLAGS2:
+            // Writing FifoOverrun clears the FIFO
+            if (data & 0x10)
+            {
+                _rfm69_rx_drop();
+            }
+            break;
+        case REG_PACKETCONFIG2:
+            // RestartRx drops any frame in progress, the bit self clears
+            if ((data & 0x04) && !payload_ready)
+            {
+                _rfm69_rx_drop();
+            }
+            regs[address] = data & (uint8_t)(~0x04);
+            break;
+        default:
+            regs[address] = data;
+            break;
+    }
+}
+
+/**
+ * Handle a register read
+ *
+ * @param address Register address
+ * @return        Register value
+ */
+static uint8_t _rfm69_read(uint8_t address)
+{
+    switch (address)
+    {
+        case REG_FIFO:
+        {
+            uint8_t data = _rfm69_fifo_pop();
+            _rfm69_rx_feed();
+            return data;
+        }
+        case REG_OPMODE:
+            return (uint8_t)((regs[REG_OPMODE] & 0x80) | (listen_on ? 0x40 : 0) |
+                    (mode << 2));
+        case REG_IRQFLAGS1:
+            return (uint8_t)(0x80 | (mode == MODE_RX ? 0x40 : 0) |
+                    (mode == MODE_TX ? 0x20 : 0) |
+                    (mode == MODE_TX || mode == MODE_RX || mode == MODE_FS ? 0x10 : 0) |
+                    (sync_match ? 0x01 : 0));
+        case REG_IRQFLAGS2:
+            return (uint8_t)((fifo_count == RFM69_FIFO_SIZE ? 0x80 : 0) |
+                    (fifo_count > 0 ? 0x40 : 0) |
+                    (fifo_count > (regs[REG_FIFOTHRESH] & 0x7F) ? 0x20 : 0) |
+                    (fifo_overrun ? 0x10 : 0) |
+                    (packet_sent ? 0x08 : 0) |
+                    (payload_ready ? 0x04 : 0) |
+                    (payload_ready && rx_crc_ok ? 0x02 : 0));
+        default:
+            return regs[address];
+    }
+}
+
+/**
+ * Apply a write to RegOpMode. Listen mode can only be left by setting
+ * ListenAbort in the same write that clears ListenOn.
+ *
+ * @param value Value written
+ */
+static void _rfm69_set_mode(uint8_t value)
+{
+    uint8_t new_mode = (value >> 2) & 0x07;
+    uint8_t old_mode = mode;
+    bool was_receiving = (mode == MODE_RX || listen_on);
+
+    regs[REG_OPMODE] = value & 0x80;
+
+    if (listen_on)
+    {
+        if (!(value & 0x20) || (value & 0x40))
+        {
+            return;
+        }
+
+        listen_on = false;
+    }
+    else if (value & 0x40)
+    {
+        listen_on = true;
+        new_mode = MODE_STDBY;
+    }
+
+    mode = new_mode;
+
+    // Leaving transmit abandons whatever was going out
+    if (old_mode == MODE_TX && mode != MODE_TX)
+    {
+        tx_active = false;
+        packet_sent = false;
+    }
+
+    // Sync match only holds while receiving, sleep loses the FIFO
+    if (was_receiving && mode != MODE_RX && !listen_on)
+    {
+        sync_match = false;
+    }
+
+    if (mode == MODE_SLEEP)
+    {
+        _rfm69_rx_drop();
+    }
+
+    if ((mode == MODE_RX || listen_on) && !was_receiving)
+    {
+        rx_since = host_now_us();
+    }
+
+    if (mode == MODE_TX && old_mode != MODE_TX)
+    {
+        packet_sent = false;
+        _rfm69_tx_try_start();
+    }
+}
+
+/**
+ * Move a transmission along: take bytes from the FIFO as they go out and
+ * finish the frame once the CRC has been sent
+ *
+ * @param now Virtual time in us
+ */
+static void _rfm69_update(uint64_t now)
+{
+    if (!tx_active || packet_sent)
+    {
+        return;
+    }
+
+    uint32_t header = _rfm69_preamble() + _rfm69_sync_len();
+
+    while (tx_sent < tx_total &&
+            tx_start + _rfm69_bytes_us(header + tx_sent) <= now)
+    {
+        // An empty FIFO here is an underrun, send something anyway and let the
+        // receiver's CRC catch it
+        uint8_t data = (fifo_count > 0) ? _rfm69_fifo_pop() : 0x00;
+
+        // Variable length frames carry their length in the first byte
+        if (tx_sent == 0)
+        {
+            tx_total = (regs[REG_PACKETCONFIG1] & 0x80) ?
+                    (uint16_t)(data + 1) : regs[REG_PAYLOADLENGTH];
+        }
+
+        tx_frame.data[tx_sent++] = data;
+    }
+
+    if (tx_sent == tx_total &&
+            tx_start + _rfm69_bytes_us(header + tx_total + 2) <= now)
+    {
+        _rfm69_tx_finish();
+    }
+}
+
+/**
+ * Work out the level DIO0 should be at from the mapping for the current mode
+ *
+ * @return True if DIO0 should be high
+ */
+static bool _rfm69_dio0_level(void)
+{
+    uint8_t mapping = regs[REG_DIOMAPPING1] >> 6;
+    bool level = false;
+
+    if (mode == MODE_TX)
+    {
+        level = (mapping == 0) ? packet_sent : (mapping == 1);
+    }
+    else if (mode == MODE_RX || listen_on || payload_ready)
+    {
+        switch (mapping)
+        {
+            case 0:
+                level = payload_ready && rx_crc_ok;
+                break;
+            case 1:
+                level = payload_ready;
+                break;
+            default:
+                level = sync_match;
+                break;
+        }
+    }
+
+    return level;
+}
+
+/**
+ * Raise or lower DIO0 according to the mapping for the current mode, calling
+ * the handler on a rising edge
+ */
+static void _rfm69_update_dio0(void)
+{
+    bool level = _rfm69_dio0_level();
+    bool rising = level && !dio0_level;
+    dio0_level = level;
+
+    if (rising && dio0_handler)
+    {
+        dio0_handler();
+    }
+}
+
+/**
+ * Add a byte to the FIFO
+ *
+ * @param data Byte to add
+ * @return     False if the FIFO was full and the byte was lost
+ */
+static bool _rfm69_fifo_push(uint8_t data)
+{
+    if (fifo_count == RFM69_FIFO_SIZE)
+    {
+        fifo_overrun = true;
+        return false;
+    }
+
+    fifo[(fifo_head + fifo_count) % RFM69_FIFO_SIZE] = data;
+    fifo_count++;
+
+    return true;
+}
+
+/**
+ * Take a byte from the FIFO
+ *
+ * @return Byte, zero if the FIFO was empty
+ */
+static uint8_t _rfm69_fifo_pop(void)
+{
+    if (fifo_count == 0)
+    {
+        return 0x00;
+    }
+
+    uint8_t data = fifo[fifo_head];
+    fifo_head = (fifo_head + 1) % RFM69_FIFO_SIZE;
+    fifo_count--;
+
+    return data;
+}
+
+/**
+ * Empty the FIFO and clear its overrun flag
+ */
+static void _rfm69_fifo_clear(void)
+{
+    fifo_head = 0;
+    fifo_count = 0;
+    fifo_overrun = false;
+}
+
+/**
+ * Start sending once in transmit mode with something in the FIFO (or above
+ * the threshold, depending on the start condition)
+ */
+static void _rfm69_tx_try_start(void)
+{
+    if (mode != MODE_TX || tx_active)
+    {
+        return;
+    }
+
+    bool start = (regs[REG_FIFOTHRESH] & 0x80) ? (fifo_count > 0) :
+            (fifo_count > (regs[REG_FIFOTHRESH] & 0x7F));
+
+    if (!start)
+    {
+        return;
+    }
+
+    tx_active = true;
+    tx_start = host_now_us();
+    tx_sent = 0;
+    tx_total = 1;
+    packet_sent = false;
+}
+
+/**
+ * The last CRC bit has gone, put the frame on air and flag packet sent
+ */
+static void _rfm69_tx_finish(void)
+{
+    uint32_t header = _rfm69_preamble() + _rfm69_sync_len();
+
+    uint16_t crc = rfm69_crc(tx_frame.data, tx_total);
+    tx_frame.data[tx_total] = (uint8_t)(crc >> 8);
+    tx_frame.data[tx_total + 1] = (uint8_t)(crc & 0xFF);
+    tx_frame.size = (uint16_t)(tx_total + 2);
+
+    tx_frame.start_us = tx_start;
+    tx_frame.sync_us = tx_start + _rfm69_bytes_us(header);
+    tx_frame.end_us = tx_start + _rfm69_bytes_us(header + tx_total + 2);
+    tx_frame.bitrate_reg = _rfm69_bitrate_reg();
+    tx_frame.fdev_reg = (uint16_t)(regs[REG_FDEVMSB] << 8 | regs[REG_FDEVLSB]);
+    tx_frame.frf_reg = (uint32_t)regs[REG_FRFMSB] << 16 |
+            (uint32_t)regs[REG_FRFMID] << 8 | regs[REG_FRFLSB];
+    tx_frame.sync_len = _rfm69_sync_len();
+    memcpy(tx_frame.sync, &regs[REG_SYNCVALUE1], sizeof(tx_frame.sync));
+    tx_frame.tx_power = (int8_t)(-18 + (regs[REG_PALEVEL] & 0x1F));
+    tx_frame.rssi = 0;
+
+    packet_sent = true;
+
+    host_air_transmit(&tx_frame);
+}
+
+/**
+ * Move bytes of the frame being received into the FIFO as room appears. Once
+ * all are in, payload ready sets if the CRC passed. Once they have all been
+ * read out the receiver restarts.
+ */
+static void _rfm69_rx_feed(void)
+{
+    if (!rx_active)
+    {
+        return;
+    }
+
+    while (rx_pushed < rx_length && fifo_count < RFM69_FIFO_SIZE)
+    {
+        _rfm69_fifo_push(rx_frame.data[rx_pushed++]);
+    }
+
+    if (rx_pushed == rx_length)
+    {
+        payload_ready = rx_crc_ok;
+
+        if (fifo_count == 0)
+        {
+            // Frame fully read, back to looking for the next one
+            rx_active = false;
+            payload_ready = false;
+            sync_match = false;
+        }
+    }
+}
+
+/**
+ * Throw away the frame being received along with the FIFO
+ */
+static void _rfm69_rx_drop(void)
+{
+    rx_active = false;
+    payload_ready = false;
+    sync_match = false;
+
+    _rfm69_fifo_clear();
+}
+
+/**
+ * Get the raw RegBitrate value
+ *
+ * @return Bitrate divider from the 32MHz crystal
+ */
+static uint16_t _rfm69_bitrate_reg(void)
+{
+    return (uint16_t)(regs[REG_BITRATEMSB] << 8 | regs[REG_BITRATELSB]);
+}
+
+/**
+ * Work out how long some bytes take on air. A bit lasts RegBitrate / 32MHz,
+ * so a byte lasts RegBitrate / 4 us.
+ *
+ * @param bytes Number of bytes
+ * @return      Time in us
+ */
+static uint64_t _rfm69_bytes_us(uint32_t bytes)
+{
+    return ((uint64_t)bytes * _rfm69_bitrate_reg()) / 4;
+}
+
+/**
+ * Get the preamble length
+ *
+ * @return Preamble bytes
+ */
+static uint16_t _rfm69_preamble(void)
+{
+    return (uint16_t)(regs[REG_PREAMBLEMSB] << 8 | regs[REG_PREAMBLELSB]);
+}
+
+/**
+ * Get the sync word length
+ *
+ * @return Sync word bytes, zero if sync is off
+ */
+static uint8_t _rfm69_sync_len(void)
+{
+    if (!(regs[REG_SYNCCONFIG] & 0x80))
+    {
+        return 0;
+    }
+
+    return (uint8_t)(((regs[REG_SYNCCONFIG] >> 3) & 0x07) + 1);
+}
+
+/**
+ * Decide whether the receiver was listening on the right settings, early
+ * enough and with a strong enough signal to pick a frame up
+ *
+ * @param frame Frame that has arrived
+ * @return      True if it would have been received
+ */
+static bool _rfm69_can_hear(const host_frame_t* frame)
+{
+    // Must still be receiving and have nothing waiting in the FIFO
+    if (!(mode == MODE_RX || listen_on) || rx_active || fifo_count > 0)
+    {
+        return false;
+    }
+
+    // Modulation and channel have to match
+    uint32_t frf = (uint32_t)regs[REG_FRFMSB] << 16 |
+            (uint32_t)regs[REG_FRFMID] << 8 | regs[REG_FRFLSB];
+
+    if (frame->bitrate_reg != _rfm69_bitrate_reg() || frame->frf_reg != frf ||
+            frame->fdev_reg != (uint16_t)(regs[REG_FDEVMSB] << 8 | regs[REG_FDEVLSB]))
+    {
+        return false;
+    }
+
+    // Sync word has to match if we are looking for one
+    uint8_t sync_len = _rfm69_sync_len();
+
+    if (sync_len != frame->sync_len ||
+            memcmp(frame->sync, &regs[REG_SYNCVALUE1], sync_len) != 0)
+    {
+        return false;
+    }
+
+    // Signal must beat both the sensitivity and the RSSI threshold
+    if (frame->rssi < _rfm69_sensitivity() ||
+            frame->rssi < -(int16_t)(regs[REG_RSSITHRESH] / 2))
+    {
+        return false;
+    }
+
+    // Receiver has to have been on for some of the preamble
+    uint64_t lock_by = frame->sync_us - _rfm69_bytes_us(sync_len +
+            RFM69_RX_SETTLE_BYTES);
+
+    if (!listen_on)
+    {
+        return rx_since <= lock_by;
+    }
+
+    // In listen mode one of the receive windows has to land in the preamble
+    uint32_t idle = _rfm69_listen_us(regs[REG_LISTEN1] >> 6, regs[REG_LISTEN2]);
+    uint32_t window = _rfm69_listen_us((regs[REG_LISTEN1] >> 4) & 0x03,
+            regs[REG_LISTEN3]);
+    uint64_t cycle = (uint64_t)idle + window;
+
+    if (cycle == 0 || lock_by <= rx_since)
+    {
+        return false;
+    }
+
+    uint64_t first = (frame->start_us > rx_since + idle) ?
+            (frame->start_us - rx_since - idle) / cycle : 0;
+
+    for (uint64_t k = first; k <= first + 1; k++)
+    {
+        uint64_t open = rx_since + idle + k * cycle;
+
+        if (open < lock_by && open + window > frame->start_us)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Estimate receiver sensitivity at the current bitrate
+ *
+ * @return Weakest usable signal in dBm
+ */
+static int16_t _rfm69_sensitivity(void)
+{
+    uint16_t bitrate_reg = _rfm69_bitrate_reg();
+
+    if (bitrate_reg >= 0x1A0B)
+    {
+        return -105;
+    }
+    else if (bitrate_reg >= 0x0683)
+    {
+        return -100;
+    }
+
+    return -94;
+}
+
+/**
+ * Convert a listen mode resolution and coefficient to a duration
+ *
+ * @param resolution ListenResol field, 1 to 3
+ * @param coef       ListenCoef register
+ * @return           Duration in us
+ */
+static uint32_t _rfm69_listen_us(uint8_t resolution, uint8_t coef)
+{
+    switch (resolution)
+    {
+        case 1:
+            return 64u * coef;
+        case 2:
+            return 4100u * coef;
+        case 3:
+            return 262000u * coef;
+        default:
+            return 0;
+    }
+}
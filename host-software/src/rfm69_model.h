@@ -0,0 +1,30 @@
+/**
+ * Software model of the RFM69W radio module for host builds - header file
+ * Emulates the SPI register and FIFO interface closely enough for the
+ * unmodified radio_control.c to run against it
+ */
+
+#ifndef RFM69_MODEL_H_
+#define RFM69_MODEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "host_env.h"
+
+void rfm69_reset(void);
+
+void rfm69_select(bool select);
+uint8_t rfm69_transfer(uint8_t send_data);
+
+void rfm69_set_dio0_handler(void (*handler)(void));
+bool rfm69_dio0(void);
+
+uint64_t rfm69_next_event(void);
+void rfm69_service(uint64_t now);
+
+bool rfm69_air_receive(const host_frame_t* frame);
+
+uint16_t rfm69_crc(const uint8_t* data_p, uint16_t length);
+
+#endif /* RFM69_MODEL_H_ */
@@ -0,0 +1,485 @@
+/**
+ * Packs each packet in radio_packets.h as its sender does and unpacks it as
+ * its receiver does, through the header both firmwares use, and checks every
+ * field comes back as it went in. Returns 0 if they all do:
+ *
+ *     test_radio_packets
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Application-specific headers */
+#include "radio_control.h"
+#include "radio_shared_types.h"
+#include "radio_packets.h"
+
+// Check a condition, noting where it failed
+#define CHECK(cond) _test_check((cond), #cond, __LINE__)
+
+static uint16_t checks = 0;
+static uint16_t failures = 0;
+
+/* Functions used only in this file */
+static void _test_check(bool passed, const char* text, int line);
+static bool _test_tx_time_clear(const uint8_t* data, uint8_t length);
+static void _test_beaconack(void);
+static void _test_beaconack_short(void);
+static void _test_ack(const radio_ack_t* sent, uint8_t length);
+static void _test_ack_short(void);
+static void _test_upload(void);
+static void _test_sack(void);
+static void _test_patch(void);
+static void _test_schedule(uint8_t count);
+static void _test_schedule_short(void);
+
+/**
+ * Run the tests
+ *
+ * @return 0 if they all passed
+ */
+int main(void)
+{
+    radio_ack_t ack;
+
+    _test_beaconack();
+    _test_beaconack_short();
+
+    // No slot, the shortest there is
+    memset(&ack, 0, sizeof(ack));
+    ack.time = 0x1FFFF;
+    ack.tx_power = -18;
+    ack.profile = 2;
+    ack.rx_time = 0x89ABCDEF;
+    _test_ack(&ack, RADIO_ACK_LEN);
+
+    // A slot, with the top bits of the times set and the clock running slow
+    ack.slot = true;
+    ack.next_wake = 0x1FFFE;
+    ack.next_wake_ms = 999;
+    ack.period = 0xFFFF;
+    ack.drift_ppm = -3000;
+    _test_ack(&ack, RADIO_ACK_LEN);
+
+    // Sub-slots for a relay
+    ack.children = RADIO_RELAY_MAX_CHILDREN;
+    ack.children_ms = 0xFEDC;
+    _test_ack(&ack, RADIO_ACK_LEN + RADIO_ACK_RELAY_LEN);
+
+    // A command and sub-slots, the longest there is
+    ack.command_id = 0xA5;
+    ack.command = CMD_RELAY;
+    ack.value = 0xBEEF;
+    _test_ack(&ack, RADIO_ACK_MAX_LEN);
+
+    // A command alone
+    ack.children = 0;
+    ack.children_ms = 0;
+    ack.drift_ppm = 2999;
+    _test_ack(&ack, RADIO_ACK_LEN + RADIO_COMMAND_LEN);
+
+    _test_ack_short();
+
+    _test_upload();
+    _test_sack();
+    _test_patch();
+    _test_schedule(0);
+    _test_schedule(1);
+    _test_schedule(RADIO_SCHEDULE_MAX_ENTRIES);
+    _test_schedule_short();
+
+    printf("%u checks, %u failed\n", checks, failures);
+
+    return failures ? 1 : 0;
+}
+
+/**
+ * Count a check, and say so if it failed
+ *
+ * @param passed Whether it held
+ * @param text   What was checked
+ * @param line   Where
+ */
+static void _test_check(bool passed, const char* text, int line)
+{
+    checks++;
+
+    if (!passed)
+    {
+        failures++;
+        printf("Line %d: %s failed\n", line, text);
+    }
+}
+
+/**
+ * See if a packed reply leaves its tx time for radio_send_timed() to fill in
+ *
+ * @param data   Packed reply
+ * @param length Its length
+ * @return       True if the last RADIO_TIMESTAMP_LEN bytes are 0
+ */
+static bool _test_tx_time_clear(const uint8_t* data, uint8_t length)
+{
+    for (uint8_t i = length - RADIO_TIMESTAMP_LEN; i < length; i++)
+    {
+        if (data[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Round trip a BEACONACK with every field at an awkward value
+ */
+static void _test_beaconack(void)
+{
+    radio_beaconack_t sent =
+    {
+        .time = 0x1ABCD,
+        .period = 0x10000,
+        .next_wake = 0x15180 - 1,
+        .next_wake_ms = 999,
+        .tx_power = -18,
+        .profile = RADIO_PROFILE_COUNT - 1,
+        .channel = RADIO_CHANNEL_COUNT - 1,
+        .rx_time = 0xFEDCBA98,
+    };
+    radio_beaconack_t got;
+    uint8_t data[RADIO_BEACONACK_LEN + 1];
+
+    memset(data, 0xFF, sizeof(data));
+
+    uint8_t length = radio_beaconack_pack(&sent, data);
+
+    CHECK(length == RADIO_BEACONACK_LEN);
+    CHECK(data[0] == PKT_BEACONACK);
+    CHECK(data[RADIO_BEACONACK_LEN] == 0xFF);
+    CHECK(_test_tx_time_clear(data, length));
+
+    CHECK(radio_beaconack_unpack(data, length, &got));
+    CHECK(got.time == sent.time);
+    CHECK(got.period == sent.period);
+    CHECK(got.next_wake == sent.next_wake);
+    CHECK(got.next_wake_ms == sent.next_wake_ms);
+    CHECK(got.tx_power == sent.tx_power);
+    CHECK(got.profile == sent.profile);
+    CHECK(got.channel == sent.channel);
+    CHECK(got.rx_time == sent.rx_time);
+
+    // The top bits alone
+    sent.time = 0x10000;
+    sent.period = 0;
+    sent.next_wake = 0x10000;
+    radio_beaconack_pack(&sent, data);
+
+    CHECK(radio_beaconack_unpack(data, length, &got));
+    CHECK(got.time == sent.time);
+    CHECK(got.period == sent.period);
+    CHECK(got.next_wake == sent.next_wake);
+}
+
+/**
+ * Read a BEACONACK from a relay from before channels, without the channel,
+ * and turn away ones too short or of another type
+ */
+static void _test_beaconack_short(void)
+{
+    radio_beaconack_t sent =
+    {
+        .time = 43210,
+        .period = 600,
+        .next_wake = 43333,
+        .next_wake_ms = 250,
+        .tx_power = 7,
+        .profile = 2,
+        .channel = 1,
+        .rx_time = 123456,
+    };
+    radio_beaconack_t got;
+    uint8_t data[RADIO_BEACONACK_LEN];
+
+    radio_beaconack_pack(&sent, data);
+
+    // Take the channel out as an older relay would
+    memmove(&data[12], &data[13], 2 * RADIO_TIMESTAMP_LEN);
+
+    CHECK(radio_beaconack_unpack(data, RADIO_BEACONACK_MIN_LEN, &got));
+    CHECK(got.time == sent.time);
+    CHECK(got.next_wake == sent.next_wake);
+    CHECK(got.next_wake_ms == sent.next_wake_ms);
+    CHECK(got.channel == RADIO_CHANNEL_CONTROL);
+    CHECK(got.rx_time == sent.rx_time);
+
+    CHECK(!radio_beaconack_unpack(data, RADIO_BEACONACK_MIN_LEN - 1, &got));
+
+    data[0] = PKT_ACK;
+    CHECK(!radio_beaconack_unpack(data, RADIO_BEACONACK_MIN_LEN, &got));
+}
+
+/**
+ * Round trip an ACK
+ *
+ * @param sent   Fields to send
+ * @param length Length it should pack to
+ */
+static void _test_ack(const radio_ack_t* sent, uint8_t length)
+{
+    radio_ack_t got;
+    uint8_t data[RADIO_ACK_MAX_LEN + 1];
+
+    memset(data, 0xFF, sizeof(data));
+    memset(&got, 0xFF, sizeof(got));
+
+    CHECK(radio_ack_length(sent) == length);
+    CHECK(radio_ack_pack(sent, data) == length);
+    CHECK(data[0] == PKT_ACK);
+    CHECK(data[length] == 0xFF);
+    CHECK(_test_tx_time_clear(data, length));
+
+    CHECK(radio_ack_unpack(data, length, &got));
+    CHECK(got.time == sent->time);
+    CHECK(got.tx_power == sent->tx_power);
+    CHECK(got.profile == sent->profile);
+    CHECK(got.slot == sent->slot);
+    CHECK(got.children == sent->children);
+    CHECK(got.children_ms == sent->children_ms);
+    CHECK(got.command_id == sent->command_id);
+    CHECK(got.command == sent->command);
+    CHECK(got.value == sent->value);
+    CHECK(got.rx_time == sent->rx_time);
+
+    // Without a slot the rest is left 0
+    if (sent->slot)
+    {
+        CHECK(got.next_wake == sent->next_wake);
+        CHECK(got.next_wake_ms == sent->next_wake_ms);
+        CHECK(got.period == sent->period);
+        CHECK(got.drift_ppm == sent->drift_ppm);
+    }
+    else
+    {
+        CHECK(got.next_wake == 0);
+        CHECK(got.next_wake_ms == 0);
+        CHECK(got.period == 0);
+        CHECK(got.drift_ppm == 0);
+    }
+}
+
+/**
+ * Turn away ACKs too short or of another type
+ */
+static void _test_ack_short(void)
+{
+    radio_ack_t sent;
+    radio_ack_t got;
+    uint8_t data[RADIO_ACK_MAX_LEN];
+
+    memset(&sent, 0, sizeof(sent));
+    radio_ack_pack(&sent, data);
+
+    CHECK(radio_ack_unpack(data, RADIO_ACK_LEN, &got));
+    CHECK(!radio_ack_unpack(data, RADIO_ACK_LEN - 1, &got));
+
+    data[0] = PKT_BEACONACK;
+    CHECK(!radio_ack_unpack(data, RADIO_ACK_LEN, &got));
+}
+
+/**
+ * Round trip an upload packet, and turn away beacons and patch requests
+ */
+static void _test_upload(void)
+{
+    radio_upload_t sent =
+    {
+        .seq = 0xFEDC,
+        .flags = RADIO_FLAG_LAST | RADIO_FLAG_POLL,
+        .backlog = 0xA5,
+        .length = 3,
+    };
+    radio_upload_t got;
+    uint8_t data[RADIO_UPLOAD_HEADER_LEN + 3] = {0, 0, 0, 0, 0x11, 0x22, 0x33};
+
+    memset(&got, 0xFF, sizeof(got));
+
+    CHECK(radio_upload_pack(&sent, data) == RADIO_UPLOAD_HEADER_LEN + 3);
+    CHECK(data[RADIO_UPLOAD_HEADER_LEN] == 0x11);
+
+    CHECK(radio_upload_unpack(data, sizeof(data), &got));
+    CHECK(got.seq == sent.seq);
+    CHECK(got.flags == sent.flags);
+    CHECK(got.backlog == sent.backlog);
+    CHECK(got.data == &data[RADIO_UPLOAD_HEADER_LEN]);
+    CHECK(got.length == sent.length);
+
+    // No data at all is still an upload
+    CHECK(radio_upload_unpack(data, RADIO_UPLOAD_HEADER_LEN, &got));
+    CHECK(got.length == 0);
+
+    // A beacon, [1],[1],[PKT_BEACON], is too short
+    CHECK(!radio_upload_unpack(data, RADIO_UPLOAD_HEADER_LEN - 1, &got));
+
+    data[2] = RADIO_FLAG_PATCH;
+    CHECK(!radio_upload_unpack(data, sizeof(data), &got));
+}
+
+/**
+ * Round trip a SACK, and turn away ones too short or of another type
+ */
+static void _test_sack(void)
+{
+    radio_sack_t sent = { .next = 0x1234, .have = 0x5A };
+    radio_sack_t got;
+    uint8_t data[RADIO_SACK_LEN + 1];
+
+    memset(data, 0xFF, sizeof(data));
+    memset(&got, 0xFF, sizeof(got));
+
+    CHECK(radio_sack_pack(&sent, data) == RADIO_SACK_LEN);
+    CHECK(data[0] == PKT_SACK);
+    CHECK(data[RADIO_SACK_LEN] == 0xFF);
+
+    CHECK(radio_sack_unpack(data, RADIO_SACK_LEN, &got));
+    CHECK(got.next == sent.next);
+    CHECK(got.have == sent.have);
+
+    CHECK(!radio_sack_unpack(data, RADIO_SACK_LEN - 1, &got));
+
+    data[0] = PKT_ACK;
+    CHECK(!radio_sack_unpack(data, RADIO_SACK_LEN, &got));
+}
+
+/**
+ * Round trip a patch request and a patch chunk, and turn away a request
+ * without its flag or a chunk with nothing in it
+ */
+static void _test_patch(void)
+{
+    radio_patch_request_t request = { .next = 0x0102, .have = 0x81 };
+    radio_patch_request_t request_got;
+    radio_patch_t sent =
+    {
+        .chunk = 0xABCD,
+        .chunks = 0xABCE,
+        .flags = RADIO_FLAG_POLL | RADIO_FLAG_LAST,
+        .length = RADIO_PATCH_CHUNK_LEN,
+    };
+    radio_patch_t got;
+    radio_upload_t upload;
+    uint8_t data[RADIO_PATCH_FRAME_LEN + 1];
+
+    memset(&request_got, 0xFF, sizeof(request_got));
+    memset(&got, 0xFF, sizeof(got));
+
+    CHECK(radio_patch_request_pack(&request, data) == RADIO_PATCH_REQUEST_LEN);
+    CHECK(radio_patch_request_unpack(data, RADIO_PATCH_REQUEST_LEN, &request_got));
+    CHECK(request_got.next == request.next);
+    CHECK(request_got.have == request.have);
+
+    // It mustn't be taken for an upload, nor an upload for it
+    CHECK(!radio_upload_unpack(data, RADIO_PATCH_REQUEST_LEN, &upload));
+    CHECK(!radio_patch_request_unpack(data, RADIO_PATCH_REQUEST_LEN - 1, &request_got));
+
+    data[2] = RADIO_FLAG_POLL;
+    CHECK(!radio_patch_request_unpack(data, RADIO_PATCH_REQUEST_LEN, &request_got));
+
+    memset(data, 0xFF, sizeof(data));
+
+    CHECK(radio_patch_pack(&sent, data) == RADIO_PATCH_FRAME_LEN);
+    CHECK(data[0] == PKT_PATCH);
+    CHECK(data[RADIO_PATCH_HEADER_LEN] == 0xFF);
+
+    CHECK(radio_patch_unpack(data, RADIO_PATCH_FRAME_LEN, &got));
+    CHECK(got.chunk == sent.chunk);
+    CHECK(got.chunks == sent.chunks);
+    CHECK(got.flags == sent.flags);
+    CHECK(got.data == &data[RADIO_PATCH_HEADER_LEN]);
+    CHECK(got.length == sent.length);
+
+    CHECK(!radio_patch_unpack(data, RADIO_PATCH_HEADER_LEN, &got));
+
+    data[0] = PKT_SACK;
+    CHECK(!radio_patch_unpack(data, RADIO_PATCH_FRAME_LEN, &got));
+}
+
+/**
+ * Round trip a SCHEDULE
+ *
+ * @param count Entries to send
+ */
+static void _test_schedule(uint8_t count)
+{
+    radio_schedule_t sent;
+    radio_schedule_t got;
+    uint8_t data[RADIO_SCHEDULE_HEADER_LEN + RADIO_SCHEDULE_MAX_ENTRIES *
+            RADIO_SCHEDULE_ENTRY_LEN + RADIO_TIMESTAMP_LEN + 1];
+
+    memset(data, 0xFF, sizeof(data));
+    memset(&got, 0, sizeof(got));
+
+    sent.version = 0xC3;
+    sent.count = count;
+
+    // The longest wait 24 bits hold
+    for (uint8_t i = 0; i < count; i++)
+    {
+        sent.entry[i].node = (uint8_t)(0xF0 + i);
+        sent.entry[i].wake_in_ms = 0xFFFFFFu - i;
+        sent.entry[i].period = (uint16_t)(0xFFFF - i);
+    }
+
+    uint8_t length = radio_schedule_pack(&sent, data);
+
+    CHECK(length == radio_schedule_length(count));
+    CHECK(data[0] == PKT_SCHEDULE);
+    CHECK(data[length] == 0xFF);
+    CHECK(_test_tx_time_clear(data, length));
+
+    // As radio_send_timed() would
+    _radio_put_le(&data[length - RADIO_TIMESTAMP_LEN], 0x89ABCDEF, RADIO_TIMESTAMP_LEN);
+
+    CHECK(radio_schedule_unpack(data, length, &got));
+    CHECK(got.version == sent.version);
+    CHECK(got.count == sent.count);
+    CHECK(got.tx_time == 0x89ABCDEF);
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        CHECK(got.entry[i].node == sent.entry[i].node);
+        CHECK(got.entry[i].wake_in_ms == sent.entry[i].wake_in_ms);
+        CHECK(got.entry[i].period == sent.entry[i].period);
+    }
+}
+
+/**
+ * Turn away a SCHEDULE too short for the entries it says it has, with more
+ * than there's room for, or of another type
+ */
+static void _test_schedule_short(void)
+{
+    radio_schedule_t sent;
+    radio_schedule_t got;
+    uint8_t data[RADIO_MAX_FRAME_LEN];
+
+    memset(&sent, 0, sizeof(sent));
+    memset(data, 0, sizeof(data));
+    sent.count = 2;
+
+    uint8_t length = radio_schedule_pack(&sent, data);
+
+    CHECK(radio_schedule_unpack(data, length, &got));
+    CHECK(!radio_schedule_unpack(data, length - 1, &got));
+
+    data[2] = RADIO_SCHEDULE_MAX_ENTRIES + 1;
+    CHECK(!radio_schedule_unpack(data, radio_schedule_length(RADIO_SCHEDULE_MAX_ENTRIES + 1),
+            &got));
+
+    data[2] = 2;
+    data[0] = PKT_PATCH;
+    CHECK(!radio_schedule_unpack(data, length, &got));
+}
@@ -0,0 +1,52 @@
+/**
+ * EFM32 Wireless Sensor Node bootloader
+ * Sits in the bottom OTA_BOOT_SIZE of flash. Applies a firmware patch the
+ * application has staged, or rolls one back, then starts the application,
+ * which is linked to start at OTA_APP_BASE. Built with ../src/ota_patch.c,
+ * printf.c and emlib's em_msc.c by the Bootloader configuration and linked
+ * with ../ldscripts/bootloader.ld.
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Peripheral control headers */
+#include "em_device.h"
+#include "em_chip.h"
+
+/* Application-specific headers */
+#include "radio_shared_types.h"
+#include "ota_patch.h"
+
+/**
+ * Main function. Updates the image if there's anything to do and jumps to it.
+ */
+int main(void)
+{
+    const uint32_t* vectors = (const uint32_t*)OTA_APP_BASE;
+
+    CHIP_Init();
+
+    ota_boot();
+
+    // The application's vector table comes first, its stack then reset handler
+    SCB->VTOR = OTA_APP_BASE;
+    __set_MSP(vectors[0]);
+    ((void (*)(void))vectors[1])();
+
+    while (true)
+    {
+
+    }
+}
+
+/**
+ * There's no debug output from the bootloader
+ *
+ * @param c Character to send
+ */
+void putchar(char c)
+{
+    (void)c;
+}
@@ -36,6 +36,24 @@ static uint8_t call_count;
 static uint8_t detect_state;
 static uint8_t transient_count;
 
+// Bounds for each DETECT_PROFILE_x
+static const detect_profile_t detect_profiles[DETECT_PROFILE_COUNT] =
+{
+    {
+        DETECT_HIGH_UB, DETECT_HIGH_LB, DETECT_LOW_UB, DETECT_LOW_LB,
+        DETECT_WAIT_F_UB, DETECT_WAIT_F_LB, DETECT_LOW_F_UB,
+        DETECT_MINCOUNT, DETECT_MAXCOUNT, DETECT_TRANSIENTTH
+    },
+    {
+        5250, 656, 5250, 656, // 4ms, 0.5ms
+        52500, 26250, 6563,   // 40ms, 20ms, 5ms
+        4, DETECT_MAXCOUNT, DETECT_TRANSIENTTH
+    }
+};
+
+// Bounds in use
+static const detect_profile_t* detect_profile = &detect_profiles[DETECT_PROFILE_DEFAULT];
+
 #ifdef DETECT_DEBUG_ON
 uint16_t debug_data_array[20] = {0};
 #endif
@@ -52,6 +70,24 @@ void detect_init(void)
     detect_state = DETECT_IDLE;
 }
 
+/**
+ * Choose the bounds calls are detected with, from the next edge on
+ *
+ * @param profile One of DETECT_PROFILE_x
+ * @return        False if there is no such profile
+ */
+bool detect_set_profile(uint8_t profile)
+{
+    if (profile >= DETECT_PROFILE_COUNT)
+    {
+        return false;
+    }
+
+    detect_profile = &detect_profiles[profile];
+
+    return true;
+}
+
 
 /**
  * Set up a timer for the detection system to use, default to the first state
@@ -79,7 +115,7 @@ static void _detect_timer_config(void)
     TIMER_Init(TIMER0, &timerInit);
 
     // Wrap around is about 1kHz
-    TIMER_TopSet(TIMER0, DETECT_HIGH_UB);
+    TIMER_TopSet(TIMER0, detect_profile->high_ub);
 
     // Enable the overflow interrupt
     TIMER_IntEnable(TIMER0, TIMER_IEN_OF);
@@ -168,7 +204,7 @@ void TIMER0_IRQHandler(void)
     	_detect_reset_to_idle();
     }
     // If we got enough hits, enable female detect mode
-    else if (call_count >= DETECT_MINCOUNT && detect_state != DETECT_WAIT_F)
+    else if (call_count >= detect_profile->mincount && detect_state != DETECT_WAIT_F)
     {
     	detect_state = DETECT_WAIT_F;
 
@@ -179,8 +215,8 @@ void TIMER0_IRQHandler(void)
         // Reset the timers
         TIMER_Enable(TIMER0, false);
         TIMER_CounterSet(TIMER0, 0);
-        TIMER_TopSet(TIMER0, DETECT_WAIT_F_UB);
-        TIMER_CounterSet(TIMER0, DETECT_LOW_UB);
+        TIMER_TopSet(TIMER0, detect_profile->wait_f_ub);
+        TIMER_CounterSet(TIMER0, detect_profile->low_ub);
         TIMER_Enable(TIMER0, true);
 
     }
@@ -206,7 +242,7 @@ void ACMP0_IRQHandler(void)
 
         case DETECT_HIGH:
             // Did this falling edge arrive approx 1ms after the rise?
-            if (timer_val > DETECT_HIGH_LB)
+            if (timer_val > detect_profile->high_lb)
             {
 #ifdef DETECT_DEBUG_ON
                 debug_data_array[2 * call_count] = timer_val;
@@ -224,12 +260,12 @@ void ACMP0_IRQHandler(void)
 				TIMER_CounterSet(TIMER0, 0);
 
                 // If we now have a full call, enter female mode
-				if (call_count >= DETECT_MAXCOUNT)
+				if (call_count >= detect_profile->maxcount)
 				{
 					detect_state = DETECT_WAIT_F;
 
 					// Set wait time for female call
-					TIMER_TopSet(TIMER0, DETECT_WAIT_F_UB);
+					TIMER_TopSet(TIMER0, detect_profile->wait_f_ub);
 				}
 				// Otherwise wait for the low period
 				else
@@ -237,7 +273,7 @@ void ACMP0_IRQHandler(void)
 					detect_state = DETECT_LOW;
 
 					// Set wait time for next high
-					TIMER_TopSet(TIMER0, DETECT_LOW_UB);
+					TIMER_TopSet(TIMER0, detect_profile->low_ub);
 				}
 
 				// Start timer
@@ -251,7 +287,7 @@ void ACMP0_IRQHandler(void)
 
         case DETECT_LOW:
             // Did this rising edge arrive approx 2ms after the fall?
-            if (timer_val > DETECT_LOW_LB)
+            if (timer_val > detect_profile->low_lb)
             {
 #ifdef DETECT_DEBUG_ON
                 debug_data_array[2 * (call_count - 1) + 1] = timer_val;
@@ -265,7 +301,7 @@ void ACMP0_IRQHandler(void)
 				// Reset the timers again
 				TIMER_Enable(TIMER0, false);
 				TIMER_CounterSet(TIMER0, 0);
-				TIMER_TopSet(TIMER0, DETECT_HIGH_UB);
+				TIMER_TopSet(TIMER0, detect_profile->high_ub);
 				TIMER_Enable(TIMER0, true);
             }
             else
@@ -274,7 +310,7 @@ void ACMP0_IRQHandler(void)
             }
             break;
         case DETECT_WAIT_F:
-        	if (timer_val > DETECT_WAIT_F_LB)
+        	if (timer_val > detect_profile->wait_f_lb)
         	{
 #if DETECT_DEBUG_ON
         		debug_data_array[17] = timer_val;
@@ -290,7 +326,7 @@ void ACMP0_IRQHandler(void)
                 // Reset the timers again
                 TIMER_Enable(TIMER0, false);
                 TIMER_CounterSet(TIMER0, 0);
-                TIMER_TopSet(TIMER0, DETECT_HIGH_UB);
+                TIMER_TopSet(TIMER0, detect_profile->high_ub);
                 TIMER_Enable(TIMER0, true);
         	}
         	else
@@ -299,7 +335,7 @@ void ACMP0_IRQHandler(void)
         	}
         	break;
         case DETECT_HIGH_F:
-        	if (timer_val > DETECT_HIGH_LB)
+        	if (timer_val > detect_profile->high_lb)
         	{
 #if DETECT_DEBUG_ON
         		debug_data_array[18] = timer_val;
@@ -314,7 +350,7 @@ void ACMP0_IRQHandler(void)
                 // Reset the timers again
                 TIMER_Enable(TIMER0, false);
                 TIMER_CounterSet(TIMER0, 0);
-                TIMER_TopSet(TIMER0, DETECT_LOW_UB);
+                TIMER_TopSet(TIMER0, detect_profile->low_ub);
                 TIMER_Enable(TIMER0, true);
         	}
         	else
@@ -350,7 +386,7 @@ void ACMP0_IRQHandler(void)
             // Reset the timers again
             TIMER_Enable(TIMER0, false);
             TIMER_CounterSet(TIMER0, 0);
-            TIMER_TopSet(TIMER0, DETECT_LOW_UB);
+            TIMER_TopSet(TIMER0, detect_profile->low_ub);
             TIMER_Enable(TIMER0, true);
             break;
     }
@@ -378,7 +414,7 @@ static void _detect_start_new(void)
 	// Reset the timers
 	TIMER_Enable(TIMER0, false);
 	TIMER_CounterSet(TIMER0, 0);
-	TIMER_TopSet(TIMER0, DETECT_HIGH_UB);
+	TIMER_TopSet(TIMER0, detect_profile->high_ub);
 	TIMER_Enable(TIMER0, true);
 
 	TIMER_IntClear(TIMER0, TIMER_IFC_OF);
@@ -394,7 +430,7 @@ static void _detect_transient_handler(void)
     // probably hearing something else
     transient_count++;
 
-    if (transient_count > DETECT_TRANSIENTTH)
+    if (transient_count > detect_profile->transient_th)
     {
         // Reject and reset
         _detect_reset_to_idle();
@@ -432,7 +468,7 @@ static void _detect_reset_to_idle(void)
     // Stop and reset the timer for next detect
     TIMER_Enable(TIMER0, false);
     TIMER_CounterSet(TIMER0, 0);
-    TIMER_TopSet(TIMER0, DETECT_HIGH_UB);
+    TIMER_TopSet(TIMER0, detect_profile->high_ub);
     TIMER_IntClear(TIMER0, TIMER_IFC_OF);
     NVIC_ClearPendingIRQ(TIMER0_IRQn);
 
@@ -440,7 +476,7 @@ static void _detect_reset_to_idle(void)
     CMU_ClockEnable(cmuClock_TIMER0, false);
 
     // Mark a detection if we got enough
-    if (call_count >= DETECT_MINCOUNT)
+    if (call_count >= detect_profile->mincount)
     {
     	status_led_set(STATUS_YELLOW, true);
         store_call(false, call_count);
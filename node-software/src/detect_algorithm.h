@@ -24,6 +24,31 @@
 
 #define DETECT_TRANSIENTTH     5
 
+// Sets of bounds the base station can choose between. The default is the one
+// above, the wide one takes clicks of 0.5-4ms and calls of four clicks for
+// sites where the default misses quiet or distant calls
+#define DETECT_PROFILE_SBC     0
+#define DETECT_PROFILE_WIDE    1
+#define DETECT_PROFILE_COUNT   2
+#define DETECT_PROFILE_DEFAULT DETECT_PROFILE_SBC
+
+/**
+ * Bounds the detection runs with, in timer counts as above
+ */
+typedef struct
+{
+    uint16_t high_ub;
+    uint16_t high_lb;
+    uint16_t low_ub;
+    uint16_t low_lb;
+    uint16_t wait_f_ub;
+    uint16_t wait_f_lb;
+    uint16_t low_f_ub;
+    uint8_t mincount;
+    uint8_t maxcount;
+    uint8_t transient_th;
+} detect_profile_t;
+
 // State declarations
 #define DETECT_IDLE 0
 #define DETECT_HIGH 1
@@ -34,5 +59,6 @@
 
 
 void detect_init(void);
+bool detect_set_profile(uint8_t profile);
 
 #endif /* DETECT_ALGORITHM_H_ */
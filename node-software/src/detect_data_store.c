@@ -46,9 +46,21 @@ void store_other(data_type_t data_type, uint8_t otherdata)
     data_type &= 0x7F;
     data_type |= flag ? 0x80 : 0x0;
 
-    data_array[data_write_index].time = counter;
-    data_array[data_write_index].type = data_type;
-    data_array[data_write_index].otherdata = otherdata;
+    data_struct_t record;
+    record.time = counter;
+    record.type = data_type;
+    record.otherdata = otherdata;
+
+    store_record(&record);
+}
+
+/**
+ * Store a record as it is, one relayed from another node
+ * @param record Record to store, its time already set
+ */
+void store_record(const data_struct_t* record)
+{
+    data_array[data_write_index] = *record;
 
     data_write_index++;
 
@@ -13,6 +13,7 @@
 
 void store_call(bool female, uint8_t clicks);
 void store_other(data_type_t data_type, uint8_t data);
+void store_record(const data_struct_t* record);
 
 uint16_t store_get_size(void);
 uint16_t store_get_write_position(void);
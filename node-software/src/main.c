@@ -25,6 +25,7 @@
 #include "ext_sensor.h"
 #include "radio_protocol.h"
 #include "status_leds.h"
+#include "node_config.h"
 #include "printf.h"
 
 /* Functions used only in this file */
@@ -76,6 +77,9 @@ int main(void)
 
     printf("Detection ready\r\n");
 
+    // Take up the settings the base station last gave us
+    config_init();
+
     // Configure sensors
     if (!sensors_init())
     {
@@ -100,7 +104,9 @@ int main(void)
     // Remain in sleep mode unless woken by interrupt
     while (true)
     {
+        radio_service();
         proto_run();
+        rtc_run();
         power_sleep();
     }
 }
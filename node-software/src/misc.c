@@ -17,7 +17,13 @@
 #include "misc.h"
 #include "power_management.h"
 
-static volatile bool _delay_active = false;
+// Compare channel interrupts of the delays running. The timer counts freely
+// while any are, each delay waiting for the count on its own channel
+static volatile uint32_t _timer_running = 0;
+
+/* Functions used only in this file */
+static void _misc_timer_start(uint32_t flag, uint8_t channel, uint16_t ms);
+static void _misc_timer_stop(uint32_t flag);
 
 /**
  * Do all the run-once config for the delay timer
@@ -35,7 +41,7 @@ void misc_delay_init(void)
         .enable = false,
         .fallAction = timerInputActionStop,
         .mode = timerModeUp,
-        .oneShot = true,
+        .oneShot = false,
         .prescale = timerPrescale1024,
         .quadModeX4 = false,
         .riseAction = timerInputActionReloadStart,
@@ -43,9 +49,14 @@ void misc_delay_init(void)
     };
 
     TIMER_Init(TIMER1, &timerInit);
+    TIMER_TopSet(TIMER1, 0xFFFF);
+
+    // One compare channel for misc_delay(), one for misc_timeout()
+    TIMER_InitCC_TypeDef ccInit = TIMER_INITCC_DEFAULT;
+    ccInit.mode = timerCCModeCompare;
 
-    // Enable the overflow interrupt
-    TIMER_IntEnable(TIMER1, TIMER_IEN_OF);
+    TIMER_InitCC(TIMER1, 0, &ccInit);
+    TIMER_InitCC(TIMER1, 1, &ccInit);
 
     NVIC_ClearPendingIRQ(TIMER1_IRQn);
     NVIC_EnableIRQ(TIMER1_IRQn);
@@ -63,26 +74,12 @@ void misc_delay_init(void)
  */
 void misc_delay(uint16_t ms, bool block)
 {
-    // Calculate how many ticks this is
-    uint16_t delay_ticks = get_ticks_from_ms(ms, 1024);
-
-    // Power up the timer
-    CMU_ClockEnable(cmuClock_TIMER1, true);
-
-    // Keep clocks on
-    power_set_minimum(PWR_DELAY, PWR_EM1);
-
-    // Indicate we have a delay in progress
-    _delay_active = true;
-
-    // Set calculated wrap value and start
-    TIMER_TopSet(TIMER1, delay_ticks);
-    TIMER_Enable(TIMER1, true);
+    _misc_timer_start(TIMER_IF_CC0, 0, ms);
 
     // Wait for timeout
     if (block)
     {
-        while (_delay_active)
+        while (misc_delay_active())
         {
             power_sleep();
         }
@@ -95,27 +92,130 @@ void misc_delay(uint16_t ms, bool block)
  */
 bool misc_delay_active(void)
 {
-    return _delay_active;
+    return (_timer_running & TIMER_IF_CC0) != 0;
+}
+
+/**
+ * Stop a running delay early, releasing the timer if the timeout isn't running
+ */
+void misc_delay_cancel(void)
+{
+    _misc_timer_stop(TIMER_IF_CC0);
+}
+
+/**
+ * Start a timeout, which runs alongside misc_delay() on its own channel so
+ * neither cuts the other short. Check misc_timeout_active() after each wake
+ *
+ * @param ms Time in ms until it runs out. Do not exceed 3.19 seconds
+ */
+void misc_timeout(uint16_t ms)
+{
+    _misc_timer_start(TIMER_IF_CC1, 1, ms);
+}
+
+/**
+ * Check if a timeout is still running
+ * @return True if it hasn't run out or been cancelled
+ */
+bool misc_timeout_active(void)
+{
+    return (_timer_running & TIMER_IF_CC1) != 0;
 }
 
 /**
- * Handle timer expiry - clear the delay flag
+ * Stop a running timeout early, releasing the timer if no delay is running
+ */
+void misc_timeout_cancel(void)
+{
+    _misc_timer_stop(TIMER_IF_CC1);
+}
+
+/**
+ * Handle a delay or timeout running out
  */
 void TIMER1_IRQHandler(void)
 {
-    _delay_active = false;
+    uint32_t flags = TIMER_IntGetEnabled(TIMER1);
 
-    TIMER_IntClear(TIMER1, TIMER_IFC_OF);
+    TIMER_IntClear(TIMER1, flags);
 
-    misc_delay_cancel();
+    _misc_timer_stop(flags & (TIMER_IF_CC0 | TIMER_IF_CC1));
 }
 
-void misc_delay_cancel(void)
+/**
+ * Start the timer if it isn't already counting and set a channel to go off
+ * after a time
+ *
+ * @param flag    TIMER_IF_CCn of the channel
+ * @param channel Channel to use
+ * @param ms      Time in ms until it goes off
+ */
+static void _misc_timer_start(uint32_t flag, uint8_t channel, uint16_t ms)
 {
-    // Make sure the timer stopped, power it down
-    TIMER_Enable(TIMER1, false);
-    CMU_ClockEnable(cmuClock_TIMER1, false);
+    uint32_t ticks = get_ticks_from_ms(ms, 1024);
 
-    // Remove our requirement to keep the clocks up
-    power_set_minimum(PWR_DELAY, PWR_EM3);
+    // At least far enough ahead that the count can't pass it while it's set
+    if (ticks < 2)
+    {
+        ticks = 2;
+    }
+    else if (ticks > 0xFFFF)
+    {
+        ticks = 0xFFFF;
+    }
+
+    // Called from interrupts as well as the main loop
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    // Power up the timer and keep clocks on
+    CMU_ClockEnable(cmuClock_TIMER1, true);
+    power_set_minimum(PWR_DELAY, PWR_EM1);
+    TIMER_Enable(TIMER1, true);
+
+    TIMER_CompareSet(TIMER1, channel, (TIMER_CounterGet(TIMER1) + ticks) & 0xFFFF);
+    TIMER_IntClear(TIMER1, flag);
+    TIMER_IntEnable(TIMER1, flag);
+
+    _timer_running |= flag;
+
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Stop channels going off, then stop the timer and release it if none are left
+ *
+ * @param flag TIMER_IF_CCn of the channels
+ */
+static void _misc_timer_stop(uint32_t flag)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    if (_timer_running & flag)
+    {
+        TIMER_IntDisable(TIMER1, flag);
+        _timer_running &= ~flag;
+
+        if (!_timer_running)
+        {
+            // Make sure the timer stopped, power it down
+            TIMER_Enable(TIMER1, false);
+            CMU_ClockEnable(cmuClock_TIMER1, false);
+
+            // Remove our requirement to keep the clocks up
+            power_set_minimum(PWR_DELAY, PWR_EM3);
+        }
+    }
+
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Reset the chip, which runs the bootloader before starting again
+ */
+void misc_reset(void)
+{
+    NVIC_SystemReset();
 }
@@ -16,6 +16,10 @@ void misc_delay(uint16_t ms, bool block);
 bool misc_delay_active(void);
 void misc_delay_init(void);
 void misc_delay_cancel(void);
+void misc_timeout(uint16_t ms);
+bool misc_timeout_active(void);
+void misc_timeout_cancel(void);
+void misc_reset(void);
 
 
 #endif /* MISC_H_ */
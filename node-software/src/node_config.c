@@ -0,0 +1,200 @@
+/**
+ * Settings the base station can change at run time
+ * They arrive as commands on the ACKs, and are kept in the user data page of
+ * flash so a node that resets comes back up the way it was told to run rather
+ * than the way it was built
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Peripheral control headers */
+#include "em_device.h"
+#include "em_msc.h"
+
+/* Application-specific headers */
+#include "node_config.h"
+#include "radio_control.h"
+#include "radio_shared_types.h"
+#include "detect_algorithm.h"
+#include "status_leds.h"
+#include "printf.h"
+
+// Marks settings written by this version of the layout. Change it whenever
+// node_config_t changes so older settings are dropped instead of misread
+#define CONFIG_MAGIC 0x53424301u
+
+/**
+ * Settings as written to flash, a whole number of words
+ */
+typedef struct
+{
+    uint32_t magic;
+    node_config_t config;
+    uint16_t check;
+} config_record_t;
+
+// Settings in use
+static node_config_t config;
+
+/* Functions used only in this file */
+static void _config_defaults(void);
+static void _config_apply(void);
+static void _config_save(void);
+static uint16_t _config_check(const node_config_t* settings);
+
+/**
+ * Read the settings out of flash, or start from the ones built in if there
+ * aren't any, and put them into effect
+ */
+void config_init(void)
+{
+    const config_record_t* record = (const config_record_t*)USERDATA_BASE;
+
+    if (record->magic == CONFIG_MAGIC &&
+            record->check == _config_check(&record->config))
+    {
+        config = record->config;
+        printf("Settings read from flash\r\n");
+    }
+    else
+    {
+        _config_defaults();
+    }
+
+    _config_apply();
+}
+
+/**
+ * Get the settings in use
+ *
+ * @return The settings, valid until the next config_set()
+ */
+const node_config_t* config_get(void)
+{
+    return &config;
+}
+
+/**
+ * Change a setting as the base station says, and keep it in flash. Flash is
+ * only written if the setting changes, the base sends the same command again
+ * until it hears the node has taken it
+ *
+ * @param command One of the CMD_x settings
+ * @param value   What to set it to
+ * @return        False if there is no such setting or the value is out of range
+ */
+bool config_set(uint8_t command, uint16_t value)
+{
+    node_config_t updated = config;
+
+    switch (command)
+    {
+        case CMD_DETECT_PROFILE:
+            if (value >= DETECT_PROFILE_COUNT)
+            {
+                return false;
+            }
+            updated.detect_profile = (uint8_t)value;
+            break;
+        case CMD_TXPOWER_MAX:
+            if ((int16_t)value < RADIO_TXPOWER_MIN || (int16_t)value > RADIO_TXPOWER_MAX)
+            {
+                return false;
+            }
+            updated.txpower_max = (int8_t)value;
+            break;
+        case CMD_LED_POLICY:
+            if (value >= STATUS_POLICY_COUNT)
+            {
+                return false;
+            }
+            updated.led_policy = (uint8_t)value;
+            break;
+        case CMD_SAMPLE_PERIOD:
+            updated.sample_period = value;
+            break;
+        case CMD_RELAY:
+            if (value > 1)
+            {
+                return false;
+            }
+            updated.relay = (uint8_t)value;
+            break;
+        default:
+            return false;
+    }
+
+    if (memcmp(&updated, &config, sizeof(config)) != 0)
+    {
+        config = updated;
+        _config_apply();
+        _config_save();
+    }
+
+    return true;
+}
+
+/**
+ * Use the settings the node was built with
+ */
+static void _config_defaults(void)
+{
+    config.detect_profile = DETECT_PROFILE_DEFAULT;
+    config.txpower_max = RADIO_TXPOWER_MAX;
+    config.led_policy = STATUS_POLICY_BUTTON;
+    config.relay = 0;
+    config.sample_period = 0;
+}
+
+/**
+ * Put the settings other modules don't read for themselves into effect
+ */
+static void _config_apply(void)
+{
+    detect_set_profile(config.detect_profile);
+    status_set_policy(config.led_policy);
+}
+
+/**
+ * Write the settings in use to the user data page
+ */
+static void _config_save(void)
+{
+    config_record_t record;
+
+    record.magic = CONFIG_MAGIC;
+    record.config = config;
+    record.check = _config_check(&config);
+
+    MSC_Init();
+
+    if (MSC_ErasePage((uint32_t*)USERDATA_BASE) != mscReturnOk ||
+            MSC_WriteWord((uint32_t*)USERDATA_BASE, &record, sizeof(record)) != mscReturnOk)
+    {
+        printf("Settings not saved to flash\r\n");
+    }
+
+    MSC_Deinit();
+}
+
+/**
+ * Work out the check word kept with the settings
+ *
+ * @param settings Settings to check
+ * @return         Sum of their bytes, inverted
+ */
+static uint16_t _config_check(const node_config_t* settings)
+{
+    const uint8_t* bytes = (const uint8_t*)settings;
+    uint16_t sum = 0;
+
+    for (uint8_t i = 0; i < sizeof(node_config_t); i++)
+    {
+        sum += bytes[i];
+    }
+
+    return (uint16_t)~sum;
+}
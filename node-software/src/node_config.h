@@ -0,0 +1,24 @@
+/**
+ * Settings the base station can change at run time - header file
+ */
+
+#ifndef NODE_CONFIG_H_
+#define NODE_CONFIG_H_
+
+/**
+ * Node settings, as kept in flash
+ */
+typedef struct
+{
+    uint8_t detect_profile;   //!< One of DETECT_PROFILE_x
+    int8_t txpower_max;       //!< Most TX power to use in dBm
+    uint8_t led_policy;       //!< One of STATUS_POLICY_x
+    uint8_t relay;            //!< 1 to relay for nodes out of the base's range
+    uint16_t sample_period;   //!< Least seconds between sensor readings
+} node_config_t;
+
+void config_init(void);
+const node_config_t* config_get(void);
+bool config_set(uint8_t command, uint16_t value);
+
+#endif /* NODE_CONFIG_H_ */
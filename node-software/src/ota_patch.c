@@ -0,0 +1,539 @@
+/**
+ * Firmware updates over the radio
+ * The application writes the patch the base station sends into the staging
+ * pages at the top of flash. On the next reset the bootloader rewrites the
+ * image in place a page at a time, each page going through the scratch page
+ * first and each step going into the log, so if the power goes it carries on
+ * from where it was. The new image then has OTA_TRIAL_BOOTS boots to register
+ * with the base and confirm it works, or the reverse patch that came with it
+ * puts the old image back.
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Peripheral control headers */
+#include "em_device.h"
+#include "em_msc.h"
+
+/* Application-specific headers */
+#include "radio_shared_types.h"
+#include "ota_patch.h"
+#include "printf.h"
+
+// Log entries are [mark(8)],[argument(24)] words, written in turn into the
+// erased log page. Arguments about a patch are [patch(8)],[page(16)]
+#define OTA_LOG_STAGED    0x01 //!< Patch staged and checked, argument is its id
+#define OTA_LOG_SCRATCH   0x02 //!< New page written to the scratch page
+#define OTA_LOG_PAGE      0x03 //!< New page copied into the image
+#define OTA_LOG_APPLIED   0x04 //!< Whole image written and checked
+#define OTA_LOG_FAILED    0x05 //!< Patch couldn't be applied
+#define OTA_LOG_BOOT      0x06 //!< New image started on trial
+#define OTA_LOG_CONFIRMED 0x07 //!< New image registered with the base
+#define OTA_LOG_WORDS     (FLASH_PAGE_SIZE / 4)
+
+// Patches staged, in the order they're sent
+#define OTA_FORWARD 0
+#define OTA_REVERSE 1
+
+/**
+ * What the log says has happened
+ */
+typedef struct
+{
+    uint16_t used;       //!< Words written
+    bool staged;         //!< A patch is staged
+    uint16_t id;         //!< Its id
+    uint16_t pages[2];   //!< Pages each patch has copied into the image
+    int32_t scratch[2];  //!< Page each patch has in the scratch page, -1 for none
+    bool applied[2];     //!< Patch has been applied
+    bool failed[2];      //!< Patch couldn't be applied
+    uint8_t boots;       //!< Times the new image has started
+    bool confirmed;      //!< New image works
+} ota_log_t;
+
+/* Functions used only in this file */
+static void _ota_log_read(ota_log_t* log);
+static void _ota_log_write(ota_log_t* log, uint8_t mark, uint32_t argument);
+static bool _ota_header(uint8_t patch, radio_patch_header_t* header, const uint8_t** ops);
+static bool _ota_apply(uint8_t patch, ota_log_t* log);
+static bool _ota_build_page(const radio_patch_header_t* header, const uint8_t* ops,
+        uint16_t page, uint8_t* data);
+static bool _ota_write_page(uintptr_t address, const uint32_t* data);
+
+/**
+ * Work out the CRC-32 (as used by zip) of some bytes, carrying on from the CRC
+ * of the ones before
+ *
+ * @param crc    CRC so far, 0 to start
+ * @param data   Bytes to add
+ * @param length Number of bytes
+ * @return       CRC including them
+ */
+uint32_t ota_crc32(uint32_t crc, const uint8_t* data, uint32_t length)
+{
+    crc = ~crc;
+
+    while (length--)
+    {
+        crc ^= *data++;
+
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 0x1)));
+        }
+    }
+
+    return ~crc;
+}
+
+/**
+ * Get ready to fetch a patch, unless it's already been fetched
+ *
+ * @param id Id of the patch, the bottom 16 bits of the new image's CRC-32
+ * @return   OTA_FETCH if it has to be fetched, which erases anything staged
+ *           before, otherwise whether it's waiting to be applied
+ */
+ota_state_t ota_stage_begin(uint16_t id)
+{
+    ota_log_t log;
+
+    _ota_log_read(&log);
+
+    if (log.staged && log.id == id)
+    {
+        return (log.applied[OTA_FORWARD] || log.failed[OTA_FORWARD]) ? OTA_DONE : OTA_STAGED;
+    }
+
+    MSC_Init();
+
+    for (uintptr_t address = OTA_LOG_BASE; address < OTA_STAGE_BASE + RADIO_PATCH_MAX_LEN;
+            address += FLASH_PAGE_SIZE)
+    {
+        MSC_ErasePage((uint32_t*)address);
+    }
+
+    MSC_Deinit();
+
+    return OTA_FETCH;
+}
+
+/**
+ * Write a chunk of the patch being fetched into the staging pages
+ *
+ * @param chunk  Which chunk it is, each is RADIO_PATCH_CHUNK_LEN bytes on from
+ *               the last
+ * @param data   Chunk of the patch
+ * @param length Bytes in it, only the last may be short
+ * @return       False if it doesn't fit or couldn't be written
+ */
+bool ota_stage_chunk(uint16_t chunk, const uint8_t* data, uint8_t length)
+{
+    uint32_t words[RADIO_PATCH_CHUNK_LEN / 4];
+    uint32_t offset = (uint32_t)chunk * RADIO_PATCH_CHUNK_LEN;
+
+    if (length > RADIO_PATCH_CHUNK_LEN || offset + length > RADIO_PATCH_MAX_LEN)
+    {
+        return false;
+    }
+
+    memset(words, 0xFF, sizeof(words));
+    memcpy(words, data, length);
+
+    MSC_Init();
+
+    bool written = MSC_WriteWord((uint32_t*)(OTA_STAGE_BASE + offset), words,
+            (length + 3u) & ~3u) == mscReturnOk;
+
+    MSC_Deinit();
+
+    return written;
+}
+
+/**
+ * Check a patch once all of it is staged, and leave it for the bootloader if
+ * it's good. A patch for some other image is logged as failed so it isn't
+ * fetched again
+ *
+ * @param id     Id of the patch
+ * @param length Bytes staged
+ * @return       OTA_STAGED if it will be applied, OTA_DONE if it isn't for
+ *               this image, or OTA_FETCH if it has to be fetched again
+ */
+ota_state_t ota_stage_end(uint16_t id, uint32_t length)
+{
+    radio_patch_header_t forward;
+    radio_patch_header_t reverse;
+    const uint8_t* forward_ops;
+    const uint8_t* reverse_ops;
+
+    if (!_ota_header(OTA_FORWARD, &forward, &forward_ops) ||
+            !_ota_header(OTA_REVERSE, &reverse, &reverse_ops) ||
+            (uint32_t)(reverse_ops + reverse.length - (const uint8_t*)OTA_STAGE_BASE) > length ||
+            ota_crc32(0, forward_ops, forward.length) != forward.ops_crc ||
+            ota_crc32(0, reverse_ops, reverse.length) != reverse.ops_crc ||
+            (forward.new_crc & 0xFFFF) != id)
+    {
+        printf("Patch %d is corrupt\r\n", id);
+        return OTA_FETCH;
+    }
+
+    ota_log_t log;
+
+    _ota_log_read(&log);
+    _ota_log_write(&log, OTA_LOG_STAGED, id);
+
+    // Both ways have to be between this image and one that fits
+    if (reverse.old_length != forward.new_length || reverse.old_crc != forward.new_crc ||
+            reverse.new_length != forward.old_length || reverse.new_crc != forward.old_crc ||
+            forward.old_length > OTA_APP_SIZE || forward.new_length > OTA_APP_SIZE ||
+            ota_crc32(0, (const uint8_t*)OTA_APP_BASE, forward.old_length) != forward.old_crc)
+    {
+        _ota_log_write(&log, OTA_LOG_FAILED, (uint32_t)OTA_FORWARD << 16);
+
+        printf("Patch %d isn't for this firmware\r\n", id);
+        return OTA_DONE;
+    }
+
+    printf("Patch %d staged\r\n", id);
+
+    return OTA_STAGED;
+}
+
+/**
+ * Note that a new image works, once it has registered with the base, so the
+ * bootloader keeps it
+ */
+void ota_confirm(void)
+{
+    ota_log_t log;
+
+    _ota_log_read(&log);
+
+    if (log.applied[OTA_FORWARD] && !log.confirmed && !log.pages[OTA_REVERSE] &&
+            log.scratch[OTA_REVERSE] < 0 && !log.failed[OTA_REVERSE])
+    {
+        _ota_log_write(&log, OTA_LOG_CONFIRMED, 0);
+
+        printf("New firmware confirmed\r\n");
+    }
+}
+
+/**
+ * Run by the bootloader before starting the application. Applies a staged
+ * patch, or finishes applying one if the power went part way, and puts the
+ * old image back if the new one hasn't been confirmed in OTA_TRIAL_BOOTS boots
+ */
+void ota_boot(void)
+{
+    ota_log_t log;
+
+    _ota_log_read(&log);
+
+    if (!log.staged || log.confirmed || log.failed[OTA_FORWARD] ||
+            log.applied[OTA_REVERSE] || log.failed[OTA_REVERSE])
+    {
+        return;
+    }
+
+    if (log.applied[OTA_FORWARD] && (log.boots >= OTA_TRIAL_BOOTS ||
+            log.pages[OTA_REVERSE] || log.scratch[OTA_REVERSE] >= 0))
+    {
+        printf("New firmware not confirmed, rolling back\r\n");
+
+        _ota_apply(OTA_REVERSE, &log);
+        return;
+    }
+
+    if (!log.applied[OTA_FORWARD] && !_ota_apply(OTA_FORWARD, &log))
+    {
+        return;
+    }
+
+    _ota_log_write(&log, OTA_LOG_BOOT, 0);
+}
+
+/**
+ * Read through the log
+ *
+ * @param log Filled in with what it says
+ */
+static void _ota_log_read(ota_log_t* log)
+{
+    const uint32_t* words = (const uint32_t*)OTA_LOG_BASE;
+
+    memset(log, 0, sizeof(*log));
+    log->scratch[OTA_FORWARD] = -1;
+    log->scratch[OTA_REVERSE] = -1;
+
+    for (; log->used < OTA_LOG_WORDS && words[log->used] != 0xFFFFFFFFu; log->used++)
+    {
+        uint32_t argument = words[log->used] & 0xFFFFFF;
+        uint8_t patch = (argument >> 16) & 0x01;
+
+        switch (words[log->used] >> 24)
+        {
+            case OTA_LOG_STAGED:
+                log->staged = true;
+                log->id = (uint16_t)argument;
+                break;
+            case OTA_LOG_SCRATCH:
+                log->scratch[patch] = (int32_t)(argument & 0xFFFF);
+                break;
+            case OTA_LOG_PAGE:
+                log->pages[patch]++;
+                log->scratch[patch] = -1;
+                break;
+            case OTA_LOG_APPLIED:
+                log->applied[patch] = true;
+                break;
+            case OTA_LOG_FAILED:
+                log->failed[patch] = true;
+                break;
+            case OTA_LOG_BOOT:
+                log->boots++;
+                break;
+            case OTA_LOG_CONFIRMED:
+                log->confirmed = true;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/**
+ * Add an entry to the log
+ *
+ * @param log      Log as read, moved on past the entry
+ * @param mark     One of OTA_LOG_x
+ * @param argument What it's about
+ */
+static void _ota_log_write(ota_log_t* log, uint8_t mark, uint32_t argument)
+{
+    uint32_t word = (uint32_t)mark << 24 | (argument & 0xFFFFFF);
+
+    if (log->used >= OTA_LOG_WORDS)
+    {
+        return;
+    }
+
+    MSC_Init();
+    MSC_WriteWord((uint32_t*)OTA_LOG_BASE + log->used, &word, sizeof(word));
+    MSC_Deinit();
+
+    log->used++;
+}
+
+/**
+ * Find one of the staged patches
+ *
+ * @param patch  OTA_FORWARD or OTA_REVERSE
+ * @param header Filled in with its header
+ * @param ops    Set to its ops
+ * @return       False if it isn't there
+ */
+static bool _ota_header(uint8_t patch, radio_patch_header_t* header, const uint8_t** ops)
+{
+    const uint8_t* staged = (const uint8_t*)OTA_STAGE_BASE;
+    uint32_t offset = 0;
+
+    for (uint8_t i = 0; ; i++)
+    {
+        if (offset + sizeof(*header) > RADIO_PATCH_MAX_LEN)
+        {
+            return false;
+        }
+
+        memcpy(header, staged + offset, sizeof(*header));
+        offset += sizeof(*header);
+
+        if (header->magic != RADIO_PATCH_MAGIC ||
+                header->length > RADIO_PATCH_MAX_LEN - offset)
+        {
+            return false;
+        }
+
+        if (i == patch)
+        {
+            *ops = staged + offset;
+            return true;
+        }
+
+        offset = (offset + header->length + 3u) & ~3u;
+    }
+}
+
+/**
+ * Apply a staged patch to the image, or carry on applying it from where the
+ * log says it had got to
+ *
+ * @param patch OTA_FORWARD or OTA_REVERSE
+ * @param log   Log as read, added to as pages are done
+ * @return      True if the image is now the patch's new one
+ */
+static bool _ota_apply(uint8_t patch, ota_log_t* log)
+{
+    uint32_t data[FLASH_PAGE_SIZE / 4];
+    radio_patch_header_t header;
+    const uint8_t* ops;
+    bool started = log->pages[patch] || log->scratch[patch] >= 0;
+
+    // The image has to be the one the patch is for, unless it's part done
+    if (!_ota_header(patch, &header, &ops) ||
+            ota_crc32(0, ops, header.length) != header.ops_crc ||
+            (!started && ota_crc32(0, (const uint8_t*)OTA_APP_BASE, header.old_length) != header.old_crc))
+    {
+        _ota_log_write(log, OTA_LOG_FAILED, (uint32_t)patch << 16);
+        return false;
+    }
+
+    uint16_t pages = (uint16_t)((header.new_length + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE);
+
+    for (uint16_t done = log->pages[patch]; done < pages; done++)
+    {
+        uint16_t page = (header.flags & RADIO_PATCH_DESCENDING) ? pages - 1 - done : done;
+        uint32_t argument = (uint32_t)patch << 16 | page;
+
+        // Build the page in the scratch page, unless that's done already
+        if (log->scratch[patch] != page)
+        {
+            if (!_ota_build_page(&header, ops, page, (uint8_t*)data) ||
+                    !_ota_write_page(OTA_SCRATCH_BASE, data))
+            {
+                _ota_log_write(log, OTA_LOG_FAILED, argument);
+                return false;
+            }
+
+            _ota_log_write(log, OTA_LOG_SCRATCH, argument);
+        }
+        else
+        {
+            memcpy(data, (const uint8_t*)OTA_SCRATCH_BASE, FLASH_PAGE_SIZE);
+        }
+
+        if (!_ota_write_page(OTA_APP_BASE + page * FLASH_PAGE_SIZE, data))
+        {
+            _ota_log_write(log, OTA_LOG_FAILED, argument);
+            return false;
+        }
+
+        _ota_log_write(log, OTA_LOG_PAGE, argument);
+        log->scratch[patch] = -1;
+    }
+
+    if (ota_crc32(0, (const uint8_t*)OTA_APP_BASE, header.new_length) != header.new_crc)
+    {
+        _ota_log_write(log, OTA_LOG_FAILED, (uint32_t)patch << 16);
+        return false;
+    }
+
+    _ota_log_write(log, OTA_LOG_APPLIED, (uint32_t)patch << 16);
+
+    printf("Firmware patched\r\n");
+
+    return true;
+}
+
+/**
+ * Work out what one page of the new image holds, from its ops and the parts of
+ * the old image not rewritten yet
+ *
+ * @param header Header of the patch
+ * @param ops    Its ops
+ * @param page   Page of the image
+ * @param data   Filled in with the page, erased past the end of the image
+ * @return       False if the ops are bad
+ */
+static bool _ota_build_page(const radio_patch_header_t* header, const uint8_t* ops,
+        uint16_t page, uint8_t* data)
+{
+    const uint8_t* image = (const uint8_t*)OTA_APP_BASE;
+    uint32_t start = (uint32_t)page * FLASH_PAGE_SIZE;
+    uint32_t end = (start + FLASH_PAGE_SIZE < header->new_length) ?
+            start + FLASH_PAGE_SIZE : header->new_length;
+    uint32_t out = 0;
+    uint32_t i = 0;
+
+    memset(data, 0xFF, FLASH_PAGE_SIZE);
+
+    // Run through the ops for the pages before to find this page's
+    while (out < end)
+    {
+        if (i >= header->length)
+        {
+            return false;
+        }
+
+        uint8_t op = ops[i++];
+        uint32_t length = (uint32_t)(op & ~RADIO_PATCH_COPY) + 1;
+        const uint8_t* from;
+
+        if (op & RADIO_PATCH_COPY)
+        {
+            if (i + 2 > header->length)
+            {
+                return false;
+            }
+
+            uint32_t source = (uint32_t)(ops[i] | ops[i + 1] << 8);
+            i += 2;
+
+            // Pages already rewritten can't be copied from
+            if (out >= start && (source + length > header->old_length ||
+                    ((header->flags & RADIO_PATCH_DESCENDING) ?
+                    source + length > start + FLASH_PAGE_SIZE : source < start)))
+            {
+                return false;
+            }
+
+            from = image + source;
+        }
+        else
+        {
+            if (i + length > header->length)
+            {
+                return false;
+            }
+
+            from = ops + i;
+            i += length;
+        }
+
+        if (out / FLASH_PAGE_SIZE != (out + length - 1) / FLASH_PAGE_SIZE ||
+                out + length > header->new_length)
+        {
+            return false;
+        }
+
+        if (out >= start)
+        {
+            memcpy(data + (out - start), from, length);
+        }
+
+        out += length;
+    }
+
+    return true;
+}
+
+/**
+ * Erase a page of flash and write a new one
+ *
+ * @param address Start of the page
+ * @param data    What to write
+ * @return        False if it couldn't be written
+ */
+static bool _ota_write_page(uintptr_t address, const uint32_t* data)
+{
+    MSC_Init();
+
+    bool written = MSC_ErasePage((uint32_t*)address) == mscReturnOk &&
+            MSC_WriteWord((uint32_t*)address, data, FLASH_PAGE_SIZE) == mscReturnOk;
+
+    MSC_Deinit();
+
+    return written;
+}
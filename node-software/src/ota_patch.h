@@ -0,0 +1,43 @@
+/**
+ * Firmware updates over the radio - header file
+ * Shared by the application, which stages the patch the base station sends,
+ * and the bootloader, which applies it. Include em_device.h first
+ */
+
+#ifndef OTA_PATCH_H_
+#define OTA_PATCH_H_
+
+// The bootloader takes the bottom of flash and the application is linked to
+// start after it. The top holds the log of how far an update has got, a
+// scratch page and the staged patch. ldscripts/app.ld and bootloader.ld place
+// the two images to match, and fail the link if either outgrows its space
+#define OTA_BOOT_SIZE    0x1000u
+#define OTA_APP_BASE     (FLASH_BASE + OTA_BOOT_SIZE)
+#define OTA_LOG_BASE     (FLASH_BASE + FLASH_SIZE - 2 * FLASH_PAGE_SIZE - RADIO_PATCH_MAX_LEN)
+#define OTA_SCRATCH_BASE (OTA_LOG_BASE + FLASH_PAGE_SIZE)
+#define OTA_STAGE_BASE   (OTA_SCRATCH_BASE + FLASH_PAGE_SIZE)
+#define OTA_APP_SIZE     (OTA_LOG_BASE - OTA_APP_BASE)
+
+// Boots a new image gets to confirm it works before the old one is put back
+#define OTA_TRIAL_BOOTS 3
+
+/**
+ * Where a patch has got to on this node
+ */
+typedef enum
+{
+    OTA_FETCH,  //!< Still to be fetched, the space for it is erased
+    OTA_STAGED, //!< Staged and checked, applied when the node restarts
+    OTA_DONE    //!< Applied, rolled back or not for this image, nothing to do
+} ota_state_t;
+
+uint32_t ota_crc32(uint32_t crc, const uint8_t* data, uint32_t length);
+
+ota_state_t ota_stage_begin(uint16_t id);
+bool ota_stage_chunk(uint16_t chunk, const uint8_t* data, uint8_t length);
+ota_state_t ota_stage_end(uint16_t id, uint32_t length);
+void ota_confirm(void);
+
+void ota_boot(void);
+
+#endif /* OTA_PATCH_H_ */
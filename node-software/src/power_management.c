@@ -5,13 +5,16 @@
 /* Standard libraries */
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 /* Peripheral control headers */
 #include "em_device.h"
 #include "em_emu.h"
+#include "em_rtc.h"
 
 /* Application-specific headers */
 #include "power_management.h"
+#include "rtc_driver.h"
 
 // Storage for all the power management bits
 static power_system_store_t systems_em0 = 0x0;
@@ -24,6 +27,22 @@ static void (*sched_func)(void);
 // Marker to indicate scheduled function is running, don't recurse
 static volatile bool sched_active = false;
 
+// The RTC counter runs free and wraps at 24 bits (see rtc_driver.c)
+#define POWER_TICK_WRAP 0x1000000u
+
+// Residency counters, the states currently being charged and the RTC value
+// they have been charged up to
+static power_stats_t stats;
+static power_min_t stats_mode = PWR_EM0;
+static power_radio_t stats_radio = PWR_RADIO_SLEEP;
+static uint32_t stats_mark = 0;
+
+// Part of a ms charged ticks have left over, in ticks x 1000
+static uint32_t stats_part = 0;
+
+/* Functions used only in this file */
+static void _power_account(void);
+
 /**
  * Allow a system to indicate the minimum power state it can currently operate
  * at
@@ -33,6 +52,9 @@ static volatile bool sched_active = false;
  */
 void power_set_minimum(power_system_t system, power_min_t minimum)
 {
+    // Charge the time so far to the minimums held until now
+    _power_account();
+
     // First turn off all the state bits for this system
     systems_em0 &= ~(0x1 << system);
     systems_em1 &= ~(0x1 << system);
@@ -80,15 +102,31 @@ void power_sleep(void)
         sched_active = false;
     }
 
+    power_min_t mode = PWR_EM3;
+
     if (systems_em0)
     {
         // Nothing to do, as we've requested full power, although this is odd...
+        return;
     }
     else if (systems_em1)
     {
-        EMU_EnterEM1();
+        mode = PWR_EM1;
     }
     else if (systems_em2)
+    {
+        mode = PWR_EM2;
+    }
+
+    // Time up to here was spent awake
+    _power_account();
+    stats_mode = mode;
+
+    if (mode == PWR_EM1)
+    {
+        EMU_EnterEM1();
+    }
+    else if (mode == PWR_EM2)
     {
         EMU_EnterEM2(true);
     }
@@ -97,6 +135,10 @@ void power_sleep(void)
         // No subsystems have requested a power mode, sleep!
         EMU_EnterEM3(true);
     }
+
+    _power_account();
+    stats_mode = PWR_EM0;
+    stats.wakes++;
 }
 
 /**
@@ -109,3 +151,101 @@ void power_schedule(void (*fn)(void))
 {
     sched_func = fn;
 }
+
+/**
+ * Note a change of radio state, so time can be charged to each
+ *
+ * @param state State the radio has just been put in
+ */
+void power_radio_state(power_radio_t state)
+{
+    _power_account();
+    stats_radio = state;
+}
+
+/**
+ * Note a frame being transmitted. Frames are far shorter than the RTC's tick,
+ * so the radio driver works out how long each spends on air
+ *
+ * @param airtime_us Time from the start of the preamble to the end of the CRC
+ */
+void power_radio_transmit(uint32_t airtime_us)
+{
+    stats.tx_us += airtime_us;
+    stats.tx_frames++;
+}
+
+/**
+ * Get the time spent in each power state since the counters were cleared
+ *
+ * @return Pointer to the counters, brought up to date
+ */
+const power_stats_t* power_stats(void)
+{
+    _power_account();
+
+    return &stats;
+}
+
+/**
+ * Start counting residency afresh from now
+ */
+void power_stats_clear(void)
+{
+    _power_account();
+    memset(&stats, 0, sizeof(stats));
+}
+
+/**
+ * Carry on counting from the RTC's new value after it has been set, rather
+ * than charging the jump to whatever state we're in
+ */
+void power_clock_changed(void)
+{
+    stats_mark = RTC_CounterGet();
+}
+
+/**
+ * Charge the time since the last call to the current processor mode, radio
+ * state and the minimum each system is holding
+ */
+static void _power_account(void)
+{
+    // Called from interrupts as well as the main loop
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    uint32_t now = RTC_CounterGet();
+    uint32_t ticks = (now + POWER_TICK_WRAP - stats_mark) % POWER_TICK_WRAP;
+    stats_mark = now;
+
+    // Counters are kept in ms, as on the basestation
+    uint64_t part = (uint64_t)ticks * 1000u + stats_part;
+    ticks = (uint32_t)(part / RTC_TICKS_PER_SECOND);
+    stats_part = (uint32_t)(part % RTC_TICKS_PER_SECOND);
+
+    if (ticks)
+    {
+        stats.elapsed += ticks;
+        stats.mode[stats_mode] += ticks;
+        stats.radio[stats_radio] += ticks;
+
+        for (uint8_t i = 0; i < POWER_SYSTEM_COUNT; i++)
+        {
+            if (systems_em0 & (0x1 << i))
+            {
+                stats.system[i][PWR_EM0] += ticks;
+            }
+            else if (systems_em1 & (0x1 << i))
+            {
+                stats.system[i][PWR_EM1] += ticks;
+            }
+            else if (systems_em2 & (0x1 << i))
+            {
+                stats.system[i][PWR_EM2] += ticks;
+            }
+        }
+    }
+
+    __set_PRIMASK(primask);
+}
@@ -11,6 +11,28 @@ typedef uint8_t power_system_store_t;
 
 typedef enum {PWR_EM0, PWR_EM1, PWR_EM2, PWR_EM3} power_min_t;
 typedef enum {PWR_DETECT, PWR_RADIO, PWR_SENSOR, PWR_DELAY, PWR_RTC} power_system_t;
+typedef enum {PWR_RADIO_SLEEP, PWR_RADIO_STANDBY, PWR_RADIO_RX, PWR_RADIO_LISTEN,
+    PWR_RADIO_TX} power_radio_t;
+
+#define POWER_MODE_COUNT 4
+#define POWER_SYSTEM_COUNT 5
+#define POWER_RADIO_COUNT 5
+
+/**
+ * Time spent in each power state since the counters were last cleared, in ms.
+ * The RTC counts in 1/4096s ticks, so anything shorter is only seen when it
+ * happens to straddle a tick. Transmit time is kept from frame lengths instead.
+ */
+typedef struct
+{
+    uint32_t elapsed;                                          //!< All time accounted for
+    uint32_t mode[POWER_MODE_COUNT];                           //!< Time the processor spent in each mode
+    uint32_t system[POWER_SYSTEM_COUNT][POWER_MODE_COUNT - 1]; //!< Time each system held each mode above the lowest
+    uint32_t radio[POWER_RADIO_COUNT];                         //!< Time the radio spent in each state
+    uint32_t tx_us;                                            //!< Air time of the frames sent, in us
+    uint32_t tx_frames;                                        //!< Frames sent
+    uint32_t wakes;                                            //!< Times the processor woke from sleep
+} power_stats_t;
 
 void power_set_minimum(power_system_t system, power_min_t minimum);
 
@@ -18,4 +40,11 @@ void power_sleep(void);
 
 void power_schedule(void (*fn)(void));
 
+void power_radio_state(power_radio_t state);
+void power_radio_transmit(uint32_t airtime_us);
+
+const power_stats_t* power_stats(void);
+void power_stats_clear(void);
+void power_clock_changed(void);
+
 #endif /* POWER_MANAGEMENT_H_ */
@@ -0,0 +1,133 @@
+/**
+ * Current draw and battery life estimates from power state residency
+ * Processor figures are from the EFM32ZG datasheet running from the 21MHz
+ * HFRCO, radio figures from the RFM69W datasheet. Transmit current and the
+ * rest of the board are the measurements in SensorNode_BatteryFigures.eab.
+ * Processing is charged from the time the processor was counted awake, so
+ * there's nothing added per wake up.
+ */
+
+/* Standard libraries */
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Application-specific headers */
+#include "power_management.h"
+#include "power_model.h"
+#include "printf.h"
+
+// Processor in each energy mode, in nA
+#define POWER_MODEL_EM0_NA 2400000u
+#define POWER_MODEL_EM1_NA 1008000u
+#define POWER_MODEL_EM2_NA 900u
+#define POWER_MODEL_EM3_NA 500u
+
+// Everything else on the board, with the processor awake or asleep
+#define POWER_MODEL_AWAKE_NA 103750u
+#define POWER_MODEL_ASLEEP_NA 87900u
+
+// Radio in each state, in nA. Listen mode is RX for 3.2ms of every 31.9ms
+// with the default profile, idle in between costs next to nothing
+#define POWER_MODEL_RADIO_SLEEP_NA 100u
+#define POWER_MODEL_RADIO_STANDBY_NA 1250000u
+#define POWER_MODEL_RADIO_RX_NA 16000000u
+#define POWER_MODEL_RADIO_LISTEN_NA (POWER_MODEL_RADIO_RX_NA / 319u * 32u)
+#define POWER_MODEL_RADIO_TX_NA 66680000u
+
+static const uint32_t mode_na[POWER_MODE_COUNT] =
+{
+        POWER_MODEL_EM0_NA + POWER_MODEL_AWAKE_NA,
+        POWER_MODEL_EM1_NA + POWER_MODEL_AWAKE_NA,
+        POWER_MODEL_EM2_NA + POWER_MODEL_ASLEEP_NA,
+        POWER_MODEL_EM3_NA + POWER_MODEL_ASLEEP_NA
+};
+
+// Time in TX is charged as standby, the frames themselves are added from
+// their air time
+static const uint32_t radio_na[POWER_RADIO_COUNT] =
+{
+        POWER_MODEL_RADIO_SLEEP_NA,
+        POWER_MODEL_RADIO_STANDBY_NA,
+        POWER_MODEL_RADIO_RX_NA,
+        POWER_MODEL_RADIO_LISTEN_NA,
+        POWER_MODEL_RADIO_STANDBY_NA
+};
+
+/**
+ * Work out the charge drawn over the time the counters cover
+ *
+ * @param stats Residency counters
+ * @return      Charge in nA ms
+ */
+uint64_t power_model_charge(const power_stats_t* stats)
+{
+    uint64_t charge = 0;
+
+    for (uint8_t i = 0; i < POWER_MODE_COUNT; i++)
+    {
+        charge += (uint64_t)stats->mode[i] * mode_na[i];
+    }
+
+    for (uint8_t i = 0; i < POWER_RADIO_COUNT; i++)
+    {
+        charge += (uint64_t)stats->radio[i] * radio_na[i];
+    }
+
+    // Frames on air at full transmit current instead of standby
+    charge += (uint64_t)stats->tx_us *
+            (POWER_MODEL_RADIO_TX_NA - POWER_MODEL_RADIO_STANDBY_NA) / 1000u;
+
+    return charge;
+}
+
+/**
+ * Work out the average current over the time the counters cover
+ *
+ * @param stats Residency counters
+ * @return      Average current in nA, 0 if no time has been counted
+ */
+uint32_t power_model_average_na(const power_stats_t* stats)
+{
+    if (stats->elapsed == 0)
+    {
+        return 0;
+    }
+
+    return (uint32_t)(power_model_charge(stats) / stats->elapsed);
+}
+
+/**
+ * Work out how long a fresh battery lasts at an average current
+ *
+ * @param average_na Average current in nA
+ * @return           Battery life in days, 0 if no current was given
+ */
+uint32_t power_model_battery_days(uint32_t average_na)
+{
+    if (average_na == 0)
+    {
+        return 0;
+    }
+
+    return (uint32_t)((uint64_t)POWER_MODEL_BATTERY_MAH * 1000000u / average_na / 24u);
+}
+
+/**
+ * Print the residency counters and what they mean for the battery
+ *
+ * @param stats Residency counters
+ */
+void power_model_report(const power_stats_t* stats)
+{
+    uint32_t average_na = power_model_average_na(stats);
+
+    printf("Power: %u s EM0, %u s EM1, %u s EM2, %u s EM3, %u wakes. Radio %u s RX,"
+            " %u s standby, %u frames in %u ms TX\r\n",
+            (unsigned)(stats->mode[PWR_EM0] / 1000u), (unsigned)(stats->mode[PWR_EM1] / 1000u),
+            (unsigned)(stats->mode[PWR_EM2] / 1000u), (unsigned)(stats->mode[PWR_EM3] / 1000u),
+            (unsigned)stats->wakes, (unsigned)(stats->radio[PWR_RADIO_RX] / 1000u),
+            (unsigned)(stats->radio[PWR_RADIO_STANDBY] / 1000u), (unsigned)stats->tx_frames,
+            (unsigned)(stats->tx_us / 1000u));
+    printf("Power: %u.%03u uA average, ~%u days battery\r\n", (unsigned)(average_na / 1000u),
+            (unsigned)(average_na % 1000u), (unsigned)power_model_battery_days(average_na));
+}
@@ -0,0 +1,17 @@
+/**
+ * Current draw and battery life estimates from power state residency - header
+ * file
+ */
+
+#ifndef POWER_MODEL_H_
+#define POWER_MODEL_H_
+
+// Two alkaline AA cells in series
+#define POWER_MODEL_BATTERY_MAH 2500
+
+uint64_t power_model_charge(const power_stats_t* stats);
+uint32_t power_model_average_na(const power_stats_t* stats);
+uint32_t power_model_battery_days(uint32_t average_na);
+void power_model_report(const power_stats_t* stats);
+
+#endif /* POWER_MODEL_H_ */
@@ -10,8 +10,25 @@
 // Register addresses used directly (rather than just as part of config)
 #define RADIO_REG_SYNCA 0x2F
 #define RADIO_REG_OPMODE 0x01
+#define RADIO_REG_PALEVEL 0x0A
+#define RADIO_REG_BITRATEMSB 0x03
+#define RADIO_REG_BITRATELSB 0x04
+#define RADIO_REG_FDEVMSB 0x05
+#define RADIO_REG_FDEVLSB 0x06
+#define RADIO_REG_RXBW 0x19
+#define RADIO_REG_FRFMSB 0x07
+#define RADIO_REG_FRFMID 0x08
+#define RADIO_REG_FRFLSB 0x09
+#define RADIO_REG_LISTEN1 0x0D
+#define RADIO_REG_LISTEN2 0x0E
+#define RADIO_REG_LISTEN3 0x0F
+#define RADIO_REG_RXTIMEOUT2 0x2B
+#define RADIO_REG_FIFO 0x00
+#define RADIO_REG_PAYLOADLENGTH 0x38
+#define RADIO_REG_FIFOTHRESH 0x3C
 #define RADIO_REG_PACKETCONFIG2 0x3D
 #define RADIO_REG_IRQFLAGS 0x27
+#define RADIO_REG_IRQFLAGS2 0x28
 #define RADIO_REG_IOMAPPING 0x25
 #define RADIO_REG_RSSIVALUE 0x24
 
@@ -23,41 +40,120 @@
 #define RADIO_REG_OPMODE_LISTEN 0x44
 #define RADIO_REG_OPMODE_LISTENABORT 0x20
 
+#define RADIO_REG_PALEVEL_PA0 0x80
+
+/* Listen mode: RX windows of 50 x 64us (3.2ms) wake only on RSSI plus sync
+   word match, and drop back to idle after a packet (FIFO must be read before
+   the next window). Idle length depends on the link profile, see below */
+#define RADIO_REG_LISTEN1_CONFIG 0x9C
+#define RADIO_REG_LISTEN3_COEFRX 50
+
+/* Stop a listen RX window 192 x 16 bit times after RSSI triggers if no packet
+   arrives (longer than the longest preamble and payload) */
+#define RADIO_REG_RXTIMEOUT2_LISTEN 192
+
 #define RADIO_REG_IOMAP_TXDONE 0x00
 #define RADIO_REG_IOMAP_PAYLOAD 0x40
+#define RADIO_REG_IOMAP_SYNC 0x80
+
+/* Frames that don't fit the FIFO are streamed through it. Once the level drops
+   to the threshold during transmit there is room for the next chunk, leaving
+   the threshold's worth of byte times to write it */
+#define RADIO_FIFO_SIZE 66
+#define RADIO_FIFO_THRESH 15
+#define RADIO_FIFO_REFILL (RADIO_FIFO_SIZE - RADIO_FIFO_THRESH - 1)
+
+/* With receive streaming DIO0 fires on the sync word and the FIFO is drained
+   while the frame arrives, otherwise it fires once the whole frame is in */
+#if RADIO_RX_STREAMING
+#define RADIO_REG_IOMAP_RX RADIO_REG_IOMAP_SYNC
+#define RADIO_RX_MAX_PAYLOAD 255
+#else
+#define RADIO_REG_IOMAP_RX RADIO_REG_IOMAP_PAYLOAD
+#define RADIO_RX_MAX_PAYLOAD RADIO_FIFO_SIZE
+#endif
+
+/* Bytes on air around each payload: the 255 byte preamble, 2 byte sync word,
+   length byte and 2 byte CRC set up below */
+#define RADIO_PREAMBLE_LEN 255
+#define RADIO_FRAME_OVERHEAD (RADIO_PREAMBLE_LEN + 5)
+
+/* Longest time from the end of a frame until its sender is receiving again:
+   TxDone interrupt and wake up, radio_service() putting the receiver back on
+   and the standby to RX switch (TS_FS + TS_RE, at most 1.8ms at 4.8kbps). The
+   receiver only has to be on before the sync word, so a reply need only wait
+   for whatever of this its own preamble doesn't cover */
+#define RADIO_TURNAROUND_US 5000
+
+/* Seed for the retry jitter sequence, mixed with the node address */
+#define RADIO_JITTER_SEED 0xACE1
 
 #define RADIO_REG_READYFLAG 0x80
 
+/* Upper bound on ModeReady polls when a wait is needed. RFM69 mode changes take
+   at most a few hundred microseconds (TS_OSC 250us from sleep, TS_FS + TS_RE
+   into receive) and each poll is a 16 bit SPI transfer, so 64 polls is ample */
+#define RADIO_READY_MAX_POLLS 64
+#define RADIO_REG_IRQFLAGS2_FIFONOTEMPTY 0x40
+#define RADIO_REG_IRQFLAGS2_FIFOLEVEL 0x20
+#define RADIO_REG_IRQFLAGS2_FIFOOVERRUN 0x10
+#define RADIO_REG_IRQFLAGS2_PAYLOADREADY 0x04
+
 /* Configuration array (based on method used by Felix Ruso in Moteino code at
    https://github.com/LowPowerLab/RFM69/ */
 uint8_t radio_config_data[][2] =
 {
         {RADIO_REG_OPMODE, RADIO_REG_OPMODE_WAKE}, // RegOpMode - Sequencer on, Listen on, Standby mode
         {0x02, 0x00}, // RegDataModul - Packet mode, FSK
-        {0x03, 0x02}, // RegBitrateMSB - 4.8kbps
-        {0x04, 0x40}, // RegBitrateLSB - 4.8kbps
-        {0x05, 0x03}, // RegFdevMSB - 5khz
-        {0x06, 0x33}, // RegFdevLSB - 5khz
-        {0x07, 0xd9}, // RegFrfMSB - 868MHz
-        {0x08, 0x00}, // RegFrfMID - 868MHz
-        {0x09, 0x00}, // RegFrfLSB - 868MHz
-        {0x0A, 0x9F}, // RegPaLevel - PA0 on, Power = 13dBm
+        {RADIO_REG_BITRATEMSB, 0x02}, // RegBitrateMSB - 55.5kbps
+        {RADIO_REG_BITRATELSB, 0x40}, // RegBitrateLSB - 55.5kbps
+        {RADIO_REG_FDEVMSB, 0x03}, // RegFdevMSB - 50khz
+        {RADIO_REG_FDEVLSB, 0x33}, // RegFdevLSB - 50khz
+        {RADIO_REG_FRFMSB, 0xd9}, // RegFrfMSB - 868MHz
+        {RADIO_REG_FRFMID, 0x00}, // RegFrfMID - 868MHz
+        {RADIO_REG_FRFLSB, 0x00}, // RegFrfLSB - 868MHz
+        {RADIO_REG_PALEVEL, 0x9F}, // RegPaLevel - PA0 on, Power = 13dBm
         {0x0B, 0x20}, //
-        {0x19, 0x42}, // RegRxBW - DDC freq default,  Mant 16, Exp 2
+        {RADIO_REG_RXBW, 0x42}, // RegRxBW - DDC freq default,  Mant 16, Exp 2 (125kHz)
         {0x1E, 0x2C},
-        {RADIO_REG_IOMAPPING, RADIO_REG_IOMAP_PAYLOAD}, // RegDioMapping - DIO0 Payload Ready
+        {RADIO_REG_LISTEN1, RADIO_REG_LISTEN1_CONFIG}, // RegListen1 - Idle 4.1ms steps, RX 64us steps, sync match, resume after packet
+        {RADIO_REG_LISTEN3, RADIO_REG_LISTEN3_COEFRX}, // RegListen3 - RX window length
+        {RADIO_REG_IOMAPPING, RADIO_REG_IOMAP_RX}, // RegDioMapping - DIO0 Payload Ready or Sync Address
         {0x26, 0x07}, // RegDioMapping2 - Clock out off
         {0x28, 0x10}, // RegIrqFlags2 - Clear FIFO and flags
         {0x29, 228 }, // RegRssiThresh - Threshold for RSSI trigger, -110dBm
-        {0x2D, 0xFF},
+        {0x2D, RADIO_PREAMBLE_LEN}, // RegPreambleLsb - 255 bytes, long enough to span a listen mode idle period
         {0x2E, 0xB8}, // RegSyncConfig - Sync on, FIFO on SyncAddress, 2 byte sync word no errors
         {0x2F, 0x2D}, // RegSyncValue1 - Set first part of sync word
         {0x30, 0x64}, // RegSyncValue2 - Set second part of sync word
         {0x37, 0x90}, // RegPacketConfig1 - Variable length, DC free off, CRC on, clear off, address off
-        {0x38, 66  }, // RegPayloadLength - Max payload 66 bytes
-        {0x3C, 0x8F}, // RegFifoThresh - Transmit when bits available, threshold is 15
+        {RADIO_REG_PAYLOADLENGTH, RADIO_RX_MAX_PAYLOAD}, // RegPayloadLength - Max receive payload, 66 bytes unless streaming
+        {RADIO_REG_FIFOTHRESH, 0x80 | RADIO_FIFO_THRESH}, // RegFifoThresh - Transmit when bits available, threshold is 15
         {0x3D, 0x12}, // RegPacketConfig2 - 2 bit restart delay, Auto restart on
         {0x6F, 0x30}, // RegTestDagc - improve fading margin
 };
 
+/* Link profiles, slowest first: RegBitrate(16), RegFdev(16), RegRxBw,
+   RegListen2. Slower profiles trade airtime for sensitivity, keep the modulation
+   index near 2 and leave RxBw room for crystal offset. Listen idle plus RX window
+   must be shorter than the 255 byte preamble so a window always lands in it.
+   The last entry matches the defaults above */
+uint8_t radio_profile_data[RADIO_PROFILE_COUNT][6] =
+{
+        {0x1A, 0x0B, 0x00, 0x52, 0x4C, 96}, // 4.8kbps, 5kHz deviation, 25kHz RxBw, 394ms idle (425ms preamble)
+        {0x06, 0x83, 0x01, 0x48, 0x52, 24}, // 19.2kbps, 20kHz deviation, 83.3kHz RxBw, 98ms idle (106ms preamble)
+        {0x02, 0x40, 0x03, 0x33, 0x42, 7 }, // 55.5kbps, 50kHz deviation, 125kHz RxBw, 29ms idle (37ms preamble)
+};
+
+/* Channels, control channel first: RegFrf(24) in 61.035Hz steps. 200kHz apart
+   leaves room for the 55.5kbps profile's deviation and RxBw plus crystal
+   offset, and all of them stay inside the 868.0-868.6MHz sub-band. The first
+   entry matches the defaults above */
+uint8_t radio_channel_data[RADIO_CHANNEL_COUNT][3] =
+{
+        {0xD9, 0x00, 0x00}, // 868.0MHz, control
+        {0xD9, 0x0C, 0xCD}, // 868.2MHz
+        {0xD9, 0x19, 0x9A}, // 868.4MHz
+};
+
 #endif /* RADIO_CONFIG_H_ */
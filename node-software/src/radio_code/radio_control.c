@@ -14,13 +14,15 @@
 #include "radio_control.h"
 #include "radio_spi.h"
 #include "radio_config.h"
+#include "power_management.h"
 
 static uint8_t node_addr = 0x00;
 
-// Receiver ring buffer
-static uint8_t receive_buffer[RADIO_RECEIVE_BUFSIZE];
-static uint16_t receive_read_ptr = 0;
-static uint16_t receive_write_ptr = 0;
+// Receive ring, one frame per slot
+static uint8_t rx_slot_data[RADIO_RX_SLOTS][RADIO_RX_MAX_PAYLOAD - 1];
+static radio_packet_t rx_slots[RADIO_RX_SLOTS];
+static uint8_t rx_head = 0;
+static uint8_t rx_count = 0;
 
 // Callback to run when receiving a new packet
 void (*_radio_packet_callback)(uint16_t) = 0x0;
@@ -28,10 +30,73 @@ void (*_radio_packet_callback)(uint16_t) = 0x0;
 // Flag to indicate current radio state
 static radio_state_t _radio_state = RADIO_SLEEP;
 
+// Signal strength of the last packet received, as read from RegRssiValue
+static uint8_t last_rssi_raw = 0xFF;
+
+// Transmit power in dBm, reapplied each time the radio wakes
+static int8_t tx_power = RADIO_TXPOWER_MAX;
+
+// Current link profile, and whether it still needs writing to the radio
+static uint8_t link_profile = RADIO_PROFILE_DEFAULT;
+static bool link_profile_pending = false;
+
+// Current channel, and whether it still needs writing to the radio
+static uint8_t link_channel = RADIO_CHANNEL_CONTROL;
+static bool link_channel_pending = false;
+
+// Receive with listen mode duty cycling instead of continuously, and whether
+// the radio is currently in listen mode
+static bool listen_lowpower = false;
+static bool listen_active = false;
+
+// Queue of packets waiting for an asynchronous send
+typedef struct
+{
+    uint8_t data[RADIO_MAX_PACKET_LEN];
+    uint8_t length;
+    uint8_t dest_addr;
+    void (*callback)(bool);
+} radio_tx_entry_t;
+
+static radio_tx_entry_t tx_queue[RADIO_TX_QUEUE_LEN];
+static uint8_t tx_queue_head = 0;
+static uint8_t tx_queue_count = 0;
+
+// Receiver state to restore once the transmit queue empties
+static bool tx_recv_active = false;
+
+// Mode change wait instrumentation
+static radio_ready_stats_t ready_stats = {0, 0, 0};
+
+// Retry jitter sequence, never zero
+static uint16_t jitter_state = RADIO_JITTER_SEED;
+
 /* Functions used only in this file */
 static void _radio_write_register(uint8_t address, uint8_t data);
 static uint8_t _radio_read_register(uint8_t address);
 
+static bool _radio_wait_ready(void);
+static void _radio_write_profile(void);
+static void _radio_write_channel(void);
+static uint32_t _radio_bytes_us(uint8_t profile, uint32_t bytes);
+
+static void _radio_tx_load(uint8_t* data_p, uint16_t length, uint8_t dest_addr,
+        bool timed);
+static void _radio_tx_stream(uint8_t* data_p, uint16_t length);
+static void _radio_tx_abort(void);
+static bool _radio_send(uint8_t* data_p, uint16_t length, uint8_t dest_addr,
+        bool timed);
+static void _radio_tx_start_queued(void);
+
+#if RADIO_RX_STREAMING
+static bool _radio_rx_stream(radio_packet_t* packet_p);
+static bool _radio_rx_stream_byte(uint8_t* data_p, bool last, uint32_t start,
+        uint32_t limit);
+static uint32_t _radio_rx_stream_limit(uint16_t bytes);
+#else
+static bool _radio_rx_fifo(radio_packet_t* packet_p);
+#endif
+
 static void _radio_read_all(void);
 
 /**
@@ -47,6 +112,14 @@ bool radio_init(uint8_t addr, void (*callback)(uint16_t))
     node_addr = addr;
     _radio_packet_callback = callback;
 
+    // Nodes with different addresses pick different retry delays
+    jitter_state = (uint16_t)(RADIO_JITTER_SEED ^ (addr << 8 | addr));
+
+    for (uint8_t i = 0; i < RADIO_RX_SLOTS; i++)
+    {
+        rx_slots[i].data = rx_slot_data[i];
+    }
+
     // Enable and configure SPI
     radio_spi_init();
 
@@ -88,180 +161,431 @@ bool radio_init(uint8_t addr, void (*callback)(uint16_t))
  * Send a prepared packet over the link. Blocks until TX complete
  *
  * @param data_p  Pointer to the data to be sent
- * @param length  Number of bytes to send. No bounds checking on array is done
+ * @param length  Number of bytes to send, up to RADIO_MAX_FRAME_LEN. No bounds
+ *                checking on array is done
  * @param dest_addr Destination address to send to. 0x00 for broadcast
- * @return        True on send success
+ * @return        True on send success, false if the radio never finished
  */
 bool radio_send_data(uint8_t* data_p, uint16_t length, uint8_t dest_addr)
+{
+    return _radio_send(data_p, length, dest_addr, false);
+}
+
+/**
+ * Send a packet that ends with the time it finishes going out, so the receiver
+ * can set its clock from it. The last RADIO_TIMESTAMP_LEN bytes are filled in
+ * once the radio has started sending, with the time of day in RADIO_TIME_HZ
+ * ticks the transmit done edge is due at, least significant byte first. Blocks
+ * until TX complete
+ *
+ * @param data_p    Pointer to the data to be sent, the timestamp is written
+ *                  back into its last bytes
+ * @param length    Number of bytes to send, timestamp included. The whole
+ *                  frame has to fit in the FIFO
+ * @param dest_addr Destination address to send to. 0x00 for broadcast
+ * @return          True on send success, false if the radio never finished
+ */
+bool radio_send_timed(uint8_t* data_p, uint16_t length, uint8_t dest_addr)
+{
+    if (length < RADIO_TIMESTAMP_LEN || length > RADIO_FIFO_SIZE - 3)
+    {
+        return false;
+    }
+
+    return _radio_send(data_p, length, dest_addr, true);
+}
+
+/**
+ * Get the time the last frame sent finished going out
+ *
+ * @return Time of day in RADIO_TIME_HZ ticks of the transmit done edge
+ */
+uint32_t radio_last_txtime(void)
+{
+    return radio_spi_txtime();
+}
+
+/**
+ * Send a packet over the link, blocking until TX complete
+ *
+ * @param data_p    Pointer to the data to be sent
+ * @param length    Number of bytes to send
+ * @param dest_addr Destination address to send to
+ * @param timed     True to fill the last bytes with the time the frame ends
+ * @return          True on send success, false if the radio never finished
+ */
+static bool _radio_send(uint8_t* data_p, uint16_t length, uint8_t dest_addr,
+        bool timed)
 {
     _radio_read_all();
 
     // Make sure we got a sensible amount of data
-    if (length > RADIO_MAX_PACKET_LEN)
+    if (length > RADIO_MAX_FRAME_LEN)
     {
         return false;
     }
 
-
-    // Restart RX to avoid deadlock
-    _radio_write_register(RADIO_REG_PACKETCONFIG2, 0x16);
+    // Let any queued asynchronous sends go first so packets stay in order
+    while (tx_queue_count > 0)
+    {
+        power_sleep();
+        radio_service();
+    }
 
     // Find out if we're receiving to reset when done
     bool recv_active = (_radio_state == RADIO_LISTEN);
 
-    // Kill receiver to prevent recv during send
-    radio_receive_activate(false);
+    _radio_tx_load(data_p, length, dest_addr, timed);
 
-    // Reconfigure interrupt pin to indicate transmission complete
-    _radio_write_register(RADIO_REG_IOMAPPING, RADIO_REG_IOMAP_TXDONE);
+    // Wait for interrupt indicating buffer empty
+    if (!radio_spi_transmitwait())
+    {
+        // Transmit done never arrived, get the radio back to a known state
+        _radio_tx_abort();
+        radio_receive_activate(recv_active);
 
-    // Write data register address byte
-    radio_spi_select(true);
-    radio_spi_transfer(0x80);
+        return false;
+    }
 
-    // Write length byte
-    radio_spi_transfer((uint8_t)(length + 2));
+    // Set the interrupt pin back to default
+    _radio_write_register(RADIO_REG_IOMAPPING, RADIO_REG_IOMAP_RX);
 
-    // Write dest address
-    radio_spi_transfer(dest_addr);
+    // Flip back to standby or receive mode
+    radio_receive_activate(recv_active);
 
-    // Write sender address
-    radio_spi_transfer(node_addr);
+    return true;
+}
 
-    // Write payload
-    for (uint8_t cursor = 0; cursor < length; cursor++)
+/**
+ * Queue a packet to be sent without blocking. The packet is copied, so the
+ * caller can reuse its buffer straight away. Call radio_service() from the main
+ * loop to move the queue along.
+ *
+ * @param data_p    Pointer to the data to be sent
+ * @param length    Number of bytes to send, up to RADIO_MAX_PACKET_LEN
+ * @param dest_addr Destination address to send to. 0x00 for broadcast
+ * @param callback  Function to call with the result once sent or timed out,
+ *                  may be 0x0. Runs from radio_service(), not an interrupt
+ * @return          True if the packet was queued, false if the queue is full
+ */
+bool radio_send_async(uint8_t* data_p, uint16_t length, uint8_t dest_addr,
+        void (*callback)(bool))
+{
+    if (length > RADIO_MAX_PACKET_LEN || tx_queue_count >= RADIO_TX_QUEUE_LEN)
     {
-        radio_spi_transfer(data_p[cursor]);
+        return false;
     }
 
-    radio_spi_select(false);
-
-    // Prepare interrupt handler for a transmit interrupt (avoids TX race condition)
-    radio_spi_prepinterrupt(RADIO_INT_TXDONE);
+    // Copy into the next free slot
+    radio_tx_entry_t* entry =
+            &tx_queue[(tx_queue_head + tx_queue_count) % RADIO_TX_QUEUE_LEN];
 
-    // Flip to transmit mode to empty buffer
-    _radio_write_register(RADIO_REG_OPMODE, RADIO_REG_OPMODE_TX);
+    for (uint8_t i = 0; i < length; i++)
+    {
+        entry->data[i] = data_p[i];
+    }
 
-    // Wait for interrupt indicating buffer empty
-    radio_spi_transmitwait();
+    entry->length = (uint8_t)length;
+    entry->dest_addr = dest_addr;
+    entry->callback = callback;
 
-    // Set the interrupt pin back to default
-    _radio_write_register(RADIO_REG_IOMAPPING, RADIO_REG_IOMAP_PAYLOAD);
+    tx_queue_count++;
 
-    // Flip back to standby or receive mode
-    radio_receive_activate(recv_active);
+    // Kick off the send if nothing else is going out
+    if (tx_queue_count == 1)
+    {
+        tx_recv_active = (_radio_state == RADIO_LISTEN);
+        _radio_tx_start_queued();
+    }
 
     return true;
 }
 
 /**
+ * Move the asynchronous transmit queue forward. Finishes a send once the
+ * transmit done interrupt has fired, or recovers the radio if it never did.
+ * Call every time the main loop wakes.
+ */
+void radio_service(void)
+{
+    if (tx_queue_count == 0)
+    {
+        return;
+    }
+
+    bool success = radio_spi_transmitdone();
+
+    if (!success && misc_timeout_active())
+    {
+        // Still sending, check back later
+        return;
+    }
+
+    misc_timeout_cancel();
+
+    if (success)
+    {
+        _radio_write_register(RADIO_REG_IOMAPPING, RADIO_REG_IOMAP_RX);
+    }
+    else
+    {
+        _radio_tx_abort();
+    }
+
+    // Pop the finished entry before calling back, so the callback can queue more
+    void (*callback)(bool) = tx_queue[tx_queue_head].callback;
+
+    tx_queue_head = (tx_queue_head + 1) % RADIO_TX_QUEUE_LEN;
+    tx_queue_count--;
+
+    if (tx_queue_count > 0)
+    {
+        _radio_tx_start_queued();
+    }
+    else
+    {
+        radio_receive_activate(tx_recv_active);
+    }
+
+    if (callback)
+    {
+        callback(success);
+    }
+}
+
+/**
+ * Check whether there are asynchronous sends still queued or in flight
  *
- * Retrieve the contents of the receive buffer and clear the buffer itself
+ * @return True if the transmit queue is not empty
+ */
+bool radio_tx_busy(void)
+{
+    return (tx_queue_count > 0);
+}
+
+/**
+ * Get the oldest frame in the receive ring without copying it. The frame
+ * stays put until radio_rx_commit() is called.
  *
- * @param data_p  Pointer to store the data from the buffer
- * @param length  Number of bytes to retrieve from the buffer
- * @return        Number of bytes retrieved. If 0, buffer empty. If equal to
- *                length parameter, call again as there may be more
+ * @return Pointer to the frame, or 0x0 if nothing has been received
  */
-uint16_t radio_retrieve_data(uint8_t* data_p, uint16_t length)
+const radio_packet_t* radio_rx_peek(void)
 {
-    if (length >= RADIO_RECEIVE_BUFSIZE)
+    if (rx_count == 0)
     {
-        length = RADIO_RECEIVE_BUFSIZE - 1;
+        return 0x0;
     }
 
-    uint8_t data_count = 0;
+    return &rx_slots[rx_head];
+}
 
-    while (receive_read_ptr != receive_write_ptr)
+/**
+ * Release the oldest frame in the receive ring so its slot can be reused
+ */
+void radio_rx_commit(void)
+{
+    if (rx_count > 0)
+    {
+        rx_head = (rx_head + 1) % RADIO_RX_SLOTS;
+        rx_count--;
+    }
+}
+
+/**
+ * Called by the radio_spi interrupt handler when the payload ready flag fires,
+ * or the sync word one when streaming. Reads the frame into the receive ring
+ */
+void _radio_payload_ready(void)
+{
+    // Grab signal strength while the receiver still holds it
+    last_rssi_raw = _radio_read_register(RADIO_REG_RSSIVALUE);
+
+    // Next free slot, if there is one the frame is dropped
+    radio_packet_t* packet_p = 0x0;
+
+    if (rx_count < RADIO_RX_SLOTS)
     {
-        *data_p++ = *(receive_buffer + receive_read_ptr++);
+        packet_p = &rx_slots[(rx_head + rx_count) % RADIO_RX_SLOTS];
+    }
+
+#if RADIO_RX_STREAMING
+    // Frame is still arriving, drain it before disabling receive
+    bool packet_accepted = _radio_rx_stream(packet_p);
+
+    // The interrupt came as the frame started, it ended with the last byte
+    uint32_t rx_time = radio_spi_time();
 
-        if (receive_read_ptr >= RADIO_RECEIVE_BUFSIZE)
+    radio_receive_activate(false);
+
+    // Throw away whatever is left of a frame we gave up on
+    if (!packet_accepted)
+    {
+        _radio_write_register(RADIO_REG_IRQFLAGS2, RADIO_REG_IRQFLAGS2_FIFOOVERRUN);
+    }
+#else
+    // Disable receive
+    radio_receive_activate(false);
+
+    bool packet_accepted = _radio_rx_fifo(packet_p);
+    uint32_t rx_time = radio_spi_rxtime();
+#endif
+
+    // Turn receive back on
+    radio_receive_activate(true);
+
+    // Run callback function if packet valid
+    if (packet_accepted)
+    {
+        packet_p->rssi = radio_last_rssi();
+        packet_p->timestamp = rx_time;
+        rx_count++;
+
+        _radio_packet_callback(packet_p->length);
+    }
+}
+
+#if RADIO_RX_STREAMING
+/**
+ * Read a frame out of the FIFO while it is still being received, so frames
+ * longer than the FIFO fit. The frame only counts once the last byte has
+ * arrived with a good CRC. This runs in the interrupt handler, so as well as
+ * the stall limit on each byte the frame is given up on once it takes longer
+ * than its airtime and RADIO_RX_STREAM_SLACK_US (the longest frame's until the
+ * length byte is in).
+ *
+ * @param packet_p Slot to read into, 0x0 if the ring is full
+ * @return         True if the frame was for us and has been stored
+ */
+static bool _radio_rx_stream(radio_packet_t* packet_p)
+{
+    uint32_t start = radio_spi_time();
+    uint32_t limit = _radio_rx_stream_limit(RADIO_RX_MAX_PAYLOAD);
+    uint8_t payload_size;
+
+    // Any length byte fits a slot, RegPayloadLength is at its maximum
+    if (!packet_p || !_radio_rx_stream_byte(&payload_size, false, start, limit) ||
+            payload_size < 2)
+    {
+        return false;
+    }
+
+    limit = _radio_rx_stream_limit(payload_size);
+
+    // Try and grab an address
+    uint8_t dest_addr;
+
+    if (!_radio_rx_stream_byte(&dest_addr, false, start, limit) ||
+            (dest_addr != node_addr && dest_addr != RADIO_BCAST_ADDR))
+    {
+        return false;
+    }
+
+    // Get data (inc sender ID)
+    packet_p->length = (uint8_t)(payload_size - 1);
+
+    for (uint8_t i = 0; i < packet_p->length; i++)
+    {
+        if (!_radio_rx_stream_byte(packet_p->data + i, i == packet_p->length - 1,
+                start, limit))
         {
-            receive_read_ptr = 0;
+            return false;
         }
+    }
+
+    return true;
+}
+
+/**
+ * Wait for the next byte of a frame being received and read it. The last byte
+ * is held back until payload ready, which only sets if the CRC passed.
+ *
+ * @param data_p Where to put the byte
+ * @param last   Set to true for the last byte of the frame
+ * @param start  radio_spi_time() when the frame started being read
+ * @param limit  RADIO_TIME_HZ ticks from start the whole frame may take
+ * @return       True if a byte was read, false if the frame stalled, overran
+ *               or failed
+ */
+static bool _radio_rx_stream_byte(uint8_t* data_p, bool last, uint32_t start,
+        uint32_t limit)
+{
+    uint8_t flag = last ? RADIO_REG_IRQFLAGS2_PAYLOADREADY :
+            RADIO_REG_IRQFLAGS2_FIFONOTEMPTY;
+    uint16_t polls = 0;
 
-        data_count++;
+    while (!(_radio_read_register(RADIO_REG_IRQFLAGS2) & flag))
+    {
+        uint32_t elapsed = (radio_spi_time() + RADIO_TIME_PER_DAY - start) %
+                RADIO_TIME_PER_DAY;
 
-        if (data_count == length)
+        if (++polls >= RADIO_RX_STALL_POLLS || elapsed > limit)
         {
-            break;
+            return false;
         }
     }
 
-    return data_count;
+    *data_p = _radio_read_register(RADIO_REG_FIFO);
+
+    return true;
 }
 
 /**
- * Called by the radio_spi interrupt handler when the payload ready flag fires.
- * Reads data from the radio
+ * Work out how long a frame being streamed in may take from its sync word
+ *
+ * @param bytes Its length byte
+ * @return      The airtime of the length byte, payload and CRC plus
+ *              RADIO_RX_STREAM_SLACK_US, in RADIO_TIME_HZ ticks
  */
-void _radio_payload_ready(void)
+static uint32_t _radio_rx_stream_limit(uint16_t bytes)
 {
-    // Disable receive
-    radio_receive_activate(false);
-
+    uint32_t us = _radio_bytes_us(link_profile, bytes + 3u) +
+            RADIO_RX_STREAM_SLACK_US;
 
+    return (uint32_t)(((uint64_t)us * RADIO_TIME_HZ) / 1000000u);
+}
+#else
+/**
+ * Read a complete frame out of the FIFO into a receive ring slot
+ *
+ * @param packet_p Slot to read into, 0x0 if the ring is full
+ * @return         True if the frame was for us and has been stored
+ */
+static bool _radio_rx_fifo(radio_packet_t* packet_p)
+{
     radio_spi_select(true);
 
     // Address validation success flag
     bool packet_accepted = false;
 
     // Activate read mode (this way gives sequential reads)
-    radio_spi_transfer(0x00);
+    radio_spi_transfer(RADIO_REG_FIFO);
 
     uint8_t payload_size = radio_spi_transfer(0x00);
 
-    // Make sure payload will fit in buffer
-    uint16_t space_left;
-    if (receive_read_ptr > receive_write_ptr)
-    {
-        space_left = (uint16_t)(receive_read_ptr - receive_write_ptr - 1);
-    }
-    else
-    {
-        space_left = (uint16_t)(RADIO_RECEIVE_BUFSIZE - receive_write_ptr + receive_read_ptr - 1);
-    }
-
     // Try and grab an address
     uint8_t dest_addr = radio_spi_transfer(0x00);
 
+    // Make sure payload will fit in the slot
     if ((dest_addr == node_addr || dest_addr == RADIO_BCAST_ADDR) &&
-            (payload_size - 1 <= space_left))
+            packet_p && payload_size >= 2 && payload_size <= RADIO_RX_MAX_PAYLOAD)
     {
         packet_accepted = true;
 
         // Get data (inc sender ID)
         // Remove one byte from payload size to omit destination
-        for (uint8_t i = 0; i < payload_size - 1; i++)
-        {
-            uint8_t data = radio_spi_transfer(0x00);
-
-            *(receive_buffer + receive_write_ptr++) = data;
-
-            if (receive_write_ptr >= RADIO_RECEIVE_BUFSIZE)
-            {
-                receive_write_ptr = 0;
-            }
+        packet_p->length = (uint8_t)(payload_size - 1);
 
+        for (uint8_t i = 0; i < packet_p->length; i++)
+        {
+            packet_p->data[i] = radio_spi_transfer(0x00);
         }
     }
-    else
-    {
-        packet_accepted = false;
-    }
 
     radio_spi_select(false);
 
-    // Turn receive back on
-    radio_receive_activate(true);
-
-    // Run callback function if packet valid
-    if (packet_accepted)
-    {
-        _radio_packet_callback((uint16_t)(payload_size - 1));
-    }
+    return packet_accepted;
 }
+#endif
 
 /**
  * Turn receive mode on or off
@@ -280,23 +604,186 @@ void radio_receive_activate(bool activate)
         // Restart RX to avoid deadlock
         _radio_write_register(RADIO_REG_PACKETCONFIG2, 0x16);
 
+        // Listen windows must give up on noise, continuous receive never times out
+        _radio_write_register(RADIO_REG_RXTIMEOUT2,
+                listen_lowpower ? RADIO_REG_RXTIMEOUT2_LISTEN : 0);
+
         radio_spi_prepinterrupt(RADIO_INT_RXREADY);
-        _radio_write_register(RADIO_REG_OPMODE, RADIO_REG_OPMODE_RX);
+        _radio_write_register(RADIO_REG_OPMODE,
+                listen_lowpower ? RADIO_REG_OPMODE_LISTEN : RADIO_REG_OPMODE_RX);
         _radio_state = RADIO_LISTEN;
+        listen_active = listen_lowpower;
+        power_radio_state(listen_lowpower ? PWR_RADIO_LISTEN : PWR_RADIO_RX);
+
+        // No need to wait for receive to be ready, DIO0 tells us when a
+        // packet arrives
+        ready_stats.waits_skipped++;
     }
     else
     {
         radio_spi_prepinterrupt(RADIO_INT_NONE);
-        //_radio_write_register(RADIO_REG_OPMODE, RADIO_REG_OPMODE_WAKE | RADIO_REG_OPMODE_LISTENABORT);
+
+        // Listen mode can only be left by aborting it in the same write
+        if (listen_active)
+        {
+            _radio_write_register(RADIO_REG_OPMODE, RADIO_REG_OPMODE_WAKE | RADIO_REG_OPMODE_LISTENABORT);
+            listen_active = false;
+        }
+
         _radio_write_register(RADIO_REG_OPMODE, RADIO_REG_OPMODE_WAKE);
         _radio_state = RADIO_WAKE;
+        power_radio_state(PWR_RADIO_STANDBY);
+
+        // Receiver must really be off before the FIFO gets touched
+        _radio_wait_ready();
+    }
+}
+
+/**
+ * Load a packet into the radio FIFO and switch to transmit. The caller must
+ * wait for the transmit done interrupt afterwards.
+ *
+ * @param data_p    Pointer to the data to be sent
+ * @param length    Number of bytes to send
+ * @param dest_addr Destination address to send to
+ * @param timed     True to hold back the last RADIO_TIMESTAMP_LEN bytes and
+ *                  send the time the frame ends in them instead. The frame
+ *                  must fit in the FIFO
+ */
+static void _radio_tx_load(uint8_t* data_p, uint16_t length, uint8_t dest_addr,
+        bool timed)
+{
+    // Restart RX to avoid deadlock
+    _radio_write_register(RADIO_REG_PACKETCONFIG2, 0x16);
+
+    // Kill receiver to prevent recv during send
+    radio_receive_activate(false);
+
+    // Reconfigure interrupt pin to indicate transmission complete
+    _radio_write_register(RADIO_REG_IOMAPPING, RADIO_REG_IOMAP_TXDONE);
+
+    // Write data register address byte
+    radio_spi_select(true);
+    radio_spi_transfer(0x80);
+
+    // Write length byte
+    radio_spi_transfer((uint8_t)(length + 2));
+
+    // Write dest address
+    radio_spi_transfer(dest_addr);
+
+    // Write sender address
+    radio_spi_transfer(node_addr);
+
+    // Write as much payload as the FIFO holds after the three header bytes
+    uint16_t loaded = timed ? (uint16_t)(length - RADIO_TIMESTAMP_LEN) : length;
+    uint16_t cursor = 0;
+    for (; cursor < loaded && cursor < RADIO_FIFO_SIZE - 3; cursor++)
+    {
+        radio_spi_transfer(data_p[cursor]);
+    }
+
+    radio_spi_select(false);
+
+    // Prepare interrupt handler for a transmit interrupt (avoids TX race condition)
+    radio_spi_prepinterrupt(RADIO_INT_TXDONE);
+
+    // Flip to transmit mode to empty buffer
+    _radio_write_register(RADIO_REG_OPMODE, RADIO_REG_OPMODE_TX);
+    power_radio_state(PWR_RADIO_TX);
+    power_radio_transmit(radio_airtime_us(length));
+
+    // The preamble is still going out, which is plenty of time to add when
+    // the frame will end now its start is fixed
+    if (timed)
+    {
+        uint32_t end = (radio_spi_time() + (uint32_t)(((uint64_t)radio_airtime_us(length) *
+                RADIO_TIME_HZ) / 1000000u)) % RADIO_TIME_PER_DAY;
+
+        radio_spi_select(true);
+        radio_spi_transfer(0x80);
+
+        for (uint8_t i = 0; i < RADIO_TIMESTAMP_LEN; i++, cursor++)
+        {
+            data_p[cursor] = (uint8_t)(end >> (8 * i));
+            radio_spi_transfer(data_p[cursor]);
+        }
+
+        radio_spi_select(false);
+    }
+
+    // Feed in the rest of a long frame as the FIFO empties
+    if (cursor < length)
+    {
+        _radio_tx_stream(data_p + cursor, (uint16_t)(length - cursor));
     }
+}
+
+/**
+ * Keep the FIFO topped up while a frame too long for it is transmitted. Blocks
+ * until the last byte is in the FIFO, the transmit done interrupt still marks
+ * the end of the frame. The FIFO level is polled, DIO0 being taken by packet
+ * sent, so this busy waits for the airtime of all but the last
+ * RADIO_FIFO_THRESH or so bytes: about 16 ms for the longest upload packet at
+ * 55.5 kbps and 180 ms at 4.8 kbps, and never more than RADIO_TX_TIMEOUT_MS.
+ *
+ * @param data_p Pointer to the data not yet loaded
+ * @param length Number of bytes still to load
+ */
+static void _radio_tx_stream(uint8_t* data_p, uint16_t length)
+{
+    // Give up if the radio stops taking data, the transmit timeout then fires
+    misc_timeout(RADIO_TX_TIMEOUT_MS);
 
-    // Wait for mode ready
-    while (!(_radio_read_register(RADIO_REG_IRQFLAGS) & RADIO_REG_READYFLAG))
+    while (length > 0 && misc_timeout_active())
     {
+        // Wait for the level to drop to the threshold
+        if (_radio_read_register(RADIO_REG_IRQFLAGS2) & RADIO_REG_IRQFLAGS2_FIFOLEVEL)
+        {
+            continue;
+        }
 
+        uint16_t chunk = (length > RADIO_FIFO_REFILL) ? RADIO_FIFO_REFILL : length;
+        length = (uint16_t)(length - chunk);
+
+        radio_spi_select(true);
+        radio_spi_transfer(0x80);
+
+        while (chunk-- > 0)
+        {
+            radio_spi_transfer(*data_p++);
+        }
+
+        radio_spi_select(false);
     }
+
+    misc_timeout_cancel();
+}
+
+/**
+ * Recover from a transmission that never signalled completion by dropping to
+ * standby and throwing away whatever is left in the FIFO
+ */
+static void _radio_tx_abort(void)
+{
+    radio_receive_activate(false);
+
+    _radio_write_register(RADIO_REG_IRQFLAGS2, RADIO_REG_IRQFLAGS2_FIFOOVERRUN);
+    _radio_write_register(RADIO_REG_IOMAPPING, RADIO_REG_IOMAP_RX);
+}
+
+/**
+ * Start sending the packet at the head of the transmit queue
+ */
+static void _radio_tx_start_queued(void)
+{
+    radio_tx_entry_t* entry = &tx_queue[tx_queue_head];
+
+    _radio_tx_load(entry->data, entry->length, entry->dest_addr, false);
+
+    // Timeout in case the transmit done interrupt never arrives, on its own
+    // timer channel so the protocol's delays carry on
+    misc_timeout(RADIO_TX_TIMEOUT_MS);
 }
 
 /**
@@ -347,39 +834,399 @@ void radio_powerstate(bool state)
     {
         radio_spi_powerstate(true);
 
+        // Registers can be written while the oscillator starts, and the
+        // sequencer holds off any TX or RX until it is stable, so don't wait.
+        // A radio already in listen mode ignores the write unless aborted
+        if (listen_active)
+        {
+            _radio_write_register(RADIO_REG_OPMODE, RADIO_REG_OPMODE_WAKE | RADIO_REG_OPMODE_LISTENABORT);
+            listen_active = false;
+        }
+
         _radio_write_register(RADIO_REG_OPMODE, RADIO_REG_OPMODE_WAKE);
+        ready_stats.waits_skipped++;
 
-        uint8_t ret = 0x00;
-        while (!(ret & RADIO_REG_READYFLAG))
+        // Power, profile and channel may have been changed while asleep
+        _radio_write_register(RADIO_REG_PALEVEL, (uint8_t)(RADIO_REG_PALEVEL_PA0 |
+                (tx_power - RADIO_TXPOWER_MIN)));
+
+        if (link_profile_pending)
+        {
+            _radio_write_profile();
+        }
+
+        if (link_channel_pending)
         {
-            // Wait for radio to wake
-            ret = _radio_read_register(RADIO_REG_IRQFLAGS);
+            _radio_write_channel();
         }
 
         _radio_state = RADIO_WAKE;
+        power_radio_state(PWR_RADIO_STANDBY);
     }
     else
     {
+        // Leaving listen mode and entering sleep take effect on the next
+        // write, and nothing needs the radio once the SPI clock is gone
         _radio_write_register(RADIO_REG_OPMODE, RADIO_REG_OPMODE_SLEEP | RADIO_REG_OPMODE_LISTENABORT);
+        _radio_write_register(RADIO_REG_OPMODE, RADIO_REG_OPMODE_SLEEP);
+        ready_stats.waits_skipped += 2;
+
+        radio_spi_powerstate(false);
+
+        _radio_state = RADIO_SLEEP;
+        listen_active = false;
+        power_radio_state(PWR_RADIO_SLEEP);
+    }
+}
+
+/**
+ * Get the signal strength of the most recently received packet
+ *
+ * @return RSSI in dBm (RegRssiValue is in -0.5dBm steps)
+ */
+int16_t radio_last_rssi(void)
+{
+    return (int16_t)(-(last_rssi_raw / 2));
+}
+
+/**
+ * Set the transmit power. Takes effect immediately if the radio is awake,
+ * otherwise next time it wakes
+ *
+ * @param dbm Output power in dBm, clamped to RADIO_TXPOWER_MIN..MAX
+ */
+void radio_set_txpower(int8_t dbm)
+{
+    if (dbm < RADIO_TXPOWER_MIN)
+    {
+        dbm = RADIO_TXPOWER_MIN;
+    }
+    else if (dbm > RADIO_TXPOWER_MAX)
+    {
+        dbm = RADIO_TXPOWER_MAX;
+    }
+
+    tx_power = dbm;
+
+    if (_radio_state != RADIO_SLEEP)
+    {
+        _radio_write_register(RADIO_REG_PALEVEL, (uint8_t)(RADIO_REG_PALEVEL_PA0 |
+                (tx_power - RADIO_TXPOWER_MIN)));
+    }
+}
 
-        while (!(_radio_read_register(RADIO_REG_IRQFLAGS) & RADIO_REG_READYFLAG))
+/**
+ * Get the current transmit power
+ *
+ * @return Output power in dBm
+ */
+int8_t radio_get_txpower(void)
+{
+    return tx_power;
+}
+
+/**
+ * Switch bitrate, deviation and receive bandwidth to one of the link
+ * profiles. Takes effect immediately if the radio is awake, otherwise next
+ * time it wakes. Do not call mid-packet.
+ *
+ * @param profile One of RADIO_PROFILE_x, out of range values are ignored
+ */
+void radio_set_profile(uint8_t profile)
+{
+    if (profile >= RADIO_PROFILE_COUNT || profile == link_profile)
+    {
+        return;
+    }
+
+    link_profile = profile;
+
+    if (_radio_state == RADIO_SLEEP)
+    {
+        link_profile_pending = true;
+    }
+    else
+    {
+        bool recv_active = (_radio_state == RADIO_LISTEN);
+
+        // Receiver has to be stopped to change modulation
+        if (recv_active)
         {
-            // Wait for radio to stop listening
+            radio_receive_activate(false);
         }
 
-        _radio_write_register(RADIO_REG_OPMODE, RADIO_REG_OPMODE_SLEEP);
+        _radio_write_profile();
+
+        radio_receive_activate(recv_active);
+    }
+}
 
-        while (!(_radio_read_register(RADIO_REG_IRQFLAGS) & RADIO_REG_READYFLAG))
+/**
+ * Get the link profile in use
+ *
+ * @return One of RADIO_PROFILE_x
+ */
+uint8_t radio_get_profile(void)
+{
+    return link_profile;
+}
+
+/**
+ * Switch to one of the channels. Takes effect immediately if the radio is
+ * awake, otherwise next time it wakes. Do not call mid-packet.
+ *
+ * @param channel One of the RADIO_CHANNEL_COUNT channels, out of range values
+ *                are ignored
+ */
+void radio_set_channel(uint8_t channel)
+{
+    if (channel >= RADIO_CHANNEL_COUNT || channel == link_channel)
+    {
+        return;
+    }
+
+    link_channel = channel;
+
+    if (_radio_state == RADIO_SLEEP)
+    {
+        link_channel_pending = true;
+    }
+    else
+    {
+        bool recv_active = (_radio_state == RADIO_LISTEN);
+
+        // The synthesiser only retunes on the way back into receive
+        if (recv_active)
         {
-            // Wait for radio to sleep
+            radio_receive_activate(false);
         }
 
-        radio_spi_powerstate(false);
+        _radio_write_channel();
 
-        _radio_state = RADIO_SLEEP;
+        radio_receive_activate(recv_active);
+    }
+}
+
+/**
+ * Get the channel in use
+ *
+ * @return Channel number, RADIO_CHANNEL_CONTROL or one of the upload channels
+ */
+uint8_t radio_get_channel(void)
+{
+    return link_channel;
+}
+
+/**
+ * Get the address frames to us are sent to
+ *
+ * @return Address given to radio_init()
+ */
+uint8_t radio_get_address(void)
+{
+    return node_addr;
+}
+
+/**
+ * Choose between continuous receive and listen mode, where the radio cycles
+ * between idle and short receive windows by itself and only raises payload
+ * ready for a packet whose sync word matched. Relies on the sender's preamble
+ * being longer than one listen cycle. Takes effect straight away if receiving,
+ * otherwise the next time receive is switched on.
+ *
+ * @param enable Set to true to receive in listen mode, false for continuous
+ */
+void radio_listen_lowpower(bool enable)
+{
+    listen_lowpower = enable;
+
+    if (_radio_state == RADIO_LISTEN && listen_active != enable)
+    {
+        radio_receive_activate(false);
+        radio_receive_activate(true);
+    }
+}
+
+/**
+ * Work out how long a frame spends on air with the current link profile
+ *
+ * @param length Payload bytes, not counting the address bytes
+ * @return       Time from the start of the preamble to the end of the CRC in us
+ */
+uint32_t radio_airtime_us(uint16_t length)
+{
+    return _radio_bytes_us(link_profile, RADIO_FRAME_OVERHEAD + length + 2u);
+}
+
+/**
+ * Work out how long a frame would spend on air with another link profile
+ *
+ * @param profile One of RADIO_PROFILE_x
+ * @param length  Payload bytes, not counting the address bytes
+ * @return        Time from the start of the preamble to the end of the CRC in us
+ */
+uint32_t radio_profile_airtime_us(uint8_t profile, uint16_t length)
+{
+    if (profile >= RADIO_PROFILE_COUNT)
+    {
+        profile = RADIO_PROFILE_DEFAULT;
+    }
+
+    return _radio_bytes_us(profile, RADIO_FRAME_OVERHEAD + length + 2u);
+}
+
+/**
+ * Wait before replying to a frame that has just arrived, until its sender is
+ * sure to be receiving again. Only the part of RADIO_TURNAROUND_US our own
+ * preamble doesn't cover is waited out, which is none of it on any of the
+ * link profiles, so usually this returns straight away. The wait is timed on
+ * the radio's own channel, leaving any delay the protocol has running alone
+ */
+void radio_turnaround_wait(void)
+{
+    uint32_t preamble_us = _radio_bytes_us(link_profile, RADIO_PREAMBLE_LEN);
+
+    // A queued send goes out before the reply anyway, and has the timeout
+    if (preamble_us < RADIO_TURNAROUND_US && tx_queue_count == 0)
+    {
+        misc_timeout((uint16_t)((RADIO_TURNAROUND_US - preamble_us + 999) / 1000));
+
+        while (misc_timeout_active())
+        {
+            power_sleep();
+        }
     }
 }
 
+/**
+ * Pick a random delay for a retry, so two radios that clashed once don't
+ * clash again on the retry
+ *
+ * @param max_ms Longest delay wanted
+ * @return       Delay from 0 to max_ms inclusive in ms
+ */
+uint16_t radio_jitter_ms(uint16_t max_ms)
+{
+    // Stir in the noise on the last signal strength reading
+    jitter_state ^= last_rssi_raw;
+
+    if (jitter_state == 0)
+    {
+        jitter_state = RADIO_JITTER_SEED;
+    }
+
+    // 16 bit xorshift
+    jitter_state ^= (uint16_t)(jitter_state << 7);
+    jitter_state ^= (uint16_t)(jitter_state >> 9);
+    jitter_state ^= (uint16_t)(jitter_state << 8);
+
+    return (uint16_t)(jitter_state % ((uint32_t)max_ms + 1));
+}
+
+/**
+ * Work out how long some bytes take to send with a link profile.
+ * Each byte takes 8 bit times of RegBitrate / 32MHz
+ *
+ * @param profile Link profile to send with
+ * @param bytes   Number of bytes
+ * @return        Time on air in us
+ */
+static uint32_t _radio_bytes_us(uint8_t profile, uint32_t bytes)
+{
+    uint32_t bitrate = (uint32_t)radio_profile_data[profile][0] << 8 |
+            radio_profile_data[profile][1];
+
+    return bytes * bitrate / 4u;
+}
+
+/**
+ * Write the current link profile to the radio
+ */
+static void _radio_write_profile(void)
+{
+    _radio_write_register(RADIO_REG_BITRATEMSB, radio_profile_data[link_profile][0]);
+    _radio_write_register(RADIO_REG_BITRATELSB, radio_profile_data[link_profile][1]);
+    _radio_write_register(RADIO_REG_FDEVMSB, radio_profile_data[link_profile][2]);
+    _radio_write_register(RADIO_REG_FDEVLSB, radio_profile_data[link_profile][3]);
+    _radio_write_register(RADIO_REG_RXBW, radio_profile_data[link_profile][4]);
+    _radio_write_register(RADIO_REG_LISTEN2, radio_profile_data[link_profile][5]);
+
+    link_profile_pending = false;
+}
+
+/**
+ * Write the current channel to the radio, the frequency changes once the
+ * least significant byte is written
+ */
+static void _radio_write_channel(void)
+{
+    _radio_write_register(RADIO_REG_FRFMSB, radio_channel_data[link_channel][0]);
+    _radio_write_register(RADIO_REG_FRFMID, radio_channel_data[link_channel][1]);
+    _radio_write_register(RADIO_REG_FRFLSB, radio_channel_data[link_channel][2]);
+
+    link_channel_pending = false;
+}
+
+/**
+ * Get the mode change wait counters gathered since the last clear
+ *
+ * @return Pointer to the counters
+ */
+const radio_ready_stats_t* radio_ready_stats(void)
+{
+    return &ready_stats;
+}
+
+/**
+ * Estimate how many ModeReady polls have been avoided, using the average
+ * number of polls the remaining waits take. The skipped waits were never
+ * polled, so this is extrapolated rather than counted, and printed as est.
+ *
+ * @return Estimated polling iterations eliminated since the last clear
+ */
+uint32_t radio_ready_polls_saved(void)
+{
+    if (ready_stats.waits == 0)
+    {
+        return 0;
+    }
+
+    return (uint32_t)(((uint64_t)ready_stats.waits_skipped * ready_stats.polls) /
+            ready_stats.waits);
+}
+
+/**
+ * Reset the mode change wait counters (call once a day after reporting)
+ */
+void radio_ready_stats_clear(void)
+{
+    ready_stats.waits = 0;
+    ready_stats.polls = 0;
+    ready_stats.waits_skipped = 0;
+}
+
+/**
+ * Wait for the radio to report a mode change is complete, giving up after
+ * RADIO_READY_MAX_POLLS reads so a stuck radio can't hang the processor
+ *
+ * @return True if the radio reported ready
+ */
+static bool _radio_wait_ready(void)
+{
+    ready_stats.waits++;
+
+    for (uint8_t i = 0; i < RADIO_READY_MAX_POLLS; i++)
+    {
+        ready_stats.polls++;
+
+        if (_radio_read_register(RADIO_REG_IRQFLAGS) & RADIO_REG_READYFLAG)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
 
 /**
  * Read values from every register (function does nothing if debug mode is off)
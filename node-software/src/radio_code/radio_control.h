@@ -14,21 +14,97 @@
 
 //#define DEBUG_RADIO 1
 
-#define RADIO_MAX_PACKET_LEN  62
-#define RADIO_RECEIVE_BUFSIZE 512
+// Largest payload in one frame, bigger than the FIFO so it gets streamed
+#define RADIO_MAX_FRAME_LEN   253
+
+// Largest payload the asynchronous transmit queue holds a copy of
+#define RADIO_MAX_PACKET_LEN  124
+#define RADIO_RX_SLOTS        4
+#define RADIO_TX_QUEUE_LEN    2
 
 #define RADIO_BCAST_ADDR      0x00
 
+// Frame timestamps are times of day counted at this rate, whatever clock each
+// side keeps them with, and take this many bytes in a timed frame
+#define RADIO_TIME_HZ         32768u
+#define RADIO_TIME_PER_DAY    (86400u * RADIO_TIME_HZ)
+#define RADIO_TIMESTAMP_LEN   4
+
+// Output power range of the RFM69W PA0 in dBm
+#define RADIO_TXPOWER_MIN     (-18)
+#define RADIO_TXPOWER_MAX     13
+
+// Link profiles (see radio_config.h), registration always uses the default
+#define RADIO_PROFILE_4K8     0
+#define RADIO_PROFILE_19K2    1
+#define RADIO_PROFILE_55K5    2
+#define RADIO_PROFILE_COUNT   3
+#define RADIO_PROFILE_DEFAULT RADIO_PROFILE_55K5
+
+// Channels (see radio_config.h). Registration, the schedule broadcast and
+// relaying stay on the control channel, uploads go on the others
+#define RADIO_CHANNEL_CONTROL 0
+#define RADIO_CHANNEL_COUNT   3
+
 typedef enum {RADIO_SLEEP, RADIO_WAKE, RADIO_LISTEN} radio_state_t;
 
+/**
+ * A received frame held in the receive ring, valid from radio_rx_peek() until
+ * radio_rx_commit()
+ */
+typedef struct
+{
+    uint8_t* data;      //!< Sender address followed by the payload
+    uint8_t length;     //!< Bytes at data, including the sender address
+    int16_t rssi;       //!< Signal strength in dBm
+    uint32_t timestamp; //!< Time of day in RADIO_TIME_HZ ticks the frame arrived
+} radio_packet_t;
+
+/**
+ * Counters for mode change waits, used to report how much SPI polling of the
+ * ModeReady flag is being avoided
+ */
+typedef struct
+{
+    uint32_t waits;         //!< Mode changes we still wait on
+    uint32_t polls;         //!< ModeReady reads made during those waits
+    uint32_t waits_skipped; //!< Mode changes where the wait was dropped
+} radio_ready_stats_t;
+
 bool radio_init(uint8_t addr, void (*callback)(uint16_t));
 
 // Internal functions for sending and receiving data - exposed for convienience
 bool radio_send_data(uint8_t* data_p, uint16_t length, uint8_t dest_addr);
-uint16_t radio_retrieve_data(uint8_t* data_p, uint16_t length);
+bool radio_send_timed(uint8_t* data_p, uint16_t length, uint8_t dest_addr);
+uint32_t radio_last_txtime(void);
+bool radio_send_async(uint8_t* data_p, uint16_t length, uint8_t dest_addr,
+        void (*callback)(bool));
+void radio_service(void);
+bool radio_tx_busy(void);
+const radio_packet_t* radio_rx_peek(void);
+void radio_rx_commit(void);
 void radio_receive_activate(bool activate);
 void radio_powerstate(bool state);
 
+int16_t radio_last_rssi(void);
+void radio_set_txpower(int8_t dbm);
+int8_t radio_get_txpower(void);
+void radio_set_profile(uint8_t profile);
+uint8_t radio_get_profile(void);
+void radio_set_channel(uint8_t channel);
+uint8_t radio_get_channel(void);
+uint8_t radio_get_address(void);
+void radio_listen_lowpower(bool enable);
+
+uint32_t radio_airtime_us(uint16_t length);
+uint32_t radio_profile_airtime_us(uint8_t profile, uint16_t length);
+void radio_turnaround_wait(void);
+uint16_t radio_jitter_ms(uint16_t max_ms);
+
+const radio_ready_stats_t* radio_ready_stats(void);
+uint32_t radio_ready_polls_saved(void);
+void radio_ready_stats_clear(void);
+
 // Functions for low-level interrupt routines to make callbacks
 void _radio_payload_ready(void);
 
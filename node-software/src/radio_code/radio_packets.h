@@ -0,0 +1,615 @@
+/**
+ * Layout of the packets nodes and the base station, or a relay, send each
+ * other, packed and unpacked in the one place for both ends, symlinked.
+ * Include radio_control.h and radio_shared_types.h first
+ *
+ * Fields are given starting from the packet type, as they go to
+ * radio_send_data(). Uploads and patch requests have no type and start from
+ * their seq. Received frames have the sender's address in front, so are
+ * unpacked from the byte after it. The BEACONACK has its 16 bit fields most
+ * significant byte first and everything else least significant first. It's
+ * left that way as nodes in the field already read them so
+ */
+
+#ifndef RADIO_PACKETS_H_
+#define RADIO_PACKETS_H_
+
+// BEACONACK is [PKT_BEACONACK],[time(16)],[period(16)],[nextwake(16)],
+// [options(8)],[txpower(8)],[profile(8)],[nextwake ms(16)],[channel(8)],
+// [rx time(32)],[tx time(32)]. Bits 0 to 2 of options are the top bits of
+// time, period and nextwake. A relay from before channels leaves the channel out
+#define RADIO_BEACONACK_LEN 21
+#define RADIO_BEACONACK_MIN_LEN (RADIO_BEACONACK_LEN - 1)
+
+// ACK is [PKT_ACK],[flags(8)],[time(16)],[txpower(8)],[profile(8)],
+// [nextwake(16)],[nextwake ms(16)],[period(16)],[drift(16)], then
+// [sub-slots(8)],[sub-slots ms(16)] for a relay, [command id(8)],[command(8)],
+// [value(16)] if there's a command, and [rx time(32)],[tx time(32)]. Bits 0
+// and 1 of flags are the top bits of time and nextwake, bit 2 says whether
+// nextwake, period and drift are set and bit 3 whether the sub-slots are
+#define RADIO_ACK_LEN 22
+#define RADIO_ACK_RELAY_LEN 3
+#define RADIO_ACK_MAX_LEN (RADIO_ACK_LEN + RADIO_ACK_RELAY_LEN + RADIO_COMMAND_LEN)
+#define RADIO_ACK_SLOT 0x04
+#define RADIO_ACK_RELAY 0x08
+
+// An upload is [seq(16)],[flags(8)],[backlog(8)],[data], flags being
+// RADIO_FLAG_LAST and RADIO_FLAG_POLL. The base, or relay, answers a poll with
+// [PKT_SACK],[next seq wanted(16)],[bitmap of the ones after it]
+#define RADIO_UPLOAD_HEADER_LEN 4
+#define RADIO_SACK_LEN 4
+
+// A node asks for patch chunks with [next chunk wanted(16)],[RADIO_FLAG_PATCH],
+// [bitmap of the ones after it], and gets [PKT_PATCH],[chunk(16)],[chunks(16)],
+// [flags(8)],[data]
+#define RADIO_PATCH_REQUEST_LEN 4
+#define RADIO_PATCH_HEADER_LEN 6
+
+// SCHEDULE is [PKT_SCHEDULE],[version(8)],[count(8)], count entries of
+// [node(8)],[wake in ms(24)],[period(16)], then [tx time(32)]
+#define RADIO_SCHEDULE_HEADER_LEN 3
+
+/**
+ * What a BEACONACK tells a node registering
+ */
+typedef struct
+{
+    uint32_t time;          //!< Second of the day the reply finishes going out at
+    uint32_t period;        //!< Seconds between wakes
+    uint32_t next_wake;     //!< Second of the day to wake at first
+    uint16_t next_wake_ms;  //!< ms after that second
+    int8_t tx_power;        //!< TX power to upload at in dBm
+    uint8_t profile;        //!< Link profile to upload with, RADIO_PROFILE_x
+    uint8_t channel;        //!< Channel to upload on, RADIO_CHANNEL_x
+    uint32_t rx_time;       //!< When the beacon arrived, in RADIO_TIME_HZ ticks
+} radio_beaconack_t;
+
+/**
+ * What an ACK tells a node at the end of its upload
+ */
+typedef struct
+{
+    uint32_t time;          //!< Second of the day the reply finishes going out at
+    int8_t tx_power;        //!< TX power to upload at next in dBm
+    uint8_t profile;        //!< Link profile to upload with next, RADIO_PROFILE_x
+    bool slot;              //!< Whether the node still has a slot, given below
+    uint32_t next_wake;     //!< Second of the day to wake at next
+    uint16_t next_wake_ms;  //!< ms after that second
+    uint16_t period;        //!< Seconds between wakes
+    int16_t drift_ppm;      //!< How fast the node's clock runs against ours
+    uint8_t children;       //!< Sub-slots a relay has next period, 0 for none
+    uint16_t children_ms;   //!< ms after waking the sub-slots start
+    uint8_t command_id;     //!< Id of the command, stored once it's taken
+    uint8_t command;        //!< One of the CMD_x settings, 0 for none
+    uint16_t value;         //!< What to set it to
+    uint32_t rx_time;       //!< When the packet answered arrived, in RADIO_TIME_HZ ticks
+} radio_ack_t;
+
+/**
+ * Header of an upload packet
+ */
+typedef struct
+{
+    uint16_t seq;           //!< Packet number in the upload
+    uint8_t flags;          //!< RADIO_FLAG_LAST and RADIO_FLAG_POLL
+    uint8_t backlog;        //!< Uploads the node has waiting after this one
+    const uint8_t* data;    //!< Records it carries, set when unpacked
+    uint8_t length;         //!< Bytes at data
+} radio_upload_t;
+
+/**
+ * Which packets of an upload window the base, or relay, has
+ */
+typedef struct
+{
+    uint16_t next;          //!< First packet still wanted
+    uint8_t have;           //!< Bitmap of the ones after it already in
+} radio_sack_t;
+
+/**
+ * Which chunks of a patch a node still wants
+ */
+typedef struct
+{
+    uint16_t next;          //!< First chunk still wanted
+    uint8_t have;           //!< Bitmap of the ones after it already in
+} radio_patch_request_t;
+
+/**
+ * Header of a patch chunk
+ */
+typedef struct
+{
+    uint16_t chunk;         //!< Chunk number
+    uint16_t chunks;        //!< Chunks in the whole patch
+    uint8_t flags;          //!< RADIO_FLAG_POLL and RADIO_FLAG_LAST
+    const uint8_t* data;    //!< The chunk, set when unpacked
+    uint8_t length;         //!< Bytes at data
+} radio_patch_t;
+
+/**
+ * One node's slot in a SCHEDULE
+ */
+typedef struct
+{
+    uint8_t node;           //!< Node it's for
+    uint32_t wake_in_ms;    //!< ms from the end of the broadcast to wake at, 24 bits
+    uint16_t period;        //!< Seconds between wakes
+} radio_schedule_entry_t;
+
+/**
+ * What a SCHEDULE tells the nodes that missed their last slot
+ */
+typedef struct
+{
+    uint8_t version;        //!< Version of the schedule
+    uint8_t count;          //!< Entries used
+    radio_schedule_entry_t entry[RADIO_SCHEDULE_MAX_ENTRIES];
+    uint32_t tx_time;       //!< When it finished going out, in RADIO_TIME_HZ ticks
+} radio_schedule_t;
+
+/**
+ * Put a field in a packet, least significant byte first
+ *
+ * @param data  Where it goes
+ * @param value Field
+ * @param bytes Its length
+ */
+static inline void _radio_put_le(uint8_t* data, uint32_t value, uint8_t bytes)
+{
+    for (uint8_t i = 0; i < bytes; i++)
+    {
+        data[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+/**
+ * Read a field from a packet, least significant byte first
+ *
+ * @param data  Where it is
+ * @param bytes Its length
+ * @return      Field
+ */
+static inline uint32_t _radio_get_le(const uint8_t* data, uint8_t bytes)
+{
+    uint32_t value = 0;
+
+    for (uint8_t i = 0; i < bytes; i++)
+    {
+        value |= (uint32_t)data[i] << (8 * i);
+    }
+
+    return value;
+}
+
+/**
+ * Put a 16 bit field in a packet, most significant byte first
+ *
+ * @param data  Where it goes
+ * @param value Field
+ */
+static inline void _radio_put_be16(uint8_t* data, uint32_t value)
+{
+    data[0] = (uint8_t)(value >> 8);
+    data[1] = (uint8_t)value;
+}
+
+/**
+ * Read a 16 bit field from a packet, most significant byte first
+ *
+ * @param data Where it is
+ * @return     Field
+ */
+static inline uint16_t _radio_get_be16(const uint8_t* data)
+{
+    return (uint16_t)(data[0] << 8 | data[1]);
+}
+
+/**
+ * Lay out a BEACONACK, leaving the tx time for radio_send_timed()
+ *
+ * @param ack  Fields to send
+ * @param data Filled in, RADIO_BEACONACK_LEN bytes
+ * @return     Length to send
+ */
+static inline uint8_t radio_beaconack_pack(const radio_beaconack_t* ack, uint8_t* data)
+{
+    data[0] = PKT_BEACONACK;
+    _radio_put_be16(&data[1], ack->time);
+    _radio_put_be16(&data[3], ack->period);
+    _radio_put_be16(&data[5], ack->next_wake);
+    data[7] = (uint8_t)((ack->time & 0x10000) >> 16 | (ack->period & 0x10000) >> 15 |
+            (ack->next_wake & 0x10000) >> 14);
+    data[8] = (uint8_t)ack->tx_power;
+    data[9] = ack->profile;
+    _radio_put_be16(&data[10], ack->next_wake_ms);
+    data[12] = ack->channel;
+    _radio_put_le(&data[13], ack->rx_time, RADIO_TIMESTAMP_LEN);
+    _radio_put_le(&data[13 + RADIO_TIMESTAMP_LEN], 0, RADIO_TIMESTAMP_LEN);
+
+    return RADIO_BEACONACK_LEN;
+}
+
+/**
+ * Read a BEACONACK
+ *
+ * @param data   Packet, starting with its type
+ * @param length Its length
+ * @param ack    Filled in with its fields, the channel being the control
+ *               channel if it's left out
+ * @return       False if it's too short to be one
+ */
+static inline bool radio_beaconack_unpack(const uint8_t* data, uint8_t length,
+        radio_beaconack_t* ack)
+{
+    if (length < RADIO_BEACONACK_MIN_LEN || data[0] != PKT_BEACONACK)
+    {
+        return false;
+    }
+
+    ack->time = _radio_get_be16(&data[1]) | (uint32_t)(data[7] & 0x01) << 16;
+    ack->period = _radio_get_be16(&data[3]) | (uint32_t)(data[7] & 0x02) << 15;
+    ack->next_wake = _radio_get_be16(&data[5]) | (uint32_t)(data[7] & 0x04) << 14;
+    ack->tx_power = (int8_t)data[8];
+    ack->profile = data[9];
+    ack->next_wake_ms = _radio_get_be16(&data[10]);
+    ack->channel = (length >= RADIO_BEACONACK_LEN) ? data[12] : RADIO_CHANNEL_CONTROL;
+    ack->rx_time = _radio_get_le(&data[length - 2 * RADIO_TIMESTAMP_LEN],
+            RADIO_TIMESTAMP_LEN);
+
+    return true;
+}
+
+/**
+ * Length of an ACK with these fields
+ *
+ * @param ack Fields to send
+ * @return    Length in bytes
+ */
+static inline uint8_t radio_ack_length(const radio_ack_t* ack)
+{
+    return (uint8_t)(RADIO_ACK_LEN + (ack->children ? RADIO_ACK_RELAY_LEN : 0) +
+            (ack->command ? RADIO_COMMAND_LEN : 0));
+}
+
+/**
+ * Lay out an ACK, leaving the tx time for radio_send_timed()
+ *
+ * @param ack  Fields to send
+ * @param data Filled in, up to RADIO_ACK_MAX_LEN bytes
+ * @return     Length to send
+ */
+static inline uint8_t radio_ack_pack(const radio_ack_t* ack, uint8_t* data)
+{
+    uint8_t at = 14;
+
+    data[0] = PKT_ACK;
+    data[1] = (uint8_t)((ack->time & 0x10000) >> 16);
+    _radio_put_le(&data[2], ack->time, 2);
+    data[4] = (uint8_t)ack->tx_power;
+    data[5] = ack->profile;
+    _radio_put_le(&data[6], 0, 4);
+    _radio_put_le(&data[10], 0, 4);
+
+    if (ack->slot)
+    {
+        data[1] |= (uint8_t)(RADIO_ACK_SLOT | (ack->next_wake & 0x10000) >> 15);
+        _radio_put_le(&data[6], ack->next_wake, 2);
+        _radio_put_le(&data[8], ack->next_wake_ms, 2);
+        _radio_put_le(&data[10], ack->period, 2);
+        _radio_put_le(&data[12], (uint16_t)ack->drift_ppm, 2);
+    }
+
+    if (ack->children)
+    {
+        data[1] |= RADIO_ACK_RELAY;
+        data[at] = ack->children;
+        _radio_put_le(&data[at + 1], ack->children_ms, 2);
+        at += RADIO_ACK_RELAY_LEN;
+    }
+
+    if (ack->command)
+    {
+        data[at] = ack->command_id;
+        data[at + 1] = ack->command;
+        _radio_put_le(&data[at + 2], ack->value, 2);
+        at += RADIO_COMMAND_LEN;
+    }
+
+    _radio_put_le(&data[at], ack->rx_time, RADIO_TIMESTAMP_LEN);
+    _radio_put_le(&data[at + RADIO_TIMESTAMP_LEN], 0, RADIO_TIMESTAMP_LEN);
+
+    return (uint8_t)(at + 2 * RADIO_TIMESTAMP_LEN);
+}
+
+/**
+ * Read an ACK
+ *
+ * @param data   Packet, starting with its type
+ * @param length Its length
+ * @param ack    Filled in with its fields
+ * @return       False if it's too short to be one
+ */
+static inline bool radio_ack_unpack(const uint8_t* data, uint8_t length, radio_ack_t* ack)
+{
+    uint8_t at = 14;
+
+    if (length < RADIO_ACK_LEN || data[0] != PKT_ACK)
+    {
+        return false;
+    }
+
+    ack->time = _radio_get_le(&data[2], 2) | (uint32_t)(data[1] & 0x01) << 16;
+    ack->tx_power = (int8_t)data[4];
+    ack->profile = data[5];
+    ack->slot = (data[1] & RADIO_ACK_SLOT) != 0;
+    ack->next_wake = _radio_get_le(&data[6], 2) | (uint32_t)(data[1] & 0x02) << 15;
+    ack->next_wake_ms = (uint16_t)_radio_get_le(&data[8], 2);
+    ack->period = (uint16_t)_radio_get_le(&data[10], 2);
+    ack->drift_ppm = (int16_t)_radio_get_le(&data[12], 2);
+    ack->children = 0;
+    ack->children_ms = 0;
+    ack->command_id = 0;
+    ack->command = 0;
+    ack->value = 0;
+
+    if ((data[1] & RADIO_ACK_RELAY) && length >= RADIO_ACK_LEN + RADIO_ACK_RELAY_LEN)
+    {
+        ack->children = data[at];
+        ack->children_ms = (uint16_t)_radio_get_le(&data[at + 1], 2);
+        at += RADIO_ACK_RELAY_LEN;
+    }
+
+    if (length >= at + RADIO_COMMAND_LEN + 2 * RADIO_TIMESTAMP_LEN)
+    {
+        ack->command_id = data[at];
+        ack->command = data[at + 1];
+        ack->value = (uint16_t)_radio_get_le(&data[at + 2], 2);
+    }
+
+    ack->rx_time = _radio_get_le(&data[length - 2 * RADIO_TIMESTAMP_LEN],
+            RADIO_TIMESTAMP_LEN);
+
+    return true;
+}
+
+/**
+ * Lay out the header of an upload packet, the data going after it at
+ * RADIO_UPLOAD_HEADER_LEN
+ *
+ * @param upload Fields to send, with the length of the data
+ * @param data   Filled in, RADIO_UPLOAD_HEADER_LEN bytes
+ * @return       Length to send
+ */
+static inline uint8_t radio_upload_pack(const radio_upload_t* upload, uint8_t* data)
+{
+    _radio_put_le(&data[0], upload->seq, 2);
+    data[2] = upload->flags;
+    data[3] = upload->backlog;
+
+    return (uint8_t)(RADIO_UPLOAD_HEADER_LEN + upload->length);
+}
+
+/**
+ * Read an upload packet. A beacon is too short and a patch request has a flag
+ * uploads don't use, so neither is taken for one
+ *
+ * @param data   Packet, from after the sender's address
+ * @param length Its length
+ * @param upload Filled in with its fields, data pointing into the packet
+ * @return       False if it isn't one
+ */
+static inline bool radio_upload_unpack(const uint8_t* data, uint8_t length,
+        radio_upload_t* upload)
+{
+    if (length < RADIO_UPLOAD_HEADER_LEN ||
+            (data[2] & ~(RADIO_FLAG_LAST | RADIO_FLAG_POLL)))
+    {
+        return false;
+    }
+
+    upload->seq = (uint16_t)_radio_get_le(&data[0], 2);
+    upload->flags = data[2];
+    upload->backlog = data[3];
+    upload->data = &data[RADIO_UPLOAD_HEADER_LEN];
+    upload->length = (uint8_t)(length - RADIO_UPLOAD_HEADER_LEN);
+
+    return true;
+}
+
+/**
+ * Lay out a SACK
+ *
+ * @param sack Fields to send
+ * @param data Filled in, RADIO_SACK_LEN bytes
+ * @return     Length to send
+ */
+static inline uint8_t radio_sack_pack(const radio_sack_t* sack, uint8_t* data)
+{
+    data[0] = PKT_SACK;
+    _radio_put_le(&data[1], sack->next, 2);
+    data[3] = sack->have;
+
+    return RADIO_SACK_LEN;
+}
+
+/**
+ * Read a SACK
+ *
+ * @param data   Packet, starting with its type
+ * @param length Its length
+ * @param sack   Filled in with its fields
+ * @return       False if it's too short to be one
+ */
+static inline bool radio_sack_unpack(const uint8_t* data, uint8_t length, radio_sack_t* sack)
+{
+    if (length < RADIO_SACK_LEN || data[0] != PKT_SACK)
+    {
+        return false;
+    }
+
+    sack->next = (uint16_t)_radio_get_le(&data[1], 2);
+    sack->have = data[3];
+
+    return true;
+}
+
+/**
+ * Lay out a node's request for patch chunks
+ *
+ * @param request Chunks wanted
+ * @param data    Filled in, RADIO_PATCH_REQUEST_LEN bytes
+ * @return        Length to send
+ */
+static inline uint8_t radio_patch_request_pack(const radio_patch_request_t* request, uint8_t* data)
+{
+    _radio_put_le(&data[0], request->next, 2);
+    data[2] = RADIO_FLAG_PATCH;
+    data[3] = request->have;
+
+    return RADIO_PATCH_REQUEST_LEN;
+}
+
+/**
+ * Read a node's request for patch chunks
+ *
+ * @param data    Packet, from after the sender's address
+ * @param length  Its length
+ * @param request Filled in with the chunks wanted
+ * @return        False if it isn't one
+ */
+static inline bool radio_patch_request_unpack(const uint8_t* data, uint8_t length,
+        radio_patch_request_t* request)
+{
+    if (length < RADIO_PATCH_REQUEST_LEN || !(data[2] & RADIO_FLAG_PATCH))
+    {
+        return false;
+    }
+
+    request->next = (uint16_t)_radio_get_le(&data[0], 2);
+    request->have = data[3];
+
+    return true;
+}
+
+/**
+ * Lay out the header of a patch chunk, the chunk going after it at
+ * RADIO_PATCH_HEADER_LEN
+ *
+ * @param chunk Fields to send, with the length of the chunk
+ * @param data  Filled in, RADIO_PATCH_HEADER_LEN bytes
+ * @return      Length to send
+ */
+static inline uint8_t radio_patch_pack(const radio_patch_t* chunk, uint8_t* data)
+{
+    data[0] = PKT_PATCH;
+    _radio_put_le(&data[1], chunk->chunk, 2);
+    _radio_put_le(&data[3], chunk->chunks, 2);
+    data[5] = chunk->flags;
+
+    return (uint8_t)(RADIO_PATCH_HEADER_LEN + chunk->length);
+}
+
+/**
+ * Read a patch chunk
+ *
+ * @param data   Packet, starting with its type
+ * @param length Its length
+ * @param chunk  Filled in with its fields, data pointing into the packet
+ * @return       False if it's too short to carry any of the patch
+ */
+static inline bool radio_patch_unpack(const uint8_t* data, uint8_t length,
+        radio_patch_t* chunk)
+{
+    if (length <= RADIO_PATCH_HEADER_LEN || data[0] != PKT_PATCH)
+    {
+        return false;
+    }
+
+    chunk->chunk = (uint16_t)_radio_get_le(&data[1], 2);
+    chunk->chunks = (uint16_t)_radio_get_le(&data[3], 2);
+    chunk->flags = data[5];
+    chunk->data = &data[RADIO_PATCH_HEADER_LEN];
+    chunk->length = (uint8_t)(length - RADIO_PATCH_HEADER_LEN);
+
+    return true;
+}
+
+/**
+ * Length of a SCHEDULE with this many entries
+ *
+ * @param count Entries
+ * @return      Length in bytes
+ */
+static inline uint8_t radio_schedule_length(uint8_t count)
+{
+    return (uint8_t)(RADIO_SCHEDULE_HEADER_LEN + count * RADIO_SCHEDULE_ENTRY_LEN +
+            RADIO_TIMESTAMP_LEN);
+}
+
+/**
+ * Lay out a SCHEDULE, leaving the tx time for radio_send_timed()
+ *
+ * @param schedule Fields to send
+ * @param data     Filled in, up to radio_schedule_length(RADIO_SCHEDULE_MAX_ENTRIES)
+ *                 bytes
+ * @return         Length to send
+ */
+static inline uint8_t radio_schedule_pack(const radio_schedule_t* schedule, uint8_t* data)
+{
+    uint8_t at = RADIO_SCHEDULE_HEADER_LEN;
+
+    data[0] = PKT_SCHEDULE;
+    data[1] = schedule->version;
+    data[2] = schedule->count;
+
+    for (uint8_t i = 0; i < schedule->count; i++)
+    {
+        data[at] = schedule->entry[i].node;
+        _radio_put_le(&data[at + 1], schedule->entry[i].wake_in_ms, 3);
+        _radio_put_le(&data[at + 4], schedule->entry[i].period, 2);
+        at += RADIO_SCHEDULE_ENTRY_LEN;
+    }
+
+    _radio_put_le(&data[at], 0, RADIO_TIMESTAMP_LEN);
+
+    return (uint8_t)(at + RADIO_TIMESTAMP_LEN);
+}
+
+/**
+ * Read a SCHEDULE
+ *
+ * @param data     Packet, starting with its type
+ * @param length   Its length
+ * @param schedule Filled in with its fields
+ * @return         False if it's too short for the entries it says it has, or
+ *                 has more than there's room for
+ */
+static inline bool radio_schedule_unpack(const uint8_t* data, uint8_t length,
+        radio_schedule_t* schedule)
+{
+    uint8_t at = RADIO_SCHEDULE_HEADER_LEN;
+
+    if (length < radio_schedule_length(0) || data[0] != PKT_SCHEDULE ||
+            data[2] > RADIO_SCHEDULE_MAX_ENTRIES || length < radio_schedule_length(data[2]))
+    {
+        return false;
+    }
+
+    schedule->version = data[1];
+    schedule->count = data[2];
+
+    for (uint8_t i = 0; i < schedule->count; i++)
+    {
+        schedule->entry[i].node = data[at];
+        schedule->entry[i].wake_in_ms = _radio_get_le(&data[at + 1], 3);
+        schedule->entry[i].period = (uint16_t)_radio_get_le(&data[at + 4], 2);
+        at += RADIO_SCHEDULE_ENTRY_LEN;
+    }
+
+    schedule->tx_time = _radio_get_le(&data[at], RADIO_TIMESTAMP_LEN);
+
+    return true;
+}
+
+#endif /* RADIO_PACKETS_H_ */
@@ -5,14 +5,17 @@
 /* Standard libraries */
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 /* Peripheral control headers */
+#include "em_device.h"
 #include "em_gpio.h"
 
 /* Application-specific headers */
 #include "radio_protocol.h"
 #include "radio_control.h"
 #include "radio_shared_types.h"
+#include "radio_packets.h"
 #include "radio_schedule_settings.h"
 #include "power_management.h"
 #include "i2c_sensors.h"
@@ -20,26 +23,182 @@
 #include "misc.h"
 #include "rtc_driver.h"
 #include "status_leds.h"
+#include "node_config.h"
+#include "power_model.h"
+#include "ota_patch.h"
 #include "printf.h"
 
 // Set to zero to keep the radio awake when idle
 #define RADIO_SLEEP_IDLE 1
 
-#define RADIO_TIMEOUT 3000
 #define RADIO_BEACON_TIMEOUT 3000
 
+// Longest round trip a timed reply can show and still be to our last frame,
+// in RADIO_TIME_HZ ticks. Anything longer means the base timed an earlier one
+#define PROTO_SYNC_ROUND_TRIP_MAX (RADIO_TIME_HZ / 500)
+
+// Times the last packet is sent again to prompt a reply that never came
+#define RADIO_REPLY_RETRIES 2
+
+// Time to start listening for the schedule broadcast before it's due
+#define PROTO_SCHEDULE_GUARD_MS 50
+
+// Longest misc_delay() can time at the core clock, longer waits are made in
+// steps of it
+#define PROTO_DELAY_MAX_MS 3000
+
+// Beacons the base leaves unanswered before listening for a relay instead,
+// and how long to listen. A relay with room broadcasts once a period
+#define PROTO_RELAY_SEEK_BEACONS 8
+#define PROTO_RELAY_SEEK_MS (RSCHED_NODE_PERIOD * 1000u + 1000u)
+
+// Longest wait after hearing a relay before sending it a beacon, so nodes
+// that heard it together don't all answer at once
+#define PROTO_RELAY_JOIN_JITTER_MS 100
+
+// Time into its sub-slot a node we relay for is told to wake, and uploads it
+// may miss in a row before the sub-slot is given up. A node registered
+// through a relay registers again once it has missed as many ACKs
+#define PROTO_RELAY_SLACK_MS 30
+#define PROTO_RELAY_MISSES 3
+
+// ACKs a node registered with the base may miss in a row before it registers
+// again. The base gives up after fewer missed uploads, but ACKs get lost on
+// their own, so wait for twice as many before going back to beaconing
+#define PROTO_BASE_MISSES (2 * (RSCHED_MAX_RETRIES + 1))
+
 // Protocol state store
 static proto_radio_state_t proto_state;
 
 // End point in datastore, used to clear store once all data received
 static uint16_t datastore_end;
 
+// Upload in progress: bytes being sent and packets they take, the first
+// packet the base doesn't have yet, the next packet never sent, and which of
+// the RADIO_WINDOW packets after seq_acked the base already has
+static uint16_t upload_size = 0;
+static uint16_t seq_count = 0;
+static uint16_t seq_acked = 0;
+static uint16_t seq_next = 0;
+static uint8_t seq_sacked = 0;
+
 // Assemble some storage for the packet data array
 static uint8_t packet_data[RADIO_MAX_PACKET_LEN];
 
+// Length of the packet last queued, still in packet_data for a retry
+static uint16_t packet_len_last = 0;
+
+// Retries left for the reply to the packets sent
+static uint8_t reply_retries = 0;
+
+// Link profile agreed with the base station for uploads, and the channel it
+// gave us for them
+static uint8_t upload_profile = RADIO_PROFILE_DEFAULT;
+static uint8_t upload_channel = RADIO_CHANNEL_CONTROL;
+
+// Time between uploads, given by the base station when registering
+static uint32_t wake_period = RSCHED_NODE_PERIOD;
+
+// Range of slots to back off over before the next beacon, and when the last
+// one went in ms by our clock
+static uint16_t beacon_slots = RSCHED_BEACON_SLOTS_MIN;
+static uint32_t beacon_sent_ms = 0;
+
+// Time of day in ms we were due to wake next before listening for the
+// schedule broadcast, kept in case it doesn't list us
+static uint32_t resync_wake_ms = 0;
+
+// Time of day in ms the sensors were last read, if they have been
+static uint32_t sample_ms = 0;
+static bool sampled = false;
+
+// Firmware patch being fetched after each ACK until all of it is in: its id,
+// the command id to store once it is, chunks in it (0 until the base says),
+// the first chunk not staged yet and which of the RADIO_WINDOW - 1 after it are
+static bool patch_wanted = false;
+static uint16_t patch_id = 0;
+static uint8_t patch_command_id = 0;
+static uint16_t patch_chunks = 0;
+static uint16_t patch_next = 0;
+static uint8_t patch_have = 0;
+
+// A patch is staged and the base has been told, so restart after the next ACK
+// for the bootloader to apply it
+static bool restart_due = false;
+
+// Where our uploads go, the base or the relay we registered through, the
+// beacons the base has left unanswered, ACKs missed in a row, and the time of
+// day in ms to stop listening for a relay at
+static uint8_t parent_addr = BASE_ADDR;
+static uint8_t beacon_misses = 0;
+static uint8_t ack_misses = 0;
+static uint32_t relay_seek_ms = 0;
+
+// Data bytes in each upload packet, fewer through a relay
+static uint16_t upload_data_len = RADIO_MAX_DATA_LEN;
+
+// Relaying for nodes out of the base's range: the node in each sub-slot, 0
+// for a free one, and the uploads each has missed in a row
+static uint8_t relay_child[RADIO_RELAY_MAX_CHILDREN];
+static uint8_t relay_missed[RADIO_RELAY_MAX_CHILDREN];
+
+// Sub-slots the base gave us this period and when by our clock the first
+// starts, and the same for the next period from the latest ACK
+static uint8_t relay_count = 0;
+static uint32_t relay_start_ms = 0;
+static uint8_t relay_next_count = 0;
+static uint32_t relay_next_ms = 0;
+
+// Sub-slot being served, the packets of the upload in it so far, which of
+// them are in, the last one, whether they have been stored, and when the
+// latest arrived. Our own TX power is put back afterwards
+static uint8_t relay_slot = RADIO_RELAY_MAX_CHILDREN;
+static uint8_t relay_data[RADIO_RELAY_SLOT_PACKETS][RADIO_RELAY_DATA_LEN];
+static uint8_t relay_len[RADIO_RELAY_SLOT_PACKETS];
+static uint8_t relay_have = 0;
+static uint8_t relay_last = RADIO_RELAY_SLOT_PACKETS;
+static bool relay_stored = false;
+static uint32_t relay_rx_time = 0;
+static int8_t relay_txpower = RADIO_TXPOWER_MAX;
+
 // Functions used only in this file
 static void _proto_endcleanup(void);
 static void _proto_uploaddata(void);
+static void _proto_send_window(void);
+static void _proto_queue_packet(uint16_t length, void (*callback)(bool));
+static void _proto_start_acktimer(bool sent);
+static void _proto_beacon_backoff(void);
+static void _proto_resync_wait(void);
+static void _proto_resync_end(void);
+static void _proto_read_schedule(const radio_packet_t* packet);
+static uint8_t _proto_backlog(void);
+static void _proto_sync_clock(const radio_packet_t* packet);
+static uint32_t _proto_read_time(const uint8_t* data);
+static int32_t _proto_ticks_between(uint32_t from, uint32_t to);
+static void _proto_set_txpower(int8_t dbm);
+static bool _proto_take_command(uint8_t id, uint8_t command, uint16_t value);
+static void _proto_sample_sensors(bool now);
+static bool _proto_patch_begin(uint16_t id);
+static void _proto_patch_chunk(uint16_t chunk, uint8_t flags, const uint8_t* data,
+        uint8_t length);
+static void _proto_patch_request(void);
+static void _proto_patch_wait(bool sent);
+static void _proto_send_beacon(void);
+static void _proto_slot_end(void);
+static uint32_t _proto_now_ms(void);
+static int32_t _proto_ms_between(uint32_t from_ms, uint32_t to_ms);
+static bool _proto_wait_until(uint32_t until_ms);
+static void _proto_relay_run(void);
+static void _proto_relay_open(void);
+static void _proto_relay_step(void);
+static void _proto_relay_slot_done(void);
+static uint8_t _proto_relay_spare(void);
+static uint8_t _proto_relay_wanted(void);
+static uint32_t _proto_relay_wake_ms(uint8_t slot);
+static void _proto_relay_upload(const radio_packet_t* packet, const radio_upload_t* upload);
+static void _proto_relay_sack(void);
+static void _proto_relay_ack(void);
+static void _proto_relay_register(const radio_packet_t* packet);
 
 /**
  * Initialise protocol and start setup process
@@ -47,6 +206,8 @@ static void _proto_uploaddata(void);
 void proto_init(void)
 {
     proto_state = PROTO_SETUP;
+    patch_wanted = false;
+    restart_due = false;
 
     status_led_set(STATUS_RED, true);
 }
@@ -58,10 +219,43 @@ void proto_init(void)
  */
 void proto_incoming_packet(uint16_t bytes)
 {
-    uint8_t data[20];
+    // Parse the frame in place, it's released once handled
+    const radio_packet_t* packet = radio_rx_peek();
+
+    if (!packet)
+    {
+        return;
+    }
+
+    const uint8_t* data = packet->data;
+    radio_upload_t upload;
+
+    // Beacons only come to us while we relay, from nodes out of the base's
+    // range registering through us. Replying takes the delay the sub-slot
+    // was timed with, so time it again after
+    if (bytes == 4 && data[3] == PKT_BEACON)
+    {
+        if (proto_state == PROTO_RELAYING)
+        {
+            _proto_relay_register(packet);
+            _proto_relay_run();
+        }
+
+        radio_rx_commit();
+        return;
+    }
 
-    // Read data from ringbuffer
-    radio_retrieve_data(data, 20);
+    // So do the uploads of the node whose sub-slot it is, which have no type
+    if (proto_state == PROTO_RELAYING && relay_slot < RADIO_RELAY_MAX_CHILDREN &&
+            relay_child[relay_slot] && data[0] == relay_child[relay_slot] &&
+            radio_upload_unpack(&data[1], (uint8_t)(bytes - 1), &upload))
+    {
+        _proto_relay_upload(packet, &upload);
+        _proto_relay_run();
+
+        radio_rx_commit();
+        return;
+    }
 
     // Process the packet based on a type header
     switch (data[1])
@@ -75,71 +269,207 @@ void proto_incoming_packet(uint16_t bytes)
             rtc_set_time(timestamp, data[4] & 0x01);
             break;
         }
-        case PKT_REPEAT:
+        case PKT_SACK:
+        {
+            // See radio_packets.h for the layout
+            radio_sack_t sack;
+
+            if ((proto_state != PROTO_WAITACK && proto_state != PROTO_UPLOADING) ||
+                    !radio_sack_unpack(&data[1], (uint8_t)(bytes - 1), &sack))
+            {
+                break;
+            }
+
+            // Anything outside what we've sent is stale
+            if ((uint16_t)(sack.next - seq_acked) > (uint16_t)(seq_next - seq_acked))
+            {
+                break;
+            }
+
+            seq_acked = sack.next;
+            seq_sacked = sack.have;
+
+            // Send the next window straight away, the base is waiting. ACK
+            // timer restarts once its last packet has gone out
+            proto_state = PROTO_UPLOADING;
+            reply_retries = RADIO_REPLY_RETRIES;
+            _proto_send_window();
+
+            break;
+        }
+        case PKT_ACK:
         {
-            // Reset the ACK timer
-            misc_delay(RADIO_TIMEOUT, false);
+            radio_ack_t ack;
+
+            // A beacon frame looks like a one packet upload to a base that
+            // isn't waiting for beacons, don't take its ACK as registration
+            if ((proto_state != PROTO_WAITACK && proto_state != PROTO_UPLOADING) ||
+                    !radio_ack_unpack(&data[1], (uint8_t)(bytes - 1), &ack))
+            {
+                break;
+            }
+
+            // Keep in step with the base, see radio_packets.h for the layout
+            _proto_sync_clock(packet);
 
-            // Third byte should be total sequence size
-            packet_data[0] = data[2];
+            // Adjust power and profile for next time
+            _proto_set_txpower(ack.tx_power);
 
-            // Fourth should be sequence to repeat
-            packet_data[1] = data[3];
+            if (ack.profile < RADIO_PROFILE_COUNT)
+            {
+                upload_profile = ack.profile;
+            }
 
-            printf("Repeat request for %d of %d\r\n", data[3], data[2]);
+            // The base moves our slot about to fit everyone's backlog, and
+            // has us take turns with other nodes when it's crowded. Run our
+            // clock at its rate from here on
+            if (ack.slot)
+            {
+                wake_period = ack.period;
+                rtc_set_schedule(wake_period, ack.next_wake, ack.next_wake_ms);
+                rtc_set_drift(ack.drift_ppm);
+            }
 
-            uint8_t packet_len;
+            // A relay is told where its sub-slots are in the next period, so
+            // this period's are the ones the last ACK gave
+            relay_count = relay_next_count;
+            relay_start_ms = relay_next_ms;
+            relay_next_count = 0;
+            ack_misses = 0;
 
-            if (data[2] == data[3])
+            if (ack.children && config_get()->relay && parent_addr == BASE_ADDR)
             {
-                // Last packet was missed, send a short one
-                packet_len = store_get_size() - RADIO_MAX_DATA_LEN * (data[3] - 1);
+                relay_next_count = ack.children;
+                relay_next_ms = (rtc_get_wake_ms() + ack.children_ms) % (86400u * 1000u);
             }
-            else
+
+            // The base has what we stored once the patch was staged, it
+            // can be applied now
+            bool restart = restart_due;
+            bool fetch = false;
+
+            // Change a setting if the base has asked to
+            if (ack.command)
             {
-                packet_len = RADIO_MAX_DATA_LEN;
+                fetch = _proto_take_command(ack.command_id, ack.command, ack.value);
             }
 
-            store_get_data(&(packet_data[2]), packet_len,
-                    RADIO_MAX_DATA_LEN * (data[3] - 1));
+            // Finish up
+            _proto_endcleanup();
 
-            // Brief delay to allow far end to flip back to receive
-            misc_delay(200, true);
+            // The base has no slot for us any more, register again
+            if (!ack.slot)
+            {
+                proto_state = PROTO_SETUP;
+            }
+            else if (restart)
+            {
+                proto_state = PROTO_RESTART;
+            }
+            else if (fetch)
+            {
+                // Ask for the next part of the patch while the base has time
+                // left in our slot
+                radio_powerstate(true);
+                radio_receive_activate(true);
+                reply_retries = RADIO_REPLY_RETRIES;
+                _proto_patch_request();
+            }
+            else if (relay_count)
+            {
+                // Serve the nodes we relay for at the end of our slot
+                proto_state = PROTO_RELAYWAIT;
+                _proto_relay_run();
+            }
 
-            radio_send_data(packet_data, packet_len, BASE_ADDR);
+            printf("Got ACK\r\n");
 
             break;
         }
-        case PKT_ACK:
+        case PKT_PATCH:
         {
-            // Finish up
-            _proto_endcleanup();
+            // See radio_packets.h for the layout
+            radio_patch_t chunk;
 
-            printf("Got ACK\r\n");
+            if (proto_state == PROTO_PATCHING && patch_wanted &&
+                    radio_patch_unpack(&data[1], (uint8_t)(bytes - 1), &chunk))
+            {
+                patch_chunks = chunk.chunks;
+                _proto_patch_chunk(chunk.chunk, chunk.flags, chunk.data, chunk.length);
+            }
+
+            break;
+        }
+        case PKT_RELAY:
+        {
+            // A relay has room for us, send it a beacon after a random wait
+            if (proto_state == PROTO_SEEKRELAY && parent_addr == BASE_ADDR)
+            {
+                parent_addr = data[0];
+                relay_seek_ms = _proto_now_ms();
+                misc_delay(radio_jitter_ms(PROTO_RELAY_JOIN_JITTER_MS), false);
+
+                printf("Heard relay %d\r\n", parent_addr);
+            }
+
+            break;
+        }
+        case PKT_SCHEDULE:
+        {
+            // Only wanted when we've lost track of our slot
+            if (proto_state == PROTO_WAITSCHED)
+            {
+                _proto_read_schedule(packet);
+            }
 
             break;
         }
         case PKT_BEACONACK:
         {
-        	// Packet should be [time(16)],[period(16)],[nextwake(16)],[options(8)]
+        	// See radio_packets.h for the layout
+        	radio_beaconack_t ack;
+
+        	if (!radio_beaconack_unpack(&data[1], (uint8_t)(bytes - 1), &ack))
+        	{
+        		break;
+        	}
+
         	printf("Got BEACONACK...");
 
         	status_led_set(STATUS_GREEN, false);
 
-        	uint32_t time_now = data[2] << 8 | data[3];
-        	rtc_set_time(time_now, (data[8] & 0x01));
+        	// Start with an unknown drift, and our clock set to the tick by
+        	// the base's
+        	rtc_set_drift(0);
+        	_proto_sync_clock(packet);
+
+        	wake_period = ack.period;
+        	rtc_set_schedule(ack.period, ack.next_wake, ack.next_wake_ms);
 
-        	uint32_t period = data[4] << 8 | data[5];
-        	period |= (data[8] & 0x02) << 15;
+        	_proto_set_txpower(ack.tx_power);
 
-        	uint32_t next_wake = data[6] << 8 | data[7];
-        	next_wake |= (data[8] & 0x02) << 14;
+        	// Profile is used from the first upload onwards
+        	if (ack.profile < RADIO_PROFILE_COUNT)
+        	{
+        		upload_profile = ack.profile;
+        	}
 
-        	rtc_set_schedule(period, next_wake);
+        	// So is the channel. A relay gives the control channel, and one
+        	// from before channels leaves it out, which is taken the same
+        	upload_channel = (ack.channel < RADIO_CHANNEL_COUNT) ?
+        			ack.channel : RADIO_CHANNEL_CONTROL;
+
+        	// Upload to whoever answered, the base or a relay
+        	parent_addr = data[0];
+        	beacon_misses = 0;
+        	ack_misses = 0;
 
         	proto_state = PROTO_IDLE;
         	_proto_endcleanup();
 
+        	// Registering shows new firmware works, keep it
+        	ota_confirm();
+
         	printf("setup complete\r\n");
 
         	status_led_set(STATUS_GREEN, true);
@@ -152,6 +482,7 @@ void proto_incoming_packet(uint16_t bytes)
             break;
     }
 
+    radio_rx_commit();
 }
 
 /**
@@ -163,26 +494,65 @@ void proto_run(void)
     {
         case PROTO_SEND:
         {
+            radio_set_profile(upload_profile);
+            radio_set_channel(upload_channel);
             radio_receive_activate(true);
 
-            // Send the data
+            // Queue the data, the ACK wait starts once the last packet is out
+            proto_state = PROTO_UPLOADING;
             _proto_uploaddata();
-
-            // Wait for acknowledge
-            proto_state = PROTO_WAITACK;
-
-            misc_delay(RADIO_TIMEOUT, false);
+            break;
+        }
+        case PROTO_UPLOADING:
+        {
+            // Packets are still going out, radio_service() will move us on
             break;
         }
         case PROTO_WAITACK:
         {
-            if (!misc_delay_active())
+            if (!misc_delay_active() && reply_retries > 0)
+            {
+                // The base may have missed our last packet, or we missed its
+                // reply. Sending the last packet again gets it to reply again
+                reply_retries--;
+                printf("No reply, sending last packet again\r\n");
+
+                misc_delay(radio_jitter_ms(RADIO_RETRY_JITTER_MS), true);
+
+                proto_state = PROTO_UPLOADING;
+                _proto_queue_packet(packet_len_last, _proto_start_acktimer);
+            }
+            else if (!misc_delay_active())
             {
                 // Timer's ended, let's assume we didn't get an ACK,
-                // clear store and go back to sleep
+                // clear store and go back to sleep. The base falls back to
+                // the default profile when it misses us, so do the same
+                upload_profile = RADIO_PROFILE_DEFAULT;
+                relay_next_count = 0;
                 _proto_endcleanup();
 
                 printf("No ACK, timed out\r\n");
+
+                if (parent_addr != BASE_ADDR)
+                {
+                    // A relay keeps our sub-slot for a few misses, but has
+                    // no schedule to broadcast
+                    if (++ack_misses >= PROTO_RELAY_MISSES)
+                    {
+                        proto_state = PROTO_SETUP;
+                    }
+                }
+                else if (++ack_misses >= PROTO_BASE_MISSES)
+                {
+                    // The base has given up on us by now. It only listens on
+                    // our channel in our slot, so won't hear us to say so
+                    proto_state = PROTO_SETUP;
+                }
+                else
+                {
+                    // The base may have moved our slot, it broadcasts where to
+                    _proto_resync_wait();
+                }
             }
             // If timer is still active, spurious wake from something else,
             // ignore.
@@ -193,9 +563,26 @@ void proto_run(void)
         	//proto_state = PROTO_IDLE;
         	//printf("*Skipping proto schedule init for debugging*\r\n");
 
+        	// Register at the most power we may use, on the default profile
+        	// and the control channel. The base will pick something better if
+        	// it can
+        	radio_set_txpower(config_get()->txpower_max);
+        	upload_profile = RADIO_PROFILE_DEFAULT;
+        	radio_set_profile(RADIO_PROFILE_DEFAULT);
+        	upload_channel = RADIO_CHANNEL_CONTROL;
+        	radio_set_channel(RADIO_CHANNEL_CONTROL);
+
         	// Set the RTC up to send beacon frames
         	rtc_set_time(0, 0);
-        	rtc_set_schedule(RSCHED_BEACONPERIOD, 1);
+        	rtc_set_schedule(RSCHED_BEACONPERIOD, 1, 0);
+        	beacon_slots = RSCHED_BEACON_SLOTS_MIN;
+
+        	// Start with the base, and drop any nodes we relayed for, their
+        	// sub-slots go with ours
+        	parent_addr = BASE_ADDR;
+        	beacon_misses = 0;
+        	relay_next_count = 0;
+        	memset(relay_child, 0, sizeof(relay_child));
 
         	// Also send one now
         	proto_state = PROTO_BEACON;
@@ -204,25 +591,7 @@ void proto_run(void)
         }
         case PROTO_BEACON:
         {
-        	printf("Sending a beacon frame...");
-
-        	radio_powerstate(true);
-        	radio_receive_activate(true);
-
-        	// Prepare a beacon frame
-        	packet_data[0] = 1;
-        	packet_data[1] = 1;
-        	packet_data[2] = PKT_BEACON;
-
-        	// Send the beacon frame
-        	radio_send_data(packet_data, 3, BASE_ADDR);
-
-        	status_led_set(STATUS_RED, false);
-
-        	// Wait for the response
-        	proto_state = PROTO_WAITBEACON;
-            misc_delay(RADIO_BEACON_TIMEOUT, false);
-
+        	_proto_send_beacon();
         	break;
         }
         case PROTO_WAITBEACON:
@@ -234,17 +603,127 @@ void proto_run(void)
                 status_led_set(STATUS_RED, true);
             	status_led_set(STATUS_GREEN, true);
 
+            	printf("no beacon response\r\n");
+
+                if (parent_addr != BASE_ADDR)
+                {
+                    // The relay didn't take us, go back to the base
+                    parent_addr = BASE_ADDR;
+                }
+                else if (!config_get()->relay &&
+                        ++beacon_misses >= PROTO_RELAY_SEEK_BEACONS)
+                {
+                    // We may be out of the base's range, listen for a relay
+                    // with room for us instead
+                    beacon_misses = 0;
+                    relay_seek_ms = (_proto_now_ms() + PROTO_RELAY_SEEK_MS) %
+                            (86400u * 1000u);
+                    proto_state = PROTO_SEEKRELAY;
+                    _proto_wait_until(relay_seek_ms);
+
+                    printf("Listening for a relay\r\n");
+                    break;
+                }
+
 #if RADIO_SLEEP_IDLE
             	radio_powerstate(false);
 #endif
 
-                proto_state = PROTO_SETUP;
-            	printf("no beacon response\r\n");
+                // Others may have beaconed at the same time, try again
+                // after a random wait
+                proto_state = PROTO_BACKOFF;
+                _proto_beacon_backoff();
             }
             // If timer is still active, spurious wake from something else,
             // ignore.
             break;
         }
+        case PROTO_LISTEN:
+        {
+            // Listen for the schedule broadcast, it comes on the default
+            // profile and the control channel for every node to hear
+            radio_powerstate(true);
+            radio_set_profile(RADIO_PROFILE_DEFAULT);
+            radio_set_channel(RADIO_CHANNEL_CONTROL);
+            radio_receive_activate(true);
+
+            proto_state = PROTO_WAITSCHED;
+            misc_delay((uint16_t)(2 * PROTO_SCHEDULE_GUARD_MS + radio_airtime_us(
+                    3 + RADIO_SCHEDULE_MAX_ENTRIES * RADIO_SCHEDULE_ENTRY_LEN +
+                    RADIO_TIMESTAMP_LEN) / 1000), false);
+
+            break;
+        }
+        case PROTO_WAITSCHED:
+        {
+            if (!misc_delay_active())
+            {
+                // Nothing heard, keep the slot we had
+                printf("No schedule broadcast\r\n");
+                _proto_resync_end();
+            }
+
+            break;
+        }
+        case PROTO_PATCHING:
+        {
+            if (!misc_delay_active() && reply_retries > 0)
+            {
+                // The base may have missed our request, or we missed the end
+                // of the window
+                reply_retries--;
+                printf("No patch chunk, asking again\r\n");
+
+                misc_delay(radio_jitter_ms(RADIO_RETRY_JITTER_MS), true);
+                _proto_patch_request();
+            }
+            else if (!misc_delay_active())
+            {
+                // Carry on after the next ACK
+                printf("Patch fetch timed out\r\n");
+                _proto_slot_end();
+            }
+
+            break;
+        }
+        case PROTO_SEEKRELAY:
+        {
+            if (!misc_delay_active() && _proto_wait_until(relay_seek_ms))
+            {
+                if (parent_addr != BASE_ADDR)
+                {
+                    // Heard one, register through it
+                    _proto_send_beacon();
+                }
+                else
+                {
+                    printf("No relay heard\r\n");
+
+#if RADIO_SLEEP_IDLE
+                    radio_powerstate(false);
+#endif
+
+                    // Back off from now rather than from the last beacon
+                    beacon_sent_ms = _proto_now_ms();
+                    proto_state = PROTO_BACKOFF;
+                    _proto_beacon_backoff();
+                }
+            }
+
+            break;
+        }
+        case PROTO_RELAYWAIT:
+        case PROTO_RELAYING:
+        {
+            _proto_relay_run();
+            break;
+        }
+        case PROTO_RESTART:
+        {
+            printf("Restarting to apply patch %d\r\n", patch_id);
+            misc_reset();
+            break;
+        }
         case PROTO_IDLE:
         default:
             // Nothing to do
@@ -258,11 +737,16 @@ void proto_run(void)
  */
 void proto_triggerupload(void)
 {
-	if (proto_state == PROTO_SETUP)
+	// A node that has to register again is left in setup mode for proto_run
+	// to set it up, then it sends beacon frames
+	if (proto_state == PROTO_BACKOFF)
 	{
-		// In setup mode we prepare to send a beacon frame
 		proto_state = PROTO_BEACON;
 	}
+	else if (proto_state == PROTO_RESYNC)
+	{
+		proto_state = PROTO_LISTEN;
+	}
 	else if (proto_state == PROTO_IDLE)
 	{
 		status_led_set(STATUS_GREEN, false);
@@ -328,45 +812,1021 @@ static void _proto_uploaddata(void)
 {
 	printf("Beginning data upload...");
 
-    // Measure environment
-    store_other(DATA_TEMP, (uint8_t)sensors_read(SENS_TEMP));
-    store_other(DATA_HUMID, (uint8_t)sensors_read(SENS_HUMID));
-    store_other(DATA_LIGHT, (uint8_t)sensors_read(SENS_LIGHT));
+    // Measure environment, if it's been long enough
+    _proto_sample_sensors(false);
+
+    // A relay asks the base for a sub-slot for each node it relays for and
+    // one for another to register into
+    if (config_get()->relay && parent_addr == BASE_ADDR)
+    {
+        data_struct_t record;
 
-    // Compute how many packets need to be sent (bytes in store by bytes in a
-    // packet after overheads)
-    uint8_t packet_count = (store_get_size() / RADIO_MAX_DATA_LEN) + 1;
+        record.time = _proto_relay_wanted();
+        record.type = DATA_RELAY;
+        record.otherdata = 0;
+        store_record(&record);
+    }
 
+    // Send what's in the store now, anything detected during the upload
+    // waits for the next one
     datastore_end = store_get_write_position();
-    uint8_t seq_number = 1;
-    uint8_t data_pointer = 0;
+    upload_size = store_get_size();
+    upload_data_len = RADIO_MAX_DATA_LEN;
+
+    // A relay only has room in our sub-slot for so much, the rest waits
+    if (parent_addr != BASE_ADDR)
+    {
+        uint16_t most = RADIO_RELAY_SLOT_PACKETS * RADIO_RELAY_DATA_LEN;
+
+        upload_data_len = RADIO_RELAY_DATA_LEN;
+
+        if (upload_size > most)
+        {
+            datastore_end = (uint16_t)((datastore_end + DATA_ARRAY_SIZE -
+                    (upload_size - most) / sizeof(data_struct_t)) % DATA_ARRAY_SIZE);
+            upload_size = most;
+        }
+    }
 
-    packet_data[0] = packet_count;
+    seq_count = (uint16_t)((upload_size + upload_data_len - 1) / upload_data_len);
+
+    if (seq_count == 0)
+    {
+        seq_count = 1;
+    }
+    seq_acked = 0;
+    seq_next = 0;
+    seq_sacked = 0;
+    reply_retries = RADIO_REPLY_RETRIES;
 
     // Turn the radio on and enable receive for acking
     radio_powerstate(true);
     radio_receive_activate(true);
 
-    // Compose and send a string of full packets
-    for (uint8_t i = 0; i < packet_count - 1; i++)
+    _proto_send_window();
+
+    printf("done\r\n");
+}
+
+/**
+ * Send every packet in the window the base doesn't have yet, which is the
+ * ones it asked for again plus new ones up to the end of the window. The
+ * last one asks the base to reply and starts the ACK timer once it's out.
+ * Packets are read back out of the store as needed, so only the one being
+ * queued is held in RAM.
+ */
+static void _proto_send_window(void)
+{
+    if (seq_acked == seq_count)
     {
-        packet_data[1] = seq_number++;
+        // Nothing left to send, carry on waiting for the ACK
+        _proto_start_acktimer(true);
+        return;
+    }
+
+    uint16_t end = seq_acked + RADIO_WINDOW;
 
-        store_get_data(&(packet_data[2]), RADIO_MAX_DATA_LEN, data_pointer);
+    if ((uint16_t)(end - seq_acked) > (uint16_t)(seq_count - seq_acked))
+    {
+        end = seq_count;
+    }
 
-        radio_send_data(packet_data, RADIO_MAX_DATA_LEN + 2, BASE_ADDR);
+    // Find the last packet to send, seq_acked itself is always missing
+    uint16_t last = seq_acked;
 
-        data_pointer += RADIO_MAX_DATA_LEN;
+    for (uint16_t seq = seq_acked + 1; seq != end; seq++)
+    {
+        if (!(seq_sacked & (0x1 << (uint16_t)(seq - seq_acked - 1))))
+        {
+            last = seq;
+        }
     }
 
-    // Final packet may be smaller
-    packet_data[1] = seq_number;
-    uint8_t packet_len = store_get_size();
-    packet_len -= (seq_number - 1) * RADIO_MAX_DATA_LEN;
+    for (uint16_t seq = seq_acked; seq != (uint16_t)(last + 1); seq++)
+    {
+        if (seq != seq_acked &&
+                (seq_sacked & (0x1 << (uint16_t)(seq - seq_acked - 1))))
+        {
+            continue;
+        }
+
+        // See radio_packets.h for the layout
+        radio_upload_t upload;
+        uint16_t offset = (uint16_t)(seq * upload_data_len);
+        uint16_t packet_len = upload_size - offset;
 
-    store_get_data(&(packet_data[2]), packet_len, data_pointer);
+        if (packet_len > upload_data_len)
+        {
+            packet_len = upload_data_len;
+        }
 
-    radio_send_data(packet_data, packet_len + 2, BASE_ADDR);
+        upload.seq = seq;
+        upload.flags = (seq == last) ? RADIO_FLAG_POLL : 0x00;
+        upload.backlog = _proto_backlog();
+        upload.length = (uint8_t)packet_len;
 
-    printf("done\r\n");
+        if (seq == seq_count - 1)
+        {
+            upload.flags |= RADIO_FLAG_LAST;
+        }
+
+        store_get_data(&(packet_data[RADIO_UPLOAD_HEADER_LEN]), packet_len, offset);
+
+        _proto_queue_packet(radio_upload_pack(&upload, packet_data),
+                (seq == last) ? _proto_start_acktimer : 0x0);
+    }
+
+    seq_next = end;
+}
+
+/**
+ * Queue the contents of packet_data for sending, sleeping while the transmit
+ * queue is full so the next packet can be prepared while this one goes out
+ *
+ * @param length   Number of bytes of packet_data to send
+ * @param callback Function to run once the packet is sent, may be 0x0
+ */
+static void _proto_queue_packet(uint16_t length, void (*callback)(bool))
+{
+    packet_len_last = length;
+
+    while (!radio_send_async(packet_data, length, parent_addr, callback))
+    {
+        power_sleep();
+        radio_service();
+    }
+}
+
+/**
+ * Transmit complete callback for the last packet of a window.
+ * Starts the wait for the base station to respond, which it does as soon as
+ * the packet is in, so only has to allow for the reply's time on air
+ *
+ * @param sent True if the packet went out, false if the radio timed out
+ */
+static void _proto_start_acktimer(bool sent)
+{
+    if (!sent)
+    {
+        printf("Send timed out\r\n");
+    }
+
+    proto_state = PROTO_WAITACK;
+    misc_delay((uint16_t)(RADIO_REPLY_MARGIN_MS +
+            radio_airtime_us(RADIO_ACK_MAX_LEN) / 1000), false);
+}
+
+/**
+ * Work out how much the base station has to make room for next time, which
+ * is everything in the store, including anything detected since the upload
+ * started
+ *
+ * @return Packets needed to send the whole store, up to 0xFF
+ */
+static uint8_t _proto_backlog(void)
+{
+    uint16_t packets = (store_get_size() + RADIO_MAX_DATA_LEN - 1) / RADIO_MAX_DATA_LEN;
+
+    return (packets > 0xFF) ? 0xFF : (uint8_t)packets;
+}
+
+/**
+ * Schedule the next beacon after one went unanswered. It goes
+ * RSCHED_BEACONPERIOD after the last plus a random number of slots, from a
+ * range that doubles each time up to RSCHED_BEACON_SLOTS_MAX
+ */
+static void _proto_beacon_backoff(void)
+{
+    uint32_t slots = radio_jitter_ms((uint16_t)(beacon_slots - 1));
+    uint32_t wake_ms = (beacon_sent_ms + RSCHED_BEACONPERIOD * 1000u +
+            slots * RSCHED_BEACON_SLOT_MS) % (86400u * 1000u);
+
+    rtc_set_schedule(RSCHED_BEACONPERIOD, wake_ms / 1000, (uint16_t)(wake_ms % 1000));
+
+    if (beacon_slots < RSCHED_BEACON_SLOTS_MAX)
+    {
+        beacon_slots *= 2;
+    }
+}
+
+/**
+ * Sleep until the next schedule broadcast, at the start of the base's beacon
+ * window, instead of waking for a slot that may have moved. If the slot we
+ * had comes first, wake for that as usual
+ */
+static void _proto_resync_wait(void)
+{
+    uint32_t now_ms = (uint32_t)(((uint64_t)rtc_get_ticks() * 1000u) /
+            RTC_TICKS_PER_SECOND);
+    uint32_t period_ms = RSCHED_NODE_PERIOD * 1000u;
+    uint32_t listen_ms = (now_ms / period_ms) * period_ms +
+            RSCHED_SLOT_END * 1000u - PROTO_SCHEDULE_GUARD_MS;
+
+    if (listen_ms <= now_ms)
+    {
+        listen_ms += period_ms;
+    }
+
+    resync_wake_ms = rtc_get_wake_ms();
+
+    if (listen_ms - now_ms >= (resync_wake_ms + 86400u * 1000u - now_ms) % (86400u * 1000u))
+    {
+        return;
+    }
+
+    listen_ms %= 86400u * 1000u;
+
+    rtc_set_schedule(wake_period, listen_ms / 1000, (uint16_t)(listen_ms % 1000));
+    proto_state = PROTO_RESYNC;
+}
+
+/**
+ * Go back to waking for the slot we had before listening for the schedule
+ */
+static void _proto_resync_end(void)
+{
+    rtc_set_schedule(wake_period, resync_wake_ms / 1000,
+            (uint16_t)(resync_wake_ms % 1000));
+    _proto_endcleanup();
+}
+
+/**
+ * Take our clock and next slot from a schedule broadcast, or keep the slot we
+ * had if it doesn't list us
+ *
+ * @param packet Schedule broadcast, see PKT_SCHEDULE
+ */
+static void _proto_read_schedule(const radio_packet_t* packet)
+{
+    radio_schedule_t schedule;
+
+    if (!radio_schedule_unpack(&packet->data[1], (uint8_t)(packet->length - 1), &schedule))
+    {
+        return;
+    }
+
+    // Set our clock to when the broadcast ended by the base's
+    uint32_t sent = schedule.tx_time;
+    rtc_adjust(_proto_ticks_between(packet->timestamp, sent) /
+            (int32_t)(RADIO_TIME_HZ / RTC_TICKS_PER_SECOND));
+
+    uint8_t address = radio_get_address();
+
+    for (uint8_t i = 0; i < schedule.count; i++)
+    {
+        const radio_schedule_entry_t* entry = &schedule.entry[i];
+
+        if (entry->node != address)
+        {
+            continue;
+        }
+
+        uint32_t wake_ms = (uint32_t)(((uint64_t)sent * 1000u) / RADIO_TIME_HZ +
+                entry->wake_in_ms) % (86400u * 1000u);
+
+        wake_period = entry->period;
+        rtc_set_schedule(wake_period, wake_ms / 1000, (uint16_t)(wake_ms % 1000));
+        _proto_endcleanup();
+
+        printf("Slot moved, schedule version %d\r\n", schedule.version);
+
+        return;
+    }
+
+    _proto_resync_end();
+}
+
+/**
+ * Set our clock from a reply the base station timed. The base says when our
+ * last frame reached it and when its reply finished going out. With when we
+ * sent that frame and got the reply, the time spent getting each way cancels
+ * out. If the base timed some other frame of ours, only when the reply went
+ * out is used
+ *
+ * @param packet Reply, ending with the base's [rx time(32)],[tx time(32)]
+ */
+static void _proto_sync_clock(const radio_packet_t* packet)
+{
+    const uint8_t* times = &packet->data[packet->length - 2 * RADIO_TIMESTAMP_LEN];
+    uint32_t sent = radio_last_txtime();
+    uint32_t heard = _proto_read_time(times);
+    uint32_t replied = _proto_read_time(times + RADIO_TIMESTAMP_LEN);
+
+    int64_t offset = _proto_ticks_between(packet->timestamp, replied);
+    int32_t round_trip = _proto_ticks_between(sent, packet->timestamp) -
+            _proto_ticks_between(heard, replied);
+
+    if (round_trip >= 0 && round_trip <= (int32_t)PROTO_SYNC_ROUND_TRIP_MAX)
+    {
+        offset = (offset + _proto_ticks_between(sent, heard)) / 2;
+    }
+
+    rtc_adjust((int32_t)(offset / (int32_t)(RADIO_TIME_HZ / RTC_TICKS_PER_SECOND)));
+}
+
+/**
+ * Read a frame timestamp, least significant byte first
+ *
+ * @param data First byte of the timestamp
+ * @return     Time of day in RADIO_TIME_HZ ticks
+ */
+static uint32_t _proto_read_time(const uint8_t* data)
+{
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 |
+            (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+/**
+ * Work out the time from one timestamp to another, either way round midnight
+ *
+ * @param from Time of day in RADIO_TIME_HZ ticks
+ * @param to   Time of day in RADIO_TIME_HZ ticks
+ * @return     Ticks from from to to, negative if to is before
+ */
+static int32_t _proto_ticks_between(uint32_t from, uint32_t to)
+{
+    // A day of ticks only just fits in 32 bits, so don't add one
+    int64_t ticks = (to >= from) ? (int64_t)(to - from) :
+            (int64_t)to + RADIO_TIME_PER_DAY - from;
+
+    return (int32_t)((ticks > RADIO_TIME_PER_DAY / 2) ? ticks - RADIO_TIME_PER_DAY : ticks);
+}
+
+/**
+ * Set the TX power the base station asks for, up to the most we may use
+ *
+ * @param dbm Power in dBm
+ */
+static void _proto_set_txpower(int8_t dbm)
+{
+    int8_t most = config_get()->txpower_max;
+
+    radio_set_txpower((dbm > most) ? most : dbm);
+}
+
+/**
+ * Take a command from the base station, and store a DATA_CONFIG record to say
+ * so. The base sends it with each ACK until that record reaches it, so any
+ * command may come again and is simply applied again. A firmware patch is
+ * only taken once all of it has been fetched
+ *
+ * @param id      Id of the command, stored once it's taken
+ * @param command One of the CMD_x settings
+ * @param value   What to set it to
+ * @return        True if there's a patch to fetch now
+ */
+static bool _proto_take_command(uint8_t id, uint8_t command, uint16_t value)
+{
+    if (command == CMD_PATCH)
+    {
+        if (_proto_patch_begin(value))
+        {
+            patch_command_id = id;
+            return true;
+        }
+    }
+    else if (command == CMD_TELEMETRY)
+    {
+        // Say how long the battery lasts at the draw so far today and what
+        // power we send at, with the sensors read now
+        uint32_t months = power_model_battery_days(
+                power_model_average_na(power_stats())) / 30u;
+
+        store_other(DATA_BATTERY, (uint8_t)((months > 0xFF) ? 0xFF : months));
+        store_other(DATA_TXPOWER, (uint8_t)radio_get_txpower());
+        _proto_sample_sensors(true);
+    }
+    else if (config_set(command, value))
+    {
+        // The most power may have come down
+        _proto_set_txpower(radio_get_txpower());
+    }
+    else
+    {
+        printf("Command %d with %d not taken\r\n", command, value);
+    }
+
+    store_other(DATA_CONFIG, id);
+
+    printf("Got command %d\r\n", id);
+
+    return false;
+}
+
+/**
+ * Store a reading from each sensor, if the sample period the base station
+ * set has gone by since the last
+ *
+ * @param now True to read them whether it has or not
+ */
+static void _proto_sample_sensors(bool now)
+{
+    uint32_t time_ms = (uint32_t)(((uint64_t)rtc_get_ticks() * 1000u) /
+            RTC_TICKS_PER_SECOND);
+    uint32_t period_ms = (uint32_t)config_get()->sample_period * 1000u;
+
+    if (!now && sampled &&
+            (time_ms + 86400u * 1000u - sample_ms) % (86400u * 1000u) < period_ms)
+    {
+        return;
+    }
+
+    store_other(DATA_TEMP, (uint8_t)sensors_read(SENS_TEMP));
+    store_other(DATA_HUMID, (uint8_t)sensors_read(SENS_HUMID));
+    store_other(DATA_LIGHT, (uint8_t)sensors_read(SENS_LIGHT));
+
+    sample_ms = time_ms;
+    sampled = true;
+}
+
+/**
+ * Start fetching a firmware patch, or carry on with it
+ *
+ * @param id Id of the patch
+ * @return   True if some of it is still to be fetched
+ */
+static bool _proto_patch_begin(uint16_t id)
+{
+    if (patch_wanted && patch_id == id)
+    {
+        return true;
+    }
+
+    patch_wanted = false;
+    patch_id = id;
+
+    switch (ota_stage_begin(id))
+    {
+        case OTA_FETCH:
+            patch_wanted = true;
+            patch_chunks = 0;
+            patch_next = 0;
+            patch_have = 0;
+
+            printf("Fetching patch %d\r\n", id);
+            return true;
+        case OTA_STAGED:
+            // We restarted or the base missed our record, store it again
+            restart_due = true;
+            return false;
+        case OTA_DONE:
+        default:
+            return false;
+    }
+}
+
+/**
+ * Stage a chunk of the patch being fetched, and ask for more at the end of
+ * the window. Once all of it is in, store the DATA_CONFIG record to say so
+ *
+ * @param chunk  Which chunk it is
+ * @param flags  RADIO_FLAG_x sent with it
+ * @param data   Chunk of the patch
+ * @param length Bytes in it
+ */
+static void _proto_patch_chunk(uint16_t chunk, uint8_t flags, const uint8_t* data,
+        uint8_t length)
+{
+    uint16_t ahead = (uint16_t)(chunk - patch_next);
+
+    // Anything outside the window is stale, and anything in it may be a repeat
+    if (ahead < RADIO_WINDOW && chunk < patch_chunks &&
+            (ahead == 0 || !(patch_have & (0x1 << (ahead - 1)))) &&
+            ota_stage_chunk(chunk, data, length))
+    {
+        if (ahead)
+        {
+            patch_have |= (uint8_t)(0x1 << (ahead - 1));
+        }
+        else
+        {
+            // Move past every chunk now in order
+            patch_next++;
+
+            while (patch_have & 0x1)
+            {
+                patch_have >>= 1;
+                patch_next++;
+            }
+
+            patch_have >>= 1;
+        }
+    }
+
+    reply_retries = RADIO_REPLY_RETRIES;
+
+    if (patch_next >= patch_chunks)
+    {
+        // Let the base know we're done, and tell it on the next upload that
+        // the patch is taken
+        patch_wanted = false;
+
+        switch (ota_stage_end(patch_id, (uint32_t)patch_chunks * RADIO_PATCH_CHUNK_LEN))
+        {
+            case OTA_STAGED:
+                restart_due = true;
+                store_other(DATA_CONFIG, patch_command_id);
+                break;
+            case OTA_DONE:
+                store_other(DATA_CONFIG, patch_command_id);
+                break;
+            case OTA_FETCH:
+            default:
+                break;
+        }
+
+        _proto_patch_request();
+    }
+    else if (flags & RADIO_FLAG_LAST)
+    {
+        // The base has no more time in this slot
+        _proto_slot_end();
+    }
+    else if (flags & RADIO_FLAG_POLL)
+    {
+        _proto_patch_request();
+    }
+    else
+    {
+        _proto_patch_wait(true);
+    }
+}
+
+/**
+ * Ask the base for the chunks of the patch we still need, see radio_packets.h
+ */
+static void _proto_patch_request(void)
+{
+    radio_patch_request_t request;
+
+    request.next = patch_next;
+    request.have = patch_have;
+
+    proto_state = PROTO_UPLOADING;
+    _proto_queue_packet(radio_patch_request_pack(&request, packet_data), _proto_patch_wait);
+}
+
+/**
+ * Wait for the next chunk of the patch, once the request for it has gone or a
+ * chunk has come in. Finishes up if the whole patch is in
+ *
+ * @param sent True if the request went out, false if the radio timed out
+ */
+static void _proto_patch_wait(bool sent)
+{
+    if (!sent)
+    {
+        printf("Send timed out\r\n");
+    }
+
+    if (!patch_wanted)
+    {
+        _proto_slot_end();
+        return;
+    }
+
+    proto_state = PROTO_PATCHING;
+    misc_delay((uint16_t)(RADIO_REPLY_MARGIN_MS +
+            radio_airtime_us(RADIO_PATCH_FRAME_LEN) / 1000), false);
+}
+
+/**
+ * Send a beacon to register with, the base or a relay we heard, and wait for
+ * the BEACONACK
+ */
+static void _proto_send_beacon(void)
+{
+	printf("Sending a beacon frame...");
+
+	radio_powerstate(true);
+	radio_receive_activate(true);
+
+	// Prepare a beacon frame
+	packet_data[0] = 1;
+	packet_data[1] = 1;
+	packet_data[2] = PKT_BEACON;
+
+	// Send the beacon frame
+	beacon_sent_ms = _proto_now_ms();
+	radio_send_data(packet_data, 3, parent_addr);
+
+	status_led_set(STATUS_RED, false);
+
+	// Wait for the response
+	proto_state = PROTO_WAITBEACON;
+    misc_delay(RADIO_BEACON_TIMEOUT, false);
+}
+
+/**
+ * Finish our own part of the slot, then serve the nodes we relay for if the
+ * base gave us sub-slots this period
+ */
+static void _proto_slot_end(void)
+{
+    _proto_endcleanup();
+
+    if (relay_count)
+    {
+        proto_state = PROTO_RELAYWAIT;
+        _proto_relay_run();
+    }
+}
+
+/**
+ * Get the time of day by our clock
+ *
+ * @return Time of day in ms
+ */
+static uint32_t _proto_now_ms(void)
+{
+    return (uint32_t)(((uint64_t)rtc_get_ticks() * 1000u) / RTC_TICKS_PER_SECOND);
+}
+
+/**
+ * Work out the time from one time of day to another, either way round midnight
+ *
+ * @param from_ms Time of day in ms
+ * @param to_ms   Time of day in ms
+ * @return        ms from from_ms to to_ms, negative if to_ms is before
+ */
+static int32_t _proto_ms_between(uint32_t from_ms, uint32_t to_ms)
+{
+    int32_t ms = (int32_t)((to_ms + 86400u * 1000u - from_ms) % (86400u * 1000u));
+
+    return (ms > (int32_t)(86400u * 500u)) ? ms - (int32_t)(86400u * 1000u) : ms;
+}
+
+/**
+ * Wait for a time of day, a step at a time if it is further off than
+ * misc_delay() can time. Call again once the delay has run out
+ *
+ * @param until_ms Time of day in ms by our clock
+ * @return         True if it has come, false if still waiting for it
+ */
+static bool _proto_wait_until(uint32_t until_ms)
+{
+    int32_t left = _proto_ms_between(_proto_now_ms(), until_ms);
+
+    if (left <= 0)
+    {
+        return true;
+    }
+
+    misc_delay((uint16_t)((left > PROTO_DELAY_MAX_MS) ? PROTO_DELAY_MAX_MS : left), false);
+
+    return false;
+}
+
+/**
+ * Move relaying on, waiting for our sub-slots to start and stepping through
+ * them as each ends. Returns once there's a delay to wait for or we're done
+ */
+static void _proto_relay_run(void)
+{
+    while (!misc_delay_active())
+    {
+        if (proto_state == PROTO_RELAYWAIT)
+        {
+            if (_proto_wait_until(relay_start_ms))
+            {
+                _proto_relay_open();
+            }
+        }
+        else if (proto_state == PROTO_RELAYING)
+        {
+            if (_proto_wait_until((relay_start_ms + (relay_slot + 1u) *
+                    RADIO_RELAY_SLOT_MS) % (86400u * 1000u)))
+            {
+                _proto_relay_step();
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+}
+
+/**
+ * Start serving our sub-slots. The nodes we relay for register on the default
+ * profile and the control channel at full power, and stay on them
+ */
+static void _proto_relay_open(void)
+{
+    radio_powerstate(true);
+    radio_set_profile(RADIO_PROFILE_DEFAULT);
+    radio_set_channel(RADIO_CHANNEL_CONTROL);
+
+    relay_txpower = radio_get_txpower();
+    _proto_set_txpower(RADIO_TXPOWER_MAX);
+
+    radio_receive_activate(true);
+
+    relay_slot = RADIO_RELAY_MAX_CHILDREN;
+    proto_state = PROTO_RELAYING;
+
+    _proto_relay_step();
+}
+
+/**
+ * Finish the sub-slot being served and start the one we're in now, sending
+ * the broadcast that there's room if it's the free one. Once the last has
+ * ended go back to sleep
+ */
+static void _proto_relay_step(void)
+{
+    uint32_t index = 0;
+    int32_t into = _proto_ms_between(relay_start_ms, _proto_now_ms());
+
+    if (into > 0)
+    {
+        index = (uint32_t)into / RADIO_RELAY_SLOT_MS;
+    }
+
+    if (relay_slot < RADIO_RELAY_MAX_CHILDREN)
+    {
+        _proto_relay_slot_done();
+
+        // The delay may run out a little before our clock ticks over
+        if (index <= relay_slot)
+        {
+            index = relay_slot + 1u;
+        }
+    }
+
+    if (index >= relay_count)
+    {
+        radio_set_txpower(relay_txpower);
+        relay_slot = RADIO_RELAY_MAX_CHILDREN;
+
+#if RADIO_SLEEP_IDLE
+        radio_powerstate(false);
+#endif
+
+        proto_state = PROTO_IDLE;
+        return;
+    }
+
+    relay_slot = (uint8_t)index;
+    relay_have = 0;
+    relay_last = RADIO_RELAY_SLOT_PACKETS;
+    relay_stored = false;
+
+    // Only offer a sub-slot the base has given us next period too
+    if (!relay_child[relay_slot] && relay_slot == _proto_relay_spare() &&
+            relay_slot < relay_next_count)
+    {
+        packet_data[0] = PKT_RELAY;
+        radio_send_data(packet_data, 1, RADIO_BCAST_ADDR);
+    }
+}
+
+/**
+ * Note whether the node in the sub-slot just ended uploaded, and give its
+ * sub-slot up if it has missed too many
+ */
+static void _proto_relay_slot_done(void)
+{
+    if (!relay_child[relay_slot] || relay_stored)
+    {
+        return;
+    }
+
+    if (++relay_missed[relay_slot] >= PROTO_RELAY_MISSES)
+    {
+        printf("Node %d gone from sub-slot %d\r\n", relay_child[relay_slot], relay_slot);
+        relay_child[relay_slot] = 0;
+    }
+}
+
+/**
+ * Find the sub-slot a node can register into
+ *
+ * @return The first free sub-slot, RADIO_RELAY_MAX_CHILDREN if there's none
+ */
+static uint8_t _proto_relay_spare(void)
+{
+    uint8_t slot = 0;
+
+    while (slot < RADIO_RELAY_MAX_CHILDREN && relay_child[slot])
+    {
+        slot++;
+    }
+
+    return slot;
+}
+
+/**
+ * Work out how many sub-slots to ask the base for, up to the last one in use
+ * or the free one, whichever is later
+ *
+ * @return Sub-slots wanted
+ */
+static uint8_t _proto_relay_wanted(void)
+{
+    uint8_t wanted = _proto_relay_spare();
+
+    wanted = (wanted < RADIO_RELAY_MAX_CHILDREN) ? wanted + 1 : wanted;
+
+    for (uint8_t slot = wanted; slot < RADIO_RELAY_MAX_CHILDREN; slot++)
+    {
+        if (relay_child[slot])
+        {
+            wanted = slot + 1;
+        }
+    }
+
+    return wanted;
+}
+
+/**
+ * Work out when the node in a sub-slot is to wake next period
+ *
+ * @param slot Sub-slot
+ * @return     Time of day in ms by our clock
+ */
+static uint32_t _proto_relay_wake_ms(uint8_t slot)
+{
+    return (relay_next_ms + slot * RADIO_RELAY_SLOT_MS + PROTO_RELAY_SLACK_MS) %
+            (86400u * 1000u);
+}
+
+/**
+ * Take a packet from the node whose sub-slot it is, and answer as the base
+ * would. Once the whole upload is in, store a DATA_RELAY record with the
+ * number of records after it, then the records, for our next upload
+ *
+ * @param packet Upload packet
+ * @param upload Its fields, see radio_packets.h
+ */
+static void _proto_relay_upload(const radio_packet_t* packet, const radio_upload_t* upload)
+{
+    uint16_t seq = upload->seq;
+    uint8_t length = upload->length;
+
+    relay_rx_time = packet->timestamp;
+
+    if (seq < RADIO_RELAY_SLOT_PACKETS && length <= RADIO_RELAY_DATA_LEN)
+    {
+        if (!(relay_have & (0x1 << seq)))
+        {
+            memcpy(relay_data[seq], upload->data, length);
+            relay_len[seq] = length;
+            relay_have |= (uint8_t)(0x1 << seq);
+        }
+
+        if (upload->flags & RADIO_FLAG_LAST)
+        {
+            relay_last = (uint8_t)seq;
+        }
+    }
+
+    uint8_t all = (uint8_t)((0x1 << (relay_last + 1)) - 1);
+
+    if (relay_last < RADIO_RELAY_SLOT_PACKETS && (relay_have & all) == all)
+    {
+        // A repeat means the node missed our ACK, it's stored already
+        if (!relay_stored)
+        {
+            data_struct_t record;
+
+            record.time = 0;
+            record.type = DATA_RELAY;
+            record.otherdata = relay_child[relay_slot];
+
+            for (uint8_t i = 0; i <= relay_last; i++)
+            {
+                record.time += relay_len[i] / sizeof(data_struct_t);
+            }
+
+            store_record(&record);
+
+            for (uint8_t i = 0; i <= relay_last; i++)
+            {
+                for (uint8_t j = 0; j + sizeof(data_struct_t) <= relay_len[i];
+                        j += sizeof(data_struct_t))
+                {
+                    memcpy(&record, &relay_data[i][j], sizeof(record));
+                    store_record(&record);
+                }
+            }
+
+            relay_stored = true;
+            relay_missed[relay_slot] = 0;
+        }
+
+        _proto_relay_ack();
+    }
+    else if (upload->flags & RADIO_FLAG_POLL)
+    {
+        _proto_relay_sack();
+    }
+}
+
+/**
+ * Tell the node whose sub-slot it is which packets we have, see PKT_SACK
+ */
+static void _proto_relay_sack(void)
+{
+    uint8_t sack_data[RADIO_SACK_LEN];
+    radio_sack_t sack;
+
+    sack.next = 0;
+
+    while (sack.next < RADIO_RELAY_SLOT_PACKETS && (relay_have & (0x1 << sack.next)))
+    {
+        sack.next++;
+    }
+
+    sack.have = (uint8_t)(relay_have >> (sack.next + 1));
+
+    radio_turnaround_wait();
+    radio_send_data(sack_data, radio_sack_pack(&sack, sack_data), relay_child[relay_slot]);
+}
+
+/**
+ * ACK the upload of the node whose sub-slot it is, with its wake time in the
+ * same sub-slot next period, see the base's PKT_ACK. If the base hasn't
+ * given us that sub-slot the node is told it has no slot, so registers again
+ */
+static void _proto_relay_ack(void)
+{
+    radio_ack_t ack;
+    uint8_t data[RADIO_ACK_LEN];
+
+    memset(&ack, 0, sizeof(ack));
+
+    ack.time = ((_proto_now_ms() + radio_airtime_us(sizeof(data)) / 1000) %
+            (86400u * 1000u)) / 1000;
+    ack.tx_power = RADIO_TXPOWER_MAX;
+    ack.profile = RADIO_PROFILE_DEFAULT;
+    ack.rx_time = relay_rx_time;
+
+    if (relay_slot < relay_next_count)
+    {
+        uint32_t wake = _proto_relay_wake_ms(relay_slot);
+
+        ack.slot = true;
+        ack.next_wake = wake / 1000;
+        ack.next_wake_ms = (uint16_t)(wake % 1000);
+        ack.period = (uint16_t)wake_period;
+    }
+
+    radio_ack_pack(&ack, data);
+
+    radio_turnaround_wait();
+    radio_send_timed(data, sizeof(data), relay_child[relay_slot]);
+}
+
+/**
+ * Register a node into the free sub-slot being served, if the base has given
+ * us it next period too, and answer with a BEACONACK as the base would
+ *
+ * @param packet Beacon frame, [source(8)],[1],[1],[PKT_BEACON]
+ */
+static void _proto_relay_register(const radio_packet_t* packet)
+{
+    uint8_t node_id = packet->data[0];
+
+    if (relay_slot >= RADIO_RELAY_MAX_CHILDREN || relay_child[relay_slot] ||
+            relay_slot != _proto_relay_spare() || relay_slot >= relay_next_count)
+    {
+        return;
+    }
+
+    // A node registering again gives up the sub-slot it had
+    for (uint8_t i = 0; i < RADIO_RELAY_MAX_CHILDREN; i++)
+    {
+        if (relay_child[i] == node_id)
+        {
+            relay_child[i] = 0;
+        }
+    }
+
+    relay_child[relay_slot] = node_id;
+    relay_missed[relay_slot] = 0;
+    relay_stored = true;
+
+    // Reply as the base would, on the control channel as that's where we
+    // serve our sub-slots
+    radio_beaconack_t reply;
+    uint8_t data[RADIO_BEACONACK_LEN];
+    uint32_t wake = _proto_relay_wake_ms(relay_slot);
+
+    reply.time = ((_proto_now_ms() + radio_airtime_us(sizeof(data)) / 1000) %
+            (86400u * 1000u)) / 1000;
+    reply.period = wake_period;
+    reply.next_wake = wake / 1000;
+    reply.next_wake_ms = (uint16_t)(wake % 1000);
+    reply.tx_power = RADIO_TXPOWER_MAX;
+    reply.profile = RADIO_PROFILE_DEFAULT;
+    reply.channel = RADIO_CHANNEL_CONTROL;
+    reply.rx_time = packet->timestamp;
+
+    radio_beaconack_pack(&reply, data);
+
+    radio_turnaround_wait();
+    radio_send_timed(data, sizeof(data), node_id);
+
+    printf("Node %d registered through us in sub-slot %d\r\n", node_id, relay_slot);
 }
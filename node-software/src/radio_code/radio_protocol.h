@@ -5,9 +5,7 @@
 #ifndef RADIO_PROTOCOL_H_
 #define RADIO_PROTOCOL_H_
 
-typedef enum {PROTO_SETUP, PROTO_BEACON, PROTO_IDLE, PROTO_SEND, PROTO_WAITACK, PROTO_WAITBEACON} proto_radio_state_t;
-
-#define BASE_ADDR 0xFF
+typedef enum {PROTO_SETUP, PROTO_BEACON, PROTO_IDLE, PROTO_SEND, PROTO_UPLOADING, PROTO_WAITACK, PROTO_WAITBEACON, PROTO_BACKOFF, PROTO_RESYNC, PROTO_LISTEN, PROTO_WAITSCHED, PROTO_PATCHING, PROTO_RESTART, PROTO_SEEKRELAY, PROTO_RELAYWAIT, PROTO_RELAYING} proto_radio_state_t;
 
 void proto_init(void);
 void proto_incoming_packet(uint16_t bytes);
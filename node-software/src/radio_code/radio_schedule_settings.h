@@ -11,18 +11,34 @@
 // How long base node will remain awake each time listening for a beacon frame
 #define RSCHED_WAKELENGTH 5u
 
+// An unanswered beacon is sent again RSCHED_BEACONPERIOD later plus a random
+// number of these slots. The range of slots starts at the least and doubles
+// each time, so nodes powered up together spread out instead of colliding
+#define RSCHED_BEACON_SLOT_MS 50u
+#define RSCHED_BEACON_SLOTS_MIN 8u
+#define RSCHED_BEACON_SLOTS_MAX 32u
+
 // How often a node should wake up to send data
 #define RSCHED_NODE_PERIOD 30u
 
-// Maximum number of possible nodes
-#define RSCHED_MAX_NODES 20
+// Maximum number of possible nodes, every address but broadcast and the base's
+#define RSCHED_MAX_NODES 254
+
+// Upload slots are placed between these offsets into each period, the beacon
+// window takes the rest
+#define RSCHED_SLOT_START 1u
+#define RSCHED_SLOT_END (RSCHED_NODE_PERIOD - RSCHED_WAKELENGTH)
+
+// Slots start and end on multiples of this many ms
+#define RSCHED_SLOT_MS 50u
 
-// Calculate time step for wakeup schedules
-#define RSCHED_TIME_STEP ((RSCHED_NODE_PERIOD - RSCHED_BEACONPERIOD) / RSCHED_MAX_NODES)
+// Nodes that don't fit into every period take turns, each waking once in this
+// many periods
+#define RSCHED_SUPERFRAME 4u
 
 // Maximum number of retries
 #define RSCHED_MAX_RETRIES 3
 
-// All times are in seconds
+// All other times are in seconds
 
 #endif /* RADIO_SCHEDULE_SETTINGS_H_ */
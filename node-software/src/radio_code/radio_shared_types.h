@@ -5,14 +5,137 @@
 #ifndef RADIO_SHARED_TYPES_H_
 #define RADIO_SHARED_TYPES_H_
 
+// Address of the base station, the only one nodes send to unless they are
+// registered through a relay
+#define BASE_ADDR 0xFF
+
 // Protocol data
 #define PKT_TIMESYNC  0x01
-#define PKT_REPEAT    0x02
+#define PKT_SACK      0x02
 #define PKT_ACK       0x03
 #define PKT_BEACON    0x04
 #define PKT_BEACONACK 0x05
+#define PKT_SCHEDULE  0x06
+#define PKT_PATCH     0x07
+#define PKT_RELAY     0x08
+
+// Data bytes per upload packet, sized to the node's transmit queue entries
+#define RADIO_MAX_DATA_LEN 120
+
+// Upload packets are [seq(16)],[flags(8)],[backlog(8)],[data], backlog being
+// how many packets' worth the node has stored so the base can size its next
+// slot. The node sends up to RADIO_WINDOW packets past the first one the base
+// is missing, and asks for a PKT_SACK with the last of them: [next seq
+// wanted(16)],[bitmap of the RADIO_WINDOW - 1 after it, bit 0 first]. Once the
+// last packet is in the base sends PKT_ACK instead, which also says when the
+// node is to wake next
+#define RADIO_WINDOW 8
+#define RADIO_FLAG_LAST 0x01
+#define RADIO_FLAG_POLL 0x02
+
+// Replies are sent as soon as a packet is in. The node gives the base this
+// long on top of the reply's time on air, then sends its last packet again
+// after a random wait of up to RADIO_RETRY_JITTER_MS
+#define RADIO_REPLY_MARGIN_MS 50
+#define RADIO_RETRY_JITTER_MS 100
+
+// At the start of each beacon window the base broadcasts PKT_SCHEDULE:
+// [version(8)],[count(8)], count entries of [node(8)],[wake in ms(24)],
+// [period(16)], then [tx time(32)]. It lists the nodes that missed their last
+// slot, with how long after the frame ends their next slot is due and the
+// seconds between their wakes. The version changes whenever a slot moves. A
+// node that missed its ACK listens for it rather than registering again
+#define RADIO_SCHEDULE_ENTRY_LEN 6
+#define RADIO_SCHEDULE_MAX_ENTRIES 8
+
+// An ACK may carry a setting for the node to change, [command id(8)],
+// [command(8)],[value(16)] just before its timestamps. The node keeps its
+// settings in flash, and stores a DATA_CONFIG record of the command id once
+// it has taken one, which tells the base to stop sending it
+#define RADIO_COMMAND_LEN 4
+
+/**
+ * Settings the base station can change, and what their values are
+ */
+typedef enum
+{
+    CMD_DETECT_PROFILE = 1, //!< Detection profile, one of DETECT_PROFILE_x
+    CMD_TXPOWER_MAX = 2,    //!< Most TX power the node uses in dBm
+    CMD_LED_POLICY = 3,     //!< When the status LEDs light, one of STATUS_POLICY_x
+    CMD_SAMPLE_PERIOD = 4,  //!< Least seconds between sensor readings, 0 every upload
+    CMD_TELEMETRY = 5,      //!< Store telemetry records now, value unused
+    CMD_PATCH = 6,          //!< Fetch the firmware patch with this id, see below
+    CMD_RELAY = 7           //!< 1 to relay for nodes out of the base's range, 0 not to
+} radio_command_t;
+
+// The base sends CMD_PATCH with command id RADIO_COMMAND_ID_PATCH to every node
+// until each has fetched the firmware patch it holds, the value being the
+// patch id, the bottom 16 bits of the new image's CRC-32. After the ACK the
+// node asks for the chunks it still needs with [next chunk wanted(16)],
+// [RADIO_FLAG_PATCH],[bitmap of the RADIO_WINDOW - 1 after it]. The base sends
+// them as PKT_PATCH [chunk(16)],[chunks in all(16)],[flags(8)],[data],
+// polling with the last of each window, and the node asks again. A chunk with
+// RADIO_FLAG_LAST is the last the base has time for in this slot. The node
+// stores the DATA_CONFIG record once it has the whole patch, and starts the
+// new firmware after the ACK for that
+#define RADIO_COMMAND_ID_PATCH 0
+#define RADIO_FLAG_PATCH 0x04
+#define RADIO_PATCH_CHUNK_LEN 48
+#define RADIO_PATCH_FRAME_LEN (6 + RADIO_PATCH_CHUNK_LEN)
+
+// Most bytes in a patch, what the node keeps spare for it
+#define RADIO_PATCH_MAX_LEN 6144
+
+// A relay is a node registered with the base that other nodes register
+// through. Its slot ends with a sub-slot of RADIO_RELAY_SLOT_MS for each of
+// them, which it asks for by storing a DATA_RELAY record for node 0 with the
+// number of sub-slots as its time. The ACK then has bit 3 of its flags set and
+// [sub-slots(8)],[ms from waking to the first sub-slot(16)] before the
+// command. The relay stays awake through them, broadcasting PKT_RELAY at the
+// start of the first free one. A node whose beacons the base doesn't answer
+// listens for that, sends its beacon to the relay and is registered into that
+// sub-slot. It then uploads to the relay as it would to the base, at most
+// RADIO_RELAY_SLOT_PACKETS packets of RADIO_RELAY_DATA_LEN bytes a time on the
+// default profile, and the relay answers with SACKs, ACKs and BEACONACKs laid
+// out as the base's. The relay stores a DATA_RELAY record for the node, the
+// count of its records that follow as its time, then the records themselves,
+// so they reach the base in the relay's next upload. Relays don't relay for
+// each other
+#define RADIO_RELAY_MAX_CHILDREN 4
+#define RADIO_RELAY_SLOT_MS 300
+#define RADIO_RELAY_SLOT_PACKETS 4
+#define RADIO_RELAY_DATA_LEN 48
+
+/**
+ * Start of a firmware patch. It turns an image of old_length bytes with CRC-32
+ * old_crc into one of new_length bytes with new_crc, a flash page of
+ * RADIO_PATCH_PAGE_LEN bytes at a time, and is followed by length bytes of
+ * ops with CRC-32 ops_crc. An op is either
+ * [0x80 | (n - 1)],[source(16)], copying n bytes of the old image, or
+ * [n - 1],[n bytes], adding them as they are. No op makes bytes for more than
+ * one page. Pages are rewritten in place, first to last, so ops only copy from
+ * the page they make or later ones, or with RADIO_PATCH_DESCENDING last to
+ * first, so ops only copy from that page or earlier ones. What the base sends
+ * is a forward patch followed by a reverse one to roll back with, starting on
+ * the next whole word
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t length;
+    uint32_t ops_crc;
+    uint32_t old_length;
+    uint32_t old_crc;
+    uint32_t new_length;
+    uint32_t new_crc;
+} radio_patch_header_t;
 
-#define RADIO_MAX_DATA_LEN 60
+#define RADIO_PATCH_MAGIC 0x50434253u
+#define RADIO_PATCH_PAGE_LEN 1024
+#define RADIO_PATCH_DESCENDING 0x01
+#define RADIO_PATCH_COPY 0x80
+#define RADIO_PATCH_OP_MAX 128
 
 /**
  * Types of data we can pick up
@@ -23,7 +146,11 @@ typedef enum
     DATA_TEMP = 1, //!< DATA_TEMP
     DATA_HUMID = 2,//!< DATA_HUMID
     DATA_LIGHT = 3,//!< DATA_LIGHT
-    DATA_OTHER = 4 //!< DATA_OTHER
+    DATA_OTHER = 4,//!< DATA_OTHER
+    DATA_CONFIG = 5,  //!< Id of a command the node has taken
+    DATA_BATTERY = 6, //!< Months of battery left at the current draw
+    DATA_TXPOWER = 7, //!< TX power in use in dBm, signed
+    DATA_RELAY = 8    //!< Records relayed for a node, see RADIO_RELAY_MAX_CHILDREN
 } data_type_t;
 
 /**
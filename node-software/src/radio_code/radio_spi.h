@@ -5,11 +5,21 @@
 #ifndef RADIO_SPI_H_
 #define RADIO_SPI_H_
 
+// Delay timer functions are used by radio_control.c for timeouts
+#include "misc.h"
+
 // Values of interrupt state
 #define RADIO_INT_NONE    0
 #define RADIO_INT_RXREADY 1
 #define RADIO_INT_TXDONE  2
 
+// Longest a transmission may take before the radio is assumed stuck
+#define RADIO_TX_TIMEOUT_MS 1000
+
+// Only DIO0 is wired, and the node only ever receives short frames, so wait
+// for whole frames rather than draining the FIFO as they arrive
+#define RADIO_RX_STREAMING 0
+
 void radio_spi_init(void);
 
 void radio_spi_powerstate(bool state);
@@ -17,7 +27,12 @@ void radio_spi_powerstate(bool state);
 uint8_t radio_spi_transfer(uint8_t send_data);
 void radio_spi_select(bool select);
 
-void radio_spi_transmitwait(void);
+uint32_t radio_spi_time(void);
+uint32_t radio_spi_rxtime(void);
+uint32_t radio_spi_txtime(void);
+
+bool radio_spi_transmitwait(void);
+bool radio_spi_transmitdone(void);
 void radio_spi_prepinterrupt(uint8_t interrupt);
 
 #endif /* RADIO_SPI_H_ */
@@ -1,5 +1,10 @@
 /**
  * Real time clock configuration and control
+ * The counter runs free at RTC_TICKS_PER_SECOND and overflows every ~68
+ * minutes, the overflows are counted here to keep the time of day. The time of
+ * day is disciplined in software: it is set without touching the counter, and
+ * runs slower or faster than the counter by the drift the base station has
+ * measured for us
  */
 
 /* Standard libraries */
@@ -15,13 +20,40 @@
 /* Application-specific headers */
 #include "rtc_driver.h"
 #include "power_management.h"
+#include "power_model.h"
 #include "radio_protocol.h"
+#include "radio_control.h"
+#include "printf.h"
 
-#define RTC_OSC_PSC_VAL          (32768)
-#define RTC_TIMEOUT_INTERVAL     (86400)
-#define RTC_COUNT_BEFORE_TIMEOUT (86400)
+#define RTC_OSC_PSC_VAL          (32768 / RTC_TICKS_PER_SECOND)
+#define RTC_SECONDS_PER_DAY      (86400)
+#define RTC_TICKS_PER_DAY        (RTC_SECONDS_PER_DAY * RTC_TICKS_PER_SECOND)
 
-static uint32_t rtc_wake_period = RTC_COUNT_BEFORE_TIMEOUT;
+// The counter is 24 bits wide
+#define RTC_COUNTER_TICKS        (0x1000000u)
+
+// Time between wakes in seconds, and the time of day of the next one in ticks
+static uint32_t rtc_wake_period = RTC_SECONDS_PER_DAY;
+static uint32_t rtc_wake_ticks = RTC_TICKS_PER_DAY;
+
+// Uncorrected time of day the counter last overflowed at
+static uint32_t rtc_count_base = 0;
+
+// How fast the counter runs in ppm, and the uncorrected and corrected times
+// of day the correction runs from
+static int16_t rtc_drift_ppm = 0;
+static uint32_t rtc_sync_count = 0;
+static uint32_t rtc_sync_ticks = 0;
+
+// Set at midnight for rtc_run() to report the day
+static volatile bool rtc_day_ended = false;
+
+/* Functions used only in this file */
+static uint32_t _rtc_count(void);
+static uint32_t _rtc_ticks(uint32_t count);
+static void _rtc_anchor(uint32_t ticks);
+static void _rtc_arm(bool due_now);
+static bool _rtc_arm_compare(uint8_t comp, uint32_t ticks, bool due_now);
 
 /**
  * Configure and start the real time counter
@@ -34,37 +66,44 @@ void rtc_init(void)
     // Set RTC prescaler
     CMU_ClockDivSet(cmuClock_RTC, RTC_OSC_PSC_VAL);
 
-    // Set compare match value for RTC
-    RTC_CompareSet(1, rtc_wake_period);
-
-    // Set top value
-    RTC_CompareSet(0, RTC_COUNT_BEFORE_TIMEOUT);
-
-    // Enable RTC interrupts
-    RTC_IntEnable(RTC_IFS_COMP0 | RTC_IFC_COMP1);
+    // Enable RTC interrupts, the compares are only enabled once due before the
+    // next overflow
+    RTC_IntEnable(RTC_IEN_OF);
     NVIC_EnableIRQ(RTC_IRQn);
 
     // Configure, init and start the RTC
     RTC_Init_TypeDef rtcInit =
     {
             .enable = true,
-            .comp0Top = true,
+            .comp0Top = false,
             .debugRun = false
     };
 
     RTC_Init(&rtcInit);
 
+    _rtc_arm(false);
+
     // We can't drop to EM3 when using the ULFRCO or it will stop
     power_set_minimum(PWR_RTC, PWR_EM2);
 }
 
 bool rtc_get_time_16(uint16_t* time_p)
 {
-    uint32_t count = RTC_CounterGet();
+    uint32_t count = rtc_get_ticks() / RTC_TICKS_PER_SECOND;
     *time_p = count & 0xFFFF;
     return (0x10000 & count);
 }
 
+/**
+ * Get the time of day to the nearest tick
+ *
+ * @return Ticks since midnight, at RTC_TICKS_PER_SECOND
+ */
+uint32_t rtc_get_ticks(void)
+{
+    return _rtc_ticks(_rtc_count());
+}
+
 /**
  * Set the current real time clock value in seconds
  * @param timestamp Current time from upstream
@@ -72,14 +111,38 @@ bool rtc_get_time_16(uint16_t* time_p)
  */
 void rtc_set_time(uint16_t timestamp, uint8_t msb)
 {
-    RTC_Enable(false);
-    RTC->CNT = (uint32_t) timestamp | ((uint32_t) msb << 16);
-    RTC_Enable(true);
+    uint32_t ticks = ((uint32_t) timestamp | ((uint32_t) msb << 16)) * RTC_TICKS_PER_SECOND;
+
+    _rtc_anchor(ticks);
 
     // Calculate the next interrupt (and adjust for crossing midnight)
-    uint32_t new_compare = RTC_CounterGet() + rtc_wake_period;
-    new_compare %= RTC_COUNT_BEFORE_TIMEOUT;
-    RTC_CompareSet(1, new_compare);
+    rtc_wake_ticks = (ticks + rtc_wake_period * RTC_TICKS_PER_SECOND) % RTC_TICKS_PER_DAY;
+    _rtc_arm(false);
+}
+
+/**
+ * Move the time of day on or back, keeping the wake times as they are
+ *
+ * @param ticks Ticks to add, negative to go back
+ */
+void rtc_adjust(int32_t ticks)
+{
+    _rtc_anchor((uint32_t)(((int64_t)rtc_get_ticks() + RTC_TICKS_PER_DAY + ticks) %
+            RTC_TICKS_PER_DAY));
+    _rtc_arm(true);
+}
+
+/**
+ * Discipline the time of day against the counter from now on
+ *
+ * @param drift_ppm How fast the counter runs in ppm, the time of day makes up
+ *                  for it
+ */
+void rtc_set_drift(int16_t drift_ppm)
+{
+    _rtc_anchor(rtc_get_ticks());
+    rtc_drift_ppm = drift_ppm;
+    _rtc_arm(true);
 }
 
 /**
@@ -88,11 +151,24 @@ void rtc_set_time(uint16_t timestamp, uint8_t msb)
  *
  * @param period    Period between wakeups
  * @param next_wake Absolute time value at which to next wake
+ * @param wake_ms   Milliseconds into that second to wake at
  */
-void rtc_set_schedule(uint32_t period, uint32_t next_wake)
+void rtc_set_schedule(uint32_t period, uint32_t next_wake, uint16_t wake_ms)
 {
 	rtc_wake_period = period;
-	RTC_CompareSet(1, next_wake);
+	rtc_wake_ticks = (next_wake * RTC_TICKS_PER_SECOND +
+			(wake_ms * RTC_TICKS_PER_SECOND) / 1000u) % RTC_TICKS_PER_DAY;
+	_rtc_arm(true);
+}
+
+/**
+ * Get when the next wake is due
+ *
+ * @return Time of day in ms
+ */
+uint32_t rtc_get_wake_ms(void)
+{
+    return (uint32_t)(((uint64_t)rtc_wake_ticks * 1000u) / RTC_TICKS_PER_SECOND);
 }
 
 /**
@@ -100,24 +176,197 @@ void rtc_set_schedule(uint32_t period, uint32_t next_wake)
  */
 void RTC_IRQHandler(void)
 {
-    if (RTC_IntGet() & RTC_IF_COMP1)
+    uint32_t flags = RTC_IntGet() & RTC_IntGetEnabled();
+
+    if (flags & RTC_IF_OF)
+    {
+        // Count the overflow, and start the correction afresh so it never has
+        // more than one overflow to cover
+        uint32_t ticks = rtc_get_ticks();
+        rtc_count_base = (rtc_count_base + RTC_COUNTER_TICKS) % RTC_TICKS_PER_DAY;
+        RTC_IntClear(RTC_IFC_OF);
+        _rtc_anchor(ticks);
+
+        _rtc_arm(true);
+    }
+
+    if (flags & RTC_IF_COMP1)
     {
-        // Hourly interrupt fired, calculate the next hour interrupt (and adjust
-        // for crossing midnight with a mod)
-        uint32_t new_compare = RTC_CompareGet(1) + rtc_wake_period;
-        new_compare %= RTC_COUNT_BEFORE_TIMEOUT;
-        RTC_CompareSet(1, new_compare);
+        RTC_IntClear(RTC_IFC_COMP1);
+
+        // Upload interrupt fired, calculate the next one (and adjust for
+        // crossing midnight with a mod)
+        rtc_wake_ticks = (rtc_wake_ticks + rtc_wake_period * RTC_TICKS_PER_SECOND) %
+                RTC_TICKS_PER_DAY;
+        _rtc_arm(false);
 
         // Send a burst of data back on the radio
         proto_triggerupload();
+    }
 
-        // Clear flag for next time
-        RTC_IntClear(RTC_IFC_COMP1);
+    if (flags & RTC_IF_COMP0)
+    {
+        RTC_IntClear(RTC_IFC_COMP0);
+        _rtc_arm(false);
+
+        // Daily interrupt fired, printing takes too long to do here
+        rtc_day_ended = true;
+    }
+}
+
+/**
+ * Report the day's radio and power counters once midnight has passed, from
+ * the main loop rather than the interrupt
+ */
+void rtc_run(void)
+{
+    if (!rtc_day_ended)
+    {
+        return;
+    }
+
+    rtc_day_ended = false;
+
+    // Report radio polling avoided today
+    const radio_ready_stats_t* stats = radio_ready_stats();
+    printf("Radio: %u mode waits skipped, %u polls in %u waits, %u polls saved (est.)\r\n",
+            (unsigned)stats->waits_skipped, (unsigned)stats->polls, (unsigned)stats->waits,
+            (unsigned)radio_ready_polls_saved());
+    radio_ready_stats_clear();
+
+    // Report time spent in each power state today and the battery life
+    // it works out at
+    power_model_report(power_stats());
+    power_stats_clear();
+}
+
+/**
+ * Get the uncorrected time of day the counter says
+ *
+ * @return Ticks since midnight, before the drift correction
+ */
+static uint32_t _rtc_count(void)
+{
+    // Called from interrupts as well as the main loop
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    uint32_t count = RTC_CounterGet();
+    uint32_t base = rtc_count_base;
+
+    // The counter may have overflowed without the interrupt being handled yet
+    if ((RTC_IntGet() & RTC_IF_OF) && count < RTC_COUNTER_TICKS / 2)
+    {
+        base += RTC_COUNTER_TICKS;
     }
-    else if (RTC_IntGet() & RTC_IF_COMP0)
+
+    __set_PRIMASK(primask);
+
+    return (base + count) % RTC_TICKS_PER_DAY;
+}
+
+/**
+ * Correct a time of day the counter says for its drift
+ *
+ * @param count Ticks since midnight, before the drift correction
+ * @return      Ticks since midnight
+ */
+static uint32_t _rtc_ticks(uint32_t count)
+{
+    int64_t elapsed = (count + RTC_TICKS_PER_DAY - rtc_sync_count) % RTC_TICKS_PER_DAY;
+
+    elapsed -= elapsed * rtc_drift_ppm / 1000000;
+
+    return (uint32_t)((rtc_sync_ticks + elapsed) % RTC_TICKS_PER_DAY);
+}
+
+/**
+ * Make the time of day be a value now, and run the drift correction from here
+ *
+ * @param ticks Ticks since midnight it is now
+ */
+static void _rtc_anchor(uint32_t ticks)
+{
+    rtc_sync_count = _rtc_count();
+    rtc_sync_ticks = ticks;
+}
+
+/**
+ * Set the compares for the next wake and midnight, if they come before the
+ * counter next overflows. Otherwise they are set after the overflow
+ *
+ * @param due_now Whether a wake on this very tick is still to come, false if
+ *                it has just been handled or a period of a whole day has
+ *                brought it round again. Midnight on this tick never is, the
+ *                clock is set to it when a node registers
+ */
+static void _rtc_arm(bool due_now)
+{
+    _rtc_arm_compare(1, rtc_wake_ticks, due_now);
+    _rtc_arm_compare(0, 0, false);
+}
+
+/**
+ * Set a compare for a time of day if the counter gets there before it next
+ * overflows, or disable its interrupt if not
+ *
+ * @param comp    Compare to set, 0 or 1
+ * @param ticks   Time of day in ticks since midnight
+ * @param due_now Whether a time of day on this tick is due now, its interrupt
+ *                is raised straight away, rather than a day away
+ * @return        True if the compare is set
+ */
+static bool _rtc_arm_compare(uint8_t comp, uint32_t ticks, bool due_now)
+{
+    uint32_t flag = (comp == 0) ? RTC_IF_COMP0 : RTC_IF_COMP1;
+
+    if (ticks >= RTC_TICKS_PER_DAY)
+    {
+        RTC_IntDisable(flag);
+        return false;
+    }
+
+    // Turn the time of day back into what the counter will say then
+    uint32_t now = rtc_get_ticks();
+    int64_t ahead = (ticks + RTC_TICKS_PER_DAY - now) % RTC_TICKS_PER_DAY;
+    ahead += ahead * rtc_drift_ppm / 1000000;
+
+    uint32_t count = RTC_CounterGet();
+
+    // The compare only matches once the counter moves on to it, so one for
+    // now would wait for the counter to come round again
+    if (ahead == 0 && due_now)
+    {
+        RTC_IntEnable(flag);
+        RTC_IntSet(flag);
+        return true;
+    }
+
+    if (ahead == 0 || count + ahead >= RTC_COUNTER_TICKS)
+    {
+        RTC_IntDisable(flag);
+        return false;
+    }
+
+    RTC_IntDisable(flag);
+    RTC_CompareSet(comp, (uint32_t)(count + ahead));
+
+    // The new value takes a few ticks to reach the counter's clock domain. A
+    // match missed meanwhile would leave the interrupt off until the counter
+    // came round again, so raise it if the counter is already there
+    while (RTC->SYNCBUSY & ((comp == 0) ? RTC_SYNCBUSY_COMP0 : RTC_SYNCBUSY_COMP1))
     {
-        // Daily interrupt fired, just clear the flag
-        RTC_IntClear(RTC_IF_COMP0);
+
     }
 
+    RTC_IntClear(flag);
+
+    if (((RTC_CounterGet() - count) & (RTC_COUNTER_TICKS - 1)) >= (uint32_t)ahead)
+    {
+        RTC_IntSet(flag);
+    }
+
+    RTC_IntEnable(flag);
+
+    return true;
 }
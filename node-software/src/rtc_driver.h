@@ -5,10 +5,20 @@
 #ifndef RTC_DRIVER_H_
 #define RTC_DRIVER_H_
 
+// Rate the RTC counts at, fine enough to timestamp radio frames to well under
+// a ms
+#define RTC_TICKS_PER_SECOND 4096u
+
 void rtc_init(void);
 bool rtc_get_time_16(uint16_t* time_p);
 void rtc_set_time(uint16_t timestamp, uint8_t msb);
+uint32_t rtc_get_ticks(void);
+void rtc_adjust(int32_t ticks);
+void rtc_set_drift(int16_t drift_ppm);
+
+void rtc_set_schedule(uint32_t period, uint32_t next_wake, uint16_t wake_ms);
+uint32_t rtc_get_wake_ms(void);
 
-void rtc_set_schedule(uint32_t period, uint32_t next_wake);
+void rtc_run(void);
 
 #endif /* RTC_DRIVER_H_ */
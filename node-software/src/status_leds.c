@@ -32,6 +32,9 @@
 // Store the LED status ready for a button push
 static uint8_t status_word = 0x0;
 
+// One of STATUS_POLICY_x
+static uint8_t status_policy = STATUS_POLICY_BUTTON;
+
 /**
  * Set up the status storage and enable interrupts
  */
@@ -83,8 +86,12 @@ void GPIO_ODD_IRQHandler(void)
 	// Check the rising edge was on the right pin
     if (GPIO_IntGet() & (0x1 << STATUS_BUTTON_PIN))
     {
-    	// Find out which edge we got?
-    	if (GPIO_PinInGet(STATUS_BUTTON_GPIO, STATUS_BUTTON_PIN))
+    	// Find out which edge we got? The button only counts by default
+    	if (status_policy != STATUS_POLICY_BUTTON)
+    	{
+    		// Leave the LEDs as the policy has them
+    	}
+    	else if (GPIO_PinInGet(STATUS_BUTTON_GPIO, STATUS_BUTTON_PIN))
     	{
     		// Switch released
     		status_illuminate(false);
@@ -122,3 +129,30 @@ void status_illuminate(bool active)
 		status_word &= ~STATUS_ILLUMINATE_FLAG;
 	}
 }
+
+/**
+ * Choose when the LEDs light, and light them or not to match
+ *
+ * @param policy One of STATUS_POLICY_x
+ * @return       False if there is no such policy
+ */
+bool status_set_policy(uint8_t policy)
+{
+	if (policy >= STATUS_POLICY_COUNT)
+	{
+		return false;
+	}
+
+	status_policy = policy;
+
+	if (policy == STATUS_POLICY_BUTTON)
+	{
+		status_illuminate(!GPIO_PinInGet(STATUS_BUTTON_GPIO, STATUS_BUTTON_PIN));
+	}
+	else
+	{
+		status_illuminate(policy == STATUS_POLICY_ON);
+	}
+
+	return true;
+}
@@ -9,11 +9,19 @@
 #define STATUS_YELLOW 0x2
 #define STATUS_GREEN 0x1
 
+// When the LEDs light: while the button is held, never, or all the time
+#define STATUS_POLICY_BUTTON 0
+#define STATUS_POLICY_OFF    1
+#define STATUS_POLICY_ON     2
+#define STATUS_POLICY_COUNT  3
+
 void status_init(void);
 
 void status_led_set(uint8_t led, bool state);
 
 void status_illuminate(bool active);
 
+bool status_set_policy(uint8_t policy);
+
 
 #endif /* STATUS_LEDS_H_ */